@@ -34,9 +34,12 @@
  * can the data format be changed. Duplicate keys are allowed.
  *
  * A file will be left in a corrupted state if the functions are
- * interrupted before completing. There is no provision for identifying
- * or repairing a corrupted file. The functions will call abort()
- * if a corrupted file causes a read or write beyond the end of file.
+ * interrupted before completing, unless it was opened with a
+ * write-ahead log (avl_file_open_wal ()) or with shadow paging
+ * (avl_file_open_shadow ()). There is no provision for
+ * identifying or repairing a corrupted file. The functions will call
+ * abort() if a corrupted file causes a read or write beyond the end
+ * of file.
  *
  *
  *  2009-11-21  Added the preprocessor macro AVL_FILE_TSAFE for
@@ -48,11 +51,19 @@
  * The functions are:
  *
  *    avl_file_open ()          - open
+ *    avl_file_open_mmap ()     - open, with memory mapped access
+ *    avl_file_open_wal ()      - open, with a write-ahead log
+ *    avl_file_open_free ()     - open, with a free-space map
+ *    avl_file_open_schema ()   - open, with keys described by a schema
+ *    avl_file_open_shm ()      - open, with a shared lock segment
+ *    avl_file_open_snap ()     - open, with a version store for snapshots
+ *    avl_file_open_shadow ()   - open, with shadow paging for atomic updates
  *    avl_file_close ()         - close
  *    avl_file_getnum ()        - get a sequential record number
  *    avl_file_startseq ()      - position sequential pointer to start
  *    avl_file_readseq ()       - read the next record sequentially
  *    avl_file_insert ()        - insert a new record
+ *    avl_file_insert_batch ()  - insert many records at once
  *    avl_file_update ()        - update a record
  *    avl_file_delete ()        - delete a record
  *    avl_file_startlt ()       - read the first record less than key
@@ -60,15 +71,41 @@
  *    avl_file_next ()          - read the next record by key
  *    avl_file_prev ()          - read the previous record by key
  *    avl_file_find ()          - get a record by key
+ *    avl_file_rank ()          - count the records less than a key
+ *    avl_file_select ()        - read the record at a position by key
+ *    avl_file_count_range ()   - count the records in a key range
+ *    avl_file_delete_range ()  - delete the records in a key range
  *    avl_file_scan ()          - scan the tree recursively by key
  *    avl_file_lock ()          - lock the file for exclusive access
  *    avl_file_unlock ()        - unlock the file
+ *    avl_file_snapshot_begin () - read the file as it is now, without locking
+ *    avl_file_snapshot_end ()  - end the snapshot
+ *    avl_file_txn_begin ()     - begin a transaction
+ *    avl_file_txn_commit ()    - commit the transaction, all at once
+ *    avl_file_txn_abort ()     - discard the transaction
  *    avl_file_dump ()          - show tree nodes
  *    avl_file_squash ()        - eliminate empty records, shorten file
+ *    avl_file_squash_step ()   - squash a part of the file at a time
+ *    avl_file_reorganize ()    - store a key's tree in page-sized blocks
+ *    avl_file_pages ()         - get the average pages read per search
+ *    avl_file_free_policy ()   - choose where new records are put
+ *    avl_file_cache ()         - set the record cache size
+ *    avl_file_cache_stats ()   - get the record cache hit/miss counts
+ *    avl_file_cursor_open ()   - create an in-memory cursor for a key
+ *    avl_file_cursor_seek_ge () - read record greater or equal to key
+ *    avl_file_cursor_seek_lt () - read the first record less than key
+ *    avl_file_cursor_next ()   - read the next record by the cursor key
+ *    avl_file_cursor_prev ()   - read the previous record by the cursor key
+ *    avl_file_cursor_close ()  - free a cursor
+ *    avl_file_bulk_load ()     - create a file from many records
+ *    avl_file_upgrade ()       - convert a file from an earlier version
  *
  * Note: Thread-safe versions of the functions have '_t' appended to the
  *       end of the function names, i.e. avl_file_open_t (),
- *       avl_file_insert_t (), etc.
+ *       avl_file_insert_t (), etc. They are in the same library, 
+ *       which then needs the threads library (-pthread). Threads that
+ *       search the same AVL_FILE with the _t functions run at the 
+ *       same time, unless it has a record cache or a log.
  *
  *--------------------------------------------------------------------
  * An example program using two keys:
@@ -148,6 +185,43 @@
 
 #include "config.h"
 #include "avl_file.h"
+#include <errno.h>
+#include <signal.h>
+#ifdef	__linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+
+#define AVL_FILE_GEN_POS	20	// header 'gen', after magic, n_keys, len, reclen
+
+#define AVL_FILE_MAGIC		"AVL.MW2 "	// nodes carry subtree counts
+#define AVL_FILE_MAGIC_SCHEMA	"AVL.MW2S"	// and a key schema follows the header
+#define AVL_FILE_MAGIC_V1	"AVL.MW  "	// earlier files, see avl_file_upgrade()
+
+struct avl_file_node1_struct {	// a tree node in the earlier files
+   char b;
+   off_t l, r;
+};
+
+#define AVL_FILE_PFX_LEN	16	// stored key prefix length, AVL_FILE_SEG_PREFIX
+#define AVL_FILE_SEG_TYPE(t)	((t) & ~(AVL_FILE_SEG_DESC | AVL_FILE_SEG_PREFIX))
+
+#ifndef AVL_FILE_BULK_MEM
+#define AVL_FILE_BULK_MEM	(64 << 20)	// avl_file_bulk_load() sort memory
+#endif
+
+#ifndef AVL_FILE_BATCH_CACHE
+#define AVL_FILE_BATCH_CACHE	(1 << 20)	// avl_file_insert_batch() record cache
+#endif
+
+#ifndef AVL_FILE_WAL_MAX
+#define AVL_FILE_WAL_MAX	(4 << 20)	// log length that causes a checkpoint
+#endif
+
+#ifndef AVL_FILE_PAGE
+#define AVL_FILE_PAGE		4096		// record cache read size
+#endif
 
 
 
@@ -164,2289 +238,9170 @@ avl_file_fatal (AVL_FILE *avl_fp, char *s)
 }
 
 
-/*------------------------------------------- avl_file_lread
- * This function should only be called by other avl_file functions.
+/*------------------------------------------- avl_file_plock
+ * Apply a lock of the given type (F_RDLCK, F_WRLCK or F_UNLCK) to
+ * len bytes at pos, waiting if necessary. Unlike lockf(), this does
+ * not use the file offset, which is shared by all threads.
  */
-static void
-avl_file_lread (AVL_FILE *avl_fp, off_t *lim, off_t pos, void *pr, int32_t len)
+static int32_t
+avl_file_plock (int32_t fd, int32_t type, off_t pos, off_t len)
 {
-   if (pos > *lim) avl_file_fatal (avl_fp, "10 corrupted file, seek pos > lim");
-   if (lseek (avl_fp->fd, pos, SEEK_SET) != pos) avl_file_fatal (avl_fp, "11 lseek failed");
-   if (read (avl_fp->fd, pr, len) != len) avl_file_fatal (avl_fp, "12 read failed");
+   struct flock fl;
+
+   memset (&fl, 0, sizeof (fl));
+   fl.l_type = type;
+   fl.l_whence = SEEK_SET;
+   fl.l_start = pos;
+   fl.l_len = len;
+   return (fcntl (fd, (type == F_UNLCK) ? F_SETLK : F_SETLKW, &fl));
 }
 
 
-/*------------------------------------------- avl_file_lwrite
- * This function should only be called by other avl_file functions.
+/*------------------------------------------- avl_file_ptest
+ * Return 0 if len bytes at pos are unlocked, or locked by this
+ * process, the same as lockf (F_TEST).
  */
-static void
-avl_file_lwrite (AVL_FILE *avl_fp, off_t *lim, off_t pos, void *pr, int32_t len)
+static int32_t
+avl_file_ptest (int32_t fd, off_t pos, off_t len)
 {
-   if (pos > *lim) avl_file_fatal (avl_fp, "13 corrupted file, seek pos > lim");
-   if (lseek (avl_fp->fd, pos, SEEK_SET) != pos) avl_file_fatal (avl_fp, "14 lseek failed");
-   if (write (avl_fp->fd, pr, len) != len) avl_file_fatal (avl_fp, "15 write failed");
-   if (pos + len > *lim) *lim = pos + len;
+   struct flock fl;
+
+   memset (&fl, 0, sizeof (fl));
+   fl.l_type = F_WRLCK;
+   fl.l_whence = SEEK_SET;
+   fl.l_start = pos;
+   fl.l_len = len;
+   if (fcntl (fd, F_GETLK, &fl) != 0) return (-1);
+   if ((fl.l_type == F_UNLCK) || (fl.l_pid == getpid ())) return (0);
+   return (-1);
 }
 
 
-
-
-/*------------------------------------------- avl_file_open
- * Opens an AVL file for reading and writing. The len parameter
- * sets the (fixed) data length, and the data buffer passed to
- * the other avl_file_xxx() functions must be the same size.
- *
- * The value n_keys and the comparison function cmp() must be 
- * the same for future calls once an AVL file has been created.
- *
- * The first byte of the file is used to ensure exclusive
- * access for each of the avl_file_xxx() functions by locking 
- * it during those routines.
+/*------------------------------------------- avl_file_olive
+ * Return 1 if the file is open as another AVL_FILE, in this process
+ * or another one, or 0. The current-pointer records in the list at
+ * head_cpr belong to the open AVL_FILEs, or to processes that died.
+ * The lock test does not detect locks by this process, so the PID is
+ * checked too. The file must be locked (byte 0), and the records in
+ * it up to date, so the log must have been copied into it.
  */
-AVL_FILE *
-#ifdef	AVL_FILE_TSAFE
-avl_file_open_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
-#else
-avl_file_open (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
-#endif
+static int32_t
+avl_file_olive (AVL_FILE *avl_fp)
 {
-   AVL_FILE *avl_fp, avl_dummy;
-   int32_t fd, n, i, reclen;
-
-   struct hdr_struct {
-      char magic[8];
-      int32_t n_keys; 
-      int32_t len;        // AVL record data length
-      int32_t reclen;     // AVL record length including key nodes
-      int64_t n_avl;      // number of AVL records 
-      int64_t nextnum;    // unique record numbers 
-      off_t root[n_keys];
-      off_t head_seq;     // doubly linked
-      off_t head_empty;   // singly linked
-      off_t head_cpr;     // singly linked
-   } hdr;
-
-   struct avl_struct {
-      struct avl_node_struct n[n_keys];
-      off_t prev, next;   // prev used as sequential pointer in 'cpr' records
-      char b[len];
-   } cpr;                 // per-process current position pointer
-   off_t cp, lim;
-   pid_t pid;
-
-
-   avl_fp = NULL;
-   reclen = sizeof (struct avl_struct);
+   off_t cp, next;
+   pid_t pid, p;
+   int32_t fd;
 
-   unsetenv (AVL_FILE_EMSG_VNAME);
-   fd = open (fname, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-   if (fd < 0) {
-      setenv (AVL_FILE_EMSG_VNAME, "20 open failed", 1);
-      return (NULL);
+   fd = avl_fp->fd;
+   pid = getpid ();
+   if (pread (fd, &cp, sizeof (cp), avl_fp->hlen - sizeof (off_t)) != sizeof (cp)) return (0);
+   while (cp > 0) {
+      if (avl_file_ptest (fd, cp, avl_fp->reclen) != 0) return (1);
+      if ((avl_fp->len >= (int32_t) sizeof (pid_t)) &&
+          (pread (fd, &p, sizeof (p), cp + avl_fp->nodelen - avl_fp->uoff) == sizeof (p)) && (p == pid)) return (1);
+      if (pread (fd, &next, sizeof (next), cp + avl_fp->nodelen - avl_fp->uoff - sizeof (off_t)) != sizeof (next)) return (0);
+      cp = next;
    }
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_LOCK, 1);
-   lim = lseek (fd, 0, SEEK_END);
+   return (0);
+}
 
-   lseek (fd, 0, SEEK_SET);
-   n = read (fd, &hdr, sizeof (hdr));
-   if (n == 0) {
-      memset (&hdr, 0, sizeof (hdr));
-      memcpy (hdr.magic, "AVL.MW  ", 8);
-      hdr.n_keys = n_keys;
-      hdr.len = len;
-      hdr.reclen = reclen;
-      avl_dummy.fd = fd;
-      avl_file_lwrite (&avl_dummy, &lim, 0, &hdr, sizeof (hdr));
-   } else if (n != sizeof (hdr)) {
-      setenv (AVL_FILE_EMSG_VNAME, "21 read header != sizeof (hdr)", 1);
-      close (fd);
-      return (NULL);
-   }
 
-   if (hdr.reclen != reclen) {
-      setenv (AVL_FILE_EMSG_VNAME, "22 hdr.reclen != reclen", 1);
-      close (fd);
-      return (NULL);
+/*------------------------------------------- avl_file_scmp
+ * Compare the records a and b by the n key schema segments at sp.
+ * The segments are read with memcpy(), since they need not be 
+ * aligned, and the string and byte segments are compared by the C 
+ * library, which uses vector instructions where it can.
+ */
+static int32_t
+avl_file_scmp (AVL_FILE_SEG *sp, int32_t n, const void *a, const void *b)
+{
+   const char *pa, *pb;
+   int32_t i, d, ia, ib;
+   int64_t la, lb;
+   uint32_t ua, ub;
+   uint64_t va, vb;
+   float fa, fb;
+   double da, db;
+
+
+   for (i = 0; i < n; i++, sp++) {
+      pa = (const char *) a + sp->off;
+      pb = (const char *) b + sp->off;
+      switch (AVL_FILE_SEG_TYPE (sp->type)) {
+      case AVL_FILE_SEG_INT32:
+         memcpy (&ia, pa, 4); memcpy (&ib, pb, 4);
+         d = (ia > ib) - (ia < ib);
+         break;
+      case AVL_FILE_SEG_INT64:
+         memcpy (&la, pa, 8); memcpy (&lb, pb, 8);
+         d = (la > lb) - (la < lb);
+         break;
+      case AVL_FILE_SEG_UINT32:
+         memcpy (&ua, pa, 4); memcpy (&ub, pb, 4);
+         d = (ua > ub) - (ua < ub);
+         break;
+      case AVL_FILE_SEG_UINT64:
+         memcpy (&va, pa, 8); memcpy (&vb, pb, 8);
+         d = (va > vb) - (va < vb);
+         break;
+      case AVL_FILE_SEG_FLOAT:
+         memcpy (&fa, pa, 4); memcpy (&fb, pb, 4);
+         d = (fa > fb) - (fa < fb);
+         break;
+      case AVL_FILE_SEG_DOUBLE:
+         memcpy (&da, pa, 8); memcpy (&db, pb, 8);
+         d = (da > db) - (da < db);
+         break;
+      case AVL_FILE_SEG_STRING:
+         d = strncmp (pa, pb, sp->len);
+         break;
+      default:
+         d = memcmp (pa, pb, sp->len);
+         break;
+      }
+      if (d != 0) return ((sp->type & AVL_FILE_SEG_DESC) ? -d : d);
    }
+   return (0);
+}
 
-   if (hdr.n_keys != n_keys) {
-      setenv (AVL_FILE_EMSG_VNAME, "23 hdr.n_keys != n_keys", 1);
-      close (fd);
-      return (NULL);
-   }
 
-   avl_fp = malloc (sizeof (AVL_FILE));
-   if (avl_fp == NULL) { 
-      setenv (AVL_FILE_EMSG_VNAME, "24 malloc returned NULL", 1);
-      close (fd); 
-      return (NULL);
-   }
-   avl_fp->fname = malloc (strlen (fname)+1);
-   if (avl_fp->fname == NULL) {
-      setenv (AVL_FILE_EMSG_VNAME, "25 malloc returned NULL", 1);
-      close (fd);
-      free (avl_fp);
-      return (NULL);
-   }
-   strcpy (avl_fp->fname, fname);
-   avl_fp->fd = fd;
-   avl_fp->n_keys = n_keys;
-   avl_fp->len = len;
-   avl_fp->reclen = reclen;
-   avl_fp->cmp = cmp;
-#ifdef	AVL_FILE_TSAFE
-   sem_init (&avl_fp->sem, 0, 1);
-#endif
+/*------------------------------------------- avl_file_kcmp
+ * Compare the records a and b by key k, with the key schema if the
+ * file has one, or else with the comparison function.
+ */
+static int32_t
+avl_file_kcmp (AVL_FILE *avl_fp, int32_t k, const void *a, const void *b)
+{
+   if (avl_fp->seg == NULL) return (avl_fp->cmp (k, a, b));
+   return (avl_file_scmp (avl_fp->seg + avl_fp->kseg[k], avl_fp->kseg[k+1] - avl_fp->kseg[k], a, b));
+}
 
-  /*
-   * Search for an unused (unlocked) current-pointer record to
-   * use first, or an empty record, before creating a new one.
-   * The lock test does not detect locks by this process, so
-   * check the PID.
-   */
-   pid = getpid ();
-   for (cp = hdr.head_cpr; cp > 0; cp = cpr.next) {
-      avl_file_lread (avl_fp, &lim, cp, &cpr, reclen);
 
-      if (sizeof (cpr.b) >= sizeof (pid_t)) {
-         if (memcmp (&cpr.b, &pid, sizeof (pid_t)) != 0) {
-            lseek (fd, cp, SEEK_SET);
-            if (lockf (fd, F_TEST, reclen) == 0) break;
+/*------------------------------------------- avl_file_pkey
+ * Make the normalized prefix of a key, with the n key schema segments
+ * at sp, from the record data into p. Each segment is encoded so 
+ * that memcmp() orders the encodings as avl_file_scmp() orders the 
+ * values: integers big-endian with the sign bit flipped if signed,
+ * floating point numbers the same after flipping all of the bits of
+ * negative ones, strings padded with NULs after their end, and all 
+ * bytes inverted for descending segments. The prefix is the first 
+ * AVL_FILE_PFX_LEN bytes of the encodings, padded with zeros. Records
+ * with different prefixes are then ordered by them, and records with 
+ * the same prefix must be compared in full. (NaN values are not 
+ * ordered by either.)
+ */
+static void
+avl_file_pkey (AVL_FILE_SEG *sp, int32_t n, const void *data, unsigned char *p)
+{
+   const unsigned char *pd;
+   unsigned char e[8];
+   uint64_t v;
+   uint32_t u;
+   float f;
+   double d;
+   int32_t i, j, o, m;
+
+
+   o = 0;
+   for (i = 0; (i < n) && (o < AVL_FILE_PFX_LEN); i++, sp++) {
+      pd = (const unsigned char *) data + sp->off;
+      m = sp->len;
+      switch (AVL_FILE_SEG_TYPE (sp->type)) {
+      case AVL_FILE_SEG_INT32:
+      case AVL_FILE_SEG_UINT32:
+      case AVL_FILE_SEG_FLOAT:
+         if (AVL_FILE_SEG_TYPE (sp->type) == AVL_FILE_SEG_FLOAT) {
+            memcpy (&f, pd, 4);
+            if (f == 0) f = 0;			// -0 is the same as 0
+            memcpy (&u, &f, 4);
+            u = (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+         } else {
+            memcpy (&u, pd, 4);
+            if (AVL_FILE_SEG_TYPE (sp->type) == AVL_FILE_SEG_INT32) u ^= 0x80000000u;
+         }
+         for (j = 0; j < 4; j++) e[j] = u >> (24 - 8 * j);
+         pd = e;
+         break;
+      case AVL_FILE_SEG_INT64:
+      case AVL_FILE_SEG_UINT64:
+      case AVL_FILE_SEG_DOUBLE:
+         if (AVL_FILE_SEG_TYPE (sp->type) == AVL_FILE_SEG_DOUBLE) {
+            memcpy (&d, pd, 8);
+            if (d == 0) d = 0;
+            memcpy (&v, &d, 8);
+            v = (v & 0x8000000000000000ull) ? ~v : (v | 0x8000000000000000ull);
+         } else {
+            memcpy (&v, pd, 8);
+            if (AVL_FILE_SEG_TYPE (sp->type) == AVL_FILE_SEG_INT64) v ^= 0x8000000000000000ull;
          }
+         for (j = 0; j < 8; j++) e[j] = v >> (56 - 8 * j);
+         pd = e;
+         break;
+      case AVL_FILE_SEG_STRING:
+         m = strnlen ((const char *) pd, sp->len);
+         break;
       }
-   }
-   if (cp == 0) {
-      cp = hdr.head_empty;
-      if (cp == 0) {
-         cp = lseek (fd, 0, SEEK_END);
-      } else {
-         avl_file_lread (avl_fp, &lim, cp, &cpr, reclen);
-         hdr.head_empty = cpr.next;
+      if (m > AVL_FILE_PFX_LEN - o) m = AVL_FILE_PFX_LEN - o;
+      memcpy (p + o, pd, m);
+      if (AVL_FILE_SEG_TYPE (sp->type) == AVL_FILE_SEG_STRING) {
+         j = (sp->len < AVL_FILE_PFX_LEN - o) ? sp->len : AVL_FILE_PFX_LEN - o;
+         memset (p + o + m, 0, j - m);
+         m = j;
       }
-      cpr.next = hdr.head_cpr;
-      hdr.head_cpr = cp;
+      if (sp->type & AVL_FILE_SEG_DESC) {
+         for (j = 0; j < m; j++) p[o + j] = ~p[o + j];
+      }
+      o += m;
    }
+   memset (p + o, 0, AVL_FILE_PFX_LEN - o);
+}
 
-   avl_fp->cpr = cp;
 
-   for (i = 0; i < n_keys; i++) {
-      cpr.n[i].b = 0x20; cpr.n[i].l = 0; cpr.n[i].r = 0;
-   }
-   if (sizeof (cpr.b) >= sizeof (pid_t)) memcpy (&cpr.b, &pid, sizeof (pid_t));
-   cpr.prev = 0;
-   avl_file_lwrite (avl_fp, &lim, cp, &cpr, reclen);
-   lseek (fd, cp, SEEK_SET);
-   lockf (fd, F_LOCK, reclen);
+/*------------------------------------------- avl_file_pset
+ * Copy the caller's data into the record data b, after the key 
+ * prefixes, and make the prefixes if the file stores them.
+ */
+static void
+avl_file_pset (AVL_FILE *avl_fp, void *b, const void *data)
+{
+   int32_t k;
 
-   avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_ULOCK, 1);
-   return (avl_fp);
+   memcpy ((char *) b + avl_fp->uoff, data, avl_fp->ulen);
+   if (avl_fp->kpfx == NULL) return;
+   for (k = 0; k < avl_fp->n_keys; k++) {
+      if (avl_fp->kpfx[k] >= 0)
+         avl_file_pkey (avl_fp->seg + avl_fp->kseg[k], avl_fp->kseg[k+1] - avl_fp->kseg[k],
+                        data, (unsigned char *) b + avl_fp->kpfx[k]);
+   }
 }
 
 
-//------------------------------------------- avl_file_close
-void 
-#ifdef	AVL_FILE_TSAFE
-avl_file_close_t (AVL_FILE *avl_fp) 
-#else
-avl_file_close (AVL_FILE *avl_fp) 
-#endif
+/*------------------------------------------- avl_file_pcmp
+ * Compare the record data a and b by key k, as avl_file_kcmp(), but
+ * first by the stored key prefixes if there are any. Both a and b
+ * must be record data, made by avl_file_pset(), and not the caller's
+ * data.
+ */
+static int32_t
+avl_file_pcmp (AVL_FILE *avl_fp, int32_t k, const void *a, const void *b)
 {
-   int32_t fd, reclen, i;
-
-   struct hdr_struct {
-      char magic[8];
-      int32_t n_keys;
-      int32_t len;        // AVL record data length
-      int32_t reclen;     // AVL record length including key nodes
-      int64_t n_avl;      // number of AVL records 
-      int64_t nextnum;    // unique record numbers 
-      off_t root[avl_fp->n_keys];
-      off_t head_seq;     // doubly linked
-      off_t head_empty;   // singly linked
-      off_t head_cpr;     // singly linked
-   } hdr;
+   int32_t d, o;
 
-   struct avl_struct {
-      struct avl_node_struct n[avl_fp->n_keys];
-      off_t prev, next;   // prev used as sequential pointer in 'cpr' records
-      char b[avl_fp->len];
-   } cpr, spr;
-   off_t cp, sp, lim;
+   if ((avl_fp->kpfx != NULL) && (avl_fp->kpfx[k] >= 0)) {
+      o = avl_fp->kpfx[k];
+      d = memcmp ((const char *) a + o, (const char *) b + o, AVL_FILE_PFX_LEN);
+      if (d != 0) return (d);
+   }
+   return (avl_file_kcmp (avl_fp, k, (const char *) a + avl_fp->uoff, (const char *) b + avl_fp->uoff));
+}
 
 
-   reclen = avl_fp->reclen;
-   fd = avl_fp->fd;
+/*------------------------------------------- avl_file_svalid
+ * Return 0 if the n_seg key schema segments are valid for records
+ * of length len with n_keys keys, or -1.
+ */
+static int32_t
+avl_file_svalid (AVL_FILE_SEG *seg, int32_t n_seg, int32_t n_keys, int32_t len)
+{
+   int32_t i, k, size;
+
+   if ((seg == NULL) || (n_seg < n_keys) || (n_keys < 1)) return (-1);
+   k = 0;
+   for (i = 0; i < n_seg; i++) {
+      if ((seg[i].key != k) && (seg[i].key != k + 1)) return (-1);
+      if ((i == 0) && (seg[i].key != 0)) return (-1);
+      k = seg[i].key;
+      if ((seg[i].off < 0) || (seg[i].len <= 0) || (seg[i].off + seg[i].len > len)) return (-1);
+      switch (AVL_FILE_SEG_TYPE (seg[i].type)) {
+      case AVL_FILE_SEG_INT32:
+      case AVL_FILE_SEG_UINT32:
+      case AVL_FILE_SEG_FLOAT:
+         size = 4; break;
+      case AVL_FILE_SEG_INT64:
+      case AVL_FILE_SEG_UINT64:
+      case AVL_FILE_SEG_DOUBLE:
+         size = 8; break;
+      case AVL_FILE_SEG_STRING:
+      case AVL_FILE_SEG_BYTES:
+         size = seg[i].len; break;
+      default:
+         return (-1);
+      }
+      if (seg[i].len != size) return (-1);
+   }
+   return ((k == n_keys - 1) ? 0 : -1);
+}
 
-#ifdef AVL_FILE_TSAFE
-   sem_wait (&avl_fp->sem);
-#endif
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_LOCK, 1);
-   lim = lseek (fd, 0, SEEK_END);
 
-   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
-   cp = avl_fp->cpr;
-   avl_file_lread (avl_fp, &lim, cp, &cpr, reclen);
+/*------------------------------------------- avl_file_plen
+ * Return the length of the key prefixes stored before the data of 
+ * each record for the n_seg key schema segments, AVL_FILE_PFX_LEN 
+ * for each key that has a segment with AVL_FILE_SEG_PREFIX.
+ */
+static int32_t
+avl_file_plen (AVL_FILE_SEG *seg, int32_t n_seg)
+{
+   int32_t i, k, n;
+
+   n = 0;
+   k = -1;
+   for (i = 0; i < n_seg; i++) {
+      if ((seg[i].type & AVL_FILE_SEG_PREFIX) && (seg[i].key != k)) {
+         k = seg[i].key;
+         n += AVL_FILE_PFX_LEN;
+      }
+   }
+   return (n);
+}
 
-   lseek (fd, cp, SEEK_SET);
-   lockf (fd, F_ULOCK, reclen);
 
-   if (hdr.head_cpr == cp) {
-      hdr.head_cpr = cpr.next;
+/*------------------------------------------- avl_file_sread
+ * Read the n_seg key schema segments stored in the file at pos, 
+ * and set up avl_fp->seg, avl_fp->kseg and avl_fp->kpfx for them. 
+ * If seg is not NULL, its n segments must be the same as the file's. 
+ * Returns 0 for success, or -1 for failure.
+ */
+static int32_t
+avl_file_sread (AVL_FILE *avl_fp, off_t pos, int32_t n_seg, AVL_FILE_SEG *seg, int32_t n)
+{
+   int32_t i, k, o;
+   ssize_t size;
+
+   size = n_seg * sizeof (AVL_FILE_SEG);
+   avl_fp->seg = malloc (size);
+   avl_fp->kseg = malloc ((avl_fp->n_keys + 1) * sizeof (int32_t));
+   avl_fp->kpfx = malloc (avl_fp->n_keys * sizeof (int32_t));
+   if ((avl_fp->seg == NULL) || (avl_fp->kseg == NULL) || (avl_fp->kpfx == NULL)) {
+      setenv (AVL_FILE_EMSG_VNAME, "204 malloc returned NULL", 1);
+   } else if (pread (avl_fp->fd, avl_fp->seg, size, pos) != size) {
+      setenv (AVL_FILE_EMSG_VNAME, "202 read key schema failed", 1);
+   } else if ((avl_file_svalid (avl_fp->seg, n_seg, avl_fp->n_keys, avl_fp->ulen) != 0) ||
+              (avl_fp->ulen + avl_file_plen (avl_fp->seg, n_seg) != avl_fp->len)) {
+      setenv (AVL_FILE_EMSG_VNAME, "205 invalid key schema in the file", 1);
+   } else if ((seg != NULL) && ((n != n_seg) || (memcmp (seg, avl_fp->seg, size) != 0))) {
+      setenv (AVL_FILE_EMSG_VNAME, "206 the key schema does not match the file", 1);
    } else {
-      for (sp = hdr.head_cpr; sp > 0; sp = spr.next) {
-         avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
-         if (spr.next == cp) {
-            spr.next = cpr.next;
-            avl_file_lwrite (avl_fp, &lim, sp, &spr, reclen);
-            break;
+      for (i = 0, k = 0; k <= avl_fp->n_keys; k++) {
+         while ((i < n_seg) && (avl_fp->seg[i].key < k)) i++;
+         avl_fp->kseg[k] = i;
+      }
+      o = 0;
+      for (k = 0; k < avl_fp->n_keys; k++) {
+         avl_fp->kpfx[k] = -1;
+         for (i = avl_fp->kseg[k]; i < avl_fp->kseg[k+1]; i++) {
+            if (avl_fp->seg[i].type & AVL_FILE_SEG_PREFIX) avl_fp->kpfx[k] = o;
          }
+         if (avl_fp->kpfx[k] >= 0) o += AVL_FILE_PFX_LEN;
       }
+      if (o == 0) {
+         free (avl_fp->kpfx);
+         avl_fp->kpfx = NULL;
+      }
+      return (0);
    }
-   for (i = 0; i < avl_fp->n_keys; i++) {
-      cpr.n[i].b = 0x40; cpr.n[i].l = 0; cpr.n[i].r = 0;
-   }
-   cpr.next = hdr.head_empty;
-   hdr.head_empty = cp;
+   free (avl_fp->seg);
+   free (avl_fp->kseg);
+   free (avl_fp->kpfx);
+   avl_fp->seg = NULL;
+   avl_fp->kseg = NULL;
+   avl_fp->kpfx = NULL;
+   return (-1);
+}
 
-   avl_file_lwrite (avl_fp, &lim, cp, &cpr, reclen);
-   avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
 
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_ULOCK, 1);
-   close (fd);
-#ifdef AVL_FILE_TSAFE
-   sem_destroy (&avl_fp->sem);
-#endif
-   free (avl_fp->fname);
-   free (avl_fp);
+/*------------------------------------------- avl_file_lmap
+ * Map the file for avl_file_open_mmap(), so that it covers at least 
+ * lim bytes. Some room is left for growth, since accesses are never
+ * made past lim. If the mapping fails, the functions go back to
+ * using pread() and pwrite().
+ */
+static void
+avl_file_lmap (AVL_FILE *avl_fp, off_t lim)
+{
+   off_t sz;
+   long pg;
+
+   if (avl_fp->map != NULL) munmap (avl_fp->map, avl_fp->map_len);
+   avl_fp->map = NULL;
+   avl_fp->map_len = 0;
+
+   pg = sysconf (_SC_PAGESIZE);
+   sz = lim + lim / 4;
+   sz = ((sz + pg - 1) / pg) * pg;
+   if (sz <= 0) return;
+
+   avl_fp->map = mmap (NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, avl_fp->fd, 0);
+   if (avl_fp->map == MAP_FAILED) {
+      setenv (AVL_FILE_EMSG_VNAME, "17 mmap failed", 1);
+      avl_fp->map = NULL;
+      avl_fp->mode &= ~AVL_FILE_MMAP;
+      return;
+   }
+   avl_fp->map_len = sz;
 }
 
 
-/*------------------------------------------- avl_file_getnum
- * Return a unique (sequential) record number. (Not the same as a
- * file array index, however, because records can be deleted,
- * for example.)
+/*
+ * The write-ahead log, for files opened with avl_file_open_wal() (or
+ * any file that has a log). The header and record bytes written by
+ * each operation are appended to the log file (fname with "-wal"
+ * added) as one frame with a CRC, instead of being written into the
+ * file. Each process keeps the records from the log frames in an
+ * index in memory, which is read before the file. Once the log is
+ * longer than AVL_FILE_WAL_MAX bytes, the records are copied into the
+ * file (a checkpoint), and the log is emptied.
+ *
+ * The log header holds the end of the last complete frame, and how
+ * much of the log is known to be on disk. An operation that changed
+ * the file waits for fdatasync() after unlocking the file, and
+ * one fdatasync() covers the frames of all of the processes that
+ * have appended one by then (group commit). Incomplete frames
+ * after a crash fail the CRC check and are ignored.
  */
-int64_t 
-#ifdef	AVL_FILE_TSAFE
-avl_file_getnum_t (AVL_FILE *avl_fp) 
-#else
-avl_file_getnum (AVL_FILE *avl_fp) 
-#endif
-{
-   int32_t fd;
+struct avl_file_whdr_struct {		// log file header
+   char magic[8];
+   uint32_t epoch;       // changed by every checkpoint
+   uint32_t pad;
+   int64_t end;          // end of the last complete frame
+   int64_t synced;       // end of the frames known to be on disk
+};
+
+struct avl_file_wframe_struct {		// log frame header
+   uint32_t epoch;
+   uint32_t crc;         // of the whole frame, with crc 0
+   int64_t len;          // frame length, including this header
+   int64_t size;         // file length after the operation
+};
+
+struct avl_file_wentry_struct {		// frame entry, followed by the bytes
+   int64_t pos;
+   int32_t len;
+   int32_t pad;
+};
+
+struct avl_file_wunit_struct {		// index entry, a record or the header
+   struct avl_file_wunit_struct *next;
+   off_t pos;
+   int32_t len;
+   int32_t pad;		// data is aligned as the records' off_t fields need
+   char data[];
+};
+
+struct avl_file_wal_struct {
+   int32_t fd;           // log file, or shadow file
+   int32_t ltype;        // lock type of the current operation
+   int32_t ckpt;         // checkpoint at the end of the operation
+   int32_t shadow;       // shadow paging, see avl_file_wcommit()
+   uint32_t epoch;       // log epoch of the frames in the index, or last frame number
+   off_t start;          // first frame in the shadow file
+   off_t pos;            // end of the frames in the index
+   off_t size;           // file length after those frames, or -1
+   int64_t n_slots;      // hash table size, a power of 2
+   int64_t n_used;
+   struct avl_file_wunit_struct **head;
+   char *buf;            // frame for the current operation
+   int64_t buf_len, buf_max;
+};
+
+#define AVL_FILE_WHDR_LEN	((off_t) sizeof (struct avl_file_whdr_struct))
+#define AVL_FILE_WFRAME_LEN	((int64_t) sizeof (struct avl_file_wframe_struct))
+
+
+/*
+ * The CRC-32 table, filled in by the first avl_file_crc32() call.
+ */
+static uint32_t avl_file_crc_table[256];
+static pthread_once_t avl_file_crc_once = PTHREAD_ONCE_INIT;
 
-   struct hdr_struct {
-      char magic[8];
-      int32_t n_keys; 
-      int32_t len;        // AVL record data length
-      int32_t reclen;     // AVL record length including key nodes
-      int64_t n_avl;      // number of AVL records 
-      int64_t nextnum;    // unique record numbers 
-      off_t root[avl_fp->n_keys];
-      off_t head_seq;     // doubly linked
-      off_t head_empty;   // singly linked
-      off_t head_cpr;     // singly linked
-   } hdr;
 
+/*------------------------------------------- avl_file_crc_init
+ * Fill in the CRC-32 table, once for all AVL_FILEs and threads.
+ */
+static void
+avl_file_crc_init (void)
+{
+   uint32_t c;
+   int32_t i, j;
 
-   fd = avl_fp->fd;
+   for (i = 0; i < 256; i++) {
+      c = i;
+      for (j = 0; j < 8; j++) c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      avl_file_crc_table[i] = c;
+   }
+}
 
-#ifdef	AVL_FILE_TSAFE
-   sem_wait (&avl_fp->sem);
-#endif
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_LOCK, 1);
 
-   lseek (fd, 0, SEEK_SET);
-   read (fd, &hdr, sizeof (hdr));
-   hdr.nextnum++;
-   lseek (fd, 0, SEEK_SET);
-   write (fd, &hdr, sizeof (hdr));
+/*------------------------------------------- avl_file_crc32
+ * Return the CRC-32 (as used by zlib) of n bytes at p, continuing
+ * from crc.
+ */
+static uint32_t
+avl_file_crc32 (uint32_t crc, const void *p, int64_t n)
+{
+   const unsigned char *s;
 
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_ULOCK, 1);
-#ifdef	AVL_FILE_TSAFE
-   sem_post (&avl_fp->sem);
-#endif
-   return (hdr.nextnum);
+   pthread_once (&avl_file_crc_once, avl_file_crc_init);
+   s = p;
+   crc = ~crc;
+   while (n-- > 0) crc = avl_file_crc_table[(crc ^ *s++) & 0xff] ^ (crc >> 8);
+   return (~crc);
 }
 
 
-
-/*------------------------------------------- avl_file_startseq
- * Initialize the sequential-access file pointer.
+/*------------------------------------------- avl_file_wunit
+ * Return the position of the record (or header) holding pos.
  */
-void 
-#ifdef AVL_FILE_TSAFE
-avl_file_startseq_t (AVL_FILE *avl_fp) 
-#else
-avl_file_startseq (AVL_FILE *avl_fp) 
-#endif
+static off_t
+avl_file_wunit (AVL_FILE *avl_fp, off_t pos)
 {
-   int32_t fd, reclen;
-
-   struct hdr_struct {
-      char magic[8];
-      int32_t n_keys; 
-      int32_t len;        // AVL record data length
-      int32_t reclen;     // AVL record length including key nodes
-      int64_t n_avl;      // number of AVL records 
-      int64_t nextnum;    // unique record numbers 
-      off_t root[avl_fp->n_keys];
-      off_t head_seq;     // doubly linked
-      off_t head_empty;   // singly linked
-      off_t head_cpr;     // singly linked
-   } hdr;
+   if (pos < avl_fp->hdrlen) return (0);
+   return (pos - (pos - avl_fp->hdrlen) % avl_fp->reclen);
+}
 
-   struct avl_struct {
-      struct avl_node_struct n[avl_fp->n_keys];
-      off_t prev, next;   // prev used as sequential pointer in 'cpr' records
-      char b[avl_fp->len];
-   } cpr;
-   off_t cp, lim;
 
+/*------------------------------------------- avl_file_wlog
+ * Return 1 if the file has a write-ahead log, which keeps records in
+ * the log index between operations, or 0 (also for shadow paging).
+ */
+static int32_t
+avl_file_wlog (AVL_FILE *avl_fp)
+{
+   return ((avl_fp->wal != NULL) && !avl_fp->wal->shadow);
+}
 
-   reclen = avl_fp->reclen;
-   fd = avl_fp->fd;
-   cp = avl_fp->cpr;
 
-#ifdef	AVL_FILE_TSAFE
-   sem_wait (&avl_fp->sem);
-#endif
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_LOCK, 1);
-   lim = lseek (fd, 0, SEEK_END);
+/*------------------------------------------- avl_file_wkeep
+ * Return 1 if the file holds a current-pointer record (marked 0x20)
+ * at pos, which is the same as or newer than the record p from the
+ * log index or the shadow file, or 0. See avl_file_cwrite().
+ */
+static int32_t
+avl_file_wkeep (AVL_FILE *avl_fp, off_t pos, const char *p)
+{
+   char b;
 
-   lseek (fd, 0, SEEK_SET);
-   read (fd, &hdr, sizeof (hdr));
+   return ((pos > 0) && (avl_fp->n_keys > 0) && (p[0] == 0x20) &&
+           (pread (avl_fp->fd, &b, 1, pos) == 1) && (b == 0x20));
+}
 
-   avl_file_lread (avl_fp, &lim, cp, &cpr, reclen);
-   cpr.prev = hdr.head_seq;
-   avl_file_lwrite (avl_fp, &lim, cp, &cpr, reclen);
 
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_ULOCK, 1);
-#ifdef	AVL_FILE_TSAFE
-   sem_post (&avl_fp->sem);
-#endif
+/*------------------------------------------- avl_file_wfind
+ * Return the log index entry holding pos, or NULL.
+ */
+static struct avl_file_wunit_struct *
+avl_file_wfind (AVL_FILE *avl_fp, off_t pos)
+{
+   struct avl_file_wal_struct *w;
+   struct avl_file_wunit_struct *u;
+
+   w = avl_fp->wal;
+   pos = avl_file_wunit (avl_fp, pos);
+   for (u = w->head[(pos / 8) & (w->n_slots - 1)]; u != NULL; u = u->next)
+      if (u->pos == pos) return (u);
+   return (NULL);
 }
 
 
-
-/*------------------------------------------- avl_file_readseq
- * Read the next sequential (unordered) file record, writing it
- * into the data buffer.
- * The return value is 0 for OK, or -1 for none.
+/*------------------------------------------- avl_file_wget
+ * Return the log index entry holding pos, adding it if necessary
+ * with the bytes from the file.
  */
-int32_t 
-#ifdef	AVL_FILE_TSAFE
-avl_file_readseq_t (AVL_FILE *avl_fp, void *data) 
-#else
-avl_file_readseq (AVL_FILE *avl_fp, void *data) 
-#endif
+static struct avl_file_wunit_struct *
+avl_file_wget (AVL_FILE *avl_fp, off_t pos)
 {
-   int32_t fd, reclen, ret;
-
-   struct avl_struct {
-      struct avl_node_struct n[avl_fp->n_keys];
-      off_t prev, next;
-      char b[avl_fp->len];
-   } cpr, ar;
-   off_t cp, lim;
+   struct avl_file_wal_struct *w;
+   struct avl_file_wunit_struct *u, *v, **head;
+   int64_t i, n;
+   int32_t len;
+
+   u = avl_file_wfind (avl_fp, pos);
+   if (u != NULL) return (u);
+
+   w = avl_fp->wal;
+   if (w->n_used >= w->n_slots) {
+      n = w->n_slots * 2;
+      head = calloc (n, sizeof (struct avl_file_wunit_struct *));
+      if (head == NULL) avl_file_fatal (avl_fp, "150 malloc returned NULL");
+      for (i = 0; i < w->n_slots; i++) {
+         for (u = w->head[i]; u != NULL; u = v) {
+            v = u->next;
+            u->next = head[(u->pos / 8) & (n - 1)];
+            head[(u->pos / 8) & (n - 1)] = u;
+         }
+      }
+      free (w->head);
+      w->head = head;
+      w->n_slots = n;
+   }
 
+   pos = avl_file_wunit (avl_fp, pos);
+   len = (pos == 0) ? avl_fp->hdrlen : avl_fp->reclen;
+   u = malloc (sizeof (struct avl_file_wunit_struct) + len);
+   if (u == NULL) avl_file_fatal (avl_fp, "150 malloc returned NULL");
+   u->pos = pos;
+   u->len = len;
+   memset (u->data, 0, len);
+   if ((w->size < 0) || (pos < w->size)) {
+      if (pread (avl_fp->fd, u->data, len, pos) < 0) avl_file_fatal (avl_fp, "12 read failed");
+   }
+   u->next = w->head[(pos / 8) & (w->n_slots - 1)];
+   w->head[(pos / 8) & (w->n_slots - 1)] = u;
+   w->n_used++;
+   return (u);
+}
 
-   reclen = avl_fp->reclen;
-   fd = avl_fp->fd;
-   cp = avl_fp->cpr;
 
-#ifdef	AVL_FILE_TSAFE
-   sem_wait (&avl_fp->sem);
-#endif
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_LOCK, 1);
-   lim = lseek (fd, 0, SEEK_END);
+/*------------------------------------------- avl_file_wdrop
+ * Remove the log index entries for records at or after lim.
+ */
+static void
+avl_file_wdrop (AVL_FILE *avl_fp, off_t lim)
+{
+   struct avl_file_wal_struct *w;
+   struct avl_file_wunit_struct *u, **up;
+   int64_t i;
+
+   w = avl_fp->wal;
+   for (i = 0; i < w->n_slots; i++) {
+      for (up = &w->head[i]; (u = *up) != NULL; ) {
+         if ((u->pos > 0) && (u->pos >= lim)) {
+            *up = u->next;
+            free (u);
+            w->n_used--;
+         } else {
+            up = &u->next;
+         }
+      }
+   }
+}
 
-   avl_file_lread (avl_fp, &lim, cp, &cpr, reclen);
 
-   if (cpr.prev == 0) {
-      ret = -1;
-   } else {
-      avl_file_lread (avl_fp, &lim, cpr.prev, &ar, reclen);
-      memcpy (data, ar.b, avl_fp->len);
+/*------------------------------------------- avl_file_wclear
+ * Empty the log index.
+ */
+static void
+avl_file_wclear (struct avl_file_wal_struct *w)
+{
+   struct avl_file_wunit_struct *u, *v;
+   int64_t i;
 
-      cpr.prev = ar.next;
-      avl_file_lwrite (avl_fp, &lim, cp, &cpr, reclen);
-      ret = 0;
+   for (i = 0; i < w->n_slots; i++) {
+      for (u = w->head[i]; u != NULL; u = v) {
+         v = u->next;
+         free (u);
+      }
+      w->head[i] = NULL;
    }
-
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_ULOCK, 1);
-#ifdef	AVL_FILE_TSAFE
-   sem_post (&avl_fp->sem);
-#endif
-   return (ret);
+   w->n_used = 0;
 }
 
 
-/* ----------------------------------------------- avl_file_insert
- * Insert a new record, pointed to by the data parameter, into 
- * the AVL file. It returns 0 for success, or -1 for failure.
- *
- * (The internal format uses node elements .l and .r for left and 
- * right pointers, and negative values for previous and next threaded
- * retrieval. Also .b is the node balance.) This is taken mostly 
- * from "Fundamentals of Data Structures in Pascal" by Horowitz &
- * Sahni.
+/*------------------------------------------- avl_file_wscan
+ * Read the frames appended to the log by other processes into the
+ * index. If the log has been emptied by a checkpoint, the index is
+ * emptied first. The file must be locked.
  */
-int32_t 
-#ifdef	AVL_FILE_TSAFE
-avl_file_insert_t (AVL_FILE *avl_fp, void *data) 
-#else
-avl_file_insert (AVL_FILE *avl_fp, void *data) 
-#endif
+static void
+avl_file_wscan (AVL_FILE *avl_fp)
 {
-   int32_t fd, reclen, ret;
+   struct avl_file_wal_struct *w;
+   struct avl_file_whdr_struct h;
+   struct avl_file_wframe_struct *f;
+   struct avl_file_wentry_struct *e;
+   struct avl_file_wunit_struct *u;
+   int64_t n, o, p;
+   uint32_t crc;
+   char *buf;
+
+   w = avl_fp->wal;
+   if (pread (w->fd, &h, sizeof (h), 0) != sizeof (h)) avl_file_fatal (avl_fp, "151 log read failed");
+   if (h.epoch != w->epoch) {
+      avl_file_wclear (w);
+      w->epoch = h.epoch;
+      w->pos = AVL_FILE_WHDR_LEN;
+      w->size = -1;
+   }
+   if (h.end <= w->pos) return;
+
+   n = h.end - w->pos;
+   buf = malloc (n);
+   if (buf == NULL) avl_file_fatal (avl_fp, "150 malloc returned NULL");
+   n = pread (w->fd, buf, n, w->pos);
+   if (n < 0) avl_file_fatal (avl_fp, "151 log read failed");
+
+   for (o = 0; o + AVL_FILE_WFRAME_LEN <= n; o += f->len) {
+      f = (struct avl_file_wframe_struct *) (buf + o);
+      if ((f->epoch != w->epoch) || (f->len < AVL_FILE_WFRAME_LEN) || (f->len > n - o)) break;
+      crc = f->crc;
+      f->crc = 0;
+      if (avl_file_crc32 (0, f, f->len) != crc) break;
+
+      for (p = AVL_FILE_WFRAME_LEN; p < f->len; p += sizeof (*e) + ((e->len + 7) & ~7)) {
+         e = (struct avl_file_wentry_struct *) (buf + o + p);
+         u = avl_file_wget (avl_fp, e->pos);
+         memcpy (u->data + (e->pos - u->pos), e + 1, e->len);
+      }
+      if ((w->size < 0) || (f->size < w->size)) avl_file_wdrop (avl_fp, f->size);
+      w->size = f->size;
+   }
+   w->pos += o;
+   free (buf);
+}
 
-   struct hdr_struct {
-      char magic[8];
-      int32_t n_keys; 
-      int32_t len;
-      int32_t reclen;
-      int64_t n_avl;
-      int64_t nextnum;
-      off_t root[avl_fp->n_keys];
-      off_t head_seq;
-      off_t head_empty;
-      off_t head_cpr; 
-   } hdr;
 
-   struct avl_struct {
-      struct avl_node_struct n[avl_fp->n_keys];
-      off_t prev, next;
-      char b[avl_fp->len];
-   } yr, ar, br, cr, fr, pr, qr;
-   off_t y, a, b, c, f, p, q, lim;
-   int32_t k, d, unbalanced;
+/*------------------------------------------- avl_file_wput
+ * Write len bytes at pos into the log index, and add them to the
+ * frame for the current operation (except with shadow paging).
+ */
+static void
+avl_file_wput (AVL_FILE *avl_fp, off_t *lim, off_t pos, void *pr, int32_t len)
+{
+   struct avl_file_wal_struct *w;
+   struct avl_file_wentry_struct *e;
+   struct avl_file_wunit_struct *u;
+   int64_t n, m;
+   char *buf;
+
+   w = avl_fp->wal;
+   u = avl_file_wget (avl_fp, pos);
+   if (pos + len > u->pos + u->len) avl_file_fatal (avl_fp, "152 write crosses a record boundary");
+   memcpy (u->data + (pos - u->pos), pr, len);
+   if (pos + len > *lim) *lim = pos + len;
+   if (w->shadow) return;	// the frame is made from the index
+
+   n = sizeof (*e) + ((len + 7) & ~7);
+   if (w->buf_len + n > w->buf_max) {
+      m = (w->buf_max * 2 > w->buf_len + n) ? w->buf_max * 2 : w->buf_len + n;
+      buf = realloc (w->buf, m);
+      if (buf == NULL) avl_file_fatal (avl_fp, "150 malloc returned NULL");
+      w->buf = buf;
+      w->buf_max = m;
+   }
+   e = (struct avl_file_wentry_struct *) (w->buf + w->buf_len);
+   memset (e, 0, n);
+   e->pos = pos;
+   e->len = len;
+   memcpy (e + 1, pr, len);
+   w->buf_len += n;
+}
 
 
-   reclen = avl_fp->reclen;
-   fd = avl_fp->fd;
-   ret = 0;
+/*------------------------------------------- avl_file_wappend
+ * Append the frame for the current operation to the log, if the
+ * operation wrote anything. Frames by operations with a shared lock
+ * are serialized with a lock on byte 0 of the log.
+ * Returns the end of the frame in the log, or 0.
+ */
+static off_t
+avl_file_wappend (AVL_FILE *avl_fp, off_t *lim)
+{
+   struct avl_file_wal_struct *w;
+   struct avl_file_wframe_struct *f;
+   int64_t end;
 
-#ifdef	AVL_FILE_TSAFE
-   sem_wait (&avl_fp->sem);
-#endif
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_LOCK, 1);
-   lim = lseek (fd, 0, SEEK_END);
+   w = avl_fp->wal;
+   if (w->buf_len == AVL_FILE_WFRAME_LEN) return (0);
 
-   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+   if (w->ltype == F_RDLCK) {
+      avl_file_plock (w->fd, F_WRLCK, 0, 1);
+      avl_file_wscan (avl_fp);
+   }
+
+   f = (struct avl_file_wframe_struct *) w->buf;
+   f->epoch = w->epoch;
+   f->crc = 0;
+   f->len = w->buf_len;
+   f->size = *lim;
+   f->crc = avl_file_crc32 (0, f, f->len);
+   if (pwrite (w->fd, w->buf, f->len, w->pos) != f->len) avl_file_fatal (avl_fp, "153 log write failed");
+   w->pos += f->len;
+   w->size = *lim;
+   w->buf_len = AVL_FILE_WFRAME_LEN;
+
+   end = w->pos;
+   if (pwrite (w->fd, &end, sizeof (end), offsetof (struct avl_file_whdr_struct, end)) != sizeof (end))
+      avl_file_fatal (avl_fp, "153 log write failed");
+
+   if (w->ltype == F_RDLCK) avl_file_plock (w->fd, F_UNLCK, 0, 1);
+   return (w->pos);
+}
 
 
-   if ((hdr.n_avl + 1) < 0) {
-      setenv (AVL_FILE_EMSG_VNAME, "30 n_avl limit reached", 1);
-      ret = -1;
-      goto af_insert_return;
+/*------------------------------------------- avl_file_wsync
+ * Wait until the log is on disk up to end. Only one process at a
+ * time (holding a lock on byte 1 of the log) calls fdatasync(),
+ * and it covers the frames appended by all processes until then,
+ * so the others usually find that there is nothing left to do.
+ * The file should not be locked, so that other processes can
+ * append their frames in the meantime.
+ */
+static void
+avl_file_wsync (AVL_FILE *avl_fp, uint32_t epoch, off_t end)
+{
+   struct avl_file_wal_struct *w;
+   struct avl_file_whdr_struct h;
+
+   w = avl_fp->wal;
+   avl_file_plock (w->fd, F_WRLCK, 1, 1);
+   if (pread (w->fd, &h, sizeof (h), 0) != sizeof (h)) avl_file_fatal (avl_fp, "151 log read failed");
+   if ((h.epoch == epoch) && (h.synced < end)) {
+      if (fdatasync (w->fd) != 0) avl_file_fatal (avl_fp, "154 fdatasync failed");
+      if (pwrite (w->fd, &h.end, sizeof (h.end), offsetof (struct avl_file_whdr_struct, synced)) != sizeof (h.end))
+         avl_file_fatal (avl_fp, "153 log write failed");
    }
+   avl_file_plock (w->fd, F_UNLCK, 1, 1);
+}
 
-   y = hdr.head_empty;
-   if (y == 0) {
-      y = lseek (fd, 0, SEEK_END);
-      if (y < 0) {
-         setenv (AVL_FILE_EMSG_VNAME, "31 lseek failed", 1);
-         ret = -1;
-         goto af_insert_return;
+
+/*------------------------------------------- avl_file_wcheckpoint
+ * Copy the records in the log index into the file, and empty the
+ * log. The log is synced first, so that a crash while the file is
+ * being written leaves the frames to be written again. The file
+ * must be locked with F_WRLCK, and the index must be up to date.
+ * A current-pointer record is not copied over one in the file, see
+ * avl_file_wkeep().
+ */
+static void
+avl_file_wcheckpoint (AVL_FILE *avl_fp)
+{
+   struct avl_file_wal_struct *w;
+   struct avl_file_whdr_struct h;
+   struct avl_file_wunit_struct *u;
+   int64_t i;
+
+   w = avl_fp->wal;
+   avl_file_plock (w->fd, F_WRLCK, 1, 1);
+   if (pread (w->fd, &h, sizeof (h), 0) != sizeof (h)) avl_file_fatal (avl_fp, "151 log read failed");
+   if (fdatasync (w->fd) != 0) avl_file_fatal (avl_fp, "154 fdatasync failed");
+   if (pwrite (w->fd, &h.end, sizeof (h.end), offsetof (struct avl_file_whdr_struct, synced)) != sizeof (h.end))
+      avl_file_fatal (avl_fp, "153 log write failed");
+
+   for (i = 0; i < w->n_slots; i++) {
+      for (u = w->head[i]; u != NULL; u = u->next) {
+         if (avl_file_wkeep (avl_fp, u->pos, u->data)) continue;
+         if (pwrite (avl_fp->fd, u->data, u->len, u->pos) != u->len)
+            avl_file_fatal (avl_fp, "15 write failed");
       }
-   } else {
-      avl_file_lread (avl_fp, &lim, y, &yr, reclen);
-      hdr.head_empty = yr.next;
-   }
-   yr.prev = 0;
-   yr.next = hdr.head_seq;
-   if (yr.next > 0) {
-      p = yr.next;
-      avl_file_lread (avl_fp, &lim, p, &pr, reclen);
-      pr.prev = y;
-      avl_file_lwrite (avl_fp, &lim, p, &pr, reclen);
    }
-   hdr.head_seq = y;
+   if ((w->size >= 0) && (ftruncate (avl_fp->fd, w->size) != 0))
+      avl_file_fatal (avl_fp, "155 ftruncate failed");
+   if (fsync (avl_fp->fd) != 0) avl_file_fatal (avl_fp, "154 fsync failed");
+
+   h.epoch++;
+   h.end = AVL_FILE_WHDR_LEN;
+   h.synced = AVL_FILE_WHDR_LEN;
+   if (pwrite (w->fd, &h, sizeof (h), 0) != sizeof (h)) avl_file_fatal (avl_fp, "153 log write failed");
+   if (ftruncate (w->fd, AVL_FILE_WHDR_LEN) != 0) avl_file_fatal (avl_fp, "155 ftruncate failed");
+
+   avl_file_wclear (w);
+   w->epoch = h.epoch;
+   w->pos = AVL_FILE_WHDR_LEN;
+   w->size = -1;
+   w->ckpt = 0;
+   avl_file_plock (w->fd, F_UNLCK, 1, 1);
+}
 
-   memcpy (yr.b, data, avl_fp->len);
-   avl_file_lwrite (avl_fp, &lim, y, &yr, reclen);
 
-   for (k = 0; k < avl_fp->n_keys; k++) {
-      avl_file_lread (avl_fp, &lim, y, &yr, reclen);
+/*------------------------------------------- avl_file_wfree
+ * Close the log and free the index.
+ */
+static void
+avl_file_wfree (AVL_FILE *avl_fp)
+{
+   struct avl_file_wal_struct *w;
+
+   w = avl_fp->wal;
+   if (w == NULL) return;
+   avl_file_wclear (w);
+   close (w->fd);
+   free (w->head);
+   free (w->buf);
+   free (w);
+   avl_fp->wal = NULL;
+}
 
-      a = hdr.root[k];
-      if (a > 0) {
-         avl_file_lread (avl_fp, &lim, a, &ar, reclen);
-         f = 0; p = a; q = 0;
-         while (p > 0) {
-            avl_file_lread (avl_fp, &lim, p, &pr, reclen);
-            if (pr.n[k].b != 0) {
-               a = p; ar = pr; f = q; fr = qr;
-            }
-            if (avl_fp->cmp (k, yr.b, pr.b) < 0) {
-               q = p; qr = pr; p = pr.n[k].l;
-            } else {
-               q = p; qr = pr; p = pr.n[k].r;
-            }
-         }
-         if (avl_fp->cmp (k, yr.b, qr.b) < 0) {
-            yr.n[k].b = 0; yr.n[k].l = p; yr.n[k].r = -q;
-            qr.n[k].l = y;
-         } else {
-            yr.n[k].b = 0; yr.n[k].l = -q; yr.n[k].r = p;
-            qr.n[k].r = y;
-         }
-         avl_file_lwrite (avl_fp, &lim, y, &yr, reclen);
-         avl_file_lwrite (avl_fp, &lim, q, &qr, reclen);
 
-         avl_file_lread (avl_fp, &lim, a, &ar, reclen);
-         if (avl_fp->cmp (k, yr.b, ar.b) < 0) {
-            p = ar.n[k].l; b = p; d = +1;
-         } else {
-            p = ar.n[k].r; b = p; d = -1;
-         }
-         while (p != y) {
-            avl_file_lread (avl_fp, &lim, p, &pr, reclen);
-            if (avl_fp->cmp (k, yr.b, pr.b) < 0) {
-               pr.n[k].b = +1;
-               avl_file_lwrite (avl_fp, &lim, p, &pr, reclen);
-               p = pr.n[k].l;
-            } else {
-               pr.n[k].b = -1;
-               avl_file_lwrite (avl_fp, &lim, p, &pr, reclen);
-               p = pr.n[k].r;
-            }
-         }
-         unbalanced = 1;
-         if (ar.n[k].b == 0) {
-            ar.n[k].b = d; unbalanced = 0;
-            avl_file_lwrite (avl_fp, &lim, a, &ar, reclen);
-         }
-         if ((ar.n[k].b + d) == 0) {
-            ar.n[k].b = 0; unbalanced = 0;
-            avl_file_lwrite (avl_fp, &lim, a, &ar, reclen);
-         }
-         if (unbalanced == 1) {
-            if (d == +1) {
-               avl_file_lread (avl_fp, &lim, b, &br, reclen);
-               if (br.n[k].b == +1) {
-                  if (br.n[k].r > 0) 
-                     ar.n[k].l = br.n[k].r;
-                  else
-                     ar.n[k].l = -b;
-                  br.n[k].r = a; ar.n[k].b = 0; br.n[k].b = 0;
-                  avl_file_lwrite (avl_fp, &lim, a, &ar, reclen);
-                  avl_file_lwrite (avl_fp, &lim, b, &br, reclen);
-               } else {
-                  c = br.n[k].r;
-                  avl_file_lread (avl_fp, &lim, c, &cr, reclen);
-                  if (cr.n[k].l > 0) 
-                     br.n[k].r = cr.n[k].l;
-                  else
-                     br.n[k].r = -c;
-                  if (cr.n[k].r > 0) 
-                     ar.n[k].l = cr.n[k].r;
-                  else
-                     ar.n[k].l = -c;
-                  cr.n[k].l = b;
-                  cr.n[k].r = a;
-                  switch (cr.n[k].b) {
-                  case +1:
-                     ar.n[k].b = -1; br.n[k].b = 0; break;
-                  case -1:
-                     br.n[k].b = +1; ar.n[k].b = 0; break;
-                  case 0:
-                     br.n[k].b =  0; ar.n[k].b = 0; break;
-                  default:
-                     setenv (AVL_FILE_EMSG_VNAME, "32 invalid value n.b", 1);
-                     break;
-                  }
-                  cr.n[k].b = 0;
-                  avl_file_lwrite (avl_fp, &lim, a, &ar, reclen);
-                  avl_file_lwrite (avl_fp, &lim, b, &br, reclen);
-                  avl_file_lwrite (avl_fp, &lim, c, &cr, reclen);
-                  b = c;
-               }
-            } else {
-               avl_file_lread (avl_fp, &lim, b, &br, reclen);
-               if (br.n[k].b == -1) {
-                  if (br.n[k].l > 0) 
-                     ar.n[k].r = br.n[k].l;
-                  else
-                     ar.n[k].r = -b;
-                  br.n[k].l = a; ar.n[k].b = 0; br.n[k].b = 0;
-                  avl_file_lwrite (avl_fp, &lim, a, &ar, reclen);
-                  avl_file_lwrite (avl_fp, &lim, b, &br, reclen);
-               } else {
-                  c = br.n[k].l;
-                  avl_file_lread (avl_fp, &lim, c, &cr, reclen);
-                  if (cr.n[k].l > 0) 
-                     ar.n[k].r = cr.n[k].l;
-                  else
-                     ar.n[k].r = -c;
-                  if (cr.n[k].r > 0) 
-                     br.n[k].l = cr.n[k].r;
-                  else
-                     br.n[k].l = -c;
-                  cr.n[k].r = b;
-                  cr.n[k].l = a;
-                  switch (cr.n[k].b) {
-                  case +1: 
-                     br.n[k].b = -1; ar.n[k].b = 0; break;
-                  case -1:
-                     ar.n[k].b = +1; br.n[k].b = 0; break;
-                  case 0:
-                     br.n[k].b =  0; ar.n[k].b = 0; break;
-                  default:
-                     setenv (AVL_FILE_EMSG_VNAME, "33 invalid value n.b", 1);
-                     break;
-                  }
-                  cr.n[k].b = 0;
-                  avl_file_lwrite (avl_fp, &lim, a, &ar, reclen);
-                  avl_file_lwrite (avl_fp, &lim, b, &br, reclen);
-                  avl_file_lwrite (avl_fp, &lim, c, &cr, reclen);
-                  b = c;
-               }
-            }
-            if (f == 0) {
-               hdr.root[k] = b;
-            } else {
-               if (a == fr.n[k].l) {
-                  fr.n[k].l = b;
-               } else if (a == fr.n[k].r) {
-                  fr.n[k].r = b;
-               }
-               avl_file_lwrite (avl_fp, &lim, f, &fr, reclen);
-            }
-         }
-      } else {
-         yr.n[k].b = 0; yr.n[k].l = 0; yr.n[k].r = 0;
-         hdr.root[k] = y;
-         avl_file_lwrite (avl_fp, &lim, y, &yr, reclen);
+/*------------------------------------------- avl_file_walloc
+ * Allocate the log index for the log or shadow file fd, which is
+ * closed if that fails.
+ * Returns the index, or NULL.
+ */
+static struct avl_file_wal_struct *
+avl_file_walloc (int32_t fd)
+{
+   struct avl_file_wal_struct *w;
+
+   w = calloc (1, sizeof (struct avl_file_wal_struct));
+   if (w != NULL) {
+      w->n_slots = 1024;
+      w->head = calloc (w->n_slots, sizeof (struct avl_file_wunit_struct *));
+      w->buf_max = 4096;
+      w->buf = malloc (w->buf_max);
+   }
+   if ((w == NULL) || (w->head == NULL) || (w->buf == NULL)) {
+      setenv (AVL_FILE_EMSG_VNAME, "28 malloc returned NULL", 1);
+      if (w != NULL) {
+         free (w->head);
+         free (w->buf);
+         free (w);
       }
+      close (fd);
+      return (NULL);
    }
-
-   hdr.n_avl++;
-   avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
-
-af_insert_return:
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_ULOCK, 1);
-#ifdef	AVL_FILE_TSAFE
-   sem_post (&avl_fp->sem);
-#endif
-   return (ret);
+   w->fd = fd;
+   w->ltype = F_WRLCK;
+   w->size = -1;
+   return (w);
 }
-  
 
 
-/* --------------------------------------------------- avl_file_delete
- * Delete one record from the file. The entire buffer pointed to by
- * the data parameter must match exactly the record to be deleted.
- * (i.e., it should be read first). If the file contains more than
- * one identical matching record, then the one deleted is arbitrary.
+/*
+ * Shadow paging, for files opened with avl_file_open_shadow() (or any
+ * file that has a shadow file). The records written by an update are
+ * kept in the log index until it ends, as with the log, and are then
+ * written as one frame into fresh space in the shadow file (fname
+ * with "-shadow" added), followed by whichever of its two slots does
+ * not hold the last commit. One fdatasync() of the shadow file makes
+ * the update durable, and the records are then written into the
+ * file itself, so that the index is empty between operations and
+ * the other processes read the file without it.
  *
- * The return value is 0 for OK, or -1 for none.
+ * A slot has the number of the last frame, the range of the frames
+ * written since the file itself was last synced, and a CRC of its
+ * own. The frames have CRCs and consecutive numbers. After a crash,
+ * the newest slot with all of its frames intact is the last commit,
+ * and its frames are written into the file again. Once the frames
+ * are longer than AVL_FILE_WAL_MAX bytes, the file is synced, and
+ * the next frame starts at the beginning again.
+ *
+ * The shadow file header also has the number of the last frame that
+ * was written into the file. A process that finds the last commit
+ * newer than that (the process that committed it died) writes its
+ * frames into the file before going on. Current-pointer records are
+ * written into the file directly, as with the log (see
+ * avl_file_cwrite()), and the frames are never written over them, so
+ * that the commits and the replays do not put back older ones.
  */
-int32_t 
-#ifdef	AVL_FILE_TSAFE
-avl_file_delete_t (AVL_FILE *avl_fp, void *data) 
-#else
-avl_file_delete (AVL_FILE *avl_fp, void *data) 
-#endif
-{
-   int32_t fd, reclen, len, ret;
+struct avl_file_wslot_struct {		// shadow file slot
+   uint32_t seq;         // number of the last frame
+   uint32_t crc;         // of the slot, with crc 0
+   int64_t start;        // first frame since the file was synced
+   int64_t end;          // end of the last frame
+};
 
-   struct hdr_struct {
-      char magic[8];
-      int32_t n_keys; 
-      int32_t len;
-      int32_t reclen;
-      int64_t n_avl;
-      int64_t nextnum;
-      off_t root[avl_fp->n_keys];
-      off_t head_seq;
-      off_t head_empty;
-      off_t head_cpr; 
-   } hdr;
+struct avl_file_wshadow_struct {	// shadow file header
+   char magic[8];
+   uint32_t done;        // last frame written into the file
+   uint32_t pad;
+   struct avl_file_wslot_struct slot[2];	// by frame number % 2
+};
 
-   struct avl_struct {
-      struct avl_node_struct n[avl_fp->n_keys];
-      off_t prev, next;
-      char b[avl_fp->len];
-   } yr, ar, br, cr, cpr, spr, ur, par[128];
-   off_t y, a, b, c, cp, sp, pa[128], lim;
-   int32_t i, k, l, m, updated, stack[128];
+#define AVL_FILE_WSHADOW_LEN	((off_t) sizeof (struct avl_file_wshadow_struct))
 
 
-   fd = avl_fp->fd;
-   reclen = avl_fp->reclen;
-   len = avl_fp->len;
-   ret = 0;
+/*------------------------------------------- avl_file_wseal
+ * Set the CRC of a shadow file slot.
+ */
+static void
+avl_file_wseal (struct avl_file_wslot_struct *s)
+{
+   s->crc = 0;
+   s->crc = avl_file_crc32 (0, s, sizeof (*s));
+}
 
-#ifdef	AVL_FILE_TSAFE
-   sem_wait (&avl_fp->sem);
-#endif
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_LOCK, 1);
-   lim = lseek (fd, 0, SEEK_END);
 
-   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+/*------------------------------------------- avl_file_wnewest
+ * Return the newest shadow file slot with a good CRC, or -1 if
+ * neither has one.
+ */
+static int32_t
+avl_file_wnewest (struct avl_file_wshadow_struct *h)
+{
+   struct avl_file_wslot_struct s;
+   int32_t i, ok[2];
 
-   memcpy (yr.b, data, len);
-   y = 0;
+   for (i = 0; i < 2; i++) {
+      s = h->slot[i];
+      avl_file_wseal (&s);
+      ok[i] = (h->slot[i].seq != 0) && (s.crc == h->slot[i].crc);
+   }
+   if (ok[0] && ok[1]) return ((int32_t) (h->slot[1].seq - h->slot[0].seq) > 0);
+   if (ok[1]) return (1);
+   return (ok[0] ? 0 : -1);
+}
 
-  /*
-   * Search for a matching record by key(s), assigning it to 'y'.
-   * This may not find the matching record if there
-   * are duplicate keys.
-   */
-   for (k = 0; k < avl_fp->n_keys; k++) {
-      a = hdr.root[k];
-      while (a > 0) {
-         avl_file_lread (avl_fp, &lim, a, &ar, reclen);
-         if (avl_fp->cmp (k, yr.b, ar.b) <= 0) {
-            if (ar.n[k].l > 0)
-               a = ar.n[k].l;
-            else
-               break;
-         } else {
-            if (ar.n[k].r > 0)
-               a = ar.n[k].r;
-            else {
-               a = -ar.n[k].r;
-               break;
-            }
-         }
-      }
-      if (a > 0) {
-         avl_file_lread (avl_fp, &lim, a, &ar, reclen);
-         if (avl_fp->cmp (k, yr.b, ar.b) == 0) {
-            if (memcmp (yr.b, ar.b, len) == 0) {
-               y = a; yr = ar;
-               break;
-            }
-         }
+
+/*------------------------------------------- avl_file_wreplay
+ * Write the frames of the shadow file slot s into the file, if all
+ * of them are intact, except over current-pointer records, see
+ * avl_file_wkeep().
+ * Returns 0 if successful, or -1 if they are not.
+ */
+static int32_t
+avl_file_wreplay (AVL_FILE *avl_fp, struct avl_file_wslot_struct *s)
+{
+   struct avl_file_wframe_struct *f;
+   struct avl_file_wentry_struct *e;
+   int64_t n, o, p;
+   uint32_t crc, seq;
+   char *buf;
+
+   n = s->end - s->start;
+   if (n <= 0) return ((n == 0) ? 0 : -1);
+   buf = malloc (n);
+   if (buf == NULL) avl_file_fatal (avl_fp, "150 malloc returned NULL");
+   if (pread (avl_fp->wal->fd, buf, n, s->start) != n) {
+      free (buf);
+      return (-1);
+   }
+
+   seq = 0;
+   for (o = 0; o + AVL_FILE_WFRAME_LEN <= n; o += f->len) {
+      f = (struct avl_file_wframe_struct *) (buf + o);
+      if ((f->len < AVL_FILE_WFRAME_LEN) || (f->len > n - o)) break;
+      if ((o > 0) && (f->epoch != seq + 1)) break;
+      crc = f->crc;
+      f->crc = 0;
+      if (avl_file_crc32 (0, f, f->len) != crc) break;
+      seq = f->epoch;
+   }
+   if ((o != n) || (seq != s->seq)) {
+      free (buf);
+      return (-1);
+   }
+
+   for (o = 0; o < n; o += f->len) {
+      f = (struct avl_file_wframe_struct *) (buf + o);
+      for (p = AVL_FILE_WFRAME_LEN; p < f->len; p += sizeof (*e) + ((e->len + 7) & ~7)) {
+         e = (struct avl_file_wentry_struct *) (buf + o + p);
+         if (avl_file_wkeep (avl_fp, e->pos, (char *) (e + 1))) continue;
+         if (pwrite (avl_fp->fd, e + 1, e->len, e->pos) != e->len) avl_file_fatal (avl_fp, "15 write failed");
       }
+      if (ftruncate (avl_fp->fd, f->size) != 0) avl_file_fatal (avl_fp, "155 ftruncate failed");
    }
+   free (buf);
+   return (0);
+}
 
-  /*
-   * Search for the record if not previously found, including
-   * searching sequentially through duplicate keys.
-   */
-   if ((y == 0) && (avl_fp->n_keys > 0)) {
-      k = 0; l = 0; m = 0;
-      pa[l] = hdr.root[k];
-af_delete_loop1:
-      if (pa[l] > 0) {
-         avl_file_lread (avl_fp, &lim, pa[l], &par[l], reclen);
 
-         i = avl_fp->cmp (k, yr.b, par[l].b);
-         if (i <= 0) {
-            if (i == 0) stack[m++] = l;
+/*------------------------------------------- avl_file_wrecover
+ * Write the frames of the last commit into the file again, from the
+ * shadow file header h. A slot whose frames are not all intact is
+ * cleared, and the other one is used. The file must be locked with
+ * F_WRLCK.
+ */
+static void
+avl_file_wrecover (AVL_FILE *avl_fp, struct avl_file_wshadow_struct *h)
+{
+   struct avl_file_wal_struct *w;
+   int32_t i;
+
+   w = avl_fp->wal;
+   while ((i = avl_file_wnewest (h)) >= 0) {
+      if (avl_file_wreplay (avl_fp, &h->slot[i]) == 0) break;
+      memset (&h->slot[i], 0, sizeof (h->slot[i]));
+      if (pwrite (w->fd, &h->slot[i], sizeof (h->slot[i]), offsetof (struct avl_file_wshadow_struct, slot[i]))
+          != sizeof (h->slot[i])) avl_file_fatal (avl_fp, "234 shadow write failed");
+   }
+   if (i >= 0) {
+      w->epoch = h->slot[i].seq;
+      w->start = h->slot[i].start;
+      w->pos = h->slot[i].end;
+   } else {
+      w->epoch = h->done;
+      w->start = AVL_FILE_WSHADOW_LEN;
+      w->pos = AVL_FILE_WSHADOW_LEN;
+   }
+   h->done = w->epoch;
+   if (pwrite (w->fd, &h->done, sizeof (h->done), offsetof (struct avl_file_wshadow_struct, done))
+       != sizeof (h->done)) avl_file_fatal (avl_fp, "234 shadow write failed");
+}
 
-            pa[l+1] = par[l].n[k].l; l++; 
-            goto af_delete_loop1;
-         }
-af_delete_loop2:
-         pa[l+1] = par[l].n[k].r; l++;
-         goto af_delete_loop1;
-      }
-      if (m > 0) {
-         l = stack[--m];
-         for (i = 0; i < avl_fp->n_keys; i++) 
-            if (avl_fp->cmp (i, yr.b, par[l].b) != 0) break;
-         if ((i < avl_fp->n_keys) || (memcmp (yr.b, par[l].b, len) != 0))
-            goto af_delete_loop2;         
-         y = pa[l]; yr = par[l];
-      }
+
+/*------------------------------------------- avl_file_wcheck
+ * Read the slot of the last commit from the shadow file. If its
+ * frames have not all been written into the file, write them, if
+ * the file is locked with F_WRLCK.
+ * Returns 0 if successful, or -1 if they need to be written and the
+ * file is locked with F_RDLCK.
+ */
+static int32_t
+avl_file_wcheck (AVL_FILE *avl_fp, int32_t type)
+{
+   struct avl_file_wal_struct *w;
+   struct avl_file_wshadow_struct h;
+   int32_t i;
+
+   w = avl_fp->wal;
+   if (pread (w->fd, &h, sizeof (h), 0) != sizeof (h)) avl_file_fatal (avl_fp, "233 shadow read failed");
+   i = avl_file_wnewest (&h);
+   if ((i >= 0) && (h.slot[i].seq != h.done)) {
+      if (type != F_WRLCK) return (-1);
+      avl_file_wrecover (avl_fp, &h);
+   } else if (i >= 0) {
+      w->epoch = h.slot[i].seq;
+      w->start = h.slot[i].start;
+      w->pos = h.slot[i].end;
+   } else {
+      w->epoch = h.done;
+      w->start = AVL_FILE_WSHADOW_LEN;
+      w->pos = AVL_FILE_WSHADOW_LEN;
    }
+   return (0);
+}
 
 
-  /*
-   * Search sequentially for a matching record, if necessary.
-   * (This is needed, for example, if n_keys is zero).
-   */
-   if (y == 0) {
-      a = hdr.head_seq;
-      while (a > 0) {
-         avl_file_lread (avl_fp, &lim, a, &ar, reclen);
-         if (memcmp (yr.b, ar.b, len) == 0) {
-            y = a; yr = ar;
-            break;
-         }
-         a = ar.next;
+/*------------------------------------------- avl_file_wreset
+ * Sync the file, so that the frames in the shadow file are no longer
+ * needed, and start them again at the beginning with a slot for no
+ * frames. The file must be locked with F_WRLCK.
+ */
+static void
+avl_file_wreset (AVL_FILE *avl_fp)
+{
+   struct avl_file_wal_struct *w;
+   struct avl_file_wslot_struct s;
+
+   w = avl_fp->wal;
+   if (fsync (avl_fp->fd) != 0) avl_file_fatal (avl_fp, "235 fsync failed");
+   memset (&s, 0, sizeof (s));
+   s.seq = w->epoch + 1;
+   s.start = AVL_FILE_WSHADOW_LEN;
+   s.end = AVL_FILE_WSHADOW_LEN;
+   avl_file_wseal (&s);
+   if ((pwrite (w->fd, &s, sizeof (s), offsetof (struct avl_file_wshadow_struct, slot[s.seq % 2])) != sizeof (s)) ||
+       (pwrite (w->fd, &s.seq, sizeof (s.seq), offsetof (struct avl_file_wshadow_struct, done)) != sizeof (s.seq)))
+      avl_file_fatal (avl_fp, "234 shadow write failed");
+   w->epoch = s.seq;
+   w->start = AVL_FILE_WSHADOW_LEN;
+   w->pos = AVL_FILE_WSHADOW_LEN;
+}
+
+
+/*------------------------------------------- avl_file_wcommit
+ * Commit the records written by an update, which are in the log
+ * index: write them as a frame into the shadow file after the last
+ * one, then the other slot, and sync the shadow file. Then write
+ * them into the file itself (except over current-pointer records, see
+ * avl_file_wkeep()), and empty the index. The file must be locked
+ * with F_WRLCK.
+ */
+static void
+avl_file_wcommit (AVL_FILE *avl_fp, off_t *lim)
+{
+   struct avl_file_wal_struct *w;
+   struct avl_file_wframe_struct *f;
+   struct avl_file_wentry_struct *e;
+   struct avl_file_wunit_struct *u;
+   struct avl_file_wslot_struct s;
+   int64_t i, n;
+   char *buf;
+
+   w = avl_fp->wal;
+   if ((w->n_used == 0) && (w->size < 0)) return;
+   if (w->pos - w->start > AVL_FILE_WAL_MAX) avl_file_wreset (avl_fp);
+
+   n = AVL_FILE_WFRAME_LEN;
+   for (i = 0; i < w->n_slots; i++) {
+      for (u = w->head[i]; u != NULL; u = u->next) n += sizeof (*e) + ((u->len + 7) & ~7);
+   }
+   if (n > w->buf_max) {
+      buf = realloc (w->buf, n);
+      if (buf == NULL) avl_file_fatal (avl_fp, "150 malloc returned NULL");
+      w->buf = buf;
+      w->buf_max = n;
+   }
+   memset (w->buf, 0, n);
+   f = (struct avl_file_wframe_struct *) w->buf;
+   n = AVL_FILE_WFRAME_LEN;
+   for (i = 0; i < w->n_slots; i++) {
+      for (u = w->head[i]; u != NULL; u = u->next) {
+         e = (struct avl_file_wentry_struct *) (w->buf + n);
+         e->pos = u->pos;
+         e->len = u->len;
+         memcpy (e + 1, u->data, u->len);
+         n += sizeof (*e) + ((u->len + 7) & ~7);
+      }
+   }
+   f->epoch = w->epoch + 1;
+   f->len = n;
+   f->size = *lim;
+   f->crc = avl_file_crc32 (0, f, n);
+
+   memset (&s, 0, sizeof (s));
+   s.seq = f->epoch;
+   s.start = w->start;
+   s.end = w->pos + n;
+   avl_file_wseal (&s);
+   if ((pwrite (w->fd, w->buf, n, w->pos) != n) ||
+       (pwrite (w->fd, &s, sizeof (s), offsetof (struct avl_file_wshadow_struct, slot[s.seq % 2])) != sizeof (s)))
+      avl_file_fatal (avl_fp, "234 shadow write failed");
+   if (fdatasync (w->fd) != 0) avl_file_fatal (avl_fp, "235 fdatasync failed");
+
+   for (i = 0; i < w->n_slots; i++) {
+      for (u = w->head[i]; u != NULL; u = u->next) {
+         if (avl_file_wkeep (avl_fp, u->pos, u->data)) continue;
+         if (pwrite (avl_fp->fd, u->data, u->len, u->pos) != u->len) avl_file_fatal (avl_fp, "15 write failed");
       }
    }
+   if ((w->size >= 0) && (ftruncate (avl_fp->fd, w->size) != 0)) avl_file_fatal (avl_fp, "155 ftruncate failed");
+   if (pwrite (w->fd, &s.seq, sizeof (s.seq), offsetof (struct avl_file_wshadow_struct, done)) != sizeof (s.seq))
+      avl_file_fatal (avl_fp, "234 shadow write failed");
+
+   w->epoch = s.seq;
+   w->pos = s.end;
+   w->size = -1;
+   avl_file_wclear (w);
+}
 
-   if (y == 0) {
-      ret = -1;
-      goto af_delete_return;
-   } 
 
-  /*
-   * Find y's previous and next records for each key.
-   */
-   for (k = 0; k < avl_fp->n_keys; k++) {
-      sp = yr.n[k].l;
-      if (sp > 0) {
-         avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
-         while (spr.n[k].r > 0) {
-            sp = spr.n[k].r;
-            avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
-         }
-      } else {
-         sp = -yr.n[k].l;
-      }
-      ur.n[k].l = sp;
+/*------------------------------------------- avl_file_wshadow
+ * Open (or with AVL_FILE_SHADOW in the mode, create) the shadow file
+ * wname for the file, and write the last commit into the file again,
+ * in case the system crashed before it was all on disk. While the
+ * file is open as another AVL_FILE, that is only done if the commit
+ * was not all written (see avl_file_wcheck()), since the records in
+ * the file may be newer. The file must be locked with F_WRLCK. The
+ * shadow file is not created while the file is open as another
+ * AVL_FILE, which would not use it.
+ * Returns 0 if successful.
+ */
+static int32_t
+avl_file_wshadow (AVL_FILE *avl_fp, char *wname, int32_t mode)
+{
+   struct avl_file_wal_struct *w;
+   struct avl_file_wshadow_struct h;
+   int32_t fd, n;
 
-      sp = yr.n[k].r;
-      if (sp > 0) {
-         avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
-         while (spr.n[k].l > 0) {
-            sp = spr.n[k].l;
-            avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
-         }
-      } else {
-         sp = -yr.n[k].r;
-      }
-      ur.n[k].r = sp;
+   if ((mode & AVL_FILE_SHADOW) && (access (wname, F_OK) != 0) && avl_file_olive (avl_fp)) {
+      setenv (AVL_FILE_EMSG_VNAME, "236 the file is open, the shadow file cannot be created", 1);
+      return (-1);
+   }
+   if (mode & AVL_FILE_SHADOW)
+      fd = open (wname, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+   else
+      fd = open (wname, O_RDWR);
+   if (fd < 0) {
+      setenv (AVL_FILE_EMSG_VNAME, "230 shadow file open failed", 1);
+      return (-1);
    }
 
-  /*
-   * Advance all current pointers that point to this record.
-   */
-   cp = hdr.head_cpr;
-   while (cp > 0) {
-      avl_file_lread (avl_fp, &lim, cp, &cpr, reclen);
+   n = pread (fd, &h, sizeof (h), 0);
+   if (n == 0) {
+      memset (&h, 0, sizeof (h));
+      memcpy (h.magic, "AVL.SHDW", 8);
+      n = pwrite (fd, &h, sizeof (h), 0);
+   }
+   if ((n != sizeof (h)) || (memcmp (h.magic, "AVL.SHDW", 8) != 0)) {
+      setenv (AVL_FILE_EMSG_VNAME, "231 bad shadow file header", 1);
+      close (fd);
+      return (-1);
+   }
 
-      updated = 0;
+   w = avl_file_walloc (fd);
+   if (w == NULL) return (-1);
+   w->shadow = 1;
+   avl_fp->wal = w;
 
-      if (cpr.prev == y) {
-         cpr.prev = yr.next;
-         updated = 1;
-      }
+   if (avl_file_olive (avl_fp)) return (avl_file_wcheck (avl_fp, F_WRLCK));
+   avl_file_wrecover (avl_fp, &h);
+   if (w->pos > w->start) avl_file_wreset (avl_fp);
+   return (0);
+}
 
-      for (k = 0; k < avl_fp->n_keys; k++) {
-         if (cpr.n[k].l == y) {
-            cpr.n[k].l = ur.n[k].l;
-            updated = 1;
-         }
-         if (cpr.n[k].r == y) {
-            cpr.n[k].r = ur.n[k].r;
-            updated = 1;
-         }
-      }
 
-      if (updated == 1) {
-         avl_file_lwrite (avl_fp, &lim, cp, &cpr, reclen);
+/*------------------------------------------- avl_file_wopen
+ * Open (or with AVL_FILE_WAL in the mode, create) the log for the
+ * file, and copy any frames left in it into the file. Without
+ * AVL_FILE_WAL, a file that does not have a log is left as it is.
+ * With AVL_FILE_SHADOW, or if the file has a shadow file, the
+ * shadow file is opened instead, see avl_file_wshadow().
+ * The file must be locked with F_WRLCK. The log is not created while
+ * the file is open as another AVL_FILE, which would not use it.
+ * Returns 0 if successful.
+ */
+static int32_t
+avl_file_wopen (AVL_FILE *avl_fp, char *fname, int32_t mode)
+{
+   struct avl_file_wal_struct *w;
+   struct avl_file_whdr_struct h;
+   char wname[strlen (fname) + 5], dname[strlen (fname) + 8];
+   int32_t fd, n;
+
+   avl_fp->wal = NULL;
+   strcpy (wname, fname);
+   strcat (wname, "-wal");
+   strcpy (dname, fname);
+   strcat (dname, "-shadow");
+   if ((mode & AVL_FILE_SHADOW) || (access (dname, F_OK) == 0)) {
+      if ((mode & AVL_FILE_WAL) || (access (wname, F_OK) == 0)) {
+         setenv (AVL_FILE_EMSG_VNAME, "232 a file cannot have both a log and a shadow file", 1);
+         return (-1);
       }
-      cp = cpr.next;
+      return (avl_file_wshadow (avl_fp, dname, mode));
+   }
+   if ((mode & AVL_FILE_WAL) && (access (wname, F_OK) != 0) && avl_file_olive (avl_fp)) {
+      setenv (AVL_FILE_EMSG_VNAME, "156 the file is open, the log cannot be created", 1);
+      return (-1);
+   }
+   if (mode & AVL_FILE_WAL)
+      fd = open (wname, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+   else
+      fd = open (wname, O_RDWR);
+   if (fd < 0) {
+      if (!(mode & AVL_FILE_WAL) && (access (wname, F_OK) != 0)) return (0);
+      setenv (AVL_FILE_EMSG_VNAME, "26 log open failed", 1);
+      return (-1);
    }
 
+   n = pread (fd, &h, sizeof (h), 0);
+   if (n == 0) {
+      memset (&h, 0, sizeof (h));
+      memcpy (h.magic, "AVL.WAL ", 8);
+      h.epoch = 1;
+      h.end = AVL_FILE_WHDR_LEN;
+      h.synced = AVL_FILE_WHDR_LEN;
+      n = pwrite (fd, &h, sizeof (h), 0);
+   }
+   if ((n != sizeof (h)) || (memcmp (h.magic, "AVL.WAL ", 8) != 0)) {
+      setenv (AVL_FILE_EMSG_VNAME, "27 bad log header", 1);
+      close (fd);
+      return (-1);
+   }
 
-  /*
-   * Remove it from the tree. Only pointers change, not
-   * the positions of records in the file.
-   */
-   for (k = 0; k < avl_fp->n_keys; k++) {
-     /*
-      * Make a path to y. Duplicate keys require some searching.
-      */
-      l = 0; m = 0;
-      pa[l] = hdr.root[k];
-afd_findloop1:
-      if (pa[l] > 0) {
-         avl_file_lread (avl_fp, &lim, pa[l], &par[l], reclen);
+   w = avl_file_walloc (fd);
+   if (w == NULL) return (-1);
+   w->epoch = h.epoch - 1;     // so that the frames are read
+   w->buf_len = AVL_FILE_WFRAME_LEN;
+   avl_fp->wal = w;
 
-         i = avl_fp->cmp (k, yr.b, par[l].b);
-         if (i <= 0) {
-            if (i == 0) stack[m++] = l;
+   avl_file_wscan (avl_fp);
+   if (w->pos > AVL_FILE_WHDR_LEN) avl_file_wcheckpoint (avl_fp);
+   return (0);
+}
 
-            pa[l+1] = par[l].n[k].l; l++; 
-            goto afd_findloop1;
-         }
-afd_findloop2:
-         pa[l+1] = par[l].n[k].r; l++;
-         goto afd_findloop1;
-      }
-      if (m > 0) {
-         l = stack[--m];
-         if (pa[l] != y) goto afd_findloop2;         
-      } else {
-         setenv (AVL_FILE_EMSG_VNAME, "40 not in the tree", 1);
-         continue;
-      }
-      m = l;
 
-     /*
-      * Remove and replace.
-      */
-      if (par[l].n[k].l > 0) {
-         pa[l+1] = par[l].n[k].l; l++;
-         avl_file_lread (avl_fp, &lim, pa[l], &par[l], reclen);
+/*
+ * The version store, for the snapshots of files opened with 
+ * avl_file_open_snap() (or any file that has one), see 
+ * avl_file_snapshot_begin(). While any process has a snapshot, an 
+ * update saves each record that it writes, as it was before the 
+ * update, in a file of its own (fname with "-snap" added) that each
+ * process maps with MAP_SHARED. The saved records are tagged with the
+ * generation number of the update, and found by their file position 
+ * through a hash table of chains, newest first. The records that 
+ * avl_file_ftruncate() cuts off are saved too.
+ *
+ * A snapshot has the header and the file length from when it began, 
+ * and its operations do not lock the file. A record is read from the
+ * file, unless it has been saved with a tag that is not lower than 
+ * the snapshot's generation number, and then the one with the lowest
+ * such tag is used. Since an update saves a record before it writes
+ * it, the store is looked at again after the record has been read
+ * from the file, and the saved record is used if one was saved in 
+ * the meantime.
+ *
+ * Each snapshot has a slot in the store with its process ID. The
+ * store is emptied by the first update after the last snapshot has
+ * ended, and the slots of processes that have died are freed by the
+ * updates after every AVL_FILE_SNAP_CHECK saved records. Then, and
+ * when the store is full, the saved records with a tag lower than 
+ * the generation number of every snapshot are freed too, to be 
+ * used again. The links to a record hold its number as well as its
+ * place, so that a snapshot that follows one to a place that has 
+ * been used again sees that it has come to the end of the records
+ * it can use.
+ */
+#define AVL_FILE_SNAP_SLOTS	64	// snapshots at once
+#define AVL_FILE_SNAP_HASH	4096	// hash chains
+#define AVL_FILE_SNAP_ROOM	256	// records the store has room for at first
+#define AVL_FILE_SNAP_CHECK	4096	// records saved between checks for dead processes
+
+struct avl_file_vhdr_struct {		// store file header
+   char magic[8];
+   int32_t reclen;       // file record length
+   int32_t count;        // slots in use
+   uint32_t n;           // records saved, the last one's number
+   uint32_t room;        // records the store file has room for
+   uint32_t checked;     // n when the slots were last checked
+   uint32_t top;         // places used so far
+   uint32_t free;        // first free place + 1, or 0
+   uint32_t pad;
+   struct {
+      int32_t pid;       // process with the snapshot, or 0
+      uint32_t gen;      // the snapshot's generation number
+   } slot[AVL_FILE_SNAP_SLOTS];
+   uint64_t head[AVL_FILE_SNAP_HASH];	// chains, links to saved records, or 0
+};
+
+#define AVL_FILE_VHDR_LEN	((sizeof (struct avl_file_vhdr_struct) + 4095) & ~4095)
+#define AVL_FILE_VMAGIC		"AVL.SNP2"
+
+/*
+ * A link to a saved record: its number, and its place + 1.
+ */
+#define AVL_FILE_VLINK(num, i)	(((uint64_t) (num) << 32) | ((uint64_t) (i) + 1))
+#define AVL_FILE_VNUM(l)	((uint32_t) ((l) >> 32))
+#define AVL_FILE_VPLACE(l)	((uint32_t) (l) - 1)
+
+struct avl_file_vrec_struct {		// a saved record, followed by the record
+   off_t pos;            // file position
+   uint32_t tag;         // generation number of the update that saved it
+   uint32_t num;         // record number, or 0 while it is free or being saved
+   uint64_t next;        // link to the older record in the chain, or the next free place
+};
+
+struct avl_file_vers_struct {
+   int32_t fd;           // store file
+   int32_t save;         // records are saved by the update
+   uint32_t tag;         // the update's generation number
+   off_t flim;           // file length when the update began
+   int32_t slot;         // the snapshot's slot, or -1 for none
+   int32_t on;           // an operation is reading the snapshot
+   uint32_t gen;         // the snapshot's generation number
+   off_t lim;            // its file length
+   char *hdr;            // its header
+   char *cpr;            // its current-pointer record, which is kept here
+   char *map;            // store mapping
+   size_t map_len;
+   int32_t n_old;        // earlier mappings, kept until no snapshot can use them
+   char *old[32];
+   size_t old_len[32];
+   pthread_mutex_t mu;   // the mapping, for the _t functions
+};
+
+
+/*------------------------------------------- avl_file_vmap
+ * Map the whole store file, keeping the earlier mapping, which 
+ * operations in other threads may be using.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_vmap (AVL_FILE *avl_fp)
+{
+   struct avl_file_vers_struct *v;
+   struct avl_file_vhdr_struct *h;
+   size_t sz;
+   char *p;
+
+   v = avl_fp->vers;
+   h = (struct avl_file_vhdr_struct *) v->map;
+   sz = AVL_FILE_VHDR_LEN + (size_t) __atomic_load_n (&h->room, __ATOMIC_ACQUIRE) * 
+        (sizeof (struct avl_file_vrec_struct) + avl_fp->reclen);
+   if (sz <= v->map_len) return;
+   p = mmap (NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, v->fd, 0);
+   if (p == MAP_FAILED) avl_file_fatal (avl_fp, "223 version store mmap failed");
+   if (v->n_old == 32) avl_file_fatal (avl_fp, "223 version store mmap failed");
+   v->old[v->n_old] = v->map;
+   v->old_len[v->n_old] = v->map_len;
+   v->n_old++;
+   __atomic_store_n (&v->map, p, __ATOMIC_RELEASE);
+   __atomic_store_n (&v->map_len, sz, __ATOMIC_RELEASE);
+}
 
-         if (par[l].n[k].r > 0) {
-            while (par[l].n[k].r > 0) {
-               pa[l+1] = par[l].n[k].r; l++;
-               avl_file_lread (avl_fp, &lim, pa[l], &par[l], reclen);
-            }
 
-            if (par[l].n[k].l > 0) {
-               par[l-1].n[k].r = par[l].n[k].l;
-            } else {
+/*------------------------------------------- avl_file_vunmap
+ * Unmap the earlier mappings of the store. There must be no snapshot
+ * operations.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_vunmap (AVL_FILE *avl_fp)
+{
+   struct avl_file_vers_struct *v;
+
+   v = avl_fp->vers;
+   while (v->n_old > 0) {
+      v->n_old--;
+      munmap (v->old[v->n_old], v->old_len[v->n_old]);
+   }
+}
+
+
+/*------------------------------------------- avl_file_vget
+ * Return saved record i.
+ * This function should only be called by other avl_file functions.
+ */
+static struct avl_file_vrec_struct *
+avl_file_vget (AVL_FILE *avl_fp, uint32_t i)
+{
+   struct avl_file_vers_struct *v;
+   size_t sz;
+
+   v = avl_fp->vers;
+   sz = sizeof (struct avl_file_vrec_struct) + avl_fp->reclen;
+   if (AVL_FILE_VHDR_LEN + (i + 1) * sz > __atomic_load_n (&v->map_len, __ATOMIC_ACQUIRE)) {
+#ifdef	AVL_FILE_TSAFE
+      pthread_mutex_lock (&v->mu);
+#endif
+      avl_file_vmap (avl_fp);
+#ifdef	AVL_FILE_TSAFE
+      pthread_mutex_unlock (&v->mu);
+#endif
+   }
+   return ((struct avl_file_vrec_struct *) (__atomic_load_n (&v->map, __ATOMIC_ACQUIRE) + 
+                                            AVL_FILE_VHDR_LEN + i * sz));
+}
+
+
+/*------------------------------------------- avl_file_vfind
+ * Return the record at pos saved for generation gen: with exact, the
+ * one saved by the update with that generation number, and otherwise
+ * the one with the lowest tag that is not lower. Returns NULL if 
+ * there is none.
+ * This function should only be called by other avl_file functions.
+ */
+static char *
+avl_file_vfind (AVL_FILE *avl_fp, off_t pos, uint32_t gen, int32_t exact)
+{
+   struct avl_file_vhdr_struct *h;
+   struct avl_file_vrec_struct *r, *found;
+   uint64_t l, next;
+   uint32_t tag;
+   off_t rpos;
+
+   h = (struct avl_file_vhdr_struct *) __atomic_load_n (&avl_fp->vers->map, __ATOMIC_ACQUIRE);
+   found = NULL;
+   l = __atomic_load_n (&h->head[(pos / avl_fp->reclen) % AVL_FILE_SNAP_HASH], __ATOMIC_ACQUIRE);
+   while (l > 0) {
+      r = avl_file_vget (avl_fp, AVL_FILE_VPLACE (l));
+
+     /*
+      * A record that has been freed, or used again, is older than 
+      * every snapshot, and so are the ones after it.
+      */
+      if (__atomic_load_n (&r->num, __ATOMIC_ACQUIRE) != AVL_FILE_VNUM (l)) break;
+      rpos = r->pos;
+      tag = r->tag;
+      next = r->next;
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      if (__atomic_load_n (&r->num, __ATOMIC_RELAXED) != AVL_FILE_VNUM (l)) break;
+      if ((int32_t) (tag - gen) < 0) break;
+      if ((rpos == pos) && (!exact || (tag == gen))) found = r;
+      if (exact && (found != NULL)) break;
+      l = next;
+   }
+   if (found == NULL) return (NULL);
+   return ((char *) (found + 1));
+}
+
+
+/*------------------------------------------- avl_file_vreclaim
+ * Free the saved records that no snapshot can use, the ones with a 
+ * tag lower than the generation number of every snapshot. The file
+ * must be locked with F_WRLCK, so that no snapshot is beginning. 
+ * Returns the number of records freed.
+ * This function should only be called by other avl_file functions.
+ */
+static uint32_t
+avl_file_vreclaim (AVL_FILE *avl_fp)
+{
+   struct avl_file_vhdr_struct *h;
+   struct avl_file_vrec_struct *r;
+   uint32_t i, gen, n;
+   int32_t live;
+
+   h = (struct avl_file_vhdr_struct *) avl_fp->vers->map;
+   gen = 0;
+   live = 0;
+   for (i = 0; i < AVL_FILE_SNAP_SLOTS; i++) {
+      if (__atomic_load_n (&h->slot[i].pid, __ATOMIC_SEQ_CST) == 0) continue;
+      if (!live || ((int32_t) (h->slot[i].gen - gen) < 0)) gen = h->slot[i].gen;
+      live = 1;
+   }
+   if (!live) return (0);
+
+   for (i = n = 0; i < h->top; i++) {
+      r = avl_file_vget (avl_fp, i);
+      if ((r->num == 0) || ((int32_t) (r->tag - gen) >= 0)) continue;
+      __atomic_store_n (&r->num, 0, __ATOMIC_RELAXED);
+      __atomic_thread_fence (__ATOMIC_RELEASE);	// before the link is written
+      r->next = h->free;
+      h->free = i + 1;
+      n++;
+   }
+   return (n);
+}
+
+
+/*------------------------------------------- avl_file_vsave
+ * Save the record that holds pos, before it is written by the update,
+ * unless it has been saved by the update already, or is new.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_vsave (AVL_FILE *avl_fp, off_t pos)
+{
+   struct avl_file_vers_struct *v;
+   struct avl_file_vhdr_struct *h;
+   struct avl_file_vrec_struct *r;
+   uint32_t b, i, room;
+
+   v = avl_fp->vers;
+   pos -= (pos - avl_fp->hdrlen) % avl_fp->reclen;
+   if (pos + avl_fp->reclen > v->flim) return;
+   if (avl_file_vfind (avl_fp, pos, v->tag, 1) != NULL) return;
+
+   h = (struct avl_file_vhdr_struct *) v->map;
+   if ((h->free == 0) && (h->top == h->room) && (avl_file_vreclaim (avl_fp) < h->room / 4)) {
+      room = 2 * h->room;
+      if (ftruncate (v->fd, AVL_FILE_VHDR_LEN + (off_t) room * 
+                     (sizeof (struct avl_file_vrec_struct) + avl_fp->reclen)) != 0)
+         avl_file_fatal (avl_fp, "224 version store ftruncate failed");
+      __atomic_store_n (&h->room, room, __ATOMIC_RELEASE);
+   }
+   if (h->free > 0) {
+      i = h->free - 1;
+      r = avl_file_vget (avl_fp, i);
+      h->free = (uint32_t) r->next;
+   } else {
+      i = h->top++;
+      r = avl_file_vget (avl_fp, i);
+   }
+   __atomic_store_n (&r->num, 0, __ATOMIC_RELAXED);
+   __atomic_thread_fence (__ATOMIC_RELEASE);	// before it is written again
+   if (pread (avl_fp->fd, (char *) (r + 1), avl_fp->reclen, pos) != avl_fp->reclen)
+      avl_file_fatal (avl_fp, "12 read failed");
+   b = (pos / avl_fp->reclen) % AVL_FILE_SNAP_HASH;
+   r->pos = pos;
+   r->tag = v->tag;
+   r->next = h->head[b];
+   if (++h->n == 0) h->n = 1;
+   __atomic_store_n (&r->num, h->n, __ATOMIC_RELEASE);
+   __atomic_store_n (&h->head[b], AVL_FILE_VLINK (h->n, i), __ATOMIC_RELEASE);
+   __atomic_thread_fence (__ATOMIC_RELEASE);	// before the record is written
+}
+
+
+/*------------------------------------------- avl_file_vref
+ * Return a pointer to len bytes at pos as they were when the snapshot
+ * began, read into the buffer pr, or the snapshot's header.
+ * This function should only be called by other avl_file functions.
+ */
+static void *
+avl_file_vref (AVL_FILE *avl_fp, off_t pos, void *pr, int32_t len)
+{
+   struct avl_file_vers_struct *v;
+   off_t rp;
+   ssize_t n;
+   char *p;
+
+   v = avl_fp->vers;
+   if ((pos == 0) && (len == avl_fp->hlen)) return (v->hdr);
+   if (pos + len > v->lim) avl_file_fatal (avl_fp, "16 corrupted file, read past end of file");
+   if (pos < avl_fp->hdrlen) {
+      if (pread (avl_fp->fd, pr, len, pos) != len) avl_file_fatal (avl_fp, "12 read failed");
+      return (pr);
+   }
+
+   rp = pos - (pos - avl_fp->hdrlen) % avl_fp->reclen;
+   p = avl_file_vfind (avl_fp, rp, v->gen, 0);
+   if (p == NULL) {
+      n = pread (avl_fp->fd, pr, len, pos);
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      p = avl_file_vfind (avl_fp, rp, v->gen, 0);
+      if (p == NULL) {
+         if (n != len) avl_file_fatal (avl_fp, "12 read failed");
+         return (pr);
+      }
+   }
+   memcpy (pr, p + (pos - rp), len);
+   return (pr);
+}
+
+
+/*------------------------------------------- avl_file_vbegin
+ * Start an update of the file, with generation number gen and length
+ * lim: its records are saved if there are snapshots, and otherwise 
+ * the store is emptied. The records that no snapshot can use are 
+ * freed after every AVL_FILE_SNAP_CHECK saved records. The file 
+ * must be locked with F_WRLCK.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_vbegin (AVL_FILE *avl_fp, uint32_t gen, off_t lim)
+{
+   struct avl_file_vers_struct *v;
+   struct avl_file_vhdr_struct *h;
+   int32_t i;
+
+   v = avl_fp->vers;
+   h = (struct avl_file_vhdr_struct *) v->map;
+   if ((h->count > 0) && (h->n - h->checked >= AVL_FILE_SNAP_CHECK)) {
+      for (i = 0; i < AVL_FILE_SNAP_SLOTS; i++) {
+         if ((h->slot[i].pid != 0) && (kill (h->slot[i].pid, 0) != 0) && (errno == ESRCH)) {
+            h->slot[i].pid = 0;
+            __atomic_sub_fetch (&h->count, 1, __ATOMIC_SEQ_CST);
+         }
+      }
+      h->checked = h->n;
+      avl_file_vreclaim (avl_fp);
+   }
+   if ((__atomic_load_n (&h->count, __ATOMIC_SEQ_CST) == 0) && (h->top > 0)) {
+      memset (h->head, 0, sizeof (h->head));
+      h->n = 0;
+      h->checked = 0;
+      h->top = 0;
+      h->free = 0;
+      if ((h->room > AVL_FILE_SNAP_ROOM) && 
+          (ftruncate (v->fd, AVL_FILE_VHDR_LEN + (off_t) AVL_FILE_SNAP_ROOM * 
+                      (sizeof (struct avl_file_vrec_struct) + avl_fp->reclen)) == 0))
+         h->room = AVL_FILE_SNAP_ROOM;
+   }
+   if (v->slot < 0) avl_file_vunmap (avl_fp);
+   v->save = (h->count > 0);
+   v->tag = gen;
+   v->flim = lim;
+}
+
+
+/*------------------------------------------- avl_file_vopen
+ * Open (or with AVL_FILE_SNAP in the mode, create) the version store
+ * for the file. Without AVL_FILE_SNAP, a file that does not have one
+ * is left as it is. The file must be locked with F_WRLCK. The store
+ * is not created while the file is open as another AVL_FILE, which 
+ * would not use it.
+ * Returns 0 if successful.
+ */
+static int32_t
+avl_file_vopen (AVL_FILE *avl_fp, char *fname, int32_t mode)
+{
+   struct avl_file_vers_struct *v;
+   struct avl_file_vhdr_struct *h;
+   char vname[strlen (fname) + 6];
+   int32_t fd, i;
+
+   avl_fp->vers = NULL;
+   strcpy (vname, fname);
+   strcat (vname, "-snap");
+   if ((mode & AVL_FILE_SNAP) && (access (vname, F_OK) != 0) && avl_file_olive (avl_fp)) {
+      setenv (AVL_FILE_EMSG_VNAME, "250 the file is open, the version store cannot be created", 1);
+      return (-1);
+   }
+   if (mode & AVL_FILE_SNAP)
+      fd = open (vname, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+   else
+      fd = open (vname, O_RDWR);
+   if (fd < 0) {
+      if (!(mode & AVL_FILE_SNAP) && (access (vname, F_OK) != 0)) return (0);
+      setenv (AVL_FILE_EMSG_VNAME, "220 version store open failed", 1);
+      return (-1);
+   }
+
+   v = calloc (1, sizeof (struct avl_file_vers_struct));
+   if (v != NULL) {
+      v->hdr = malloc (avl_fp->hlen);
+      v->cpr = malloc (avl_fp->reclen);
+   }
+   if ((v == NULL) || (v->hdr == NULL) || (v->cpr == NULL)) {
+      setenv (AVL_FILE_EMSG_VNAME, "221 malloc returned NULL", 1);
+      if (v != NULL) {
+         free (v->hdr);
+         free (v->cpr);
+         free (v);
+      }
+      close (fd);
+      return (-1);
+   }
+   v->fd = fd;
+   v->slot = -1;
+   v->map_len = AVL_FILE_VHDR_LEN;
+   v->map = mmap (NULL, v->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if ((v->map == MAP_FAILED) || 
+       ((lseek (fd, 0, SEEK_END) < (off_t) AVL_FILE_VHDR_LEN) && (ftruncate (fd, AVL_FILE_VHDR_LEN) != 0))) {
+      setenv (AVL_FILE_EMSG_VNAME, "222 version store mmap failed", 1);
+      if (v->map != MAP_FAILED) munmap (v->map, v->map_len);
+      free (v->hdr);
+      free (v->cpr);
+      free (v);
+      close (fd);
+      return (-1);
+   }
+
+  /*
+   * A new store, or one that is not for this file, is made again.
+   * Otherwise the slots of processes that have died are freed.
+   */
+   h = (struct avl_file_vhdr_struct *) v->map;
+   if ((memcmp (h->magic, AVL_FILE_VMAGIC, 8) != 0) || (h->reclen != avl_fp->reclen)) {
+      memset (h, 0, sizeof (struct avl_file_vhdr_struct));
+      h->reclen = avl_fp->reclen;
+      h->room = AVL_FILE_SNAP_ROOM;
+      memcpy (h->magic, AVL_FILE_VMAGIC, 8);
+   }
+   for (i = 0; i < AVL_FILE_SNAP_SLOTS; i++) {
+      if ((h->slot[i].pid != 0) && (kill (h->slot[i].pid, 0) != 0) && (errno == ESRCH)) {
+         h->slot[i].pid = 0;
+         __atomic_sub_fetch (&h->count, 1, __ATOMIC_SEQ_CST);
+      }
+   }
+   if (ftruncate (fd, AVL_FILE_VHDR_LEN + (off_t) h->room * 
+                  (sizeof (struct avl_file_vrec_struct) + avl_fp->reclen)) != 0)
+      avl_file_fatal (avl_fp, "224 version store ftruncate failed");
+#ifdef	AVL_FILE_TSAFE
+   pthread_mutex_init (&v->mu, NULL);
+#endif
+   avl_fp->vers = v;
+   avl_file_vmap (avl_fp);
+   return (0);
+}
+
+
+/*------------------------------------------- avl_file_vfree
+ * End the snapshot, if there is one, and close the version store.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_vfree (AVL_FILE *avl_fp)
+{
+   struct avl_file_vers_struct *v;
+   struct avl_file_vhdr_struct *h;
+
+   v = avl_fp->vers;
+   if (v == NULL) return;
+   h = (struct avl_file_vhdr_struct *) v->map;
+   if (v->slot >= 0) {
+      __atomic_store_n (&h->slot[v->slot].pid, 0, __ATOMIC_SEQ_CST);
+      __atomic_sub_fetch (&h->count, 1, __ATOMIC_SEQ_CST);
+   }
+   avl_file_vunmap (avl_fp);
+   munmap (v->map, v->map_len);
+   close (v->fd);
+#ifdef	AVL_FILE_TSAFE
+   pthread_mutex_destroy (&v->mu);
+#endif
+   free (v->hdr);
+   free (v->cpr);
+   free (v);
+   avl_fp->vers = NULL;
+}
+
+
+/*------------------------------------------- avl_file_flen
+ * Return the file length, including the records that are only in
+ * the log so far.
+ */
+static off_t
+avl_file_flen (AVL_FILE *avl_fp)
+{
+   if ((avl_fp->wal != NULL) && (avl_fp->wal->size >= 0)) return (avl_fp->wal->size);
+   return (lseek (avl_fp->fd, 0, SEEK_END));
+}
+
+
+/*------------------------------------------- avl_file_ftruncate
+ * Shorten the file to lim bytes. With the log, the file itself is
+ * shortened at the next checkpoint. The records that are cut off are
+ * saved for the snapshots, if there are any. The file counts as
+ * written, so that the generation number changes with its length.
+ */
+static int32_t
+avl_file_ftruncate (AVL_FILE *avl_fp, off_t lim)
+{
+   off_t pos;
+
+   avl_fp->dirty = 1;
+   if ((avl_fp->vers != NULL) && avl_fp->vers->save) {
+      for (pos = lim; pos < avl_fp->vers->flim; pos += avl_fp->reclen) avl_file_vsave (avl_fp, pos);
+   }
+   if (avl_fp->wal == NULL) return (ftruncate (avl_fp->fd, lim));
+   avl_file_wdrop (avl_fp, lim);
+   avl_fp->wal->size = lim;
+   return (0);
+}
+
+
+/*------------------------------------------- avl_file_fref
+ * Return a pointer to len bytes at pos in the file. For mapped files
+ * this points into the mapping, and nothing is copied, and the same
+ * for records in the log index. Otherwise the bytes are read into 
+ * the buffer pr. Snapshot operations read them as they were when the
+ * snapshot began.
+ */
+static void *
+avl_file_fref (AVL_FILE *avl_fp, off_t *lim, off_t pos, void *pr, int32_t len)
+{
+   struct avl_file_wunit_struct *u;
+
+   if ((avl_fp->vers != NULL) && avl_fp->vers->on) return (avl_file_vref (avl_fp, pos, pr, len));
+   if (pos > *lim) avl_file_fatal (avl_fp, "10 corrupted file, seek pos > lim");
+   if (avl_fp->wal != NULL) {
+      u = avl_file_wfind (avl_fp, pos);
+      if (u != NULL) {
+         if (pos + len > u->pos + u->len) avl_file_fatal (avl_fp, "16 corrupted file, read past end of file");
+         return (u->data + (pos - u->pos));
+      }
+   }
+   if (avl_fp->mode & AVL_FILE_MMAP) {
+      if (pos + len > *lim) avl_file_fatal (avl_fp, "16 corrupted file, read past end of file");
+      if ((avl_fp->map != NULL) && (pos + len > avl_fp->map_len)) avl_file_lmap (avl_fp, *lim);
+      if (avl_fp->map != NULL) return (avl_fp->map + pos);
+   }
+   if (pread (avl_fp->fd, pr, len, pos) != len) avl_file_fatal (avl_fp, "12 read failed");
+   return (pr);
+}
+
+
+/*------------------------------------------- avl_file_fwrite
+ * Write len bytes at pos in the file. For mapped files, writes within
+ * the end of file are copied into the mapping. Writes that extend
+ * the file use pwrite(). With the log, the bytes go into the frame
+ * for the operation instead, and with shadow paging into the log
+ * index, except for operations with a shared lock. While there are
+ * snapshots, the record is saved first.
+ */
+static void
+avl_file_fwrite (AVL_FILE *avl_fp, off_t *lim, off_t pos, void *pr, int32_t len)
+{
+   if (pos > *lim) avl_file_fatal (avl_fp, "13 corrupted file, seek pos > lim");
+   if ((avl_fp->vers != NULL) && avl_fp->vers->save && (pos >= avl_fp->hdrlen)) avl_file_vsave (avl_fp, pos);
+   if ((avl_fp->wal != NULL) && (!avl_fp->wal->shadow || (avl_fp->wal->ltype == F_WRLCK))) {
+      avl_file_wput (avl_fp, lim, pos, pr, len);
+      return;
+   }
+   if ((avl_fp->mode & AVL_FILE_MMAP) && (pos + len <= *lim)) {
+      if ((avl_fp->map != NULL) && (pos + len > avl_fp->map_len)) avl_file_lmap (avl_fp, *lim);
+      if (avl_fp->map != NULL) {
+         memcpy (avl_fp->map + pos, pr, len);
+         return;
+      }
+   }
+   if (pwrite (avl_fp->fd, pr, len, pos) != len) avl_file_fatal (avl_fp, "15 write failed");
+   if (pos + len > *lim) *lim = pos + len;
+}
+
+
+/*
+ * The record cache. Records are kept by file position in 'slots' of
+ * reclen bytes, found through a chained hash table, and replaced
+ * with the clock algorithm. Only AVL-tree and empty records are 
+ * cached, not the header, and not the current-pointer records (see 
+ * avl_file_cread()). The cache is dropped when the generation number
+ * in the header has been changed by another process. Misses read the
+ * whole page holding the record (see avl_file_cache_page()).
+ */
+struct avl_file_cache_struct {
+   int32_t n_slots;      // number of slots
+   int32_t n_used;       // slots in use
+   int32_t mask;         // hash table size - 1
+   int32_t hand;         // clock hand
+   uint32_t gen;         // file generation the cached records belong to
+   int64_t hits, misses;
+   int32_t *head;        // hash chains, -1 terminated
+   int32_t *next;
+   off_t *pos;           // slot record positions
+   char *ref;            // slot reference bits
+   char *data;           // slot records
+   char *page;           // page buffer, see avl_file_cache_page()
+   off_t page_pos;       // file position of the page buffer
+   ssize_t page_len;     // bytes in the page buffer
+   int32_t page_reads;   // pages read since the last check
+   int32_t page_hits;    // other records found in them
+   int32_t page_skip;    // misses to read by themselves
+};
+
+
+/*------------------------------------------- avl_file_cache_find
+ * Return the slot holding the record at pos, or -1.
+ */
+static int32_t
+avl_file_cache_find (struct avl_file_cache_struct *c, off_t pos)
+{
+   int32_t i;
+
+   for (i = c->head[(pos / 8) & c->mask]; i >= 0; i = c->next[i])
+      if (c->pos[i] == pos) return (i);
+   return (-1);
+}
+
+
+/*------------------------------------------- avl_file_cache_drop
+ * Remove the record at pos from the cache, if it is there.
+ */
+static void
+avl_file_cache_drop (struct avl_file_cache_struct *c, off_t pos)
+{
+   int32_t i, *p;
+
+   for (p = &c->head[(pos / 8) & c->mask]; (i = *p) >= 0; p = &c->next[i]) {
+      if (c->pos[i] == pos) {
+         *p = c->next[i];
+         c->pos[i] = 0;
+         c->ref[i] = 0;
+         return;
+      }
+   }
+}
+
+
+/*------------------------------------------- avl_file_cache_unpage
+ * Empty the page buffer if it holds any of the len bytes at pos.
+ */
+static void
+avl_file_cache_unpage (struct avl_file_cache_struct *c, off_t pos, int32_t len)
+{
+   if ((pos < c->page_pos + c->page_len) && (pos + len > c->page_pos)) c->page_len = 0;
+}
+
+
+/*------------------------------------------- avl_file_cache_put
+ * Copy the record at pos into the cache, replacing the record in 
+ * the first slot found by the clock hand that has not been used 
+ * since the hand last passed. Returns the slot.
+ */
+static int32_t
+avl_file_cache_put (AVL_FILE *avl_fp, off_t pos, void *pr)
+{
+   struct avl_file_cache_struct *c;
+   int32_t i, h;
+
+   c = avl_fp->cache;
+   i = avl_file_cache_find (c, pos);
+   if (i < 0) {
+      if (c->n_used < c->n_slots) {
+         i = c->n_used++;
+      } else {
+         for (;;) {
+            i = c->hand;
+            c->hand = (c->hand + 1) % c->n_slots;
+            if (c->pos[i] == 0) break;
+            if (c->ref[i] == 0) {
+               avl_file_cache_drop (c, c->pos[i]);
+               break;
+            }
+            c->ref[i] = 0;
+         }
+      }
+      h = (pos / 8) & c->mask;
+      c->pos[i] = pos;
+      c->next[i] = c->head[h];
+      c->head[h] = i;
+   }
+   c->ref[i] = 1;
+   memcpy (c->data + (size_t) i * avl_fp->reclen, pr, avl_fp->reclen);
+   return (i);
+}
+
+
+/*------------------------------------------- avl_file_cache_write
+ * Update the cache for len bytes written at the start of the record
+ * at pos. A partial record (the tree nodes only) is copied into the
+ * cache only if the record is already there.
+ */
+static void
+avl_file_cache_write (AVL_FILE *avl_fp, off_t pos, void *pr, int32_t len)
+{
+   int32_t i;
+
+   avl_file_cache_unpage (avl_fp->cache, pos, len);
+   if (len == avl_fp->reclen) {
+      avl_file_cache_put (avl_fp, pos, pr);
+   } else {
+      i = avl_file_cache_find (avl_fp->cache, pos);
+      if (i >= 0) memcpy (avl_fp->cache->data + (size_t) i * avl_fp->reclen, pr, len);
+   }
+}
+
+
+/*------------------------------------------- avl_file_cache_clear
+ * Empty the cache.
+ */
+static void
+avl_file_cache_clear (struct avl_file_cache_struct *c)
+{
+   memset (c->head, 0xff, (c->mask + 1) * sizeof (int32_t));
+   memset (c->pos, 0, c->n_slots * sizeof (off_t));
+   memset (c->ref, 0, c->n_slots);
+   c->n_used = 0;
+   c->hand = 0;
+   c->page_len = 0;
+}
+
+
+/*------------------------------------------- avl_file_cache_free
+ * Turn off the record cache, freeing the memory.
+ */
+static void
+avl_file_cache_free (AVL_FILE *avl_fp)
+{
+   struct avl_file_cache_struct *c;
+
+   c = avl_fp->cache;
+   if (c == NULL) return;
+   free (c->head);
+   free (c->next);
+   free (c->pos);
+   free (c->ref);
+   free (c->data);
+   free (c->page);
+   free (c);
+   avl_fp->cache = NULL;
+}
+
+
+/*------------------------------------------- avl_file_cache_page
+ * Find the record at pos in the page buffer, reading the page of
+ * AVL_FILE_PAGE bytes holding it into the buffer first if necessary,
+ * and copy it into the cache. When the records are in the order of
+ * a key, as made by avl_file_bulk_load() from sorted records, the
+ * records of each small subtree are next to each other, so the last
+ * levels of a search are usually in the same page, and are read with
+ * one pread(). If the pages read are not being used, because
+ * the tree is not laid out that way, the next misses are read by
+ * themselves for a while. The buffer is not used with the log, since
+ * the records in the file change when the log index is emptied, and
+ * current-pointer records are not taken from it. Returns the cache 
+ * slot, or -1 if the record should be read by itself.
+ * This function should only be called by other avl_file functions.
+ */
+static int32_t
+avl_file_cache_page (AVL_FILE *avl_fp, off_t *lim, off_t pos)
+{
+   struct avl_file_cache_struct *c;
+   off_t s, e;
+   ssize_t n;
+   int32_t reclen;
+   char *p;
+
+   c = avl_fp->cache;
+   reclen = avl_fp->reclen;
+   if ((c->page == NULL) || (avl_fp->mode & AVL_FILE_MMAP) || (avl_fp->wal != NULL)) return (-1);
+
+   if ((pos < c->page_pos) || (pos + reclen > c->page_pos + c->page_len)) {
+      if (c->page_skip > 0) {
+         c->page_skip--;
+         return (-1);
+      }
+      if (c->page_reads >= 64) {
+         if (c->page_hits < c->page_reads) c->page_skip = 4096;
+         c->page_reads = 0;
+         c->page_hits = 0;
+      }
+      c->page_reads++;
+
+      s = pos - pos % AVL_FILE_PAGE;
+      if (s < avl_fp->hdrlen) s = avl_fp->hdrlen;
+      e = pos + reclen - 1;
+      e += AVL_FILE_PAGE - e % AVL_FILE_PAGE;
+      if (e > *lim) e = *lim;
+      if (e - s <= reclen) return (-1);
+
+      c->page_len = 0;
+      n = pread (avl_fp->fd, c->page, e - s, s);
+      if (n < 0) avl_file_fatal (avl_fp, "12 read failed");
+      c->page_pos = s;
+      c->page_len = n;
+      if (pos + reclen > s + n) return (-1);
+   } else {
+      c->page_hits++;
+   }
+
+   p = c->page + (pos - c->page_pos);
+   if (p[0] == 0x20) return (-1);
+   return (avl_file_cache_put (avl_fp, pos, p));
+}
+
+
+/*------------------------------------------- avl_file_lref
+ * Return a pointer to len bytes at pos, which is in the cache or
+ * the mapping if possible, so that nothing is copied. Otherwise the 
+ * bytes are read into the buffer pr. The pointer is only good until
+ * the next avl_file_lxxx() call.
+ * This function should only be called by other avl_file functions.
+ */
+static void *
+avl_file_lref (AVL_FILE *avl_fp, off_t *lim, off_t pos, void *pr, int32_t len)
+{
+   struct avl_file_cache_struct *c;
+   void *p;
+   int32_t i;
+
+   if ((avl_fp->vers != NULL) && avl_fp->vers->on) return (avl_file_vref (avl_fp, pos, pr, len));
+   if ((pos == 0) && (len == avl_fp->hlen) && (avl_fp->hdr != NULL)) return (avl_fp->hdr);
+   c = avl_fp->cache;
+   if ((c == NULL) || (pos < avl_fp->hdrlen) || (len > avl_fp->reclen))
+      return (avl_file_fref (avl_fp, lim, pos, pr, len));
+
+   if (pos > *lim) avl_file_fatal (avl_fp, "10 corrupted file, seek pos > lim");
+   i = avl_file_cache_find (c, pos);
+   if (i >= 0) {
+      c->hits++;
+      c->ref[i] = 1;
+      return (c->data + (size_t) i * avl_fp->reclen);
+   }
+   c->misses++;
+   if (len == avl_fp->reclen) {
+      i = avl_file_cache_page (avl_fp, lim, pos);
+      if (i >= 0) return (c->data + (size_t) i * avl_fp->reclen);
+   }
+   p = avl_file_fref (avl_fp, lim, pos, pr, len);
+   if (len == avl_fp->reclen) avl_file_cache_put (avl_fp, pos, p);
+   return (p);
+}
+
+
+/*------------------------------------------- avl_file_lread
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_lread (AVL_FILE *avl_fp, off_t *lim, off_t pos, void *pr, int32_t len)
+{
+   void *p;
+
+   p = avl_file_lref (avl_fp, lim, pos, pr, len);
+   if (p != pr) memcpy (pr, p, len);
+}
+
+
+/*------------------------------------------- avl_file_hwrite
+ * Write the header. Only the bytes from the first to the last that 
+ * are different from the header read by avl_file_lstart() are 
+ * written, which for most updates is a root pointer or two and the
+ * record count, and nothing if the header has not changed.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_hwrite (AVL_FILE *avl_fp, off_t *lim, void *pr)
+{
+   char *a, *b;
+   int32_t i, j;
+
+   a = avl_fp->hdr;
+   b = pr;
+   for (i = 0; (i < avl_fp->hlen) && (a[i] == b[i]); i++) ;
+   if (i == avl_fp->hlen) return;
+   for (j = avl_fp->hlen - 1; a[j] == b[j]; j--) ;
+   avl_file_fwrite (avl_fp, lim, i, b + i, j + 1 - i);
+   memcpy (a + i, b + i, j + 1 - i);
+   avl_fp->dirty = 1;
+}
+
+
+/*------------------------------------------- avl_file_lwrite
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_lwrite (AVL_FILE *avl_fp, off_t *lim, off_t pos, void *pr, int32_t len)
+{
+   if ((pos == 0) && (len == avl_fp->hlen) && (avl_fp->hdr != NULL)) {
+      avl_file_hwrite (avl_fp, lim, pr);
+      return;
+   }
+   avl_file_fwrite (avl_fp, lim, pos, pr, len);
+   avl_fp->dirty = 1;
+   if ((avl_fp->cache != NULL) && (pos >= avl_fp->hdrlen)) avl_file_cache_write (avl_fp, pos, pr, len);
+}
+
+
+/*------------------------------------------- avl_file_nref
+ * Return a pointer to the record at pos, of which only the tree 
+ * nodes, the prev and next pointers and the key prefixes (nodelen
+ * bytes) are needed, 
+ * reading them into the buffer pr if necessary. The buffer must
+ * be a whole record. With the record cache on, the whole record is
+ * read so that it can be cached.
+ * This function should only be called by other avl_file functions.
+ */
+static void *
+avl_file_nref (AVL_FILE *avl_fp, off_t *lim, off_t pos, void *pr)
+{
+   if (avl_fp->cache != NULL) return (avl_file_lref (avl_fp, lim, pos, pr, avl_fp->reclen));
+   return (avl_file_fref (avl_fp, lim, pos, pr, avl_fp->nodelen));
+}
+
+
+/*------------------------------------------- avl_file_nread
+ * Read the tree nodes, the prev and next pointers and the key 
+ * prefixes of the record at pos into the buffer pr, which must be 
+ * a whole record. 
+ * See avl_file_nref().
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_nread (AVL_FILE *avl_fp, off_t *lim, off_t pos, void *pr)
+{
+   void *p;
+
+   p = avl_file_nref (avl_fp, lim, pos, pr);
+   if (p != pr) memcpy (pr, p, avl_fp->nodelen);
+}
+
+
+/*------------------------------------------- avl_file_kref
+ * Return a pointer to the record at pos, for the comparisons by key
+ * k of a search: only its nodes and key prefixes (see avl_file_nref())
+ * if key k has a prefix, or else the whole record. The comparisons
+ * must be made by avl_file_dcmp().
+ * This function should only be called by other avl_file functions.
+ */
+static void *
+avl_file_kref (AVL_FILE *avl_fp, off_t *lim, off_t pos, void *pr, int32_t k)
+{
+   if ((avl_fp->kpfx != NULL) && (avl_fp->kpfx[k] >= 0)) return (avl_file_nref (avl_fp, lim, pos, pr));
+   return (avl_file_lref (avl_fp, lim, pos, pr, avl_fp->reclen));
+}
+
+
+/*------------------------------------------- avl_file_kread
+ * Read the record at pos into the buffer pr, as avl_file_kref().
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_kread (AVL_FILE *avl_fp, off_t *lim, off_t pos, void *pr, int32_t k)
+{
+   void *p;
+
+   p = avl_file_kref (avl_fp, lim, pos, pr, k);
+   if (p == pr) return;
+   if ((avl_fp->kpfx != NULL) && (avl_fp->kpfx[k] >= 0))
+      memcpy (pr, p, avl_fp->nodelen);
+   else
+      memcpy (pr, p, avl_fp->reclen);
+}
+
+
+/*------------------------------------------- avl_file_dcmp
+ * Compare the record data a by key k with the data b of the record
+ * at pos, read by avl_file_kref(), as avl_file_pcmp(). When their 
+ * prefixes are the same, the rest of the record at pos is read to 
+ * compare the keys in full.
+ * This function should only be called by other avl_file functions.
+ */
+static int32_t
+avl_file_dcmp (AVL_FILE *avl_fp, off_t *lim, int32_t k, const void *a, off_t pos, const void *b)
+{
+   char r[avl_fp->reclen];
+   const char *p;
+   int32_t d, o;
+
+   if ((avl_fp->kpfx == NULL) || (avl_fp->kpfx[k] < 0)) return (avl_file_pcmp (avl_fp, k, a, b));
+   o = avl_fp->kpfx[k];
+   d = memcmp ((const char *) a + o, (const char *) b + o, AVL_FILE_PFX_LEN);
+   if (d != 0) return (d);
+   p = avl_file_lref (avl_fp, lim, pos, r, avl_fp->reclen);
+   return (avl_file_kcmp (avl_fp, k, (const char *) a + avl_fp->uoff, p + avl_fp->nodelen));
+}
+
+
+/*------------------------------------------- avl_file_ncount
+ * Return the number of records in the subtree for key k with its 
+ * root at pos, or zero for an empty subtree (pos <= 0, a thread).
+ * This function should only be called by other avl_file functions.
+ */
+static int64_t
+avl_file_ncount (AVL_FILE *avl_fp, off_t *lim, off_t pos, int32_t k)
+{
+   char r[avl_fp->reclen];
+   struct avl_node_struct *np;
+
+   if (pos <= 0) return (0);
+   np = avl_file_nref (avl_fp, lim, pos, r);
+   return (np[k].c);
+}
+
+
+/*------------------------------------------- avl_file_cplace
+ * Return 1 if the current-pointer records are read and written in
+ * place in the file, instead of through the log index, or 0. That is
+ * done with the log, so that the functions that only read records
+ * append nothing to it, and with shadow paging, if the file has keys:
+ * the nodes mark the current-pointer records for avl_file_wkeep().
+ */
+static int32_t
+avl_file_cplace (AVL_FILE *avl_fp)
+{
+   return ((avl_fp->wal != NULL) && (avl_fp->n_keys > 0));
+}
+
+
+/*------------------------------------------- avl_file_cread
+ * Read a current-pointer record. Each process updates its own
+ * current-pointer record without changing the file generation, so
+ * these records are always read from the file, not the cache. A
+ * snapshot keeps the AVL_FILE's own record in memory. With the log
+ * or shadow paging, they are read from the file itself, see
+ * avl_file_cwrite().
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_cread (AVL_FILE *avl_fp, off_t *lim, off_t pos, void *pr, int32_t len)
+{
+   void *p;
+
+   if ((avl_fp->vers != NULL) && avl_fp->vers->on && (pos == avl_fp->cpr)) {
+      memcpy (pr, avl_fp->vers->cpr, len);
+      return;
+   }
+   if (avl_file_cplace (avl_fp)) {
+      if (pos > *lim) avl_file_fatal (avl_fp, "10 corrupted file, seek pos > lim");
+      if (pread (avl_fp->fd, pr, len, pos) != len) avl_file_fatal (avl_fp, "12 read failed");
+      return;
+   }
+   p = avl_file_fref (avl_fp, lim, pos, pr, len);
+   if (p != pr) memcpy (pr, p, len);
+}
+
+
+/*------------------------------------------- avl_file_cwrite
+ * Write a current-pointer record. See avl_file_cread(). With the
+ * log or shadow paging, the record is written in place, so that the
+ * functions that only read records do not append frames to the log.
+ * Operations with F_WRLCK write it into the log index as well, so
+ * that their frames hold the record and not what was there before;
+ * avl_file_wkeep() then leaves the newer copy in the file.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_cwrite (AVL_FILE *avl_fp, off_t *lim, off_t pos, void *pr, int32_t len)
+{
+   if ((avl_fp->vers != NULL) && avl_fp->vers->on && (pos == avl_fp->cpr)) {
+      memcpy (avl_fp->vers->cpr, pr, len);
+      return;
+   }
+   if (avl_file_cplace (avl_fp)) {
+      if (pos > *lim) avl_file_fatal (avl_fp, "13 corrupted file, seek pos > lim");
+      if (pwrite (avl_fp->fd, pr, len, pos) != len) avl_file_fatal (avl_fp, "15 write failed");
+      if (avl_fp->wal->ltype == F_WRLCK) avl_file_wput (avl_fp, lim, pos, pr, len);
+   } else {
+      avl_file_fwrite (avl_fp, lim, pos, pr, len);
+   }
+   if (avl_fp->cache != NULL) {
+      avl_file_cache_drop (avl_fp->cache, pos);
+      avl_file_cache_unpage (avl_fp->cache, pos, len);
+   }
+}
+
+
+/*------------------------------------------- avl_file_lwritev
+ * Write n records of length len. Records that are adjacent in the
+ * file are written together with one pwritev() call.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_lwritev (AVL_FILE *avl_fp, off_t *lim, int32_t n, off_t *pos, void **pr, int32_t len)
+{
+   struct iovec iov[n];
+   int32_t i, j, m, o[n];
+   ssize_t sz;
+
+   if ((avl_fp->mode & AVL_FILE_MMAP) || (avl_fp->wal != NULL) || 
+       ((avl_fp->vers != NULL) && avl_fp->vers->save)) {
+      for (i = 0; i < n; i++) avl_file_lwrite (avl_fp, lim, pos[i], pr[i], len);
+      return;
+   }
+
+   for (i = 0; i < n; i++) {          // order by file position
+      for (j = i; (j > 0) && (pos[o[j-1]] > pos[i]); j--) o[j] = o[j-1];
+      o[j] = i;
+   }
+
+   for (i = 0; i < n; i += m) {
+      if (pos[o[i]] > *lim) avl_file_fatal (avl_fp, "13 corrupted file, seek pos > lim");
+      for (m = 0; (i + m < n) && (pos[o[i+m]] == pos[o[i]] + (off_t) m * len); m++) {
+         iov[m].iov_base = pr[o[i+m]];
+         iov[m].iov_len = len;
+      }
+      sz = (ssize_t) m * len;
+      if (m == 1) {
+         if (pwrite (avl_fp->fd, pr[o[i]], len, pos[o[i]]) != sz) 
+            avl_file_fatal (avl_fp, "15 write failed");
+      } else {
+         if (pwritev (avl_fp->fd, iov, m, pos[o[i]]) != sz)
+            avl_file_fatal (avl_fp, "15 write failed");
+      }
+      if (pos[o[i]] + sz > *lim) *lim = pos[o[i]] + sz;
+   }
+
+   avl_fp->dirty = 1;
+   if (avl_fp->cache != NULL) {
+      for (i = 0; i < n; i++) avl_file_cache_write (avl_fp, pos[i], pr[i], len);
+   }
+}
+
+
+
+
+/*
+ * The free-space map, for files opened with avl_file_open_free() (or
+ * any file that has one). It has one bit for each record in the file,
+ * set for the empty records, and is kept in a file of its own (fname
+ * with "-free" added) that each process maps with MAP_SHARED. An 
+ * empty record is then taken without reading it: the first one in 
+ * the file, or with AVL_FILE_FREE_NEAR, one near the record that the
+ * new record goes under. The empty list at hdr.head_empty is not 
+ * used by files with a map.
+ *
+ * The map header holds the generation number and the number of
+ * records of the file when the map last matched it. If they are 
+ * different when the file is locked for writing (after a crash, or 
+ * if a program without the map changed the file), the map is made
+ * again from the empty records in the file before it is used.
+ */
+struct avl_file_fhdr_struct {		// map file header
+   char magic[8];
+   uint32_t gen;         // file generation that the map matches
+   uint32_t pad;
+   int64_t n_rec;        // file records that the map matches, or -1
+   int64_t n_free;       // bits set
+   int64_t low;          // no bits are set in the words before this
+   int64_t size;         // map file length
+};
+
+#define AVL_FILE_FHDR_LEN	64	// map file header space
+#define AVL_FILE_FGROW		65536	// map file growth
+#define AVL_FILE_FNEAR		8	// words searched each way for AVL_FILE_FREE_NEAR
+
+struct avl_file_free_struct {
+   int32_t fd;           // map file
+   int32_t valid;        // the map matched the file when it was locked
+   int32_t policy;       // AVL_FILE_FREE_LOWEST or AVL_FILE_FREE_NEAR
+   uint32_t gen;         // file generation when it was locked for writing
+   int64_t n;            // no bits are set for the records from n on
+   char *map;
+   off_t map_len;
+};
+
+
+/*------------------------------------------- avl_file_fmapped
+ * Map the whole map file, first extending it if necessary to have
+ * bits for n records.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_fmapped (AVL_FILE *avl_fp, int64_t n)
+{
+   struct avl_file_free_struct *f;
+   struct avl_file_fhdr_struct *h;
+   off_t sz;
+   char *p;
+
+   f = avl_fp->fmap;
+   h = (struct avl_file_fhdr_struct *) f->map;
+   sz = AVL_FILE_FHDR_LEN + ((n + 63) / 64) * sizeof (uint64_t);
+   if (sz > h->size) {
+      sz = ((sz + AVL_FILE_FGROW - 1) / AVL_FILE_FGROW) * AVL_FILE_FGROW;
+      if (ftruncate (f->fd, sz) != 0) avl_file_fatal (avl_fp, "182 free map ftruncate failed");
+      h->size = sz;
+   }
+   if (h->size != f->map_len) {
+      sz = h->size;
+      p = mmap (NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0);
+      if (p == MAP_FAILED) avl_file_fatal (avl_fp, "183 free map mmap failed");
+      munmap (f->map, f->map_len);
+      f->map = p;
+      f->map_len = sz;
+   }
+}
+
+
+/*------------------------------------------- avl_file_fbuild
+ * Make the map again from the empty records in the file (the ones 
+ * with 0x40 in the first node), and empty the list at head_empty, 
+ * which only has records that are in the map now.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_fbuild (AVL_FILE *avl_fp, off_t *lim, off_t *head_empty)
+{
+   struct avl_file_fhdr_struct *h;
+   struct avl_node_struct nd, *np;
+   uint64_t *w;
+   int64_t n, i;
+
+   n = (*lim - avl_fp->hdrlen) / avl_fp->reclen;
+   avl_file_fmapped (avl_fp, n);
+   h = (struct avl_file_fhdr_struct *) avl_fp->fmap->map;
+   w = (uint64_t *) (avl_fp->fmap->map + AVL_FILE_FHDR_LEN);
+   memset (w, 0, avl_fp->fmap->map_len - AVL_FILE_FHDR_LEN);
+   h->n_rec = -1;
+   h->n_free = 0;
+   h->low = 0;
+   for (i = 0; i < n; i++) {
+      np = avl_file_fref (avl_fp, lim, avl_fp->hdrlen + i * avl_fp->reclen, &nd, sizeof (nd));
+      if (np->b == 0x40) {
+         w[i / 64] |= (uint64_t) 1 << (i % 64);
+         h->n_free++;
+      }
+   }
+   *head_empty = 0;
+   avl_fp->fmap->valid = 1;
+   avl_fp->fmap->n = n;
+}
+
+
+/*------------------------------------------- avl_file_fbegin
+ * Check whether the map matches the file, which has just been locked
+ * for writing.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_fbegin (AVL_FILE *avl_fp, off_t *lim, uint32_t gen)
+{
+   struct avl_file_free_struct *f;
+   struct avl_file_fhdr_struct *h;
+
+   f = avl_fp->fmap;
+   h = (struct avl_file_fhdr_struct *) f->map;
+   if (h->size != f->map_len) {
+      avl_file_fmapped (avl_fp, 0);
+      h = (struct avl_file_fhdr_struct *) f->map;
+   }
+   f->gen = gen;
+   f->n = (*lim - avl_fp->hdrlen) / avl_fp->reclen;
+   f->valid = ((h->gen == gen) && (h->n_rec == (*lim - avl_fp->hdrlen) / avl_fp->reclen));
+   if (!f->valid) h->n_rec = -1;         // the generation number could match again later
+}
+
+
+/*------------------------------------------- avl_file_fnext
+ * Return the first record number at or after i that is empty in the
+ * map, or -1.
+ * This function should only be called by other avl_file functions.
+ */
+static int64_t
+avl_file_fnext (AVL_FILE *avl_fp, int64_t i)
+{
+   uint64_t *w, v;
+   int64_t nw, j;
+
+   w = (uint64_t *) (avl_fp->fmap->map + AVL_FILE_FHDR_LEN);
+   nw = (avl_fp->fmap->map_len - AVL_FILE_FHDR_LEN) / sizeof (uint64_t);
+   j = i / 64;
+   if (j >= nw) return (-1);
+   v = w[j] & (~(uint64_t) 0 << (i % 64));
+   while (v == 0) {
+      if (++j >= nw) return (-1);
+      v = w[j];
+   }
+   return (j * 64 + __builtin_ctzll (v));
+}
+
+
+/*------------------------------------------- avl_file_fset
+ * Set (empty is 1) or clear the map bit for record number i.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_fset (AVL_FILE *avl_fp, int64_t i, int32_t empty)
+{
+   struct avl_file_fhdr_struct *h;
+   uint64_t *w, b;
+
+   if (AVL_FILE_FHDR_LEN + (i / 64 + 1) * (off_t) sizeof (uint64_t) > avl_fp->fmap->map_len) {
+      if (!empty) return;
+      avl_file_fmapped (avl_fp, i + 1);
+   }
+   h = (struct avl_file_fhdr_struct *) avl_fp->fmap->map;
+   w = (uint64_t *) (avl_fp->fmap->map + AVL_FILE_FHDR_LEN);
+   b = (uint64_t) 1 << (i % 64);
+   h->n_rec = -1;                        // until avl_file_fend(), in case of a crash
+   if (empty && !(w[i / 64] & b)) {
+      w[i / 64] |= b;
+      h->n_free++;
+      if (i >= avl_fp->fmap->n) avl_fp->fmap->n = i + 1;
+      if (i / 64 < h->low) h->low = i / 64;
+   } else if (!empty && (w[i / 64] & b)) {
+      w[i / 64] &= ~b;
+      h->n_free--;
+   }
+}
+
+
+/*------------------------------------------- avl_file_fend
+ * Mark the map as matching the file, which has the new generation
+ * number gen and ends at lim, after an operation that wrote records. Bits for records
+ * past the end of a file that was shortened are cleared.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_fend (AVL_FILE *avl_fp, off_t *lim, uint32_t gen)
+{
+   struct avl_file_fhdr_struct *h;
+   int64_t n, i;
+
+   n = (*lim - avl_fp->hdrlen) / avl_fp->reclen;
+   for (i = n; i < avl_fp->fmap->n; i++) avl_file_fset (avl_fp, i, 0);
+   avl_fp->fmap->n = n;
+   h = (struct avl_file_fhdr_struct *) avl_fp->fmap->map;
+   h->gen = gen;
+   h->n_rec = n;
+}
+
+
+/*------------------------------------------- avl_file_fclear
+ * Clear the map, for a function that is about to set the bits for 
+ * all of the empty records.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_fclear (AVL_FILE *avl_fp)
+{
+   struct avl_file_fhdr_struct *h;
+
+   h = (struct avl_file_fhdr_struct *) avl_fp->fmap->map;
+   memset (avl_fp->fmap->map + AVL_FILE_FHDR_LEN, 0, avl_fp->fmap->map_len - AVL_FILE_FHDR_LEN);
+   h->n_rec = -1;
+   h->n_free = 0;
+   h->low = 0;
+   avl_fp->fmap->valid = 1;
+   avl_fp->fmap->n = 0;
+}
+
+
+/*------------------------------------------- avl_file_falloc
+ * Take an empty record from the map: with AVL_FILE_FREE_NEAR, the
+ * nearest one to the record at near (if not 0) within AVL_FILE_FNEAR
+ * words of bits, or else the first one in the file.
+ * Returns its position, or 0 if there are none.
+ * This function should only be called by other avl_file functions.
+ */
+static off_t
+avl_file_falloc (AVL_FILE *avl_fp, off_t *lim, off_t *head_empty, off_t near)
+{
+   struct avl_file_fhdr_struct *h;
+   uint64_t *w, v;
+   int64_t nw, c, j, i, b, d;
+
+   if (!avl_fp->fmap->valid) avl_file_fbuild (avl_fp, lim, head_empty);
+   h = (struct avl_file_fhdr_struct *) avl_fp->fmap->map;
+   w = (uint64_t *) (avl_fp->fmap->map + AVL_FILE_FHDR_LEN);
+   nw = (avl_fp->fmap->map_len - AVL_FILE_FHDR_LEN) / sizeof (uint64_t);
+   if (h->n_free <= 0) return (0);
+
+   i = -1;
+   if ((near > 0) && (avl_fp->fmap->policy == AVL_FILE_FREE_NEAR)) {
+      c = (near - avl_fp->hdrlen) / avl_fp->reclen;
+      for (d = 0; (i < 0) && (d <= AVL_FILE_FNEAR); d++) {
+         j = c / 64 + d;                     // the first bit above c,
+         if ((j < nw) && ((v = (d == 0) ? w[j] & (~(uint64_t) 0 << (c % 64)) : w[j]) != 0))
+            i = j * 64 + __builtin_ctzll (v);
+         j = c / 64 - d;                     // or below c, if nearer
+         if ((j >= 0) && (j < nw) && ((v = (d == 0) ? w[j] & (((uint64_t) 1 << (c % 64)) - 1) : w[j]) != 0)) {
+            b = j * 64 + 63 - __builtin_clzll (v);
+            if ((i < 0) || (c - b < i - c)) i = b;
+         }
+      }
+   }
+   if (i < 0) {
+      for (j = h->low; (j < nw) && (w[j] == 0); j++);
+      h->low = j;
+      if (j == nw) avl_file_fatal (avl_fp, "184 corrupted free map, n_free is wrong");
+      i = j * 64 + __builtin_ctzll (w[j]);
+   }
+
+   if (avl_fp->hdrlen + i * avl_fp->reclen >= *lim) 
+      avl_file_fatal (avl_fp, "184 corrupted free map, record past the end of the file");
+   avl_file_fset (avl_fp, i, 0);
+   return (avl_fp->hdrlen + i * avl_fp->reclen);
+}
+
+
+/*------------------------------------------- avl_file_fopen
+ * Open (or with AVL_FILE_FREE in the mode, create) the free-space map
+ * for the file. Without AVL_FILE_FREE, a file that does not have a 
+ * map is left as it is. If the file is new, an old map is reset. 
+ * The file must be locked with F_WRLCK.
+ * Returns 0 if successful.
+ */
+static int32_t
+avl_file_fopen (AVL_FILE *avl_fp, char *fname, int32_t mode, int32_t new)
+{
+   struct avl_file_free_struct *f;
+   struct avl_file_fhdr_struct h;
+   char fmname[strlen (fname) + 6];
+   int32_t fd, n;
+
+   avl_fp->fmap = NULL;
+   strcpy (fmname, fname);
+   strcat (fmname, "-free");
+   if (mode & AVL_FILE_FREE)
+      fd = open (fmname, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+   else
+      fd = open (fmname, O_RDWR);
+   if (fd < 0) {
+      if (!(mode & AVL_FILE_FREE) && (access (fmname, F_OK) != 0)) return (0);
+      setenv (AVL_FILE_EMSG_VNAME, "180 free map open failed", 1);
+      return (-1);
+   }
+   if (avl_fp->n_keys < 1) {
+      setenv (AVL_FILE_EMSG_VNAME, "181 the free map needs at least one key", 1);
+      close (fd);
+      return (-1);
+   }
+
+   n = pread (fd, &h, sizeof (h), 0);
+   if ((n == 0) || new) {
+      memset (&h, 0, sizeof (h));
+      memcpy (h.magic, "AVL.FREE", 8);
+      h.n_rec = -1;
+      h.size = AVL_FILE_FGROW;
+      if ((ftruncate (fd, 0) != 0) || (ftruncate (fd, h.size) != 0)) n = 0;
+      else n = pwrite (fd, &h, sizeof (h), 0);
+   }
+   if ((n != sizeof (h)) || (memcmp (h.magic, "AVL.FREE", 8) != 0)) {
+      setenv (AVL_FILE_EMSG_VNAME, "181 bad free map header", 1);
+      close (fd);
+      return (-1);
+   }
+
+   f = calloc (1, sizeof (struct avl_file_free_struct));
+   if (f == NULL) {
+      setenv (AVL_FILE_EMSG_VNAME, "180 malloc returned NULL", 1);
+      close (fd);
+      return (-1);
+   }
+   f->map = mmap (NULL, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (f->map == MAP_FAILED) {
+      setenv (AVL_FILE_EMSG_VNAME, "183 free map mmap failed", 1);
+      free (f);
+      close (fd);
+      return (-1);
+   }
+   f->fd = fd;
+   f->map_len = h.size;
+   f->policy = AVL_FILE_FREE_LOWEST;
+   avl_fp->fmap = f;
+   return (0);
+}
+
+
+/*------------------------------------------- avl_file_ffree
+ * Free the free-space map memory.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_ffree (AVL_FILE *avl_fp)
+{
+   if (avl_fp->fmap == NULL) return;
+   munmap (avl_fp->fmap->map, avl_fp->fmap->map_len);
+   close (avl_fp->fmap->fd);
+   free (avl_fp->fmap);
+   avl_fp->fmap = NULL;
+}
+
+
+/*
+ * The shared lock segment, for files opened with avl_file_open_shm()
+ * (or any file that has one). The lock on byte 0 of the file, which
+ * each operation takes and releases with fcntl(), is replaced by a 
+ * lock kept in a small file of its own (fname with "-shm" added) that
+ * each process maps with MAP_SHARED. A process-shared mutex, which
+ * is taken and released without a system call when no other process
+ * holds it, protects the count of shared locks and the holder of the
+ * exclusive lock, and processes that must wait for the lock sleep 
+ * on a futex. Waiting writers are served before new readers.
+ *
+ * Each AVL_FILE has a slot in the segment with its process ID and
+ * the locks it holds, so that the locks of a process that died can
+ * be removed: the mutex is robust, and a process that has waited
+ * AVL_FILE_SHM_WAIT milliseconds for the lock checks the slots.
+ *
+ * The segment also holds the header and the file length after the
+ * last update, with a stamp changed by every update. An operation 
+ * then reads neither from the file: it copies them from the segment
+ * if the stamp is not the one this AVL_FILE last saw.
+ *
+ * The segment is made again by an open when no process in its slots
+ * is running, or the system has been restarted since it was made.
+ * The opens and closes still lock byte 0 of the file, and 
+ * avl_file_lock() and the current-pointer records still use fcntl()
+ * locks.
+ */
+#define AVL_FILE_SHM_SLOTS	256	// AVL_FILEs using the segment at once
+#define AVL_FILE_SHM_WAIT	50	// milliseconds between checks for dead processes
+
+struct avl_file_sslot_struct {		// an AVL_FILE using the segment
+   int32_t pid;          // its process, or 0 for a free slot
+   int32_t readers;      // shared locks it holds
+   int32_t writer;       // 1 if it holds the exclusive lock
+   int32_t waiting;      // 1 if it waits for the exclusive lock
+   int32_t sleeping;     // 1 if it sleeps on the futex
+};
+
+struct avl_file_sseg_struct {		// the segment file
+   char magic[8];
+   char boot[40];        // system boot ID when the segment was made
+   int32_t hlen;         // file header length
+   int32_t hvalid;       // hdr and lim are the file's
+   pthread_mutex_t mu;   // robust and process-shared, for the fields below
+   uint32_t seq;         // futex word, changed when a lock is released
+   int32_t sleepers;     // slots sleeping on seq
+   int32_t readers;      // shared locks held
+   int32_t writer;       // slot + 1 of the exclusive lock holder, or 0
+   int32_t waiting;      // slots waiting for the exclusive lock
+   uint32_t stamp;       // changed by every update
+   int64_t lim;          // file length after the last update
+   struct avl_file_sslot_struct slot[AVL_FILE_SHM_SLOTS];
+   char hdr[];           // file header after the last update
+};
+
+struct avl_file_shm_struct {
+   int32_t fd;           // segment file
+   int32_t slot;         // the AVL_FILE's slot
+   int32_t type;         // lock held, F_RDLCK or F_WRLCK, or 0
+   uint32_t stamp;       // seg->stamp for the header in avl_fp->hdr
+   size_t len;           // segment length
+   struct avl_file_sseg_struct *seg;
+};
+
+
+#ifdef	__linux__
+/*------------------------------------------- avl_file_swait
+ * Sleep until *p is not val, or another process wakes this one.
+ * Returns 1 if AVL_FILE_SHM_WAIT milliseconds passed first.
+ */
+static int32_t
+avl_file_swait (uint32_t *p, uint32_t val)
+{
+   struct timespec ts;
+
+   ts.tv_sec = 0;
+   ts.tv_nsec = AVL_FILE_SHM_WAIT * 1000000L;
+   if (syscall (SYS_futex, p, FUTEX_WAIT, val, &ts, NULL, 0) == 0) return (0);
+   return (errno == ETIMEDOUT);
+}
+
+
+/*------------------------------------------- avl_file_swake
+ * Wake the processes sleeping on *p.
+ */
+static void
+avl_file_swake (uint32_t *p)
+{
+   syscall (SYS_futex, p, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+
+/*------------------------------------------- avl_file_sclean
+ * Free the slots of processes that have died, and count the locks
+ * again from the slots. If a process died holding the exclusive 
+ * lock, the header in the segment is not used until it is read from
+ * the file again. The segment mutex must be locked.
+ */
+static void
+avl_file_sclean (struct avl_file_sseg_struct *seg)
+{
+   struct avl_file_sslot_struct *s;
+   int32_t i;
+
+   seg->readers = 0;
+   seg->writer = 0;
+   seg->waiting = 0;
+   seg->sleepers = 0;
+   for (i = 0; i < AVL_FILE_SHM_SLOTS; i++) {
+      s = &seg->slot[i];
+      if ((s->pid != 0) && (kill (s->pid, 0) != 0) && (errno == ESRCH)) {
+         if (s->writer) seg->hvalid = 0;
+         memset (s, 0, sizeof (*s));
+      }
+      seg->readers += s->readers;
+      if (s->writer) seg->writer = i + 1;
+      seg->waiting += s->waiting;
+      seg->sleepers += s->sleeping;
+   }
+   seg->seq++;
+   avl_file_swake (&seg->seq);
+}
+
+
+/*------------------------------------------- avl_file_smutex
+ * Lock the segment mutex, cleaning up after its holder if it died.
+ */
+static void
+avl_file_smutex (struct avl_file_sseg_struct *seg)
+{
+   if (pthread_mutex_lock (&seg->mu) == EOWNERDEAD) {
+      avl_file_sclean (seg);
+      pthread_mutex_consistent (&seg->mu);
+   }
+}
+
+
+/*------------------------------------------- avl_file_slock
+ * Take the lock in the segment, shared (F_RDLCK) or exclusive 
+ * (F_WRLCK), waiting if necessary.
+ */
+static void
+avl_file_slock (AVL_FILE *avl_fp, int32_t type)
+{
+   struct avl_file_shm_struct *sh;
+   struct avl_file_sseg_struct *seg;
+   struct avl_file_sslot_struct *s;
+   uint32_t seq;
+   int32_t late;
+
+   sh = avl_fp->shm;
+   seg = sh->seg;
+   s = &seg->slot[sh->slot];
+   avl_file_smutex (seg);
+   for (;;) {
+      if (type == F_RDLCK) {
+         if ((seg->writer == 0) && (seg->waiting == 0)) {
+            seg->readers++;
+            s->readers++;
+            break;
+         }
+      } else {
+         if ((seg->writer == 0) && (seg->readers == 0)) {
+            seg->writer = sh->slot + 1;
+            s->writer = 1;
+            if (s->waiting) seg->waiting--;
+            s->waiting = 0;
+            break;
+         }
+         if (!s->waiting) seg->waiting++;
+         s->waiting = 1;
+      }
+      seq = seg->seq;
+      s->sleeping = 1;
+      seg->sleepers++;
+      pthread_mutex_unlock (&seg->mu);
+      late = avl_file_swait (&seg->seq, seq);
+      avl_file_smutex (seg);
+      if (s->sleeping) seg->sleepers--;
+      s->sleeping = 0;
+      if (late) avl_file_sclean (seg);
+   }
+   pthread_mutex_unlock (&seg->mu);
+   sh->type = type;
+}
+
+
+/*------------------------------------------- avl_file_sunlock
+ * Release the lock in the segment, and wake the processes waiting
+ * for it.
+ */
+static void
+avl_file_sunlock (AVL_FILE *avl_fp)
+{
+   struct avl_file_shm_struct *sh;
+   struct avl_file_sseg_struct *seg;
+   struct avl_file_sslot_struct *s;
+   int32_t n;
+
+   sh = avl_fp->shm;
+   seg = sh->seg;
+   s = &seg->slot[sh->slot];
+   avl_file_smutex (seg);
+   if (sh->type == F_WRLCK) {
+      seg->writer = 0;
+      s->writer = 0;
+   } else {
+      seg->readers--;
+      s->readers--;
+   }
+   seg->seq++;
+   n = seg->sleepers;
+   pthread_mutex_unlock (&seg->mu);
+   if (n > 0) avl_file_swake (&seg->seq);
+   sh->type = 0;
+}
+#endif
+
+
+/*------------------------------------------- avl_file_olock
+ * Lock the file for an operation (F_RDLCK or F_WRLCK), or unlock it
+ * (F_UNLCK), with the shared lock segment if the file has one, and
+ * otherwise with an fcntl() lock on byte 0.
+ */
+static void
+avl_file_olock (AVL_FILE *avl_fp, int32_t type)
+{
+   if (avl_fp->shm == NULL)
+      avl_file_plock (avl_fp->fd, type, 0, 1);
+#ifdef	__linux__
+   else if (type == F_UNLCK)
+      avl_file_sunlock (avl_fp);
+   else
+      avl_file_slock (avl_fp, type);
+#endif
+}
+
+
+/*------------------------------------------- avl_file_sput
+ * Copy the header and the file length into the segment after an
+ * update, for the other processes. The segment must be locked with
+ * F_WRLCK.
+ */
+static void
+avl_file_sput (AVL_FILE *avl_fp, off_t lim)
+{
+   struct avl_file_shm_struct *sh;
+
+   sh = avl_fp->shm;
+   memcpy (sh->seg->hdr, avl_fp->hdr, avl_fp->hlen);
+   sh->seg->lim = lim;
+   sh->seg->hvalid = 1;
+   sh->seg->stamp++;
+   sh->stamp = sh->seg->stamp;
+}
+
+
+/*------------------------------------------- avl_file_sboot
+ * Read the system boot ID into b (40 bytes).
+ */
+static void
+avl_file_sboot (char *b)
+{
+   int32_t fd;
+
+   memset (b, 0, 40);
+   fd = open ("/proc/sys/kernel/random/boot_id", O_RDONLY);
+   if (fd < 0) return;
+   if (read (fd, b, 39) < 0) b[0] = '\0';
+   close (fd);
+}
+
+
+/*------------------------------------------- avl_file_sopen
+ * Open the shared lock segment for a file with a header of hlen 
+ * bytes, creating it with AVL_FILE_SHM, and take the exclusive lock
+ * in it for the open. The file must be locked (byte 0), so that the
+ * opens are made one at a time. The segment is made again if no 
+ * other AVL_FILE is using it, and otherwise it must match the file.
+ * If it does not exist, and cannot be created, the file is used
+ * without it. It is not created while the file is open as another 
+ * AVL_FILE, which would not use it, so the log must have been copied
+ * into the file first.
+ * Returns 0 if successful.
+ */
+static int32_t
+avl_file_sopen (AVL_FILE *avl_fp, char *fname, int32_t mode, int32_t hlen)
+{
+   struct avl_file_shm_struct *sh;
+   struct avl_file_sseg_struct *seg;
+   pthread_mutexattr_t attr;
+   struct stat st;
+   char smname[strlen (fname) + 5], boot[40];
+   size_t len;
+   int32_t fd, i, alone;
+   pid_t pid;
+
+   avl_fp->shm = NULL;
+   strcpy (smname, fname);
+   strcat (smname, "-shm");
+#ifdef	__linux__
+   if ((mode & AVL_FILE_SHM) && (access (smname, F_OK) != 0) && avl_file_olive (avl_fp)) {
+      setenv (AVL_FILE_EMSG_VNAME, "217 the file is open, the shared lock segment cannot be created", 1);
+      return (-1);
+   }
+   if (mode & AVL_FILE_SHM)
+      fd = open (smname, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+   else
+      fd = open (smname, O_RDWR);
+   if (fd < 0) {
+      if (access (smname, F_OK) != 0) return (0);
+      setenv (AVL_FILE_EMSG_VNAME, "210 shared lock segment open failed", 1);
+      return (-1);
+   }
+#else
+   if (access (smname, F_OK) != 0) return (0);
+   setenv (AVL_FILE_EMSG_VNAME, "211 shared lock segments are not supported", 1);
+   return (-1);
+#endif
+
+   len = sizeof (struct avl_file_sseg_struct) + hlen;
+   if ((fstat (fd, &st) != 0) || (st.st_size < (off_t) len)) {
+      if ((ftruncate (fd, 0) != 0) || (ftruncate (fd, len) != 0)) {
+         setenv (AVL_FILE_EMSG_VNAME, "213 shared lock segment write failed", 1);
+         close (fd);
+         return (-1);
+      }
+   }
+   seg = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (seg == MAP_FAILED) {
+      setenv (AVL_FILE_EMSG_VNAME, "214 shared lock segment mmap failed", 1);
+      close (fd);
+      return (-1);
+   }
+
+  /*
+   * The segment is in use if a process in its slots is running, 
+   * unless the system has been restarted since.
+   */
+   pid = getpid ();
+   avl_file_sboot (boot);
+   alone = 1;
+   if ((memcmp (seg->magic, "AVL.SHM ", 8) == 0) && (memcmp (seg->boot, boot, 40) == 0)) {
+      for (i = 0; i < AVL_FILE_SHM_SLOTS; i++) {
+         if ((seg->slot[i].pid != 0) && 
+             ((kill (seg->slot[i].pid, 0) == 0) || (errno == EPERM))) alone = 0;
+      }
+   }
+   if (alone) {
+      memset (seg, 0, len);
+      memcpy (seg->boot, boot, 40);
+      pthread_mutexattr_init (&attr);
+      pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+      pthread_mutexattr_setrobust (&attr, PTHREAD_MUTEX_ROBUST);
+      pthread_mutex_init (&seg->mu, &attr);
+      pthread_mutexattr_destroy (&attr);
+      seg->hlen = hlen;
+      memcpy (seg->magic, "AVL.SHM ", 8);
+   } else if ((memcmp (seg->magic, "AVL.SHM ", 8) != 0) || (seg->hlen != hlen)) {
+      setenv (AVL_FILE_EMSG_VNAME, "212 bad shared lock segment", 1);
+      munmap (seg, len);
+      close (fd);
+      return (-1);
+   }
+
+   sh = calloc (1, sizeof (struct avl_file_shm_struct));
+   if (sh == NULL) {
+      setenv (AVL_FILE_EMSG_VNAME, "215 malloc returned NULL", 1);
+      munmap (seg, len);
+      close (fd);
+      return (-1);
+   }
+#ifdef	__linux__
+   avl_file_smutex (seg);
+   for (i = 0; (i < AVL_FILE_SHM_SLOTS) && (seg->slot[i].pid != 0); i++) ;
+   if (i == AVL_FILE_SHM_SLOTS) {
+      avl_file_sclean (seg);
+      for (i = 0; (i < AVL_FILE_SHM_SLOTS) && (seg->slot[i].pid != 0); i++) ;
+   }
+   if (i < AVL_FILE_SHM_SLOTS) seg->slot[i].pid = pid;
+   pthread_mutex_unlock (&seg->mu);
+   if (i == AVL_FILE_SHM_SLOTS) {
+      setenv (AVL_FILE_EMSG_VNAME, "216 too many AVL_FILEs using the shared lock segment", 1);
+      free (sh);
+      munmap (seg, len);
+      close (fd);
+      return (-1);
+   }
+#endif
+   sh->fd = fd;
+   sh->slot = i;
+   sh->len = len;
+   sh->seg = seg;
+   sh->stamp = seg->stamp - 1;
+   avl_fp->shm = sh;
+   avl_file_olock (avl_fp, F_WRLCK);
+   return (0);
+}
+
+
+/*------------------------------------------- avl_file_sfree
+ * Release the lock and the slot in the segment, and close it. 
+ */
+static void
+avl_file_sfree (AVL_FILE *avl_fp)
+{
+   struct avl_file_shm_struct *sh;
+
+   sh = avl_fp->shm;
+   if (sh == NULL) return;
+#ifdef	__linux__
+   if (sh->type != 0) avl_file_sunlock (avl_fp);
+   avl_file_smutex (sh->seg);
+   memset (&sh->seg->slot[sh->slot], 0, sizeof (struct avl_file_sslot_struct));
+   pthread_mutex_unlock (&sh->seg->mu);
+#endif
+   munmap (sh->seg, sh->len);
+   close (sh->fd);
+   free (sh);
+   avl_fp->shm = NULL;
+}
+
+
+/*------------------------------------------- avl_file_ealloc
+ * Take an empty record, from the free-space map if the file has 
+ * one, or else from the empty list at head_empty. See 
+ * avl_file_falloc() for near.
+ * Returns its position, or 0 if there are none.
+ * This function should only be called by other avl_file functions.
+ */
+static off_t
+avl_file_ealloc (AVL_FILE *avl_fp, off_t *lim, off_t *head_empty, off_t near)
+{
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } yr;
+   off_t y;
+
+   if (avl_fp->fmap != NULL) return (avl_file_falloc (avl_fp, lim, head_empty, near));
+
+   y = *head_empty;
+   if (y > 0) {
+      avl_file_nread (avl_fp, lim, y, &yr);
+      *head_empty = yr.next;
+   }
+   return (y);
+}
+
+
+/*------------------------------------------- avl_file_efree
+ * Add the record at pos to the free-space map, or to the empty list 
+ * at head_empty, and set next for the record, which the caller must
+ * write as an empty record.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_efree (AVL_FILE *avl_fp, off_t *lim, off_t *head_empty, off_t pos, off_t *next)
+{
+   if (avl_fp->fmap != NULL) {
+      if (!avl_fp->fmap->valid) avl_file_fbuild (avl_fp, lim, head_empty);
+      avl_file_fset (avl_fp, (pos - avl_fp->hdrlen) / avl_fp->reclen, 1);
+      *next = 0;
+   } else {
+      *next = *head_empty;
+      *head_empty = pos;
+   }
+}
+
+
+/*------------------------------------------- avl_file_lstart
+ * Lock the file for an operation, and return the file length. The
+ * lock type is F_RDLCK for the functions that only read the tree, 
+ * and F_WRLCK for the others. Readers still write their own 
+ * current-pointer records, which is safe under a shared lock because
+ * other processes only use them with an exclusive lock. With the
+ * log, the frames appended by other processes are read into the log 
+ * index first. With shadow paging, a commit that a process did not
+ * finish is finished first.
+ *
+ * The header is read once here, into avl_fp->hdr, for all of the
+ * reads of it by the operation. If its generation number is the 
+ * one this AVL_FILE last saw, the file has not been changed by 
+ * another process, and the file length is known without asking 
+ * for it. Otherwise, if another process has changed the file since
+ * the record cache was filled, the cache is emptied. A mapping is
+ * extended to the end of the file here, rather than by the reads,
+ * so that threads can read it at the same time.
+ *
+ * If the AVL_FILE has a snapshot, the F_RDLCK operations read it
+ * instead, without locking the file. Updates of a file that has a
+ * version store save records in it for the snapshots. In a 
+ * transaction, the file is already locked, and the header and the
+ * file length are the ones left by the last operation.
+ */
+static off_t
+avl_file_lstart (AVL_FILE *avl_fp, int32_t type)
+{
+   struct avl_file_shm_struct *sh;
+   uint32_t gen;
+   off_t lim;
+   void *p;
+
+   if ((type == F_RDLCK) && (avl_fp->vers != NULL) && (avl_fp->vers->slot >= 0)) {
+      avl_fp->vers->on = 1;	// the snapshot, without a lock
+      return (avl_fp->vers->lim);
+   }
+   if (avl_fp->txn) return (avl_fp->hlim);	// locked by avl_file_txn_begin()
+   avl_file_olock (avl_fp, type);
+   if ((avl_fp->wal != NULL) && !avl_fp->wal->shadow) {
+      avl_fp->wal->ltype = type;
+      avl_file_wscan (avl_fp);
+   }
+   while ((avl_fp->wal != NULL) && avl_fp->wal->shadow && (avl_file_wcheck (avl_fp, type) != 0)) {
+      avl_file_olock (avl_fp, F_UNLCK);      // a commit to finish, with F_WRLCK
+      avl_file_olock (avl_fp, F_WRLCK);
+      avl_file_wcheck (avl_fp, F_WRLCK);
+      avl_file_olock (avl_fp, F_UNLCK);
+      avl_file_olock (avl_fp, type);
+   }
+   if (avl_fp->wal != NULL) avl_fp->wal->ltype = type;
+   sh = avl_fp->shm;
+   if ((sh != NULL) && !avl_file_wlog (avl_fp) && sh->seg->hvalid) {
+      if (sh->stamp != sh->seg->stamp) {
+         memcpy (avl_fp->hdr, sh->seg->hdr, avl_fp->hlen);
+         sh->stamp = sh->seg->stamp;
+      }
+      lim = sh->seg->lim;
+      memcpy (&gen, avl_fp->hdr + AVL_FILE_GEN_POS, sizeof (gen));
+   } else {
+      lim = avl_fp->hdrlen;
+      p = avl_file_fref (avl_fp, &lim, 0, avl_fp->hdr, avl_fp->hlen);
+      if (p != avl_fp->hdr) memcpy (avl_fp->hdr, p, avl_fp->hlen);
+      memcpy (&gen, avl_fp->hdr + AVL_FILE_GEN_POS, sizeof (gen));
+      if ((gen != avl_fp->hgen) || avl_file_wlog (avl_fp) || (sh != NULL))
+         lim = avl_file_flen (avl_fp);
+      else
+         lim = avl_fp->hlim;
+   }
+   avl_fp->hgen = gen;
+   avl_fp->hlim = lim;
+   if (avl_fp->vers != NULL) {
+      if ((type == F_WRLCK) && !avl_file_wlog (avl_fp))
+         avl_file_vbegin (avl_fp, gen, lim);
+      else
+         avl_fp->vers->save = 0;
+   }
+
+   if (avl_fp->cache != NULL) {
+      if (gen != avl_fp->cache->gen) {
+         avl_file_cache_clear (avl_fp->cache);
+         avl_fp->cache->gen = gen;
+      }
+   }
+
+   if (avl_fp->fmap != NULL) {
+      if (type == F_WRLCK) {
+         avl_file_fbegin (avl_fp, &lim, gen);
+      } else {
+         avl_fp->fmap->valid = 0;
+      }
+   }
+   if ((avl_fp->mode & AVL_FILE_MMAP) && (lim > avl_fp->map_len)) avl_file_lmap (avl_fp, lim);
+   return (lim);
+}
+
+
+/*------------------------------------------- avl_file_lbegin
+ * Lock the file for an operation with avl_file_lstart(), and return 
+ * the file length. For the _t functions, threads that read the file
+ * at the same time share the lock, which is taken by the first of 
+ * them. The file cannot change until the last of them unlocks it.
+ */
+static off_t
+avl_file_lbegin (AVL_FILE *avl_fp, int32_t type)
+{
+#ifdef	AVL_FILE_TSAFE
+   off_t lim;
+
+   if (type == F_WRLCK) return (avl_file_lstart (avl_fp, type));
+   pthread_mutex_lock (&avl_fp->tmu);
+   if (avl_fp->readers++ == 0) avl_fp->rlim = avl_file_lstart (avl_fp, type);
+   lim = avl_fp->rlim;
+   pthread_mutex_unlock (&avl_fp->tmu);
+   return (lim);
+#else
+   return (avl_file_lstart (avl_fp, type));
+#endif
+}
+
+
+/*------------------------------------------- avl_file_lfinish
+ * Unlock the file after an operation. If any records were written,
+ * the generation number in the header is incremented first, which 
+ * tells other processes to empty their record caches, and the 
+ * free-space map is marked as matching the file again.
+ *
+ * With the log, the frame for the operation is appended to it, and
+ * after unlocking, operations that had the file locked with F_WRLCK
+ * wait for the log to be on disk. Operations with F_RDLCK write only
+ * their current-pointer records, in place, so they append nothing.
+ * A checkpoint is made when the log is long enough, with a new
+ * F_WRLCK lock if necessary. With shadow
+ * paging, an update is committed before the file is unlocked. In a
+ * transaction, the file stays locked, and the frame or the commit is
+ * left for avl_file_txn_commit().
+ */
+static void
+avl_file_lfinish (AVL_FILE *avl_fp, off_t *lim)
+{
+   struct avl_file_wal_struct *w;
+   uint32_t gen, epoch;
+   off_t end;
+   int32_t ltype, dirty;
+
+   if ((avl_fp->vers != NULL) && avl_fp->vers->on) {
+      avl_fp->vers->on = 0;
+      return;
+   }
+   dirty = avl_fp->dirty;
+   if (avl_fp->dirty) {
+      memcpy (&gen, avl_fp->hdr + AVL_FILE_GEN_POS, sizeof (gen));
+      gen++;
+      avl_file_fwrite (avl_fp, lim, AVL_FILE_GEN_POS, &gen, sizeof (gen));
+      memcpy (avl_fp->hdr + AVL_FILE_GEN_POS, &gen, sizeof (gen));
+      avl_fp->hgen = gen;
+      if (avl_fp->cache != NULL) avl_fp->cache->gen = gen;
+      avl_fp->dirty = 0;
+      if ((avl_fp->fmap != NULL) && avl_fp->fmap->valid) avl_file_fend (avl_fp, lim, gen);
+   }
+   avl_fp->hlim = *lim;
+   if (avl_fp->txn) {
+      if (dirty) avl_fp->txn = 2;	// written, see avl_file_txn_commit()
+      return;
+   }
+   if ((avl_fp->shm != NULL) && !avl_file_wlog (avl_fp) && (avl_fp->shm->type == F_WRLCK) &&
+       (dirty || !avl_fp->shm->seg->hvalid)) avl_file_sput (avl_fp, *lim);
+
+   w = avl_fp->wal;
+   if ((w == NULL) || w->shadow) {
+      if ((w != NULL) && (w->ltype == F_WRLCK)) avl_file_wcommit (avl_fp, lim);
+      avl_file_olock (avl_fp, F_UNLCK);
+      return;
+   }
+
+   end = avl_file_wappend (avl_fp, lim);
+   epoch = w->epoch;
+   ltype = w->ltype;
+   if ((ltype == F_WRLCK) && (w->ckpt || (w->pos > AVL_FILE_WAL_MAX))) {
+      avl_file_wcheckpoint (avl_fp);
+      end = 0;
+   }
+   avl_file_olock (avl_fp, F_UNLCK);
+
+   if ((ltype == F_WRLCK) && (end > 0)) avl_file_wsync (avl_fp, epoch, end);
+
+   if ((ltype == F_RDLCK) && (w->pos > AVL_FILE_WAL_MAX)) {
+      avl_file_lbegin (avl_fp, F_WRLCK);
+      if (w->pos > AVL_FILE_WAL_MAX) avl_file_wcheckpoint (avl_fp);
+      avl_file_olock (avl_fp, F_UNLCK);
+   }
+}
+
+
+/*------------------------------------------- avl_file_lend
+ * Unlock the file after an operation with avl_file_lfinish(). For 
+ * the _t functions, the last of the threads reading the file at 
+ * the same time unlocks it.
+ */
+static void
+avl_file_lend (AVL_FILE *avl_fp, off_t *lim)
+{
+#ifdef	AVL_FILE_TSAFE
+   pthread_mutex_lock (&avl_fp->tmu);
+   if ((avl_fp->readers == 0) || (--avl_fp->readers == 0)) avl_file_lfinish (avl_fp, lim);
+   pthread_mutex_unlock (&avl_fp->tmu);
+#else
+   avl_file_lfinish (avl_fp, lim);
+#endif
+}
+
+
+#ifdef	AVL_FILE_TSAFE
+/*------------------------------------------- avl_file_tlock
+ * Lock the AVL_FILE for a thread, for a function that reads the file
+ * (F_RDLCK) or changes it (F_WRLCK). Readers share the lock, unless
+ * the record cache or the log is used, which reads change, or there
+ * is a transaction, in which reads write to the log index.
+ */
+static void
+avl_file_tlock (AVL_FILE *avl_fp, int32_t type)
+{
+   if (type == F_RDLCK) {
+      pthread_rwlock_rdlock (&avl_fp->rwl);
+      if ((avl_fp->cache == NULL) && !avl_file_wlog (avl_fp) && !avl_fp->txn) return;
+      pthread_rwlock_unlock (&avl_fp->rwl);
+   }
+   pthread_rwlock_wrlock (&avl_fp->rwl);
+}
+#endif
+
+
+
+
+/*------------------------------------------- avl_file_lgen
+ * Return the generation number from the header kept by 
+ * avl_file_lbegin(), or the snapshot's. The file must be locked.
+ */
+static uint32_t
+avl_file_lgen (AVL_FILE *avl_fp)
+{
+   uint32_t gen;
+
+   if ((avl_fp->vers != NULL) && avl_fp->vers->on) return (avl_fp->vers->gen);
+   memcpy (&gen, avl_fp->hdr + AVL_FILE_GEN_POS, sizeof (gen));
+   return (gen);
+}
+
+
+/*------------------------------------------- avl_file_tabort
+ * Discard the records written in a transaction, and unlock the file.
+ * With the log, the index is read again from the log. If the 
+ * transaction changed the generation number, the file gets the next
+ * one after it, with one small commit, so that the numbers that the
+ * transaction used (and that the cursors and the record cache may 
+ * have kept) do not mean another state of the file later.
+ */
+static void
+avl_file_tabort (AVL_FILE *avl_fp)
+{
+   struct avl_file_wal_struct *w;
+   uint32_t gen;
+   off_t lim;
+   void *p;
+
+   w = avl_fp->wal;
+   avl_file_wclear (w);
+   w->size = -1;
+   if (!w->shadow) {
+      w->pos = AVL_FILE_WHDR_LEN;
+      w->buf_len = AVL_FILE_WFRAME_LEN;
+      avl_file_wscan (avl_fp);
+   }
+   if (avl_fp->cache != NULL) avl_file_cache_clear (avl_fp->cache);
+   if (avl_fp->fmap != NULL) {
+      ((struct avl_file_fhdr_struct *) avl_fp->fmap->map)->n_rec = -1;
+      avl_fp->fmap->valid = 0;
+   }
+   if (avl_fp->shm != NULL) avl_fp->shm->seg->hvalid = 0;
+
+   memcpy (&gen, avl_fp->hdr + AVL_FILE_GEN_POS, sizeof (gen));
+   lim = avl_file_flen (avl_fp);
+   p = avl_file_fref (avl_fp, &lim, 0, avl_fp->hdr, avl_fp->hlen);
+   if (p != avl_fp->hdr) memcpy (avl_fp->hdr, p, avl_fp->hlen);
+   avl_fp->dirty = (avl_fp->txn > 1);
+   if (avl_fp->dirty) memcpy (avl_fp->hdr + AVL_FILE_GEN_POS, &gen, sizeof (gen));
+   avl_fp->txn = 0;
+   avl_file_lfinish (avl_fp, &lim);
+}
+
+
+/*------------------------------------------- avl_file_reclen
+ * Return the record length for n_keys keys and len bytes of data.
+ */
+static int32_t
+avl_file_reclen (int32_t n_keys, int32_t len)
+{
+   struct avl_struct {
+      struct avl_node_struct n[n_keys];
+      off_t prev, next;
+      char b[len];
+   };
+
+   return (sizeof (struct avl_struct));
+}
+
+
+/*------------------------------------------- avl_file_open_fd
+ * Open the AVL file fname for avl_file_open_mode(), which has opened
+ * and locked it as fd. The records have plen bytes of key prefixes
+ * followed by len bytes of the caller's data, and there are n_fseg
+ * key schema segments after the header, or none if it is zero. The 
+ * file is closed if the open fails.
+ */
+static AVL_FILE *
+avl_file_open_fd (int32_t fd, char *fname, int32_t len, int32_t plen, int32_t n_keys, 
+                  avl_file_cmp_fn_t cmp, AVL_FILE_SEG *seg, int32_t n_seg, int32_t n_fseg, 
+                  int32_t mode)
+{
+   AVL_FILE *avl_fp, avl_dummy;
+   int32_t n, i, reclen, hdrlen;
+
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;        // AVL record data length
+      int32_t reclen;     // AVL record length including key nodes
+      uint32_t gen;       // generation, changed by every update
+      int64_t n_avl;      // number of AVL records 
+      int64_t nextnum;    // unique record numbers 
+      off_t root[n_keys];
+      off_t head_seq;     // doubly linked
+      off_t head_empty;   // singly linked
+      off_t head_cpr;     // singly linked
+   } hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[n_keys];
+      off_t prev, next;   // prev used as sequential pointer in 'cpr' records
+      char b[len + plen];
+   } cpr;                 // per-process current position pointer
+   off_t cp, lim;
+   pid_t pid;
+
+
+   reclen = sizeof (struct avl_struct);
+   hdrlen = sizeof (hdr);
+   if (n_fseg > 0) hdrlen += 2 * sizeof (int32_t) + n_fseg * sizeof (AVL_FILE_SEG);
+
+  /*
+   * Take the lock in the shared lock segment, if there is one, for
+   * the processes that do not use the fcntl() lock. Then replay the
+   * log, if there is one, so that the header and the records in the 
+   * file are up to date. A new segment is created after that, since 
+   * until then every process uses the fcntl() lock.
+   */
+   memset (&avl_dummy, 0, sizeof (avl_dummy));
+   avl_dummy.fd = fd;
+   avl_dummy.n_keys = n_keys;
+   avl_dummy.hdrlen = hdrlen;
+   avl_dummy.hlen = sizeof (hdr);
+   avl_dummy.reclen = reclen;
+   avl_dummy.len = len + plen;
+   avl_dummy.uoff = plen;
+   avl_dummy.nodelen = offsetof (struct avl_struct, b) + plen;
+   if (avl_file_sopen (&avl_dummy, fname, mode & ~AVL_FILE_SHM, sizeof (hdr)) != 0) {
+      close (fd);
+      return (NULL);
+   }
+   if (avl_file_wopen (&avl_dummy, fname, mode) != 0) {
+      avl_file_sfree (&avl_dummy);
+      close (fd);
+      return (NULL);
+   }
+   if ((avl_dummy.shm == NULL) && (mode & AVL_FILE_SHM) &&
+       (avl_file_sopen (&avl_dummy, fname, mode, sizeof (hdr)) != 0)) {
+      avl_file_wfree (&avl_dummy);
+      close (fd);
+      return (NULL);
+   }
+   if (avl_dummy.wal != NULL) mode |= avl_dummy.wal->shadow ? AVL_FILE_SHADOW : AVL_FILE_WAL;
+   lim = lseek (fd, 0, SEEK_END);
+
+   n = pread (fd, &hdr, sizeof (hdr), 0);
+   if (n == 0) {
+      memset (&hdr, 0, sizeof (hdr));
+      memcpy (hdr.magic, AVL_FILE_MAGIC, 8);
+      hdr.n_keys = n_keys;
+      hdr.len = len;
+      hdr.reclen = reclen;
+      avl_file_lwrite (&avl_dummy, &lim, 0, &hdr, sizeof (hdr));
+   } else if (n != (int32_t) sizeof (hdr)) {
+      setenv (AVL_FILE_EMSG_VNAME, "21 read header != sizeof (hdr)", 1);
+      avl_file_wfree (&avl_dummy);
+      avl_file_sfree (&avl_dummy);
+      close (fd);
+      return (NULL);
+   }
+
+   if (memcmp (hdr.magic, AVL_FILE_MAGIC_V1, 8) == 0) {
+      setenv (AVL_FILE_EMSG_VNAME, "29 the file is from an earlier version, see avl_file_upgrade()", 1);
+      avl_file_wfree (&avl_dummy);
+      avl_file_sfree (&avl_dummy);
+      close (fd);
+      return (NULL);
+   }
+   if ((memcmp (hdr.magic, AVL_FILE_MAGIC, 8) != 0) && 
+       (memcmp (hdr.magic, AVL_FILE_MAGIC_SCHEMA, 8) != 0)) {
+      setenv (AVL_FILE_EMSG_VNAME, "29 hdr.magic != " AVL_FILE_MAGIC, 1);
+      avl_file_wfree (&avl_dummy);
+      avl_file_sfree (&avl_dummy);
+      close (fd);
+      return (NULL);
+   }
+
+   if (hdr.reclen != reclen) {
+      setenv (AVL_FILE_EMSG_VNAME, "22 hdr.reclen != reclen", 1);
+      avl_file_wfree (&avl_dummy);
+      avl_file_sfree (&avl_dummy);
+      close (fd);
+      return (NULL);
+   }
+
+   if (hdr.n_keys != n_keys) {
+      setenv (AVL_FILE_EMSG_VNAME, "23 hdr.n_keys != n_keys", 1);
+      avl_file_wfree (&avl_dummy);
+      avl_file_sfree (&avl_dummy);
+      close (fd);
+      return (NULL);
+   }
+
+   avl_fp = malloc (sizeof (AVL_FILE));
+   if (avl_fp == NULL) { 
+      setenv (AVL_FILE_EMSG_VNAME, "24 malloc returned NULL", 1);
+      avl_file_wfree (&avl_dummy);
+      avl_file_sfree (&avl_dummy);
+      close (fd); 
+      return (NULL);
+   }
+   avl_fp->fname = malloc (strlen (fname)+1);
+   if (avl_fp->fname == NULL) {
+      setenv (AVL_FILE_EMSG_VNAME, "25 malloc returned NULL", 1);
+      avl_file_wfree (&avl_dummy);
+      avl_file_sfree (&avl_dummy);
+      close (fd);
+      free (avl_fp);
+      return (NULL);
+   }
+   strcpy (avl_fp->fname, fname);
+   avl_fp->hdr = malloc (sizeof (hdr));
+   if (avl_fp->hdr == NULL) {
+      setenv (AVL_FILE_EMSG_VNAME, "25 malloc returned NULL", 1);
+      avl_file_wfree (&avl_dummy);
+      avl_file_sfree (&avl_dummy);
+      close (fd);
+      free (avl_fp->fname);
+      free (avl_fp);
+      return (NULL);
+   }
+   memcpy (avl_fp->hdr, &hdr, sizeof (hdr));
+   avl_fp->hlen = sizeof (hdr);
+   avl_fp->hgen = hdr.gen;
+   avl_fp->hlim = lim;
+   avl_fp->fd = fd;
+   avl_fp->n_keys = n_keys;
+   avl_fp->len = len + plen;
+   avl_fp->ulen = len;
+   avl_fp->uoff = plen;
+   avl_fp->reclen = reclen;
+   avl_fp->cmp = cmp;
+   avl_fp->mode = mode;
+   avl_fp->map = NULL;
+   avl_fp->map_len = 0;
+   avl_fp->hdrlen = hdrlen;
+   avl_fp->nodelen = offsetof (struct avl_struct, b) + plen;
+   avl_fp->dirty = 0;
+   avl_fp->txn = 0;
+   avl_fp->cache = NULL;
+   avl_fp->wal = avl_dummy.wal;
+   avl_fp->shm = avl_dummy.shm;
+   avl_fp->fmap = NULL;
+   avl_fp->vers = NULL;
+   avl_fp->seg = NULL;
+   avl_fp->kseg = NULL;
+   avl_fp->kpfx = NULL;
+   if (((n_fseg > 0) && 
+        (avl_file_sread (avl_fp, sizeof (hdr) + 2 * sizeof (int32_t), n_fseg, seg, n_seg) != 0)) ||
+       (avl_file_fopen (avl_fp, fname, mode, (n == 0)) != 0) ||
+       (avl_file_vopen (avl_fp, fname, mode) != 0)) {
+      avl_file_wfree (avl_fp);
+      avl_file_ffree (avl_fp);
+      avl_file_vfree (avl_fp);
+      avl_file_sfree (avl_fp);
+      close (fd);
+      free (avl_fp->seg);
+      free (avl_fp->kseg);
+      free (avl_fp->kpfx);
+      free (avl_fp->hdr);
+      free (avl_fp->fname);
+      free (avl_fp);
+      return (NULL);
+   }
+   if (avl_fp->fmap != NULL) {
+      avl_fp->mode |= AVL_FILE_FREE;
+      avl_file_fbegin (avl_fp, &lim, hdr.gen);
+   }
+   if (mode & AVL_FILE_MMAP) avl_file_lmap (avl_fp, lim);
+#ifdef	AVL_FILE_TSAFE
+   {
+      pthread_rwlockattr_t attr;
+
+      pthread_rwlockattr_init (&attr);
+#if defined (__GLIBC__) && defined (_GNU_SOURCE)
+      // keep a stream of readers from holding off the writers
+      pthread_rwlockattr_setkind_np (&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+      pthread_rwlock_init (&avl_fp->rwl, &attr);
+      pthread_rwlockattr_destroy (&attr);
+   }
+   pthread_mutex_init (&avl_fp->tmu, NULL);
+   pthread_mutex_init (&avl_fp->cmu, NULL);
+   avl_fp->readers = 0;
+#endif
+
+  /*
+   * Search for an unused (unlocked) current-pointer record to
+   * use first, or an empty record, before creating a new one.
+   * The lock test does not detect locks by this process, so
+   * check the PID.
+   */
+   pid = getpid ();
+   for (cp = hdr.head_cpr; cp > 0; cp = cpr.next) {
+      avl_file_cread (avl_fp, &lim, cp, &cpr, reclen);
+
+      if (sizeof (cpr.b) >= sizeof (pid_t)) {
+         if (memcmp (&cpr.b, &pid, sizeof (pid_t)) != 0) {
+            if (avl_file_ptest (fd, cp, reclen) == 0) break;
+         }
+      }
+   }
+   if (cp == 0) {
+      cp = avl_file_ealloc (avl_fp, &lim, &hdr.head_empty, 0);
+      if (cp == 0) cp = lim;
+      cpr.next = hdr.head_cpr;
+      hdr.head_cpr = cp;
+   }
+
+   avl_fp->cpr = cp;
+
+   for (i = 0; i < n_keys; i++) {
+      cpr.n[i].b = 0x20; cpr.n[i].l = 0; cpr.n[i].r = 0;
+   }
+   if (sizeof (cpr.b) >= sizeof (pid_t)) memcpy (&cpr.b, &pid, sizeof (pid_t));
+   cpr.prev = 0;
+   avl_file_cwrite (avl_fp, &lim, cp, &cpr, reclen);
+   avl_file_plock (fd, F_WRLCK, cp, reclen);
+
+   avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+   avl_file_lend (avl_fp, &lim);
+   if (avl_fp->shm != NULL) avl_file_plock (fd, F_UNLCK, 0, 1);
+   return (avl_fp);
+}
+
+
+/*------------------------------------------- avl_file_open_mode
+ * Opens an AVL file for reading and writing. The len parameter
+ * sets the (fixed) data length, and the data buffer passed to
+ * the other avl_file_xxx() functions must be the same size.
+ *
+ * The value n_keys and the comparison function cmp() must be 
+ * the same for future calls once an AVL file has been created.
+ *
+ * The first byte of the file is used to ensure exclusive
+ * access for each of the avl_file_xxx() functions by locking 
+ * it during those routines.
+ *
+ * The mode is zero, or AVL_FILE_MMAP to access the records through
+ * a shared memory mapping of the file instead of pread()/pwrite(),
+ * AVL_FILE_WAL to create the write-ahead log, AVL_FILE_FREE to
+ * create the free-space map, AVL_FILE_SHM to create the shared lock
+ * segment, AVL_FILE_SNAP to create the version store, and
+ * AVL_FILE_SHADOW to create the shadow file. Files that have a log,
+ * a map, a segment, a store or a shadow file always use them. A
+ * file cannot have both a log and a shadow file.
+ *
+ * If seg is not NULL, the file is created with the n_seg key schema 
+ * segments, or it must already have the same ones. A file that has 
+ * a key schema always uses it, and cmp is not used. Otherwise cmp 
+ * must not be NULL if the file has keys.
+ */
+static AVL_FILE *
+avl_file_open_mode (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp,
+                    AVL_FILE_SEG *seg, int32_t n_seg, int32_t mode)
+{
+   int32_t fd, sh[2];
+
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;
+      int32_t reclen;
+      uint32_t gen;
+      int64_t n_avl;
+      int64_t nextnum;
+      off_t root[n_keys];
+      off_t head_seq;
+      off_t head_empty;
+      off_t head_cpr; 
+   } hdr;
+   struct iovec iov[3];
+
+
+   unsetenv (AVL_FILE_EMSG_VNAME);
+   if ((seg != NULL) && (avl_file_svalid (seg, n_seg, n_keys, len) != 0)) {
+      setenv (AVL_FILE_EMSG_VNAME, "200 invalid key schema", 1);
+      return (NULL);
+   }
+   fd = open (fname, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+   if (fd < 0) {
+      setenv (AVL_FILE_EMSG_VNAME, "20 open failed", 1);
+      return (NULL);
+   }
+   avl_file_plock (fd, F_WRLCK, 0, 1);
+
+  /*
+   * A key schema is kept after the header, with the length of the 
+   * key prefixes in each record, and the records start after it. It
+   * is written when the file is created, directly rather than 
+   * through the log, so that its length is known before the log is
+   * replayed.
+   */
+   if ((seg != NULL) && (lseek (fd, 0, SEEK_END) == 0)) {
+      sh[0] = n_seg;
+      sh[1] = avl_file_plen (seg, n_seg);
+      memset (&hdr, 0, sizeof (hdr));
+      memcpy (hdr.magic, AVL_FILE_MAGIC_SCHEMA, 8);
+      hdr.n_keys = n_keys;
+      hdr.len = len;
+      hdr.reclen = avl_file_reclen (n_keys, len + sh[1]);
+      iov[0].iov_base = &hdr; iov[0].iov_len = sizeof (hdr);
+      iov[1].iov_base = sh; iov[1].iov_len = sizeof (sh);
+      iov[2].iov_base = seg; iov[2].iov_len = n_seg * sizeof (AVL_FILE_SEG);
+      if (pwritev (fd, iov, 3, 0) != (ssize_t) (sizeof (hdr) + sizeof (sh) + iov[2].iov_len)) {
+         setenv (AVL_FILE_EMSG_VNAME, "201 write failed", 1);
+         close (fd);
+         return (NULL);
+      }
+   }
+   sh[0] = 0;
+   sh[1] = 0;
+   if ((pread (fd, &hdr, sizeof (hdr), 0) == (ssize_t) sizeof (hdr)) && 
+       (memcmp (hdr.magic, AVL_FILE_MAGIC_SCHEMA, 8) == 0)) {
+      if ((pread (fd, sh, sizeof (sh), sizeof (hdr)) != sizeof (sh)) || (sh[0] <= 0) || (sh[1] < 0)) {
+         setenv (AVL_FILE_EMSG_VNAME, "202 read key schema failed", 1);
+         close (fd);
+         return (NULL);
+      }
+   } else if (seg != NULL) {
+      setenv (AVL_FILE_EMSG_VNAME, "203 the file has no key schema", 1);
+      close (fd);
+      return (NULL);
+   } else if ((cmp == NULL) && (n_keys > 0)) {
+      setenv (AVL_FILE_EMSG_VNAME, "207 no comparison function and no key schema", 1);
+      close (fd);
+      return (NULL);
+   }
+   return (avl_file_open_fd (fd, fname, len, sh[1], n_keys, cmp, seg, n_seg, sh[0], mode));
+}
+
+
+/*------------------------------------------- avl_file_open
+ * Opens an AVL file for reading and writing, using pread() and
+ * pwrite() for access to the records.
+ */
+AVL_FILE *
+#ifdef	AVL_FILE_TSAFE
+avl_file_open_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
+#else
+avl_file_open (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
+#endif
+{
+   return (avl_file_open_mode (fname, len, n_keys, cmp, NULL, 0, 0));
+}
+
+
+/*------------------------------------------- avl_file_open_mmap
+ * Opens an AVL file for reading and writing, with the records
+ * accessed through a shared memory mapping of the file. The tree
+ * searches then read the nodes in place, without system calls or
+ * copying. The mapping is extended as the file grows, and reduced
+ * by avl_file_squash().
+ */
+AVL_FILE *
+#ifdef	AVL_FILE_TSAFE
+avl_file_open_mmap_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
+#else
+avl_file_open_mmap (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
+#endif
+{
+   return (avl_file_open_mode (fname, len, n_keys, cmp, NULL, 0, AVL_FILE_MMAP));
+}
+
+
+/*------------------------------------------- avl_file_open_wal
+ * Opens an AVL file for reading and writing, creating the write-ahead
+ * log (fname with "-wal" added) if it does not exist. The records 
+ * written by each update are appended to the log, which is synced
+ * before the update returns, and they are copied into the file at
+ * checkpoints. After a crash, the complete updates in the log are
+ * copied into the file by the next avl_file_open(). Every open of
+ * the file uses the log from then on, so all processes must open
+ * the file after the log has been created.
+ */
+AVL_FILE *
+#ifdef	AVL_FILE_TSAFE
+avl_file_open_wal_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
+#else
+avl_file_open_wal (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
+#endif
+{
+   return (avl_file_open_mode (fname, len, n_keys, cmp, NULL, 0, AVL_FILE_WAL));
+}
+
+
+/*------------------------------------------- avl_file_open_free
+ * Opens an AVL file for reading and writing, creating the free-space
+ * map (fname with "-free" added) if it does not exist. Empty records 
+ * are then found with the map instead of the empty list in the file,
+ * so inserting a record does not read an empty record first, and with
+ * avl_file_free_policy() they can be chosen near the new record's
+ * place in the tree. Every open of the file uses the map from then 
+ * on. The map is made again from the file if it does not match it,
+ * as after a crash, or after the file was changed by a program that
+ * did not use the map. The file must have at least one key.
+ */
+AVL_FILE *
+#ifdef	AVL_FILE_TSAFE
+avl_file_open_free_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
+#else
+avl_file_open_free (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
+#endif
+{
+   return (avl_file_open_mode (fname, len, n_keys, cmp, NULL, 0, AVL_FILE_FREE));
+}
+
+
+/*------------------------------------------- avl_file_open_schema
+ * Opens an AVL file for reading and writing, creating it with the
+ * key schema seg if it does not exist. The schema has n_seg 
+ * segments, each a field of the record and its type, given in order 
+ * for key 0, then key 1, etc. Records are compared by the first 
+ * segment of a key, then by the next if those are equal, and so on,
+ * without calling a comparison function. The schema is stored in 
+ * the file, and must be the same when the file is opened again, 
+ * though the file can also be opened by the other avl_file_open 
+ * functions, which then use its schema, with cmp NULL.
+ */
+AVL_FILE *
+#ifdef	AVL_FILE_TSAFE
+avl_file_open_schema_t (char *fname, int32_t len, int32_t n_keys, AVL_FILE_SEG *seg, int32_t n_seg)
+#else
+avl_file_open_schema (char *fname, int32_t len, int32_t n_keys, AVL_FILE_SEG *seg, int32_t n_seg)
+#endif
+{
+   return (avl_file_open_mode (fname, len, n_keys, NULL, seg, n_seg, 0));
+}
+
+
+/*------------------------------------------- avl_file_open_shm
+ * Opens an AVL file for reading and writing, creating the shared lock
+ * segment (fname with "-shm" added) if it does not exist. The segment
+ * is mapped by every process that has the file open, and the 
+ * functions lock it, instead of byte 0 of the file with fcntl(), so
+ * that a lock that is free, as for readers, takes no system calls. It
+ * also keeps the header and the file length after an update, so 
+ * they are not read from the file again. A process that stops while
+ * it holds the lock is found by the others, and if it was updating
+ * the file, the header is read from the file again. Every open of 
+ * the file uses the segment from then on, so all processes must open
+ * the file after it has been created. Only on Linux.
+ */
+AVL_FILE *
+#ifdef	AVL_FILE_TSAFE
+avl_file_open_shm_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
+#else
+avl_file_open_shm (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
+#endif
+{
+   return (avl_file_open_mode (fname, len, n_keys, cmp, NULL, 0, AVL_FILE_SHM));
+}
+
+
+/*------------------------------------------- avl_file_open_snap
+ * Opens an AVL file for reading and writing, creating the version 
+ * store (fname with "-snap" added) if it does not exist, so that the
+ * file can have snapshots, see avl_file_snapshot_begin(). Every open
+ * of the file uses the store from then on, so all processes must 
+ * open the file after it has been created.
+ */
+AVL_FILE *
+#ifdef	AVL_FILE_TSAFE
+avl_file_open_snap_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
+#else
+avl_file_open_snap (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
+#endif
+{
+   return (avl_file_open_mode (fname, len, n_keys, cmp, NULL, 0, AVL_FILE_SNAP));
+}
+
+
+/*------------------------------------------- avl_file_open_shadow
+ * Opens an AVL file for reading and writing, creating the shadow file
+ * (fname with "-shadow" added) if it does not exist. Each update is
+ * committed as a whole with one fdatasync() of the shadow file, and
+ * then written into the file, so that a crash leaves the file as it
+ * was before or after the update. Every open of the file uses the
+ * shadow file from then on.
+ */
+AVL_FILE *
+#ifdef	AVL_FILE_TSAFE
+avl_file_open_shadow_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
+#else
+avl_file_open_shadow (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
+#endif
+{
+   return (avl_file_open_mode (fname, len, n_keys, cmp, NULL, 0, AVL_FILE_SHADOW));
+}
+
+
+//------------------------------------------- avl_file_close
+void 
+#ifdef	AVL_FILE_TSAFE
+avl_file_close_t (AVL_FILE *avl_fp) 
+#else
+avl_file_close (AVL_FILE *avl_fp) 
+#endif
+{
+   int32_t fd, reclen, i;
+
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys;
+      int32_t len;        // AVL record data length
+      int32_t reclen;     // AVL record length including key nodes
+      uint32_t gen;       // generation, changed by every update
+      int64_t n_avl;      // number of AVL records 
+      int64_t nextnum;    // unique record numbers 
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;     // doubly linked
+      off_t head_empty;   // singly linked
+      off_t head_cpr;     // singly linked
+   } hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;   // prev used as sequential pointer in 'cpr' records
+      char b[avl_fp->len];
+   } cpr, spr;
+   off_t cp, sp, lim;
+
+
+   reclen = avl_fp->reclen;
+   fd = avl_fp->fd;
+
+#ifdef AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   if (avl_fp->txn) avl_file_tabort (avl_fp);
+   if (avl_fp->shm != NULL) avl_file_plock (fd, F_WRLCK, 0, 1);	// one open or close at a time
+   lim = avl_file_lbegin (avl_fp, F_WRLCK);
+
+   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+   cp = avl_fp->cpr;
+   avl_file_cread (avl_fp, &lim, cp, &cpr, reclen);
+
+   avl_file_plock (fd, F_UNLCK, cp, reclen);
+
+   if (hdr.head_cpr == cp) {
+      hdr.head_cpr = cpr.next;
+   } else {
+      for (sp = hdr.head_cpr; sp > 0; sp = spr.next) {
+         avl_file_cread (avl_fp, &lim, sp, &spr, reclen);
+         if (spr.next == cp) {
+            spr.next = cpr.next;
+            avl_file_cwrite (avl_fp, &lim, sp, &spr, reclen);
+            break;
+         }
+      }
+   }
+   for (i = 0; i < avl_fp->n_keys; i++) {
+      cpr.n[i].b = 0x40; cpr.n[i].l = 0; cpr.n[i].r = 0;
+   }
+   avl_file_efree (avl_fp, &lim, &hdr.head_empty, cp, &cpr.next);
+
+   avl_file_cwrite (avl_fp, &lim, cp, &cpr, reclen);
+   avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+
+   if (avl_file_wlog (avl_fp)) avl_fp->wal->ckpt = 1;	// leave the log empty
+   avl_file_lend (avl_fp, &lim);
+   if (avl_fp->map != NULL) munmap (avl_fp->map, avl_fp->map_len);
+   avl_file_cache_free (avl_fp);
+   avl_file_wfree (avl_fp);
+   avl_file_ffree (avl_fp);
+   avl_file_vfree (avl_fp);
+   avl_file_sfree (avl_fp);
+   close (fd);
+#ifdef AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+   pthread_rwlock_destroy (&avl_fp->rwl);
+   pthread_mutex_destroy (&avl_fp->tmu);
+   pthread_mutex_destroy (&avl_fp->cmu);
+#endif
+   free (avl_fp->seg);
+   free (avl_fp->kseg);
+   free (avl_fp->kpfx);
+   free (avl_fp->hdr);
+   free (avl_fp->fname);
+   free (avl_fp);
+}
+
+
+/*------------------------------------------- avl_file_getnum
+ * Return a unique (sequential) record number. (Not the same as a
+ * file array index, however, because records can be deleted,
+ * for example.)
+ */
+int64_t 
+#ifdef	AVL_FILE_TSAFE
+avl_file_getnum_t (AVL_FILE *avl_fp) 
+#else
+avl_file_getnum (AVL_FILE *avl_fp) 
+#endif
+{
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;        // AVL record data length
+      int32_t reclen;     // AVL record length including key nodes
+      uint32_t gen;       // generation, changed by every update
+      int64_t n_avl;      // number of AVL records 
+      int64_t nextnum;    // unique record numbers 
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;     // doubly linked
+      off_t head_empty;   // singly linked
+      off_t head_cpr;     // singly linked
+   } hdr;
+   off_t lim;
+
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_WRLCK);
+
+   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+   hdr.nextnum++;
+   avl_file_fwrite (avl_fp, &lim, offsetof (struct hdr_struct, nextnum), &hdr.nextnum, sizeof (hdr.nextnum));
+   memcpy (avl_fp->hdr, &hdr, sizeof (hdr));
+   if ((avl_fp->shm != NULL) && !avl_file_wlog (avl_fp)) avl_file_sput (avl_fp, lim);
+
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (hdr.nextnum);
+}
+
+
+
+/*------------------------------------------- avl_file_startseq
+ * Initialize the sequential-access file pointer.
+ */
+void 
+#ifdef AVL_FILE_TSAFE
+avl_file_startseq_t (AVL_FILE *avl_fp) 
+#else
+avl_file_startseq (AVL_FILE *avl_fp) 
+#endif
+{
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;        // AVL record data length
+      int32_t reclen;     // AVL record length including key nodes
+      uint32_t gen;       // generation, changed by every update
+      int64_t n_avl;      // number of AVL records 
+      int64_t nextnum;    // unique record numbers 
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;     // doubly linked
+      off_t head_empty;   // singly linked
+      off_t head_cpr;     // singly linked
+   } hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;   // prev used as sequential pointer in 'cpr' records
+      char b[avl_fp->len];
+   } cpr;
+   off_t cp, lim;
+
+
+   cp = avl_fp->cpr;
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_RDLCK);
+
+   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+
+   avl_file_cread (avl_fp, &lim, cp, &cpr, avl_fp->nodelen);
+   cpr.prev = hdr.head_seq;
+   avl_file_cwrite (avl_fp, &lim, cp, &cpr, avl_fp->nodelen);
+
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+}
+
+
+
+/*------------------------------------------- avl_file_readseq
+ * Read the next sequential (unordered) file record, writing it
+ * into the data buffer.
+ * The return value is 0 for OK, or -1 for none.
+ */
+int32_t 
+#ifdef	AVL_FILE_TSAFE
+avl_file_readseq_t (AVL_FILE *avl_fp, void *data) 
+#else
+avl_file_readseq (AVL_FILE *avl_fp, void *data) 
+#endif
+{
+   int32_t reclen, ret;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } cpr, ar;
+   off_t cp, lim;
+
+
+   reclen = avl_fp->reclen;
+   cp = avl_fp->cpr;
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_RDLCK);
+
+   avl_file_cread (avl_fp, &lim, cp, &cpr, avl_fp->nodelen);
+
+   if (cpr.prev == 0) {
+      ret = -1;
+   } else {
+      avl_file_lread (avl_fp, &lim, cpr.prev, &ar, reclen);
+      memcpy (data, ar.b + avl_fp->uoff, avl_fp->ulen);
+
+      cpr.prev = ar.next;
+      avl_file_cwrite (avl_fp, &lim, cp, &cpr, avl_fp->nodelen);
+      ret = 0;
+   }
+
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
+
+
+/* ----------------------------------------------- avl_file_itree
+ * Insert the record at y, which has the data, into the tree for key k.
+ * The header hp is updated but not written.
+ *
+ * (The internal format uses node elements .l and .r for left and 
+ * right pointers, and negative values for previous and next threaded
+ * retrieval. Also .b is the node balance.) This is taken mostly 
+ * from "Fundamentals of Data Structures in Pascal" by Horowitz &
+ * Sahni.
+ */
+static void
+avl_file_itree (AVL_FILE *avl_fp, off_t *lim, void *hp, off_t y, void *data, int32_t k)
+{
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;
+      int32_t reclen;
+      uint32_t gen;
+      int64_t n_avl;
+      int64_t nextnum;
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;
+      off_t head_empty;
+      off_t head_cpr; 
+   } *hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } yr, ar, br, cr, fr, pr, qr, par[128];
+   off_t a, b, c, f, p, q, wp[3], pa[128];
+   int64_t n;
+   int32_t d, l, m, unbalanced;
+   char left[128];
+   void *wr[128];
+
+
+   hdr = hp;
+   avl_file_nread (avl_fp, lim, y, &yr);
+   avl_file_pset (avl_fp, yr.b, data);
+
+  /*
+   * The way taken at each record on the path is kept, so that the 
+   * records need to be compared only once. With key prefixes only
+   * their nodes are read, and the whole record only when the 
+   * prefixes are the same.
+   */
+   a = hdr->root[k];
+   if (a > 0) {
+      avl_file_nread (avl_fp, lim, a, &ar);
+      f = 0; p = a; q = 0; l = 0; m = 0;
+      while (p > 0) {
+         avl_file_kread (avl_fp, lim, p, &pr, k);
+         left[l] = (avl_file_dcmp (avl_fp, lim, k, yr.b, p, pr.b) < 0);
+         pr.n[k].c++;
+         if (pr.n[k].b != 0) {
+            a = p; ar = pr; f = q; fr = qr; m = l;
+         }
+         pa[l] = p; par[l] = pr; l++;
+         if (left[l-1]) {
+            q = p; qr = pr; p = pr.n[k].l;
+         } else {
+            q = p; qr = pr; p = pr.n[k].r;
+         }
+      }
+      if (left[l-1]) {
+         yr.n[k].b = 0; yr.n[k].l = p; yr.n[k].r = -q; yr.n[k].c = 1;
+         qr.n[k].l = y;
+      } else {
+         yr.n[k].b = 0; yr.n[k].l = -q; yr.n[k].r = p; yr.n[k].c = 1;
+         qr.n[k].r = y;
+      }
+      avl_file_lwrite (avl_fp, lim, y, &yr, avl_fp->nodelen);
+      avl_file_lwrite (avl_fp, lim, q, &qr, avl_fp->nodelen);
+
+     /*
+      * Of the records on the path, with their subtree counts now one
+      * more, only those above a are not written again below.
+      */
+      if (m > 0) {
+         for (l = 0; l < m; l++) wr[l] = &par[l];
+         avl_file_lwritev (avl_fp, lim, m, pa, wr, avl_fp->nodelen);
+      }
+
+      avl_file_nread (avl_fp, lim, a, &ar);
+      if (a != q) ar.n[k].c++;
+      if (left[m]) {
+         p = ar.n[k].l; b = p; d = +1;
+      } else {
+         p = ar.n[k].r; b = p; d = -1;
+      }
+      while (p != y) {
+         avl_file_nread (avl_fp, lim, p, &pr);
+         if (p != q) pr.n[k].c++;
+         if (left[++m]) {
+            pr.n[k].b = +1;
+            avl_file_lwrite (avl_fp, lim, p, &pr, avl_fp->nodelen);
+            p = pr.n[k].l;
+         } else {
+            pr.n[k].b = -1;
+            avl_file_lwrite (avl_fp, lim, p, &pr, avl_fp->nodelen);
+            p = pr.n[k].r;
+         }
+      }
+      unbalanced = 1;
+      if (ar.n[k].b == 0) {
+         ar.n[k].b = d; unbalanced = 0;
+         avl_file_lwrite (avl_fp, lim, a, &ar, avl_fp->nodelen);
+      }
+      if ((ar.n[k].b + d) == 0) {
+         ar.n[k].b = 0; unbalanced = 0;
+         avl_file_lwrite (avl_fp, lim, a, &ar, avl_fp->nodelen);
+      }
+      if (unbalanced == 1) {
+         if (d == +1) {
+            avl_file_nread (avl_fp, lim, b, &br);
+            if (br.n[k].b == +1) {
+               n = ar.n[k].c;
+               ar.n[k].c -= br.n[k].c - avl_file_ncount (avl_fp, lim, br.n[k].r, k);
+               br.n[k].c = n;
+               if (br.n[k].r > 0) 
+                  ar.n[k].l = br.n[k].r;
+               else
+                  ar.n[k].l = -b;
+               br.n[k].r = a; ar.n[k].b = 0; br.n[k].b = 0;
+               wp[0] = a; wr[0] = &ar; wp[1] = b; wr[1] = &br;
+               avl_file_lwritev (avl_fp, lim, 2, wp, wr, avl_fp->nodelen);
+            } else {
+               c = br.n[k].r;
+               avl_file_nread (avl_fp, lim, c, &cr);
+               n = avl_file_ncount (avl_fp, lim, cr.n[k].l, k);
+               ar.n[k].c -= br.n[k].c - (cr.n[k].c - 1 - n);
+               br.n[k].c -= cr.n[k].c - n;
+               cr.n[k].c = ar.n[k].c + br.n[k].c + 1;
+               if (cr.n[k].l > 0) 
+                  br.n[k].r = cr.n[k].l;
+               else
+                  br.n[k].r = -c;
+               if (cr.n[k].r > 0) 
+                  ar.n[k].l = cr.n[k].r;
+               else
+                  ar.n[k].l = -c;
+               cr.n[k].l = b;
+               cr.n[k].r = a;
+               switch (cr.n[k].b) {
+               case +1:
+                  ar.n[k].b = -1; br.n[k].b = 0; break;
+               case -1:
+                  br.n[k].b = +1; ar.n[k].b = 0; break;
+               case 0:
+                  br.n[k].b =  0; ar.n[k].b = 0; break;
+               default:
+                  setenv (AVL_FILE_EMSG_VNAME, "32 invalid value n.b", 1);
+                  break;
+               }
+               cr.n[k].b = 0;
+               wp[0] = a; wr[0] = &ar; wp[1] = b; wr[1] = &br; wp[2] = c; wr[2] = &cr;
+               avl_file_lwritev (avl_fp, lim, 3, wp, wr, avl_fp->nodelen);
+               b = c;
+            }
+         } else {
+            avl_file_nread (avl_fp, lim, b, &br);
+            if (br.n[k].b == -1) {
+               n = ar.n[k].c;
+               ar.n[k].c -= br.n[k].c - avl_file_ncount (avl_fp, lim, br.n[k].l, k);
+               br.n[k].c = n;
+               if (br.n[k].l > 0) 
+                  ar.n[k].r = br.n[k].l;
+               else
+                  ar.n[k].r = -b;
+               br.n[k].l = a; ar.n[k].b = 0; br.n[k].b = 0;
+               wp[0] = a; wr[0] = &ar; wp[1] = b; wr[1] = &br;
+               avl_file_lwritev (avl_fp, lim, 2, wp, wr, avl_fp->nodelen);
+            } else {
+               c = br.n[k].l;
+               avl_file_nread (avl_fp, lim, c, &cr);
+               n = avl_file_ncount (avl_fp, lim, cr.n[k].r, k);
+               ar.n[k].c -= br.n[k].c - (cr.n[k].c - 1 - n);
+               br.n[k].c -= cr.n[k].c - n;
+               cr.n[k].c = ar.n[k].c + br.n[k].c + 1;
+               if (cr.n[k].l > 0) 
+                  ar.n[k].r = cr.n[k].l;
+               else
+                  ar.n[k].r = -c;
+               if (cr.n[k].r > 0) 
+                  br.n[k].l = cr.n[k].r;
+               else
+                  br.n[k].l = -c;
+               cr.n[k].r = b;
+               cr.n[k].l = a;
+               switch (cr.n[k].b) {
+               case +1: 
+                  br.n[k].b = -1; ar.n[k].b = 0; break;
+               case -1:
+                  ar.n[k].b = +1; br.n[k].b = 0; break;
+               case 0:
+                  br.n[k].b =  0; ar.n[k].b = 0; break;
+               default:
+                  setenv (AVL_FILE_EMSG_VNAME, "33 invalid value n.b", 1);
+                  break;
+               }
+               cr.n[k].b = 0;
+               wp[0] = a; wr[0] = &ar; wp[1] = b; wr[1] = &br; wp[2] = c; wr[2] = &cr;
+               avl_file_lwritev (avl_fp, lim, 3, wp, wr, avl_fp->nodelen);
+               b = c;
+            }
+         }
+         if (f == 0) {
+            hdr->root[k] = b;
+         } else {
+            if (a == fr.n[k].l) {
+               fr.n[k].l = b;
+            } else if (a == fr.n[k].r) {
+               fr.n[k].r = b;
+            }
+            avl_file_lwrite (avl_fp, lim, f, &fr, avl_fp->nodelen);
+         }
+      }
+   } else {
+      yr.n[k].b = 0; yr.n[k].l = 0; yr.n[k].r = 0; yr.n[k].c = 1;
+      hdr->root[k] = y;
+      avl_file_lwrite (avl_fp, lim, y, &yr, avl_fp->nodelen);
+   }
+}
+
+
+/* ----------------------------------------------- avl_file_iparent
+ * Return the position of the record that a new record with the data
+ * would be put under in the tree for key 0, or 0 if the tree is empty.
+ */
+static off_t
+avl_file_iparent (AVL_FILE *avl_fp, off_t *lim, off_t root, void *data)
+{
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } ar, *arp;
+   char b[avl_fp->len];
+   off_t a, c;
+
+
+   avl_file_pset (avl_fp, b, data);
+   for (a = root; a > 0; a = c) {
+      arp = avl_file_kref (avl_fp, lim, a, &ar, 0);
+      if (avl_file_dcmp (avl_fp, lim, 0, b, a, arp->b) <= 0)
+         c = arp->n[0].l;
+      else
+         c = arp->n[0].r;
+      if (c <= 0) break;
+   }
+   return (a);
+}
+
+
+/* ----------------------------------------------- avl_file_ialloc
+ * Write a new record with the data into the file, using an empty 
+ * record if there is one (near its place in the tree, with the 
+ * AVL_FILE_FREE_NEAR policy), and add it to the sequential list. The
+ * header hp is updated but not written.
+ * Returns the record position, or 0 for failure.
+ */
+static off_t
+avl_file_ialloc (AVL_FILE *avl_fp, off_t *lim, void *hp, void *data)
+{
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;
+      int32_t reclen;
+      uint32_t gen;
+      int64_t n_avl;
+      int64_t nextnum;
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;
+      off_t head_empty;
+      off_t head_cpr; 
+   } *hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } yr, pr;
+   off_t y, p;
+
+
+   hdr = hp;
+   if ((hdr->n_avl + 1) < 0) {
+      setenv (AVL_FILE_EMSG_VNAME, "30 n_avl limit reached", 1);
+      return (0);
+   }
+
+   p = 0;
+   if ((avl_fp->fmap != NULL) && (avl_fp->fmap->policy == AVL_FILE_FREE_NEAR))
+      p = avl_file_iparent (avl_fp, lim, hdr->root[0], data);
+   y = avl_file_ealloc (avl_fp, lim, &hdr->head_empty, p);
+   if (y == 0) {
+      y = *lim;
+      if (y < 0) {
+         setenv (AVL_FILE_EMSG_VNAME, "31 lseek failed", 1);
+         return (0);
+      }
+   }
+   yr.prev = 0;
+   yr.next = hdr->head_seq;
+   if (yr.next > 0) {
+      p = yr.next;
+      avl_file_nread (avl_fp, lim, p, &pr);
+      pr.prev = y;
+      avl_file_lwrite (avl_fp, lim, p, &pr, avl_fp->nodelen);
+   }
+   hdr->head_seq = y;
+
+   avl_file_pset (avl_fp, yr.b, data);
+   avl_file_lwrite (avl_fp, lim, y, &yr, avl_fp->reclen);
+
+   hdr->n_avl++;
+   return (y);
+}
+
+
+/* ----------------------------------------------- avl_file_insert
+ * Insert a new record, pointed to by the data parameter, into 
+ * the AVL file. It returns 0 for success, or -1 for failure.
+ */
+int32_t 
+#ifdef	AVL_FILE_TSAFE
+avl_file_insert_t (AVL_FILE *avl_fp, void *data) 
+#else
+avl_file_insert (AVL_FILE *avl_fp, void *data) 
+#endif
+{
+   int32_t k, ret;
+
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;
+      int32_t reclen;
+      uint32_t gen;
+      int64_t n_avl;
+      int64_t nextnum;
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;
+      off_t head_empty;
+      off_t head_cpr; 
+   } hdr;
+   off_t y, lim;
+
+
+   ret = 0;
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_WRLCK);
+
+   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+
+   y = avl_file_ialloc (avl_fp, &lim, &hdr, data);
+   if (y == 0) {
+      ret = -1;
+   } else {
+      for (k = 0; k < avl_fp->n_keys; k++) avl_file_itree (avl_fp, &lim, &hdr, y, data, k);
+      avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+   }
+
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
+  
+
+
+/*
+ * The current-pointer records of a file, read once by
+ * avl_file_delete_range() for all of the records it deletes, rather
+ * than once for each of them. A record is written back at the end
+ * if it was updated.
+ */
+struct avl_file_dcpr_struct {
+   int32_t n;
+   off_t *pos;
+   char *r;		// n records of nodelen bytes
+   char *updated;
+};
+
+
+/* ----------------------------------------------- avl_file_dadvance
+ * Advance the current-pointer record at cp past the record y, which
+ * is being deleted. The record y is at yp, and up has the previous
+ * (.l) and next (.r) records of y for each key. The return value is
+ * 1 if the current-pointer record was changed, or 0.
+ */
+static int32_t
+avl_file_dadvance (AVL_FILE *avl_fp, void *cp, off_t y, void *yp, void *up)
+{
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } *cpr, *yr, *ur;
+   int32_t k, updated;
+
+
+   cpr = cp; yr = yp; ur = up;
+   updated = 0;
+
+   if (cpr->prev == y) {
+      cpr->prev = yr->next;
+      updated = 1;
+   }
+
+   for (k = 0; k < avl_fp->n_keys; k++) {
+      if (cpr->n[k].l == y) {
+         cpr->n[k].l = ur->n[k].l;
+         updated = 1;
+      }
+      if (cpr->n[k].r == y) {
+         cpr->n[k].r = ur->n[k].r;
+         updated = 1;
+      }
+   }
+   return (updated);
+}
+
+
+/* ----------------------------------------------- avl_file_dremove
+ * Remove the record at y, which is at yp, from the trees and the
+ * sequential list, and add it to the empty list. The current-pointer
+ * records are updated in the file, or in dc if it is not NULL.
+ * The header hp is updated but not written.
+ */
+static void
+avl_file_dremove (AVL_FILE *avl_fp, off_t *lim, void *hp, off_t y, void *yp, struct avl_file_dcpr_struct *dc)
+{
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;
+      int32_t reclen;
+      uint32_t gen;
+      int64_t n_avl;
+      int64_t nextnum;
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;
+      off_t head_empty;
+      off_t head_cpr; 
+   } *hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } yr, ar, br, cr, cpr, spr, ur, par[128], *sprp;
+   off_t a, b, c, cp, sp, pa[128], wp[3];
+   int64_t n;
+   int32_t i, k, l, m, reclen, stack[128];
+   void *wr[3], *pr[128];
+
+
+   hdr = hp;
+   reclen = avl_fp->reclen;
+   memcpy (&yr, yp, reclen);
+
+  /*
+   * Find y's previous and next records for each key.
+   */
+   for (k = 0; k < avl_fp->n_keys; k++) {
+      sp = yr.n[k].l;
+      if (sp > 0) {
+         sprp = avl_file_lref (avl_fp, lim, sp, &spr, reclen);
+         while (sprp->n[k].r > 0) {
+            sp = sprp->n[k].r;
+            sprp = avl_file_lref (avl_fp, lim, sp, &spr, reclen);
+         }
+      } else {
+         sp = -yr.n[k].l;
+      }
+      ur.n[k].l = sp;
+
+      sp = yr.n[k].r;
+      if (sp > 0) {
+         sprp = avl_file_lref (avl_fp, lim, sp, &spr, reclen);
+         while (sprp->n[k].l > 0) {
+            sp = sprp->n[k].l;
+            sprp = avl_file_lref (avl_fp, lim, sp, &spr, reclen);
+         }
+      } else {
+         sp = -yr.n[k].r;
+      }
+      ur.n[k].r = sp;
+   }
+
+  /*
+   * Advance all current pointers that point to this record.
+   */
+   if (dc == NULL) {
+      cp = hdr->head_cpr;
+      while (cp > 0) {
+         avl_file_cread (avl_fp, lim, cp, &cpr, avl_fp->nodelen);
+         if (avl_file_dadvance (avl_fp, &cpr, y, &yr, &ur) != 0)
+            avl_file_cwrite (avl_fp, lim, cp, &cpr, avl_fp->nodelen);
+         cp = cpr.next;
+      }
+   } else {
+      for (i = 0; i < dc->n; i++) 
+         dc->updated[i] |= avl_file_dadvance (avl_fp, dc->r + i * avl_fp->nodelen, y, &yr, &ur);
+   }
+
+
+  /*
+   * Remove it from the tree. Only pointers change, not
+   * the positions of records in the file.
+   */
+   for (k = 0; k < avl_fp->n_keys; k++) {
+     /*
+      * Make a path to y. Duplicate keys require some searching.
+      */
+      l = 0; m = 0;
+      pa[l] = hdr->root[k];
+afd_findloop1:
+      if (pa[l] > 0) {
+         avl_file_kread (avl_fp, lim, pa[l], &par[l], k);
+
+         i = avl_file_dcmp (avl_fp, lim, k, yr.b, pa[l], par[l].b);
+         if (i <= 0) {
+            if (i == 0) stack[m++] = l;
+
+            pa[l+1] = par[l].n[k].l; l++; 
+            goto afd_findloop1;
+         }
+afd_findloop2:
+         pa[l+1] = par[l].n[k].r; l++;
+         goto afd_findloop1;
+      }
+      if (m > 0) {
+         l = stack[--m];
+         if (pa[l] != y) goto afd_findloop2;         
+      } else {
+         setenv (AVL_FILE_EMSG_VNAME, "40 not in the tree", 1);
+         continue;
+      }
+      m = l;
+      for (i = 0; i < m; i++) par[i].n[k].c--;
+
+     /*
+      * Remove and replace.
+      */
+      if (par[l].n[k].l > 0) {
+         pa[l+1] = par[l].n[k].l; l++;
+         avl_file_nread (avl_fp, lim, pa[l], &par[l]);
+
+         if (par[l].n[k].r > 0) {
+            while (par[l].n[k].r > 0) {
+               pa[l+1] = par[l].n[k].r; l++;
+               avl_file_nread (avl_fp, lim, pa[l], &par[l]);
+            }
+            for (i = m + 1; i < l; i++) par[i].n[k].c--;
+
+            if (par[l].n[k].l > 0) {
+               par[l-1].n[k].r = par[l].n[k].l;
+            } else {
                par[l-1].n[k].r = -pa[l];
             }
-            par[l-1].n[k].b += 1;
-            avl_file_lwrite (avl_fp, &lim, pa[l-1], &par[l-1], reclen);
-         } else {
-            yr.n[k].l = par[l].n[k].l;
-            yr.n[k].b -= 1;
+            par[l-1].n[k].b += 1;
+            avl_file_lwrite (avl_fp, lim, pa[l-1], &par[l-1], avl_fp->nodelen);
+         } else {
+            yr.n[k].l = par[l].n[k].l;
+            yr.n[k].b -= 1;
+         }
+
+         pa[m] = pa[l]; par[m] = par[l]; l--;
+         yr.n[k].c--;
+         par[m].n[k] = yr.n[k];
+         avl_file_lwrite (avl_fp, lim, pa[m], &par[m], avl_fp->nodelen);
+
+         if (yr.n[k].r > 0) {
+            sp = ur.n[k].r;
+            avl_file_nread (avl_fp, lim, sp, &spr);
+            spr.n[k].l = -pa[m];
+            avl_file_lwrite (avl_fp, lim, sp, &spr, avl_fp->nodelen);
+         }
+
+         if (m == 0) {
+            hdr->root[k] = pa[m];
+         } else {
+            if (par[m-1].n[k].l == y) 
+               par[m-1].n[k].l = pa[m];
+            else
+               par[m-1].n[k].r = pa[m];
+            avl_file_lwrite (avl_fp, lim, pa[m-1], &par[m-1], avl_fp->nodelen);
+         }
+
+      } else if (par[l].n[k].r > 0) {
+         pa[l+1] = par[l].n[k].r; l++;
+         avl_file_nread (avl_fp, lim, pa[l], &par[l]);
+
+         if (par[l].n[k].l > 0) {
+            while (par[l].n[k].l > 0) {
+               pa[l+1] = par[l].n[k].l; l++;
+               avl_file_nread (avl_fp, lim, pa[l], &par[l]);
+            }
+            for (i = m + 1; i < l; i++) par[i].n[k].c--;
+
+            if (par[l].n[k].r > 0) {
+               par[l-1].n[k].l = par[l].n[k].r;
+            } else {
+               par[l-1].n[k].l = -pa[l];
+            }
+            par[l-1].n[k].b -= 1;
+            avl_file_lwrite (avl_fp, lim, pa[l-1], &par[l-1], avl_fp->nodelen);
+         } else {
+            yr.n[k].r = par[l].n[k].r;
+            yr.n[k].b += 1;
+         }
+
+         pa[m] = pa[l]; par[m] = par[l]; l--;
+         yr.n[k].c--;
+         par[m].n[k] = yr.n[k];
+         avl_file_lwrite (avl_fp, lim, pa[m], &par[m], avl_fp->nodelen);
+
+         if (yr.n[k].l > 0) {
+            sp = ur.n[k].l;
+            avl_file_nread (avl_fp, lim, sp, &spr);
+            spr.n[k].r = -pa[m];
+            avl_file_lwrite (avl_fp, lim, sp, &spr, avl_fp->nodelen);
+         }
+
+         if (m == 0) {
+            hdr->root[k] = pa[m];
+         } else {
+            if (par[m-1].n[k].l == y)
+               par[m-1].n[k].l = pa[m]; 
+            else
+               par[m-1].n[k].r = pa[m]; 
+            avl_file_lwrite (avl_fp, lim, pa[m-1], &par[m-1], avl_fp->nodelen);
+         }
+
+      } else {              // no sub-trees
+         if (m == 0) {
+            hdr->root[k] = 0;
+         } else {
+            if (par[m-1].n[k].l == y) {
+               par[m-1].n[k].l = yr.n[k].l; 
+               par[m-1].n[k].b -= 1;
+            } else if (par[m-1].n[k].r == y) {
+               par[m-1].n[k].r = yr.n[k].r; 
+               par[m-1].n[k].b += 1;
+            }
+            avl_file_lwrite (avl_fp, lim, pa[m-1], &par[m-1], avl_fp->nodelen);
+         }
+         l--;
+      }
+
+     /*
+      * Re-balance.
+      */
+      while (l >= 0) {
+         a = pa[l]; ar = par[l];
+
+        /*
+         * 
+         */
+         if ((ar.n[k].b == +1) || (ar.n[k].b == -1)) break;
+
+         if (ar.n[k].b == 0) {
+            if (l > 0) {
+               if (par[l-1].n[k].l == a) {
+                  par[l-1].n[k].b -= 1;
+               } else if (par[l-1].n[k].r == a) {
+                  par[l-1].n[k].b += 1;
+               }
+               avl_file_lwrite (avl_fp, lim, pa[l-1], &par[l-1], avl_fp->nodelen);
+            }
+            l--;
+            continue;
+         }
+
+        /*
+         * Do a rotation around a. Do not decrement l afterwards.
+         */
+         if (ar.n[k].b == +2) {
+            b = ar.n[k].l;
+            avl_file_nread (avl_fp, lim, b, &br);
+
+            if ((br.n[k].b == 0) || (br.n[k].b == +1)) {
+               n = ar.n[k].c;
+               ar.n[k].c -= br.n[k].c - avl_file_ncount (avl_fp, lim, br.n[k].r, k);
+               br.n[k].c = n;
+               if (br.n[k].r > 0) 
+                  ar.n[k].l = br.n[k].r;
+               else
+                  ar.n[k].l = -b;
+               br.n[k].r = a;
+               if (br.n[k].b == 0) {
+                  ar.n[k].b = +1; br.n[k].b = -1;
+               } else {
+                  ar.n[k].b =  0; br.n[k].b =  0;
+               }
+               wp[0] = a; wr[0] = &ar; wp[1] = b; wr[1] = &br;
+               avl_file_lwritev (avl_fp, lim, 2, wp, wr, avl_fp->nodelen);
+
+               pa[l] = b; par[l] = br;
+            } else {
+               c = br.n[k].r;
+               avl_file_nread (avl_fp, lim, c, &cr);
+               n = avl_file_ncount (avl_fp, lim, cr.n[k].l, k);
+               ar.n[k].c -= br.n[k].c - (cr.n[k].c - 1 - n);
+               br.n[k].c -= cr.n[k].c - n;
+               cr.n[k].c = ar.n[k].c + br.n[k].c + 1;
+               if (cr.n[k].l > 0) 
+                  br.n[k].r = cr.n[k].l;
+               else
+                  br.n[k].r = -c;
+               if (cr.n[k].r > 0) 
+                  ar.n[k].l = cr.n[k].r;
+               else
+                  ar.n[k].l = -c;
+               cr.n[k].l = b;
+               cr.n[k].r = a;
+               switch (cr.n[k].b) {
+               case +1:
+                  ar.n[k].b = -1; br.n[k].b = 0; break;
+               case -1:
+                  br.n[k].b = +1; ar.n[k].b = 0; break;
+               case 0:
+                  br.n[k].b =  0; ar.n[k].b = 0; break;
+               default:
+                  setenv (AVL_FILE_EMSG_VNAME, "41 invalid value n.b", 1);
+                  break;
+               }
+               cr.n[k].b = 0;
+               wp[0] = a; wr[0] = &ar; wp[1] = b; wr[1] = &br; wp[2] = c; wr[2] = &cr;
+               avl_file_lwritev (avl_fp, lim, 3, wp, wr, avl_fp->nodelen);
+
+               pa[l] = c; par[l] = cr;
+            }
+         } else if (ar.n[k].b == -2) {
+            b = ar.n[k].r; 
+            avl_file_nread (avl_fp, lim, b, &br);
+
+            if ((br.n[k].b == 0) || (br.n[k].b == -1)) {
+               n = ar.n[k].c;
+               ar.n[k].c -= br.n[k].c - avl_file_ncount (avl_fp, lim, br.n[k].l, k);
+               br.n[k].c = n;
+               if (br.n[k].l > 0) 
+                  ar.n[k].r = br.n[k].l;
+               else
+                  ar.n[k].r = -b;
+               br.n[k].l = a; 
+               if (br.n[k].b == 0) {
+                  ar.n[k].b = -1; br.n[k].b = +1;
+               } else {
+                  ar.n[k].b =  0; br.n[k].b =  0;
+               }
+               wp[0] = a; wr[0] = &ar; wp[1] = b; wr[1] = &br;
+               avl_file_lwritev (avl_fp, lim, 2, wp, wr, avl_fp->nodelen);
+
+               pa[l] = b; par[l] = br;
+            } else {
+               c = br.n[k].l;
+               avl_file_nread (avl_fp, lim, c, &cr);
+               n = avl_file_ncount (avl_fp, lim, cr.n[k].r, k);
+               ar.n[k].c -= br.n[k].c - (cr.n[k].c - 1 - n);
+               br.n[k].c -= cr.n[k].c - n;
+               cr.n[k].c = ar.n[k].c + br.n[k].c + 1;
+               if (cr.n[k].l > 0) 
+                  ar.n[k].r = cr.n[k].l;
+               else
+                  ar.n[k].r = -c;
+               if (cr.n[k].r > 0) 
+                  br.n[k].l = cr.n[k].r;
+               else
+                  br.n[k].l = -c;
+               cr.n[k].r = b;
+               cr.n[k].l = a;
+               switch (cr.n[k].b) {
+               case +1: 
+                  br.n[k].b = -1; ar.n[k].b = 0; break;
+               case -1:
+                  ar.n[k].b = +1; br.n[k].b = 0; break;
+               case 0:
+                  br.n[k].b =  0; ar.n[k].b = 0; break;
+               default:
+                  setenv (AVL_FILE_EMSG_VNAME, "42 invalid value n.b", 1);
+                  break;
+               }
+               cr.n[k].b = 0;
+               wp[0] = a; wr[0] = &ar; wp[1] = b; wr[1] = &br; wp[2] = c; wr[2] = &cr;
+               avl_file_lwritev (avl_fp, lim, 3, wp, wr, avl_fp->nodelen);
+
+               pa[l] = c; par[l] = cr;
+            }
+         } else {
+            setenv (AVL_FILE_EMSG_VNAME, "43 bad balance factor", 1);	// key  k
+            break;
+         }
+
+         if (l == 0) {
+            hdr->root[k] = pa[l];
+         } else {
+            if (par[l-1].n[k].l == a) {
+               par[l-1].n[k].l = pa[l];
+            } else if (par[l-1].n[k].r == a) {
+               par[l-1].n[k].r = pa[l];
+            }
+            avl_file_lwrite (avl_fp, lim, pa[l-1], &par[l-1], avl_fp->nodelen);
+         }
+      } 
+
+     /*
+      * Write the rest of the path, above where the re-balancing
+      * stopped, for the subtree counts.
+      */
+      if (l >= 0) {
+         for (i = 0; i <= l; i++) pr[i] = &par[i];
+         avl_file_lwritev (avl_fp, lim, l + 1, pa, pr, avl_fp->nodelen);
+      }
+   }
+
+
+  /*
+   * Remove y from the sequential list.
+   */
+   if (yr.next > 0) {
+      a = yr.next;
+      avl_file_nread (avl_fp, lim, a, &ar);
+      ar.prev = yr.prev;
+      avl_file_lwrite (avl_fp, lim, a, &ar, avl_fp->nodelen);
+   }
+
+   if (hdr->head_seq == y) {
+      hdr->head_seq = yr.next;
+   } else {
+      a = yr.prev;
+      avl_file_nread (avl_fp, lim, a, &ar);
+      ar.next = yr.next;
+      avl_file_lwrite (avl_fp, lim, a, &ar, avl_fp->nodelen);
+   }
+
+
+  /*
+   * Add it to the empty list.
+   */
+   avl_file_efree (avl_fp, lim, &hdr->head_empty, y, &yr.next);
+   yr.prev = 0;
+   for (i = 0; i < avl_fp->n_keys; i++) {
+      yr.n[i].b = 0x40; yr.n[i].l = 0; yr.n[i].r = 0;
+   }
+   avl_file_lwrite (avl_fp, lim, y, &yr, avl_fp->nodelen);
+
+   hdr->n_avl--;
+}
+
+
+/* --------------------------------------------------- avl_file_delete
+ * Delete one record from the file. The entire buffer pointed to by
+ * the data parameter must match exactly the record to be deleted.
+ * (i.e., it should be read first). If the file contains more than
+ * one identical matching record, then the one deleted is arbitrary.
+ *
+ * The return value is 0 for OK, or -1 for none.
+ */
+int32_t 
+#ifdef	AVL_FILE_TSAFE
+avl_file_delete_t (AVL_FILE *avl_fp, void *data) 
+#else
+avl_file_delete (AVL_FILE *avl_fp, void *data) 
+#endif
+{
+   int32_t reclen, len, ret;
+
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;
+      int32_t reclen;
+      uint32_t gen;
+      int64_t n_avl;
+      int64_t nextnum;
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;
+      off_t head_empty;
+      off_t head_cpr; 
+   } hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } yr, ar, par[128], *arp;
+   off_t y, a, pa[128], lim;
+   int32_t i, k, l, m, stack[128];
+
+
+   reclen = avl_fp->reclen;
+   len = avl_fp->len;
+   ret = 0;
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_WRLCK);
+
+   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+
+   avl_file_pset (avl_fp, yr.b, data);
+   y = 0;
+
+  /*
+   * Search for a matching record by key(s), assigning it to 'y'.
+   * This may not find the matching record if there
+   * are duplicate keys.
+   */
+   for (k = 0; k < avl_fp->n_keys; k++) {
+      a = hdr.root[k];
+      while (a > 0) {
+         arp = avl_file_kref (avl_fp, &lim, a, &ar, k);
+         if (avl_file_dcmp (avl_fp, &lim, k, yr.b, a, arp->b) <= 0) {
+            if (arp->n[k].l > 0)
+               a = arp->n[k].l;
+            else
+               break;
+         } else {
+            if (arp->n[k].r > 0)
+               a = arp->n[k].r;
+            else {
+               a = -arp->n[k].r;
+               break;
+            }
+         }
+      }
+      if (a > 0) {
+         avl_file_lread (avl_fp, &lim, a, &ar, reclen);
+         if (avl_file_pcmp (avl_fp, k, yr.b, ar.b) == 0) {
+            if (memcmp (yr.b, ar.b, len) == 0) {
+               y = a; yr = ar;
+               break;
+            }
+         }
+      }
+   }
+
+  /*
+   * Search for the record if not previously found, including
+   * searching sequentially through duplicate keys.
+   */
+   if ((y == 0) && (avl_fp->n_keys > 0)) {
+      k = 0; l = 0; m = 0;
+      pa[l] = hdr.root[k];
+af_delete_loop1:
+      if (pa[l] > 0) {
+         avl_file_lread (avl_fp, &lim, pa[l], &par[l], reclen);
+
+         i = avl_file_pcmp (avl_fp, k, yr.b, par[l].b);
+         if (i <= 0) {
+            if (i == 0) stack[m++] = l;
+
+            pa[l+1] = par[l].n[k].l; l++; 
+            goto af_delete_loop1;
+         }
+af_delete_loop2:
+         pa[l+1] = par[l].n[k].r; l++;
+         goto af_delete_loop1;
+      }
+      if (m > 0) {
+         l = stack[--m];
+         for (i = 0; i < avl_fp->n_keys; i++) 
+            if (avl_file_pcmp (avl_fp, i, yr.b, par[l].b) != 0) break;
+         if ((i < avl_fp->n_keys) || (memcmp (yr.b, par[l].b, len) != 0))
+            goto af_delete_loop2;         
+         y = pa[l]; yr = par[l];
+      }
+   }
+
+
+  /*
+   * Search sequentially for a matching record, if necessary.
+   * (This is needed, for example, if n_keys is zero).
+   */
+   if (y == 0) {
+      a = hdr.head_seq;
+      while (a > 0) {
+         avl_file_lread (avl_fp, &lim, a, &ar, reclen);
+         if (memcmp (yr.b, ar.b, len) == 0) {
+            y = a; yr = ar;
+            break;
+         }
+         a = ar.next;
+      }
+   }
+
+   if (y == 0) {
+      ret = -1;
+      goto af_delete_return;
+   } 
+
+   avl_file_dremove (avl_fp, &lim, &hdr, y, &yr, NULL);
+   avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+
+af_delete_return:
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
+
+
+/* --------------------------------------------------- avl_file_update
+ * Update a record with new information. For trees with multiple
+ * keys, all of the keys must match for the update to succeed.
+ * The return value is 0 for OK, or -1 for none.
+ */
+int32_t 
+#ifdef	AVL_FILE_TSAFE
+avl_file_update_t (AVL_FILE *avl_fp, void *data) 
+#else
+avl_file_update (AVL_FILE *avl_fp, void *data) 
+#endif
+{
+   int32_t reclen, ret;
+
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;
+      int32_t reclen;
+      uint32_t gen;
+      int64_t n_avl;
+      int64_t nextnum;
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;
+      off_t head_empty;
+      off_t head_cpr; 
+   } hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } yr, par[128];
+   off_t y, pa[128], lim;
+   int32_t i, k, l, m, stack[128];
+
+
+   reclen = avl_fp->reclen;
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_WRLCK);
+
+   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+
+   avl_file_pset (avl_fp, yr.b, data);
+   y = 0;
+
+  /*
+   * Find the record. Duplicate keys require some searching.
+   */
+   if (avl_fp->n_keys > 0) {
+      k = 0; l = 0; m = 0;
+      pa[l] = hdr.root[k];
+af_update_loop1:
+      if (pa[l] > 0) {
+         avl_file_kread (avl_fp, &lim, pa[l], &par[l], k);
+
+         i = avl_file_dcmp (avl_fp, &lim, k, yr.b, pa[l], par[l].b);
+         if (i <= 0) {
+            if (i == 0) stack[m++] = l;
+
+            pa[l+1] = par[l].n[k].l; l++; 
+            goto af_update_loop1;
+         }
+af_update_loop2:
+         pa[l+1] = par[l].n[k].r; l++;
+         goto af_update_loop1;
+      }
+      if (m > 0) {
+         l = stack[--m];
+         avl_file_lread (avl_fp, &lim, pa[l], &par[l], reclen);
+         for (i = 0; i < avl_fp->n_keys; i++) 
+            if (avl_file_pcmp (avl_fp, i, yr.b, par[l].b) != 0) break;
+         if (i < avl_fp->n_keys) goto af_update_loop2;         
+         y = pa[l]; yr = par[l];
+      }
+   }
+
+   if (y == 0) {
+      ret = -1;
+   } else {
+      avl_file_pset (avl_fp, yr.b, data);
+      avl_file_lwrite (avl_fp, &lim, y, &yr, reclen);
+      ret = 0;
+   }
+
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
+
+
+
+/*--------------------------------------------------- avl_file_startlt
+ * Using key k, return the first record less than data. The data field
+ * is over-written with the file record, if one exists.
+ * The return value is 0 for OK, or -1 for none.
+ */
+int32_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_startlt_t (AVL_FILE *avl_fp, void *data, int32_t k) 
+#else
+avl_file_startlt (AVL_FILE *avl_fp, void *data, int32_t k) 
+#endif
+{
+   int32_t reclen, ret;
+
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;
+      int32_t reclen;
+      uint32_t gen;
+      int64_t n_avl;
+      int64_t nextnum;
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;
+      off_t head_empty;
+      off_t head_cpr; 
+   } hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } ar, br, cpr, sr, *arp, *srp;
+   off_t a, cp, sp, lim;
+
+
+   if ((k < 0) || (k >= avl_fp->n_keys)) {
+      setenv (AVL_FILE_EMSG_VNAME, "70 the key index is out of bounds", 1);
+      return (-1);
+   }
+   reclen = avl_fp->reclen;
+   cp = avl_fp->cpr;
+   ret = 0;
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_RDLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_RDLCK);
+
+   avl_file_pset (avl_fp, br.b, data);
+
+   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+   a = hdr.root[k];
+   while (a > 0) {
+      arp = avl_file_kref (avl_fp, &lim, a, &ar, k);
+      if (avl_file_dcmp (avl_fp, &lim, k, br.b, a, arp->b) <= 0) {
+         if (arp->n[k].l > 0)
+            a = arp->n[k].l;
+         else {
+            a = -arp->n[k].l;
+            break;
+         }
+      } else {
+         if (arp->n[k].r > 0)
+            a = arp->n[k].r;
+         else
+            break;
+      }
+   }
+
+#ifdef	AVL_FILE_TSAFE
+   pthread_mutex_lock (&avl_fp->cmu);
+#endif
+   avl_file_cread (avl_fp, &lim, cp, &cpr, avl_fp->nodelen);
+
+   if (a > 0) {
+      avl_file_lread (avl_fp, &lim, a, &ar, reclen);
+      memcpy (data, ar.b + avl_fp->uoff, avl_fp->ulen);
+
+      sp = ar.n[k].l; 
+      if (sp > 0) {
+         srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         while (srp->n[k].r > 0) {
+            sp = srp->n[k].r;
+            srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         }
+      } else {
+         sp = -ar.n[k].l;
+      }
+      cpr.n[k].l = sp;
+
+      sp = ar.n[k].r; 
+      if (sp > 0) {
+         srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         while (srp->n[k].l > 0) {
+            sp = srp->n[k].l;
+            srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         }
+      } else {
+         sp = -ar.n[k].r;
+      }
+      cpr.n[k].r = sp;
+   } else {
+      cpr.n[k].l = 0;
+      cpr.n[k].r = 0;
+      ret = -1;
+   }
+
+   avl_file_cwrite (avl_fp, &lim, cp, &cpr, avl_fp->nodelen);
+#ifdef	AVL_FILE_TSAFE
+   pthread_mutex_unlock (&avl_fp->cmu);
+#endif
+
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
+
+
+/*--------------------------------------------------- avl_file_startge
+ * Using key k, return the first record greater than or equal to data.
+ * The data field is over-written with the file record, if one exists.
+ * The return value is 0 for OK, or -1 for none.
+ */
+int32_t 
+#ifdef	AVL_FILE_TSAFE
+avl_file_startge_t (AVL_FILE *avl_fp, void *data, int32_t k) 
+#else
+avl_file_startge (AVL_FILE *avl_fp, void *data, int32_t k) 
+#endif
+{
+   int32_t reclen, ret;
+
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;      // AVL record data length
+      int32_t reclen;   // AVL record length including key nodes
+      uint32_t gen;     // generation, changed by every update
+      int64_t n_avl;    // number of AVL records 
+      int64_t nextnum;  // unique record numbers 
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;
+      off_t head_empty;
+      off_t head_cpr; 
+   } hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } ar, br, cpr, sr, *arp, *srp;
+   off_t a, cp, sp, lim;
+
+
+   if ((k < 0) || (k >= avl_fp->n_keys)) {
+      setenv (AVL_FILE_EMSG_VNAME, "80 the key index is out of bounds", 1);
+      return (-1);
+   }
+   reclen = avl_fp->reclen;
+   cp = avl_fp->cpr;
+   ret = 0;
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_RDLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_RDLCK);
+
+   avl_file_pset (avl_fp, br.b, data);
+
+   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+   a = hdr.root[k];
+   while (a > 0) {
+      arp = avl_file_kref (avl_fp, &lim, a, &ar, k);
+      if (avl_file_dcmp (avl_fp, &lim, k, br.b, a, arp->b) <= 0) {
+         if (arp->n[k].l > 0)
+            a = arp->n[k].l;
+         else
+            break;
+      } else {
+         if (arp->n[k].r > 0)
+            a = arp->n[k].r;
+         else {
+            a = -arp->n[k].r;
+            break;
+         }
+      }
+   }
+
+#ifdef	AVL_FILE_TSAFE
+   pthread_mutex_lock (&avl_fp->cmu);
+#endif
+   avl_file_cread (avl_fp, &lim, cp, &cpr, avl_fp->nodelen);
+
+   if (a > 0) {
+      avl_file_lread (avl_fp, &lim, a, &ar, reclen);
+      memcpy (data, ar.b + avl_fp->uoff, avl_fp->ulen);
+
+      sp = ar.n[k].l; 
+      if (sp > 0) {
+         srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         while (srp->n[k].r > 0) {
+            sp = srp->n[k].r;
+            srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         }
+      } else {
+         sp = -ar.n[k].l;
+      }
+      cpr.n[k].l = sp;
+
+      sp = ar.n[k].r; 
+      if (sp > 0) {
+         srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         while (srp->n[k].l > 0) {
+            sp = srp->n[k].l;
+            srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         }
+      } else {
+         sp = -ar.n[k].r;
+      }
+      cpr.n[k].r = sp;
+   } else {
+      cpr.n[k].l = 0;
+      cpr.n[k].r = 0;
+      ret = -1;
+   }
+
+   avl_file_cwrite (avl_fp, &lim, cp, &cpr, avl_fp->nodelen);
+#ifdef	AVL_FILE_TSAFE
+   pthread_mutex_unlock (&avl_fp->cmu);
+#endif
+
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
+
+
+/*--------------------------------------------------- avl_file_next
+ * Using key k, read the next record into data buffer. 
+ * Separate pointers are maintained for the 'previous' and 'next' functions. 
+ * The return value is 0 for OK, or -1 for none.
+ */
+int32_t 
+#ifdef	AVL_FILE_TSAFE
+avl_file_next_t (AVL_FILE *avl_fp, void *data, int32_t k) 
+#else
+avl_file_next (AVL_FILE *avl_fp, void *data, int32_t k) 
+#endif
+{
+   int32_t reclen, ret;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } ar, cpr, sr, *srp;
+   off_t a, cp, sp, lim;
+
+
+   if ((k < 0) || (k >= avl_fp->n_keys)) {
+      setenv (AVL_FILE_EMSG_VNAME, "90 the key index is out of bounds", 1);
+      return (-1);
+   }
+   reclen = avl_fp->reclen;
+   cp = avl_fp->cpr;
+   ret = 0;
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_RDLCK);
+
+   avl_file_cread (avl_fp, &lim, cp, &cpr, avl_fp->nodelen);
+
+   a = cpr.n[k].r;
+   if (a > 0) {
+      avl_file_lread (avl_fp, &lim, a, &ar, reclen);
+      memcpy (data, ar.b + avl_fp->uoff, avl_fp->ulen);
+
+      sp = ar.n[k].r; 
+      if (sp > 0) {
+         srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         while (srp->n[k].l > 0) {
+            sp = srp->n[k].l;
+            srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         }
+      } else {
+         sp = -ar.n[k].r;
+      }
+      cpr.n[k].r = sp;
+
+      avl_file_cwrite (avl_fp, &lim, cp, &cpr, avl_fp->nodelen);
+   } else 
+      ret = -1;
+
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
+
+
+/*--------------------------------------------------- avl_file_prev
+ * Using key k, read the previous record into the data buffer.
+ * Separate pointers are maintained for the 'previous' and 'next' functions. 
+ * The return value is 0 for OK, or -1 for none.
+ */
+int32_t 
+#ifdef	AVL_FILE_TSAFE
+avl_file_prev_t (AVL_FILE *avl_fp, void *data, int32_t k) 
+#else
+avl_file_prev (AVL_FILE *avl_fp, void *data, int32_t k) 
+#endif
+{
+   int32_t reclen, ret;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } ar, cpr, sr, *srp;
+   off_t a, cp, sp, lim;
+
+
+   if ((k < 0) || (k >= avl_fp->n_keys)) {
+      setenv (AVL_FILE_EMSG_VNAME, "100 the key index is out of bounds", 1);
+      return (-1);
+   }
+   reclen = avl_fp->reclen;
+   cp = avl_fp->cpr;
+   ret = 0;
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_RDLCK);
+
+   avl_file_cread (avl_fp, &lim, cp, &cpr, avl_fp->nodelen);
+
+   a = cpr.n[k].l;
+   if (a > 0) {
+      avl_file_lread (avl_fp, &lim, a, &ar, reclen);
+      memcpy (data, ar.b + avl_fp->uoff, avl_fp->ulen);
+
+      sp = ar.n[k].l;
+      if (sp > 0) {
+         srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         while (srp->n[k].r > 0) {
+            sp = srp->n[k].r;
+            srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         }
+      } else {
+         sp = -ar.n[k].l;
+      }
+      cpr.n[k].l = sp;
+
+      avl_file_cwrite (avl_fp, &lim, cp, &cpr, avl_fp->nodelen);
+   } else 
+      ret = -1;
+
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
+
+
+/*--------------------------------------------------- avl_file_find
+ * Find a record using key k, over-writing the data buffer with
+ * the matching file record, if one exists.
+ * The return value is 0 for OK, or -1 for none.
+ */
+int32_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_find_t (AVL_FILE *avl_fp, void *data, int32_t k) 
+#else
+avl_file_find (AVL_FILE *avl_fp, void *data, int32_t k) 
+#endif
+{
+   char b[avl_fp->len];
+
+   memcpy (b, data, avl_fp->ulen);
+#ifdef	AVL_FILE_TSAFE
+   if (avl_file_startge_t (avl_fp, b, k) == 0) { 
+#else
+   if (avl_file_startge (avl_fp, b, k) == 0) { 
+#endif
+      if (avl_file_kcmp (avl_fp, k, b, data) == 0) {
+         memcpy (data, b, avl_fp->ulen);
+         return (0);
+      }
+   }
+   return (-1);
+}
+
+
+/*------------------------------------------- avl_file_crank
+ * Return the number of records in the tree of key k that are less
+ * than the data.
+ */
+static int64_t
+avl_file_crank (AVL_FILE *avl_fp, off_t *lim, int32_t k, void *data)
+{
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;
+      int32_t reclen;
+      uint32_t gen;
+      int64_t n_avl;
+      int64_t nextnum;
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;
+      off_t head_empty;
+      off_t head_cpr; 
+   } hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } ar, *arp;
+   char b[avl_fp->len];
+   off_t a;
+   int64_t n;
+
+
+   n = 0;
+   avl_file_pset (avl_fp, b, data);
+   avl_file_lread (avl_fp, lim, 0, &hdr, sizeof (hdr));
+   a = hdr.root[k];
+   while (a > 0) {
+      arp = avl_file_kref (avl_fp, lim, a, &ar, k);
+      if (avl_file_dcmp (avl_fp, lim, k, b, a, arp->b) <= 0) {
+         a = arp->n[k].l;
+      } else {
+         a = arp->n[k].r;
+         n += avl_file_ncount (avl_fp, lim, arp->n[k].l, k) + 1;
+      }
+   }
+   return (n);
+}
+
+
+/*--------------------------------------------------- avl_file_rank
+ * Return the number of records whose key k is less than the data,
+ * i.e. the position the data would have in key order, counting from
+ * zero. The subtree counts in the nodes make this one search down 
+ * the tree. The return value is -1 for an invalid key index.
+ */
+int64_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_rank_t (AVL_FILE *avl_fp, void *data, int32_t k) 
+#else
+avl_file_rank (AVL_FILE *avl_fp, void *data, int32_t k) 
+#endif
+{
+   off_t lim;
+   int64_t n;
+
+
+   if ((k < 0) || (k >= avl_fp->n_keys)) {
+      setenv (AVL_FILE_EMSG_VNAME, "190 the key index is out of bounds", 1);
+      return (-1);
+   }
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_RDLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_RDLCK);
+
+   n = avl_file_crank (avl_fp, &lim, k, data);
+
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (n);
+}
+
+
+/*--------------------------------------------------- avl_file_select
+ * Read the record at position idx in the order of key k, counting 
+ * from zero, into the data buffer. As with avl_file_startge(), the 
+ * current pointer for the key is set so that avl_file_next() and 
+ * avl_file_prev() continue from the record.
+ * The return value is 0 for OK, or -1 for none.
+ */
+int32_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_select_t (AVL_FILE *avl_fp, int64_t idx, void *data, int32_t k) 
+#else
+avl_file_select (AVL_FILE *avl_fp, int64_t idx, void *data, int32_t k) 
+#endif
+{
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;
+      int32_t reclen;
+      uint32_t gen;
+      int64_t n_avl;
+      int64_t nextnum;
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;
+      off_t head_empty;
+      off_t head_cpr; 
+   } hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } ar, cpr, sr, *arp, *srp;
+   off_t a, cp, sp, lim;
+   int64_t n;
+   int32_t ret;
+
+
+   if ((k < 0) || (k >= avl_fp->n_keys)) {
+      setenv (AVL_FILE_EMSG_VNAME, "191 the key index is out of bounds", 1);
+      return (-1);
+   }
+   cp = avl_fp->cpr;
+   ret = 0;
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_RDLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_RDLCK);
+
+   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+   a = ((idx >= 0) && (idx < hdr.n_avl)) ? hdr.root[k] : 0;
+   while (a > 0) {
+      arp = avl_file_lref (avl_fp, &lim, a, &ar, avl_fp->reclen);
+      n = avl_file_ncount (avl_fp, &lim, arp->n[k].l, k);
+      if (idx < n) {
+         a = arp->n[k].l;
+      } else if (idx > n) {
+         idx -= n + 1;
+         a = arp->n[k].r;
+      } else {
+         break;
+      }
+   }
+
+#ifdef	AVL_FILE_TSAFE
+   pthread_mutex_lock (&avl_fp->cmu);
+#endif
+   avl_file_cread (avl_fp, &lim, cp, &cpr, avl_fp->nodelen);
+
+   if (a > 0) {
+      avl_file_lread (avl_fp, &lim, a, &ar, avl_fp->reclen);
+      memcpy (data, ar.b + avl_fp->uoff, avl_fp->ulen);
+
+      sp = ar.n[k].l; 
+      if (sp > 0) {
+         srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         while (srp->n[k].r > 0) {
+            sp = srp->n[k].r;
+            srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         }
+      } else {
+         sp = -ar.n[k].l;
+      }
+      cpr.n[k].l = sp;
+
+      sp = ar.n[k].r; 
+      if (sp > 0) {
+         srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         while (srp->n[k].l > 0) {
+            sp = srp->n[k].l;
+            srp = avl_file_nref (avl_fp, &lim, sp, &sr);
+         }
+      } else {
+         sp = -ar.n[k].r;
+      }
+      cpr.n[k].r = sp;
+   } else {
+      cpr.n[k].l = 0;
+      cpr.n[k].r = 0;
+      ret = -1;
+   }
+
+   avl_file_cwrite (avl_fp, &lim, cp, &cpr, avl_fp->nodelen);
+#ifdef	AVL_FILE_TSAFE
+   pthread_mutex_unlock (&avl_fp->cmu);
+#endif
+
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
+
+
+/*------------------------------------------- avl_file_csearch
+ * Search the tree of key k for the first record greater than or 
+ * equal to the data (dir > 0), or for the last record less than the
+ * data (dir < 0). The return value is the record position, or 0 for
+ * none.
+ */
+static off_t
+avl_file_csearch (AVL_FILE *avl_fp, off_t *lim, int32_t k, void *data, int32_t dir)
+{
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;
+      int32_t reclen;
+      uint32_t gen;
+      int64_t n_avl;
+      int64_t nextnum;
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;
+      off_t head_empty;
+      off_t head_cpr; 
+   } hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } ar, *arp;
+   char b[avl_fp->len];
+   off_t a;
+
+
+   avl_file_pset (avl_fp, b, data);
+   avl_file_lread (avl_fp, lim, 0, &hdr, sizeof (hdr));
+   a = hdr.root[k];
+   while (a > 0) {
+      arp = avl_file_kref (avl_fp, lim, a, &ar, k);
+      if (avl_file_dcmp (avl_fp, lim, k, b, a, arp->b) <= 0) {
+         if (arp->n[k].l > 0)
+            a = arp->n[k].l;
+         else {
+            if (dir < 0) a = -arp->n[k].l;
+            break;
+         }
+      } else {
+         if (arp->n[k].r > 0)
+            a = arp->n[k].r;
+         else {
+            if (dir > 0) a = -arp->n[k].r;
+            break;
+         }
+      }
+   }
+   return (a);
+}
+
+
+/*------------------------------------------- avl_file_cnext
+ * Return the position of the next record by key k after the record
+ * in the buffer pr (dir > 0), or of the previous record (dir < 0),
+ * or 0 for none.
+ */
+static off_t
+avl_file_cnext (AVL_FILE *avl_fp, off_t *lim, int32_t k, void *pr, int32_t dir)
+{
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } sr, *srp, *arp;
+   off_t sp;
+
+
+   arp = pr;
+   if (dir > 0) {
+      sp = arp->n[k].r;
+      if (sp > 0) {
+         srp = avl_file_nref (avl_fp, lim, sp, &sr);
+         while (srp->n[k].l > 0) {
+            sp = srp->n[k].l;
+            srp = avl_file_nref (avl_fp, lim, sp, &sr);
+         }
+      } else {
+         sp = -arp->n[k].r;
+      }
+   } else {
+      sp = arp->n[k].l;
+      if (sp > 0) {
+         srp = avl_file_nref (avl_fp, lim, sp, &sr);
+         while (srp->n[k].r > 0) {
+            sp = srp->n[k].r;
+            srp = avl_file_nref (avl_fp, lim, sp, &sr);
+         }
+      } else {
+         sp = -arp->n[k].l;
+      }
+   }
+   return (sp);
+}
+
+
+/*------------------------------------------- avl_file_cfix
+ * Find the cursor positions again after the file has been changed.
+ * The records last read in each direction are searched for by their
+ * positions among the records with equal keys, so records that have
+ * been updated are still found. If one has been deleted, the cursor
+ * continues from the record it would have read next, if that is 
+ * still among them. Otherwise it continues from the records with
+ * greater (or lesser) keys, so any other records with the same key
+ * are skipped.
+ */
+static void
+avl_file_cfix (AVL_FILE_CURSOR *cur, off_t *lim)
+{
+   AVL_FILE *avl_fp;
+   int32_t k, found;
+
+   avl_fp = cur->avl_fp;
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } ar;
+   off_t a, s;
+
+
+   k = cur->k;
+
+   if (cur->rp > 0) {
+      s = 0;
+      a = avl_file_csearch (avl_fp, lim, k, cur->rb + avl_fp->uoff, +1);
+      while (a > 0) {
+         avl_file_lread (avl_fp, lim, a, &ar, avl_fp->reclen);
+         if (avl_file_pcmp (avl_fp, k, cur->rb, ar.b) != 0) break;
+         if (a == cur->rp) {
+            a = avl_file_cnext (avl_fp, lim, k, &ar, +1);
+            s = 0;
+            break;
+         }
+         if (a == cur->r) s = a;
+         a = avl_file_cnext (avl_fp, lim, k, &ar, +1);
+      }
+      cur->r = (s > 0) ? s : a;
+   }
+
+   if (cur->lp > 0) {
+      found = 0;
+      a = avl_file_csearch (avl_fp, lim, k, cur->lb + avl_fp->uoff, +1);
+      while (a > 0) {
+         avl_file_lread (avl_fp, lim, a, &ar, avl_fp->reclen);
+         if (avl_file_pcmp (avl_fp, k, cur->lb, ar.b) != 0) break;
+         if (a == cur->lp) {
+            cur->l = avl_file_cnext (avl_fp, lim, k, &ar, -1);
+            found = 1;
+            break;
+         }
+         if (a == cur->l) found = 2;       // cur->l is still good
+         a = avl_file_cnext (avl_fp, lim, k, &ar, +1);
+      }
+      if (found == 0) cur->l = avl_file_csearch (avl_fp, lim, k, cur->lb + avl_fp->uoff, -1);
+   }
+}
+
+
+/*------------------------------------------- avl_file_cursor_open
+ * Create a cursor for reading the records in the order of key k.
+ * The cursor position is kept in memory, not in the file, so moving
+ * it does not write anything, and any number of cursors can be used
+ * with one AVL_FILE. When the file has been changed (the header 
+ * generation number is different), the cursor finds its place again
+ * by searching for the records it last read.
+ * Cursors must be closed before closing the AVL_FILE.
+ * Returns NULL for failure.
+ */
+AVL_FILE_CURSOR *
+#ifdef	AVL_FILE_TSAFE
+avl_file_cursor_open_t (AVL_FILE *avl_fp, int32_t k)
+#else
+avl_file_cursor_open (AVL_FILE *avl_fp, int32_t k)
+#endif
+{
+   AVL_FILE_CURSOR *cur;
+
+   if ((k < 0) || (k >= avl_fp->n_keys)) {
+      setenv (AVL_FILE_EMSG_VNAME, "130 the key index is out of bounds", 1);
+      return (NULL);
+   }
+   cur = malloc (sizeof (AVL_FILE_CURSOR) + 2 * avl_fp->len);
+   if (cur == NULL) {
+      setenv (AVL_FILE_EMSG_VNAME, "131 malloc returned NULL", 1);
+      return (NULL);
+   }
+   cur->avl_fp = avl_fp;
+   cur->k = k;
+   cur->gen = 0;
+   cur->l = 0; cur->r = 0;
+   cur->lp = 0; cur->rp = 0;
+   cur->lb = (char *) (cur + 1);
+   cur->rb = cur->lb + avl_fp->len;
+   return (cur);
+}
+
+
+/*------------------------------------------- avl_file_cseek
+ * Position the cursor at the first record greater than or equal to 
+ * the data (dir > 0) or the last record less than the data (dir < 0),
+ * reading the record into the data buffer.
+ * The return value is 0 for OK, or -1 for none.
+ */
+static int32_t
+avl_file_cseek (AVL_FILE_CURSOR *cur, void *data, int32_t dir)
+{
+   AVL_FILE *avl_fp;
+   int32_t k, ret;
+
+   avl_fp = cur->avl_fp;
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } ar;
+   char b[avl_fp->len];
+   off_t a, lim;
+
+
+   k = cur->k;
+   memcpy (b, data, avl_fp->ulen);
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_RDLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_RDLCK);
+
+   a = avl_file_csearch (avl_fp, &lim, k, b, dir);
+   if (a > 0) {
+      avl_file_lread (avl_fp, &lim, a, &ar, avl_fp->reclen);
+      memcpy (data, ar.b + avl_fp->uoff, avl_fp->ulen);
+      cur->l = avl_file_cnext (avl_fp, &lim, k, &ar, -1);
+      cur->r = avl_file_cnext (avl_fp, &lim, k, &ar, +1);
+      cur->lp = a; cur->rp = a;
+      memcpy (cur->lb, ar.b, avl_fp->len);
+      memcpy (cur->rb, ar.b, avl_fp->len);
+      ret = 0;
+   } else {
+      cur->l = 0; cur->r = 0;
+      cur->lp = 0; cur->rp = 0;
+      ret = -1;
+   }
+   cur->gen = avl_file_lgen (avl_fp);
+
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
+
+
+/*------------------------------------------- avl_file_cursor_seek_ge
+ * Read the first record greater than or equal to the data, by the
+ * cursor key, into the data buffer, and position the cursor there.
+ * The return value is 0 for OK, or -1 for none.
+ */
+int32_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_cursor_seek_ge_t (AVL_FILE_CURSOR *cur, void *data)
+#else
+avl_file_cursor_seek_ge (AVL_FILE_CURSOR *cur, void *data)
+#endif
+{
+   return (avl_file_cseek (cur, data, +1));
+}
+
+
+/*------------------------------------------- avl_file_cursor_seek_lt
+ * Read the last record less than the data, by the cursor key, into
+ * the data buffer, and position the cursor there.
+ * The return value is 0 for OK, or -1 for none.
+ */
+int32_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_cursor_seek_lt_t (AVL_FILE_CURSOR *cur, void *data)
+#else
+avl_file_cursor_seek_lt (AVL_FILE_CURSOR *cur, void *data)
+#endif
+{
+   return (avl_file_cseek (cur, data, -1));
+}
+
+
+/*------------------------------------------- avl_file_cstep
+ * Read the next (dir > 0) or previous (dir < 0) record by the cursor
+ * key into the data buffer. Separate positions are kept for each 
+ * direction, as for avl_file_next() and avl_file_prev().
+ * The return value is 0 for OK, or -1 for none.
+ */
+static int32_t
+avl_file_cstep (AVL_FILE_CURSOR *cur, void *data, int32_t dir)
+{
+   AVL_FILE *avl_fp;
+   int32_t k, ret;
+   uint32_t gen;
+
+   avl_fp = cur->avl_fp;
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } ar;
+   off_t a, lim;
+
+
+   k = cur->k;
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_RDLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_RDLCK);
+
+   gen = avl_file_lgen (avl_fp);
+   if (gen != cur->gen) {
+      avl_file_cfix (cur, &lim);
+      cur->gen = gen;
+   }
+
+   a = (dir > 0) ? cur->r : cur->l;
+   if (a > 0) {
+      avl_file_lread (avl_fp, &lim, a, &ar, avl_fp->reclen);
+      memcpy (data, ar.b + avl_fp->uoff, avl_fp->ulen);
+      if (dir > 0) {
+         cur->r = avl_file_cnext (avl_fp, &lim, k, &ar, +1);
+         cur->rp = a;
+         memcpy (cur->rb, ar.b, avl_fp->len);
+      } else {
+         cur->l = avl_file_cnext (avl_fp, &lim, k, &ar, -1);
+         cur->lp = a;
+         memcpy (cur->lb, ar.b, avl_fp->len);
+      }
+      ret = 0;
+   } else {
+      ret = -1;
+   }
+
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
+
+
+/*------------------------------------------- avl_file_cursor_next
+ * Read the next record by the cursor key into the data buffer.
+ * The return value is 0 for OK, or -1 for none.
+ */
+int32_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_cursor_next_t (AVL_FILE_CURSOR *cur, void *data)
+#else
+avl_file_cursor_next (AVL_FILE_CURSOR *cur, void *data)
+#endif
+{
+   return (avl_file_cstep (cur, data, +1));
+}
+
+
+/*------------------------------------------- avl_file_cursor_prev
+ * Read the previous record by the cursor key into the data buffer.
+ * The return value is 0 for OK, or -1 for none.
+ */
+int32_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_cursor_prev_t (AVL_FILE_CURSOR *cur, void *data)
+#else
+avl_file_cursor_prev (AVL_FILE_CURSOR *cur, void *data)
+#endif
+{
+   return (avl_file_cstep (cur, data, -1));
+}
+
+
+/*------------------------------------------- avl_file_cursor_close
+ * Free a cursor.
+ */
+void
+#ifdef	AVL_FILE_TSAFE
+avl_file_cursor_close_t (AVL_FILE_CURSOR *cur)
+#else
+avl_file_cursor_close (AVL_FILE_CURSOR *cur)
+#endif
+{
+   free (cur);
+}
+
+
+/*------------------------------------------------- avl_file_scan
+ * Recursively scan a tree by the order of key k. The variable sp and
+ * 'count' must be zero initially when calling this function.
+ * The return value is the height of the tree. The variable 
+ * 'count' contains the record count.
+ */
+int32_t 
+#ifdef	AVL_FILE_TSAFE
+avl_file_scan_t (AVL_FILE *avl_fp, int32_t k, off_t sp, int64_t *count) 
+#else
+avl_file_scan (AVL_FILE *avl_fp, int32_t k, off_t sp, int64_t *count) 
+#endif
+{
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;      // AVL record data length
+      int32_t reclen;   // AVL record length including key nodes
+      uint32_t gen;     // generation, changed by every update
+      int64_t n_avl;    // number of AVL records 
+      int64_t nextnum;  // unique record numbers 
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;
+      off_t head_empty;
+      off_t head_cpr; 
+   } hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;
+      char b[avl_fp->len];
+   } sr;
+   off_t lim;
+   int64_t n;
+   int32_t hl, hr, h;
+   unsigned char pfx[AVL_FILE_PFX_LEN];
+
+
+   if ((k < 0) || (k >= avl_fp->n_keys)) {
+      setenv (AVL_FILE_EMSG_VNAME, "110 the key index is out of bounds", 1);
+      return (-1);
+   }
+
+
+   if (sp == 0) {
+#ifdef	AVL_FILE_TSAFE
+      avl_file_tlock (avl_fp, F_RDLCK);
+#endif
+      lim = avl_file_lbegin (avl_fp, F_RDLCK);
+
+      avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+
+      if (hdr.root[k] > 0) {
+#ifdef	AVL_FILE_TSAFE
+         h = avl_file_scan_t (avl_fp, k, hdr.root[k], count);
+#else
+         h = avl_file_scan (avl_fp, k, hdr.root[k], count);
+#endif
+      } else {
+         h = 0;
+      }
+
+      avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+      pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+      if (*count != hdr.n_avl) {
+         setenv (AVL_FILE_EMSG_VNAME, "50 count != hdr.n_avl", 1);
+//       fprintf (stderr, "avl_file_scan: count %lld != %lld\n", *count, hdr.n_avl);
+      }
+   } else if (sp > 0) {
+      lim = avl_fp->hlim;
+      if ((avl_fp->kpfx != NULL) && (avl_fp->kpfx[k] >= 0)) {
+         avl_file_lread (avl_fp, &lim, sp, &sr, avl_fp->reclen);
+         avl_file_pkey (avl_fp->seg + avl_fp->kseg[k], avl_fp->kseg[k+1] - avl_fp->kseg[k], sr.b + avl_fp->uoff, pfx);
+         if (memcmp (pfx, sr.b + avl_fp->kpfx[k], AVL_FILE_PFX_LEN) != 0)
+            setenv (AVL_FILE_EMSG_VNAME, "53 bad key prefix", 1);	// key k
+      } else {
+         avl_file_nread (avl_fp, &lim, sp, &sr);
+      }
+
+      n = *count;
+     *count += 1;
+      hl = 1; hr = 1;
+#ifdef	AVL_FILE_TSAFE
+      if (sr.n[k].l > 0) hl += avl_file_scan_t (avl_fp, k, sr.n[k].l, count);
+      if (sr.n[k].r > 0) hr += avl_file_scan_t (avl_fp, k, sr.n[k].r, count);
+#else
+      if (sr.n[k].l > 0) hl += avl_file_scan (avl_fp, k, sr.n[k].l, count);
+      if (sr.n[k].r > 0) hr += avl_file_scan (avl_fp, k, sr.n[k].r, count);
+#endif
+      if (sr.n[k].b != hl - hr) {
+         setenv (AVL_FILE_EMSG_VNAME, "51 bad balance", 1);	// key k
+//       fprintf (stderr, "avl_file_scan: key %d bad balance = %2d\n", k, sr.n[k].b);
+      }
+      if (sr.n[k].c != *count - n) {
+         setenv (AVL_FILE_EMSG_VNAME, "52 bad subtree count", 1);	// key k
+      }
+
+      h = (hl > hr) ? hl : hr;
+   } else {
+      h = 0;
+   }
+   return (h);
+}
+
+
+/*------------------------------------------- avl_file_lock
+ * Place an advisory lock on the file at byte position 1.
+ * Note that byte position 0 is already used by the other
+ * functions.
+ * 
+ * This function does not block process threads from concurrent access,
+ * because file locks do not guarantee exclusive access for threads.
+ */
+#ifdef	AVL_FILE_TSAFE
+
+void 
+avl_file_lock_t (AVL_FILE *avl_fp) 
+{
+   avl_file_tlock (avl_fp, F_WRLCK);
+   avl_file_plock (avl_fp->fd, F_WRLCK, 1, 1);
+   pthread_rwlock_unlock (&avl_fp->rwl);
+}
+
+#else
+
+void 
+avl_file_lock (AVL_FILE *avl_fp) 
+{
+   avl_file_plock (avl_fp->fd, F_WRLCK, 1, 1);
+}
+
+#endif
+
+
+/*------------------------------------------- avl_file_unlock
+ * Remove the lock at byte position 1 from the file.
+ */
+#ifdef	AVL_FILE_TSAFE
+
+void 
+avl_file_unlock_t (AVL_FILE *avl_fp) 
+{
+   avl_file_tlock (avl_fp, F_WRLCK);
+   avl_file_plock (avl_fp->fd, F_UNLCK, 1, 1);
+   pthread_rwlock_unlock (&avl_fp->rwl);
+}
+
+#else
+
+void 
+avl_file_unlock (AVL_FILE *avl_fp) 
+{
+   avl_file_plock (avl_fp->fd, F_UNLCK, 1, 1);
+}
+
+#endif
+
+
+
+/*------------------------------------------- avl_file_snapshot_begin
+ * Begin a snapshot of the file, for a file opened with 
+ * avl_file_open_snap() (or any file that has a version store). Until
+ * avl_file_snapshot_end(), the functions that only read the file 
+ * (find, startge, next, scan, rank, cursors, etc.) see it as it was
+ * now, and do not lock it, so they neither wait for updates by other
+ * processes nor hold them off. The updates save the records they 
+ * change, for as long as there are snapshots. Updates through this
+ * AVL_FILE still change the file itself, and the positions of the
+ * next and prev functions are kept for the snapshot only. A file 
+ * with a write-ahead log cannot have snapshots, nor an AVL_FILE in a
+ * transaction.
+ * Returns 0 if successful, or -1.
+ */
+int32_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_snapshot_begin_t (AVL_FILE *avl_fp)
+#else
+avl_file_snapshot_begin (AVL_FILE *avl_fp)
+#endif
+{
+   struct avl_file_vers_struct *v;
+   struct avl_file_vhdr_struct *h;
+   int32_t i, pid, z;
+   uint32_t gen;
+   off_t lim;
+
+
+   v = avl_fp->vers;
+   if (v == NULL) {
+      setenv (AVL_FILE_EMSG_VNAME, "225 the file has no version store", 1);
+      return (-1);
+   }
+   if (avl_file_wlog (avl_fp)) {
+      setenv (AVL_FILE_EMSG_VNAME, "226 a file with a log cannot have snapshots", 1);
+      return (-1);
+   }
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   if (v->slot >= 0) {
+      setenv (AVL_FILE_EMSG_VNAME, "227 the snapshot has already begun", 1);
+#ifdef	AVL_FILE_TSAFE
+      pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+      return (-1);
+   }
+   if (avl_fp->txn) {
+      setenv (AVL_FILE_EMSG_VNAME, "243 a file cannot have a snapshot and a transaction at once", 1);
+#ifdef	AVL_FILE_TSAFE
+      pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+      return (-1);
+   }
+   lim = avl_file_lbegin (avl_fp, F_RDLCK);
+
+   h = (struct avl_file_vhdr_struct *) v->map;
+   pid = getpid ();
+   for (i = 0; i < AVL_FILE_SNAP_SLOTS; i++) {
+      z = 0;
+      if (__atomic_compare_exchange_n (&h->slot[i].pid, &z, pid, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+         break;
+   }
+   if (i < AVL_FILE_SNAP_SLOTS) {
+      gen = avl_file_lgen (avl_fp);
+      h->slot[i].gen = gen;
+      __atomic_add_fetch (&h->count, 1, __ATOMIC_SEQ_CST);
+      memcpy (v->hdr, avl_fp->hdr, avl_fp->hlen);
+      avl_file_cread (avl_fp, &lim, avl_fp->cpr, v->cpr, avl_fp->reclen);
+      v->gen = gen;
+      v->lim = lim;
+      v->slot = i;
+   }
+
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   if (i == AVL_FILE_SNAP_SLOTS) {
+      setenv (AVL_FILE_EMSG_VNAME, "228 too many snapshots", 1);
+      return (-1);
+   }
+   return (0);
+}
+
+
+/*------------------------------------------- avl_file_snapshot_end
+ * End the snapshot begun by avl_file_snapshot_begin(). The functions
+ * read the file itself again, from the positions the next and prev 
+ * functions had before the snapshot.
+ * Returns 0 if successful, or -1 if there is no snapshot.
+ */
+int32_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_snapshot_end_t (AVL_FILE *avl_fp)
+#else
+avl_file_snapshot_end (AVL_FILE *avl_fp)
+#endif
+{
+   struct avl_file_vers_struct *v;
+   struct avl_file_vhdr_struct *h;
+   int32_t ret;
+
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   v = avl_fp->vers;
+   if ((v == NULL) || (v->slot < 0)) {
+      setenv (AVL_FILE_EMSG_VNAME, "229 there is no snapshot", 1);
+      ret = -1;
+   } else {
+      h = (struct avl_file_vhdr_struct *) v->map;
+      __atomic_store_n (&h->slot[v->slot].pid, 0, __ATOMIC_SEQ_CST);
+      __atomic_sub_fetch (&h->count, 1, __ATOMIC_SEQ_CST);
+      v->slot = -1;
+      avl_file_vunmap (avl_fp);
+      ret = 0;
+   }
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
+
+
+/*------------------------------------------- avl_file_txn_begin
+ * Begin a transaction, for a file opened with avl_file_open_wal() or
+ * avl_file_open_shadow() (or any file that has a log or a shadow 
+ * file). The file is locked with F_WRLCK until avl_file_txn_commit()
+ * or avl_file_txn_abort(), and the functions called in between use
+ * that lock and the header read here, instead of locking the file
+ * and reading the header each time. The records they write are kept
+ * in the log index, where the functions in the transaction read them
+ * and other processes do not, until the commit. For the _t functions,
+ * the calls of all of the threads in between are in the transaction.
+ * An AVL_FILE with a snapshot cannot begin one.
+ * Returns 0 if successful, or -1.
+ */
+int32_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_txn_begin_t (AVL_FILE *avl_fp)
+#else
+avl_file_txn_begin (AVL_FILE *avl_fp)
+#endif
+{
+   int32_t ret;
+
+
+   if (avl_fp->wal == NULL) {
+      setenv (AVL_FILE_EMSG_VNAME, "241 a transaction needs a log or a shadow file", 1);
+      return (-1);
+   }
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   ret = -1;
+   if (avl_fp->txn) {
+      setenv (AVL_FILE_EMSG_VNAME, "240 the transaction has already begun", 1);
+   } else if ((avl_fp->vers != NULL) && (avl_fp->vers->slot >= 0)) {
+      setenv (AVL_FILE_EMSG_VNAME, "243 a file cannot have a snapshot and a transaction at once", 1);
+   } else {
+      avl_file_lbegin (avl_fp, F_WRLCK);
+      avl_fp->txn = 1;
+      ret = 0;
+   }
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
+
+
+/*------------------------------------------- avl_file_txn_commit
+ * Commit the transaction begun by avl_file_txn_begin(), and unlock
+ * the file. The records written by all of its functions go into one
+ * frame of the log, or one commit of the shadow file, with a single
+ * fdatasync(), so after a crash the file has either all of them or
+ * none of them.
+ * Returns 0 if successful, or -1 if there is no transaction.
+ */
+int32_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_txn_commit_t (AVL_FILE *avl_fp)
+#else
+avl_file_txn_commit (AVL_FILE *avl_fp)
+#endif
+{
+   int32_t ret;
+   off_t lim;
+
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   if (!avl_fp->txn) {
+      setenv (AVL_FILE_EMSG_VNAME, "242 there is no transaction", 1);
+      ret = -1;
+   } else {
+      if (avl_fp->txn > 1) avl_fp->dirty = 1;	// for the other processes
+      avl_fp->txn = 0;
+      lim = avl_fp->hlim;
+      avl_file_lend (avl_fp, &lim);
+      ret = 0;
+   }
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
+
+
+/*------------------------------------------- avl_file_txn_abort
+ * Discard the transaction begun by avl_file_txn_begin(), leaving the
+ * file as it was before it, and unlock the file. avl_file_close()
+ * discards a transaction that has not been committed.
+ * Returns 0 if successful, or -1 if there is no transaction.
+ */
+int32_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_txn_abort_t (AVL_FILE *avl_fp)
+#else
+avl_file_txn_abort (AVL_FILE *avl_fp)
+#endif
+{
+   int32_t ret;
+
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   if (!avl_fp->txn) {
+      setenv (AVL_FILE_EMSG_VNAME, "242 there is no transaction", 1);
+      ret = -1;
+   } else {
+      avl_file_tabort (avl_fp);
+      ret = 0;
+   }
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
+
+
+
+/*------------------------------------------- avl_file_cache
+ * Set the size in bytes of the record cache, or turn the cache off
+ * with a size of 0. Records read or written by this AVL_FILE are kept
+ * in the cache, so that the searches near the tree roots do not need
+ * to read them again, with the other records in the pages read. The cache is emptied whenever the file has been
+ * updated by another process (or another AVL_FILE). 
+ * Returns 0 if successful.
+ */
+static int32_t
+avl_file_cache_set (AVL_FILE *avl_fp, int64_t size)
+{
+   struct avl_file_cache_struct *c;
+   int64_t n, m;
+
+   avl_file_cache_free (avl_fp);
+   n = size / avl_fp->reclen;
+   if (n <= 0) return (0);
+   if (n > 0x10000000) n = 0x10000000;
+   for (m = 1; m < n; m <<= 1);
+
+   c = calloc (1, sizeof (struct avl_file_cache_struct));
+   if (c == NULL) {
+      setenv (AVL_FILE_EMSG_VNAME, "120 malloc returned NULL", 1);
+      return (-1);
+   }
+   c->n_slots = n;
+   c->mask = m - 1;
+   c->head = malloc (m * sizeof (int32_t));
+   c->next = malloc (n * sizeof (int32_t));
+   c->pos = malloc (n * sizeof (off_t));
+   c->ref = malloc (n);
+   c->data = malloc (n * avl_fp->reclen);
+   if (2 * avl_fp->reclen <= AVL_FILE_PAGE) c->page = malloc (2 * AVL_FILE_PAGE);
+   avl_fp->cache = c;
+   if ((c->head == NULL) || (c->next == NULL) || (c->pos == NULL) || 
+       (c->ref == NULL) || (c->data == NULL)) {
+      avl_file_cache_free (avl_fp);
+      setenv (AVL_FILE_EMSG_VNAME, "121 malloc returned NULL", 1);
+      return (-1);
+   }
+   avl_file_cache_clear (c);
+   return (0);
+}
+
+
+int32_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_cache_t (AVL_FILE *avl_fp, int64_t size)
+#else
+avl_file_cache (AVL_FILE *avl_fp, int64_t size)
+#endif
+{
+   int32_t i;
+
+   unsetenv (AVL_FILE_EMSG_VNAME);
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   i = avl_file_cache_set (avl_fp, size);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (i);
+}
+
+
+/*------------------------------------------- avl_file_cache_stats
+ * Get the number of record cache hits and misses, since the cache
+ * was turned on. Either pointer may be NULL.
+ */
+void
+#ifdef	AVL_FILE_TSAFE
+avl_file_cache_stats_t (AVL_FILE *avl_fp, int64_t *hits, int64_t *misses)
+#else
+avl_file_cache_stats (AVL_FILE *avl_fp, int64_t *hits, int64_t *misses)
+#endif
+{
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_RDLCK);
+#endif
+   if (hits != NULL) *hits = (avl_fp->cache != NULL) ? avl_fp->cache->hits : 0;
+   if (misses != NULL) *misses = (avl_fp->cache != NULL) ? avl_fp->cache->misses : 0;
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+}
+
+
+
+/*------------------------------------------- avl_file_dump
+ * Show record nodes for debugging.
+ */
+void 
+#ifdef	AVL_FILE_TSAFE
+avl_file_dump_t (AVL_FILE *avl_fp) 
+#else
+avl_file_dump (AVL_FILE *avl_fp) 
+#endif
+{
+   int32_t fd, n, i, reclen;
+
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;        // AVL record data length
+      int32_t reclen;     // AVL record length including key nodes
+      uint32_t gen;       // generation, changed by every update
+      int64_t n_avl;      // number of AVL records 
+      int64_t nextnum;    // unique record numbers 
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;     // doubly linked
+      off_t head_empty;   // singly linked
+      off_t head_cpr;     // singly linked
+   } hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;   // prev used as sequential pointer in 'cpr' records
+      char b[avl_fp->len];
+   } pr;                 // per-process current position pointer
+   struct avl_file_fhdr_struct *h;
+   off_t pos;
+
+
+   fd = avl_fp->fd;
+   reclen = avl_fp->reclen;
+
+   pread (fd, &hdr, sizeof (hdr), 0);
+
+   printf ("hdr: n_keys %d, len %d, reclen %d, n_avl %lld, head_seq %d, head_empty %d, head_cpr %d\n",
+           hdr.n_keys, hdr.len, hdr.reclen, hdr.n_avl,
+           (int) hdr.head_seq, (int) hdr.head_empty, (int) hdr.head_cpr);
+   if (avl_fp->fmap != NULL) {
+      h = (struct avl_file_fhdr_struct *) avl_fp->fmap->map;
+      printf ("free map: gen %u, n_rec %d, n_free %d, policy %d\n",
+              h->gen, (int) h->n_rec, (int) h->n_free, avl_fp->fmap->policy);
+   }
+
+   printf ("hdr: ");
+   for (i = 0; i < avl_fp->n_keys; i++) {
+      printf ("%2d: %6d | ", i, (int) hdr.root[i]);
+   }
+   printf ("\n");
+
+
+   for (pos = avl_fp->hdrlen; ; pos += reclen) {
+      printf ("  pos %6ld: ", pos); 
+      n = pread (fd, &pr, reclen, pos);
+      if (n != reclen) {
+         printf ("\n");
+         break;
+      }
+      for (i = 0; i < avl_fp->n_keys; i++) {
+         printf ("%2d:%3d %6ld %6ld | ", i, pr.n[i].b, pr.n[i].l, pr.n[i].r);
+      }
+      printf (" prev %6ld, next %6ld | ", pr.prev, pr.next);
+//    printf (" (%s)", &pr.b[0]);	// show data?
+      printf ("\n");
+   }
+}
+
+
+
+/*------------------------------------------- avl_file_cpr_free
+ * Search for unused (unlocked) current-pointer records, left by 
+ * processes that did not close the file, to remove from the list at
+ * head_cpr and add to the empty records (see avl_file_efree()). The header with
+ * the list heads must be written by the caller.
+ * This function should only be called by other avl_file functions.
+ */
+static void
+avl_file_cpr_free (AVL_FILE *avl_fp, off_t *lim, off_t *head_cpr, off_t *head_empty)
+{
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;   // prev used as sequential pointer in 'cpr' records
+      char b[avl_fp->len];
+   } cpr, spr, ar;
+   off_t cp, sp, a;
+   int32_t i, reclen;
+   pid_t pid;
+
+
+   reclen = avl_fp->reclen;
+   pid = getpid ();
+   sp = 0;
+   for (cp = *head_cpr; cp > 0; cp = cpr.next) {
+      avl_file_cread (avl_fp, lim, cp, &cpr, reclen);
+
+      if (sizeof (cpr.b) >= sizeof (pid_t)) {
+         if (memcmp (&cpr.b, &pid, sizeof (pid_t)) != 0) {
+            if (avl_file_ptest (avl_fp->fd, cp, reclen) == 0) {
+               if (sp > 0) {
+                  avl_file_cread (avl_fp, lim, sp, &spr, reclen);
+                  spr.next = cpr.next;
+                  avl_file_cwrite (avl_fp, lim, sp, &spr, reclen);
+               } else {
+                  *head_cpr = cpr.next;
+               }
+               a = cp; ar = cpr;
+               for (i = 0; i < avl_fp->n_keys; i++) {
+                  ar.n[i].b = 0x40; ar.n[i].l = 0; ar.n[i].r = 0;
+               }
+               avl_file_efree (avl_fp, lim, head_empty, a, &ar.next);
+               avl_file_lwrite (avl_fp, lim, a, &ar, reclen);
+               continue;
+            }
+         }
+      }
+
+      sp = cp;
+   }
+}
+
+
+/*------------------------------------------- avl_file_rmap
+ * Return the new position of the record at pos (or of a thread to it,
+ * if negative), from the map made by avl_file_squash() or
+ * avl_file_reorganize().
+ * This function should only be called by other avl_file functions.
+ */
+static off_t
+avl_file_rmap (AVL_FILE *avl_fp, off_t *map, int64_t n, off_t pos)
+{
+   int64_t i;
+   off_t p;
+
+   if (pos == 0) return (0);
+   p = (pos < 0) ? -pos : pos;
+   i = (p - avl_fp->hdrlen) / avl_fp->reclen;
+   if ((p < avl_fp->hdrlen) || (i >= n) || (map[i] == 0)) 
+      avl_file_fatal (avl_fp, "166 corrupted file, bad record pointer");
+   p = (map[i] < 0) ? -map[i] : map[i];
+   return ((pos < 0) ? -p : p);
+}
+
+
+/* --------------------------------------------------- avl_file_squash
+ * Move the records at the end of the file into the empty records
+ * and shorten it. Shortening is limited to the last 'current-pointer'
+ * record for files opened more than once.
+ *
+ * The new position of every record is found first, in a map with one
+ * entry for each record in the file (zero for the empty records, and
+ * negative for the current-pointer records), from the empty list (or
+ * the free-space map) and the current-pointer list. Then one pass through the file moves the 
+ * records and changes their pointers, and one pass through the
+ * current-pointer list changes theirs.
+ * Returns the number of records moved, or -1 for an error.
+ */
+int64_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_squash_t (AVL_FILE *avl_fp) 
+#else
+avl_file_squash (AVL_FILE *avl_fp) 
+#endif
+{
+   int32_t fd, reclen, d, changed;
+
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;        // AVL record data length
+      int32_t reclen;     // AVL record length including key nodes
+      uint32_t gen;       // generation, changed by every update
+      int64_t n_avl;      // number of AVL records 
+      int64_t nextnum;    // unique record numbers 
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;     // doubly linked
+      off_t head_empty;   // singly linked
+      off_t head_cpr;     // singly linked
+   } hdr;
+
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;   // prev used as sequential pointer in 'cpr' records
+      char b[avl_fp->len];
+   } cpr, spr, ar, *rp;
+   off_t cp, sp, a, y, lim, head, *map;
+   int64_t n, i, lo, hi, e, oc, count, moved;
+
+
+   unsetenv (AVL_FILE_EMSG_VNAME);
+   fd = avl_fp->fd;
+   reclen = avl_fp->reclen;
+
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_WRLCK);
+
+   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+
+   avl_file_cpr_free (avl_fp, &lim, &hdr.head_cpr, &hdr.head_empty);
+   avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+
+   moved = 0;
+   n = (lim - avl_fp->hdrlen) / reclen;
+   map = calloc (n + 1, sizeof (off_t));
+   if (map == NULL) {
+      setenv (AVL_FILE_EMSG_VNAME, "61 malloc returned NULL", 1);
+      moved = -1;
+      goto af_squash_return;
+   }
+
+  /*
+   * Every record that is not empty keeps its position for now. The
+   * current-pointer records are negative, and this process's record
+   * (oc) is the only one of them that can be moved.
+   */
+   for (i = 0; i < n; i++) map[i] = avl_fp->hdrlen + i * reclen;
+   count = n;
+
+   if ((avl_fp->fmap != NULL) && !avl_fp->fmap->valid) avl_file_fbuild (avl_fp, &lim, &hdr.head_empty);
+   for (sp = hdr.head_empty; sp > 0; sp = spr.next) {
+      i = (sp - avl_fp->hdrlen) / reclen;
+      if ((sp < avl_fp->hdrlen) || (i >= n) || ((sp - avl_fp->hdrlen) % reclen != 0) ||
+          (map[i] != sp)) {
+         setenv (AVL_FILE_EMSG_VNAME, "62 corrupted file, bad empty list pointer", 1);
+         moved = -1;
+         goto af_squash_return;
+      }
+      avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
+      map[i] = 0;
+      count--;
+   }
+   if (avl_fp->fmap != NULL) {
+      for (i = avl_file_fnext (avl_fp, 0); (i >= 0) && (i < n); i = avl_file_fnext (avl_fp, i + 1)) {
+         if (map[i] == 0) {
+            setenv (AVL_FILE_EMSG_VNAME, "62 corrupted file, bad empty list pointer", 1);
+            moved = -1;
+            goto af_squash_return;
          }
+         map[i] = 0;
+         count--;
+      }
+   }
+
+   oc = -1;
+   for (cp = hdr.head_cpr; cp > 0; cp = cpr.next) {
+      i = (cp - avl_fp->hdrlen) / reclen;
+      if ((cp < avl_fp->hdrlen) || (i >= n) || ((cp - avl_fp->hdrlen) % reclen != 0) ||
+          (map[i] != cp)) {
+         setenv (AVL_FILE_EMSG_VNAME, "63 corrupted file, bad current-pointer list", 1);
+         moved = -1;
+         goto af_squash_return;
+      }
+      avl_file_cread (avl_fp, &lim, cp, &cpr, reclen);
+      map[i] = -cp;
+      if (cp == avl_fp->cpr) oc = i;
+      count--;
+   }
+
+   if (count != hdr.n_avl) {
+      setenv (AVL_FILE_EMSG_VNAME, "64 corrupted file, count != hdr.n_avl", 1);
+      moved = -1;
+      goto af_squash_return;
+   }
+
+  /*
+   * Fill the first empty record with the last record that can be 
+   * moved, and so on, until they meet. The records before lo are then
+   * all in use.
+   */
+   lo = 0; hi = n - 1;
+   for (;;) {
+      while ((lo < hi) && (map[lo] != 0)) lo++;
+      while ((lo < hi) && ((map[hi] == 0) || ((map[hi] < 0) && (hi != oc)))) hi--;
+      if (lo >= hi) break;
+      map[hi] = (map[hi] < 0) ? -(avl_fp->hdrlen + lo * reclen) : avl_fp->hdrlen + lo * reclen;
+      moved++;
+      lo++; hi--;
+   }
+
+  /*
+   * Move the records and change their pointers, in one pass through
+   * the file. A record is only written over an empty record, which 
+   * the pass has skipped, or over itself.
+   */
+   for (i = 0; i < n; i++) {
+      if (map[i] <= 0) continue;
+      y = avl_fp->hdrlen + i * reclen;
+      rp = avl_file_fref (avl_fp, &lim, y, &ar, reclen);
+      if (rp != &ar) memcpy (&ar, rp, reclen);
+
+      changed = (map[i] != y);
+      for (d = 0; d < avl_fp->n_keys; d++) {
+         a = avl_file_rmap (avl_fp, map, n, ar.n[d].l);
+         if (a != ar.n[d].l) { ar.n[d].l = a; changed = 1; }
+         a = avl_file_rmap (avl_fp, map, n, ar.n[d].r);
+         if (a != ar.n[d].r) { ar.n[d].r = a; changed = 1; }
+      }
+      a = avl_file_rmap (avl_fp, map, n, ar.prev);
+      if (a != ar.prev) { ar.prev = a; changed = 1; }
+      a = avl_file_rmap (avl_fp, map, n, ar.next);
+      if (a != ar.next) { ar.next = a; changed = 1; }
+
+      if (changed) avl_file_fwrite (avl_fp, &lim, map[i], &ar, reclen);
+   }
+
+  /*
+   * Change the current-pointer records, moving this process's record
+   * and its lock if needed.
+   */
+   for (cp = hdr.head_cpr; cp > 0; cp = sp) {
+      avl_file_cread (avl_fp, &lim, cp, &cpr, reclen);
+      sp = cpr.next;
+      for (d = 0; d < avl_fp->n_keys; d++) {
+         cpr.n[d].l = avl_file_rmap (avl_fp, map, n, cpr.n[d].l);
+         cpr.n[d].r = avl_file_rmap (avl_fp, map, n, cpr.n[d].r);
+      }
+      cpr.prev = avl_file_rmap (avl_fp, map, n, cpr.prev);
+      cpr.next = avl_file_rmap (avl_fp, map, n, cpr.next);
+      y = avl_file_rmap (avl_fp, map, n, cp);
+      avl_file_cwrite (avl_fp, &lim, y, &cpr, reclen);
+      if (y != cp) {
+         avl_file_plock (fd, F_UNLCK, cp, reclen);
+         avl_file_plock (fd, F_WRLCK, y, reclen);
+         avl_fp->cpr = y;
+      }
+   }
+
+  /*
+   * The file ends after the last record that is in use, and the
+   * records after lo that are not in use (now) are the new empty list,
+   * or the only empty records in the free-space map.
+   */
+   for (e = n; e > lo; e--) {
+      y = avl_fp->hdrlen + (e - 1) * reclen;
+      if ((map[e-1] == y) || (map[e-1] == -y)) break;
+   }
+   head = 0;
+   if (avl_fp->fmap != NULL) avl_file_fclear (avl_fp);
+   memset (&ar, 0, reclen);
+   for (d = 0; d < avl_fp->n_keys; d++) ar.n[d].b = 0x40;
+   for (i = e - 1; i >= lo; i--) {
+      y = avl_fp->hdrlen + i * reclen;
+      if ((map[i] == y) || (map[i] == -y)) continue;
+      avl_file_efree (avl_fp, &lim, &head, y, &ar.next);
+      avl_file_fwrite (avl_fp, &lim, y, &ar, reclen);
+   }
+
+   for (d = 0; d < avl_fp->n_keys; d++) hdr.root[d] = avl_file_rmap (avl_fp, map, n, hdr.root[d]);
+   hdr.head_seq = avl_file_rmap (avl_fp, map, n, hdr.head_seq);
+   hdr.head_cpr = avl_file_rmap (avl_fp, map, n, hdr.head_cpr);
+   hdr.head_empty = head;
+   avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+
+   y = avl_fp->hdrlen + e * reclen;
+   if (y < lim) {
+      if (avl_file_ftruncate (avl_fp, y) != 0) {
+         setenv (AVL_FILE_EMSG_VNAME, "60 ftruncate failed", 1);
+         moved = -1;
+      } else {
+         lim = y;
+      }
+   }
+
+   if (avl_fp->mode & AVL_FILE_MMAP) avl_file_lmap (avl_fp, lim);
+   if (avl_fp->cache != NULL) avl_file_cache_clear (avl_fp->cache);
+
+af_squash_return:
+   free (map);
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (moved);
+}
+
+
+/*------------------------------------------- avl_file_offcmp
+ * Compare two file positions, for qsort().
+ * This function should only be called by other avl_file functions.
+ */
+static int
+avl_file_offcmp (const void *a, const void *b)
+{
+   off_t x = *(const off_t *) a, y = *(const off_t *) b;
+
+   return ((x < y) ? -1 : (x > y));
+}
+
+
+/* --------------------------------------------------- avl_file_squash_step
+ * Do a part of avl_file_squash(): move at most budget records from the
+ * end of the file into the first empty records, and shorten the file
+ * past them and any empty records at the end. The file is only locked
+ * for the one step, so other processes can read and write the file 
+ * between steps. Call it until it returns 0.
+ * Returns the number of records the file was shortened by, or -1 for
+ * an error.
+ */
+int64_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_squash_step_t (AVL_FILE *avl_fp, int64_t budget) 
+#else
+avl_file_squash_step (AVL_FILE *avl_fp, int64_t budget) 
+#endif
+{
+   int32_t fd, reclen;
+
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;        // AVL record data length
+      int32_t reclen;     // AVL record length including key nodes
+      uint32_t gen;       // generation, changed by every update
+      int64_t n_avl;      // number of AVL records 
+      int64_t nextnum;    // unique record numbers 
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;     // doubly linked
+      off_t head_empty;   // singly linked
+      off_t head_cpr;     // singly linked
+   } hdr;
 
-         pa[m] = pa[l]; par[m] = par[l]; l--;
-         par[m].n[k] = yr.n[k];
-         avl_file_lwrite (avl_fp, &lim, pa[m], &par[m], reclen);
+   struct avl_struct {
+      struct avl_node_struct n[avl_fp->n_keys];
+      off_t prev, next;   // prev used as sequential pointer in 'cpr' records
+      char b[avl_fp->len];
+   } cpr, spr, yr, zr, par[128];
+   off_t *ls, *srt, *mv, cp, sp, b, y, z, t, pa[128], lim, lim0, head_cpr, head_empty;
+   int64_t e, max_e, f, i, hi, m, pk, ret;
+   int32_t j, k, l, c, updated, stack[128];
+   void *p;
 
-         if (yr.n[k].r > 0) {
-            sp = ur.n[k].r;
-            avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
-            spr.n[k].l = -pa[m];
-            avl_file_lwrite (avl_fp, &lim, sp, &spr, reclen);
-         }
 
-         if (m == 0) {
-            hdr.root[k] = pa[m];
-         } else {
-            if (par[m-1].n[k].l == y) 
-               par[m-1].n[k].l = pa[m];
-            else
-               par[m-1].n[k].r = pa[m];
-            avl_file_lwrite (avl_fp, &lim, pa[m-1], &par[m-1], reclen);
-         }
+   unsetenv (AVL_FILE_EMSG_VNAME);
+   fd = avl_fp->fd;
+   reclen = avl_fp->reclen;
+   ls = srt = mv = NULL;
+   ret = 0;
 
-      } else if (par[l].n[k].r > 0) {
-         pa[l+1] = par[l].n[k].r; l++;
-         avl_file_lread (avl_fp, &lim, pa[l], &par[l], reclen);
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_WRLCK);
+   lim0 = lim;
 
-         if (par[l].n[k].l > 0) {
-            while (par[l].n[k].l > 0) {
-               pa[l+1] = par[l].n[k].l; l++;
-               avl_file_lread (avl_fp, &lim, pa[l], &par[l], reclen);
-            }
+   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+   head_cpr = hdr.head_cpr;
+   head_empty = hdr.head_empty;
+   avl_file_cpr_free (avl_fp, &lim, &hdr.head_cpr, &hdr.head_empty);
+   f = 0;
+   if (avl_fp->fmap != NULL) {
+      if (!avl_fp->fmap->valid) avl_file_fbuild (avl_fp, &lim, &hdr.head_empty);
+      f = ((struct avl_file_fhdr_struct *) avl_fp->fmap->map)->n_free;
+   }
 
-            if (par[l].n[k].r > 0) {
-               par[l-1].n[k].l = par[l].n[k].r;
-            } else {
-               par[l-1].n[k].l = -pa[l];
-            }
-            par[l-1].n[k].b -= 1;
-            avl_file_lwrite (avl_fp, &lim, pa[l-1], &par[l-1], reclen);
-         } else {
-            yr.n[k].r = par[l].n[k].r;
-            yr.n[k].b += 1;
+  /*
+   * Get the empty list, in list order (ls) and sorted (srt). With the
+   * free-space map, the list is empty, and srt is filled from the map
+   * as the records to move are chosen.
+   */
+   max_e = (lim - avl_fp->hdrlen) / reclen;
+   e = 0;
+   for (sp = hdr.head_empty; sp > 0; sp = spr.next) {
+      if ((sp < avl_fp->hdrlen) || (sp >= lim) || ((sp - avl_fp->hdrlen) % reclen != 0) ||
+          (e >= max_e)) {
+         setenv (AVL_FILE_EMSG_VNAME, "67 corrupted file, bad empty list pointer", 1);
+         ret = -1;
+         goto af_squash_step_return;
+      }
+      if ((e & (e - 1)) == 0) {
+         p = realloc (ls, 2 * (e + 1) * sizeof (off_t));
+         if (p == NULL) {
+            setenv (AVL_FILE_EMSG_VNAME, "68 malloc returned NULL", 1);
+            ret = -1;
+            goto af_squash_step_return;
          }
+         ls = p;
+      }
+      ls[e++] = sp;
+      avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
+   }
 
-         pa[m] = pa[l]; par[m] = par[l]; l--;
-         par[m].n[k] = yr.n[k];
-         avl_file_lwrite (avl_fp, &lim, pa[m], &par[m], reclen);
+   if (budget < 0) budget = 0;
+   srt = malloc ((e + f + 1) * sizeof (off_t));
+   mv = malloc (((budget < e + f) ? budget + 1 : e + f + 1) * sizeof (off_t));
+   if ((srt == NULL) || (mv == NULL)) {
+      setenv (AVL_FILE_EMSG_VNAME, "68 malloc returned NULL", 1);
+      ret = -1;
+      goto af_squash_step_return;
+   }
+   if (e > 0) memcpy (srt, ls, e * sizeof (off_t));
+   qsort (srt, e, sizeof (off_t), avl_file_offcmp);
+   for (i = 1; i < e; i++) {
+      if (srt[i] == srt[i-1]) {
+         setenv (AVL_FILE_EMSG_VNAME, "67 corrupted file, bad empty list pointer", 1);
+         ret = -1;
+         goto af_squash_step_return;
+      }
+   }
 
-         if (yr.n[k].l > 0) {
-            sp = ur.n[k].l;
-            avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
-            spr.n[k].r = -pa[m];
-            avl_file_lwrite (avl_fp, &lim, sp, &spr, reclen);
+  /*
+   * Going back from the end of the file, skip the empty records, and
+   * choose the records to move, each to the first empty record that
+   * has not been taken (srt[m]), up to budget records. The file will
+   * end at t.
+   * Another process's current-pointer record can not be moved.
+   */
+   t = lim;
+   hi = e - 1;
+   m = 0;
+   while (t > avl_fp->hdrlen) {
+      y = t - reclen;
+      if (avl_fp->fmap != NULL) {
+         i = (y - avl_fp->hdrlen) / reclen;
+         if (((m == 0) || (y > srt[m-1])) && (avl_file_fnext (avl_fp, i) == i)) {
+            t = y;
+            continue;
          }
-
-         if (m == 0) {
-            hdr.root[k] = pa[m];
-         } else {
-            if (par[m-1].n[k].l == y)
-               par[m-1].n[k].l = pa[m]; 
-            else
-               par[m-1].n[k].r = pa[m]; 
-            avl_file_lwrite (avl_fp, &lim, pa[m-1], &par[m-1], reclen);
+         if ((m >= budget) || (m >= f)) break;
+         i = avl_file_fnext (avl_fp, (m == 0) ? 0 : (srt[m-1] - avl_fp->hdrlen) / reclen + 1);
+         if ((i < 0) || (avl_fp->hdrlen + i * reclen >= y)) break;
+         srt[m] = avl_fp->hdrlen + i * reclen;
+      } else {
+         if ((hi >= m) && (srt[hi] == y)) {
+            hi--;
+            t = y;
+            continue;
          }
+         if ((m >= budget) || (m > hi)) break;
+      }
 
-      } else {              // no sub-trees
-         if (m == 0) {
-            hdr.root[k] = 0;
+      for (cp = hdr.head_cpr; (cp > 0) && (cp != y); cp = cpr.next) {
+         avl_file_cread (avl_fp, &lim, cp, &cpr, reclen);
+      }
+      if ((cp == y) && (y != avl_fp->cpr)) break;
+
+      mv[m++] = y;
+      t = y;
+   }
+
+  /*
+   * Move the records, changing the pointers to each.
+   */
+   for (i = 0; i < m; i++) {
+      y = mv[i];
+      b = srt[i];
+
+      if (y == avl_fp->cpr) {
+         avl_file_cread (avl_fp, &lim, y, &yr, reclen);
+         avl_file_plock (fd, F_UNLCK, y, reclen);
+
+         if (hdr.head_cpr == y) {
+            hdr.head_cpr = b;
          } else {
-            if (par[m-1].n[k].l == y) {
-               par[m-1].n[k].l = yr.n[k].l; 
-               par[m-1].n[k].b -= 1;
-            } else if (par[m-1].n[k].r == y) {
-               par[m-1].n[k].r = yr.n[k].r; 
-               par[m-1].n[k].b += 1;
+            for (sp = hdr.head_cpr; sp > 0; sp = spr.next) {
+               avl_file_cread (avl_fp, &lim, sp, &spr, reclen);
+               if (spr.next == y) {
+                  spr.next = b;
+                  avl_file_cwrite (avl_fp, &lim, sp, &spr, reclen);
+                  break;
+               }
             }
-            avl_file_lwrite (avl_fp, &lim, pa[m-1], &par[m-1], reclen);
          }
-         l--;
+         avl_file_cwrite (avl_fp, &lim, b, &yr, reclen);
+
+         avl_file_plock (fd, F_WRLCK, b, reclen);
+         avl_fp->cpr = b;
+         continue;
       }
 
+      avl_file_lread (avl_fp, &lim, y, &yr, reclen);
+      avl_file_lwrite (avl_fp, &lim, b, &yr, reclen);
+
      /*
-      * Re-balance.
+      * Change its neighbours on the sequential list.
       */
-      while (l >= 0) {
-         a = pa[l]; ar = par[l];
+      if (yr.next > 0) {
+         z = yr.next;
+         avl_file_lread (avl_fp, &lim, z, &zr, reclen);
+         if (zr.prev != y) {
+            setenv (AVL_FILE_EMSG_VNAME, "69 bad sequential list pointer", 1);
+            ret = -1;
+            break;
+         }
+         zr.prev = b;
+         avl_file_lwrite (avl_fp, &lim, z, &zr, reclen);
+      }
+
+      if (yr.prev > 0) {
+         z = yr.prev;
+         avl_file_lread (avl_fp, &lim, z, &zr, reclen);
+         if (zr.next != y) {
+            setenv (AVL_FILE_EMSG_VNAME, "69 bad sequential list pointer", 1);
+            ret = -1;
+            break;
+         }
+         zr.next = b;
+         avl_file_lwrite (avl_fp, &lim, z, &zr, reclen);
+      } else {
+         hdr.head_seq = b;
+      }
 
+     /*
+      * Find all tree node pointers to 'y' and change them to 'b'.
+      */
+      for (k = 0; k < avl_fp->n_keys; k++) {
         /*
-         * 
+         * Make a path to y. Duplicate keys require some searching.
          */
-         if ((ar.n[k].b == +1) || (ar.n[k].b == -1)) break;
+         l = 0; c = 0;
+         pa[l] = hdr.root[k];
+af_squash_step_loop1:
+         if (pa[l] > 0) {
+            avl_file_lread (avl_fp, &lim, pa[l], &par[l], reclen);
 
-         if (ar.n[k].b == 0) {
-            if (l > 0) {
-               if (par[l-1].n[k].l == a) {
-                  par[l-1].n[k].b -= 1;
-               } else if (par[l-1].n[k].r == a) {
-                  par[l-1].n[k].b += 1;
-               }
-               avl_file_lwrite (avl_fp, &lim, pa[l-1], &par[l-1], reclen);
+            j = avl_file_pcmp (avl_fp, k, yr.b, par[l].b);
+            if (j <= 0) {
+               if (j == 0) stack[c++] = l;
+
+               pa[l+1] = par[l].n[k].l; l++; 
+               goto af_squash_step_loop1;
             }
-            l--;
+af_squash_step_loop2:
+            pa[l+1] = par[l].n[k].r; l++;
+            goto af_squash_step_loop1;
+         }
+         if (c > 0) {
+            l = stack[--c];
+            if (pa[l] != y) goto af_squash_step_loop2;         
+         } else {
+            setenv (AVL_FILE_EMSG_VNAME, "65 not in the tree", 1);	// key k
             continue;
          }
+         if (l > 0) {
+            if (par[l-1].n[k].l == y) 
+               par[l-1].n[k].l = b;
+            else
+               par[l-1].n[k].r = b;
+            avl_file_lwrite (avl_fp, &lim, pa[l-1], &par[l-1], reclen);
+         } else {
+            hdr.root[k] = b;
+         }
 
         /*
-         * Do a rotation around a. Do not decrement l afterwards.
+         * Change thread pointers.
          */
-         if (ar.n[k].b == +2) {
-            b = ar.n[k].l;
-            avl_file_lread (avl_fp, &lim, b, &br, reclen);
-
-            if ((br.n[k].b == 0) || (br.n[k].b == +1)) {
-               if (br.n[k].r > 0) 
-                  ar.n[k].l = br.n[k].r;
-               else
-                  ar.n[k].l = -b;
-               br.n[k].r = a;
-               if (br.n[k].b == 0) {
-                  ar.n[k].b = +1; br.n[k].b = -1;
-               } else {
-                  ar.n[k].b =  0; br.n[k].b =  0;
-               }
-               avl_file_lwrite (avl_fp, &lim, a, &ar, reclen);
-               avl_file_lwrite (avl_fp, &lim, b, &br, reclen);
-
-               pa[l] = b; par[l] = br;
-            } else {
-               c = br.n[k].r;
-               avl_file_lread (avl_fp, &lim, c, &cr, reclen);
-               if (cr.n[k].l > 0) 
-                  br.n[k].r = cr.n[k].l;
-               else
-                  br.n[k].r = -c;
-               if (cr.n[k].r > 0) 
-                  ar.n[k].l = cr.n[k].r;
-               else
-                  ar.n[k].l = -c;
-               cr.n[k].l = b;
-               cr.n[k].r = a;
-               switch (cr.n[k].b) {
-               case +1:
-                  ar.n[k].b = -1; br.n[k].b = 0; break;
-               case -1:
-                  br.n[k].b = +1; ar.n[k].b = 0; break;
-               case 0:
-                  br.n[k].b =  0; ar.n[k].b = 0; break;
-               default:
-                  setenv (AVL_FILE_EMSG_VNAME, "41 invalid value n.b", 1);
-                  break;
-               }
-               cr.n[k].b = 0;
-               avl_file_lwrite (avl_fp, &lim, a, &ar, reclen);
-               avl_file_lwrite (avl_fp, &lim, b, &br, reclen);
-               avl_file_lwrite (avl_fp, &lim, c, &cr, reclen);
-
-               pa[l] = c; par[l] = cr;
+         sp = yr.n[k].l;
+         if (sp > 0) {
+            avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
+            while (spr.n[k].r > 0) {
+               sp = spr.n[k].r;
+               avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
             }
-         } else if (ar.n[k].b == -2) {
-            b = ar.n[k].r; 
-            avl_file_lread (avl_fp, &lim, b, &br, reclen);
-
-            if ((br.n[k].b == 0) || (br.n[k].b == -1)) {
-               if (br.n[k].l > 0) 
-                  ar.n[k].r = br.n[k].l;
-               else
-                  ar.n[k].r = -b;
-               br.n[k].l = a; 
-               if (br.n[k].b == 0) {
-                  ar.n[k].b = -1; br.n[k].b = +1;
-               } else {
-                  ar.n[k].b =  0; br.n[k].b =  0;
-               }
-               avl_file_lwrite (avl_fp, &lim, a, &ar, reclen);
-               avl_file_lwrite (avl_fp, &lim, b, &br, reclen);
-
-               pa[l] = b; par[l] = br;
-            } else {
-               c = br.n[k].l;
-               avl_file_lread (avl_fp, &lim, c, &cr, reclen);
-               if (cr.n[k].l > 0) 
-                  ar.n[k].r = cr.n[k].l;
-               else
-                  ar.n[k].r = -c;
-               if (cr.n[k].r > 0) 
-                  br.n[k].l = cr.n[k].r;
-               else
-                  br.n[k].l = -c;
-               cr.n[k].r = b;
-               cr.n[k].l = a;
-               switch (cr.n[k].b) {
-               case +1: 
-                  br.n[k].b = -1; ar.n[k].b = 0; break;
-               case -1:
-                  ar.n[k].b = +1; br.n[k].b = 0; break;
-               case 0:
-                  br.n[k].b =  0; ar.n[k].b = 0; break;
-               default:
-                  setenv (AVL_FILE_EMSG_VNAME, "42 invalid value n.b", 1);
-                  break;
-               }
-               cr.n[k].b = 0;
-               avl_file_lwrite (avl_fp, &lim, a, &ar, reclen);
-               avl_file_lwrite (avl_fp, &lim, b, &br, reclen);
-               avl_file_lwrite (avl_fp, &lim, c, &cr, reclen);
+            spr.n[k].r = -b;
+            avl_file_lwrite (avl_fp, &lim, sp, &spr, reclen);
+         }
 
-               pa[l] = c; par[l] = cr;
+         sp = yr.n[k].r;
+         if (sp > 0) {
+            avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
+            while (spr.n[k].l > 0) {
+               sp = spr.n[k].l;
+               avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
             }
-         } else {
-            setenv (AVL_FILE_EMSG_VNAME, "43 bad balance factor", 1);	// key  k
-            break;
+            spr.n[k].l = -b;
+            avl_file_lwrite (avl_fp, &lim, sp, &spr, reclen);
          }
+      }
 
-         if (l == 0) {
-            hdr.root[k] = pa[l];
-         } else {
-            if (par[l-1].n[k].l == a) {
-               par[l-1].n[k].l = pa[l];
-            } else if (par[l-1].n[k].r == a) {
-               par[l-1].n[k].r = pa[l];
+     /*
+      * Go through the cpr list changing 'y' pointers to 'b'.
+      */
+      for (cp = hdr.head_cpr; cp > 0; cp = cpr.next) {
+         avl_file_cread (avl_fp, &lim, cp, &cpr, reclen);
+
+         updated = 0;
+
+         if (cpr.prev == y) {
+            cpr.prev = b;
+            updated = 1;
+         }
+
+         for (k = 0; k < avl_fp->n_keys; k++) {
+            if (cpr.n[k].l == y) {
+               cpr.n[k].l = b;
+               updated = 1;
+            }
+            if (cpr.n[k].r == y) {
+               cpr.n[k].r = b;
+               updated = 1;
             }
-            avl_file_lwrite (avl_fp, &lim, pa[l-1], &par[l-1], reclen);
          }
-      } 
-   }
 
+         if (updated == 1) {
+            avl_file_cwrite (avl_fp, &lim, cp, &cpr, reclen);
+         }
+      }
+   }
+   if (ret != 0) {
+      m = i;
+      t = lim;
+   }
 
   /*
-   * Remove y from the sequential list.
+   * Take the records that were filled, and the ones past the new end
+   * of the file, off the empty list. Only the records before a gap in
+   * the list are changed. The ones past the end are taken out of the
+   * free-space map by avl_file_lend().
    */
-   if (yr.next > 0) {
-      a = yr.next;
-      avl_file_lread (avl_fp, &lim, a, &ar, reclen);
-      ar.prev = yr.prev;
-      avl_file_lwrite (avl_fp, &lim, a, &ar, reclen);
+   if (avl_fp->fmap != NULL) {
+      for (i = 0; i < m; i++) avl_file_fset (avl_fp, (srt[i] - avl_fp->hdrlen) / reclen, 0);
    }
-
-   if (hdr.head_seq == y) {
-      hdr.head_seq = yr.next;
-   } else {
-      a = yr.prev;
-      avl_file_lread (avl_fp, &lim, a, &ar, reclen);
-      ar.next = yr.next;
-      avl_file_lwrite (avl_fp, &lim, a, &ar, reclen);
+   pk = -1;
+   for (i = 0; i <= e; i++) {
+      if (i < e) {
+         if (((m > 0) && (ls[i] <= srt[m-1])) || (ls[i] >= t)) continue;
+         y = ls[i];
+      } else {
+         y = 0;
+      }
+      if (i != pk + 1) {
+         if (pk < 0) {
+            hdr.head_empty = y;
+         } else {
+            avl_file_lread (avl_fp, &lim, ls[pk], &spr, reclen);
+            spr.next = y;
+            avl_file_lwrite (avl_fp, &lim, ls[pk], &spr, reclen);
+         }
+      }
+      pk = i;
    }
 
-
-  /*
-   * Add it to the empty list.
-   */
-   yr.next = hdr.head_empty;
-   hdr.head_empty = y;
-   yr.prev = 0;
-   for (i = 0; i < avl_fp->n_keys; i++) {
-      yr.n[i].b = 0x40; yr.n[i].l = 0; yr.n[i].r = 0;
+   if ((m > 0) || (t < lim) || (hdr.head_cpr != head_cpr) || (hdr.head_empty != head_empty)) {
+      avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
    }
-   avl_file_lwrite (avl_fp, &lim, y, &yr, reclen);
 
-   hdr.n_avl--;
-   avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+   if (t < lim) {
+      if (avl_file_ftruncate (avl_fp, t) != 0) {
+         setenv (AVL_FILE_EMSG_VNAME, "66 ftruncate failed", 1);
+         ret = -1;
+      } else {
+         lim = t;
+         if (avl_fp->mode & AVL_FILE_MMAP) avl_file_lmap (avl_fp, lim);
+         if (avl_fp->cache != NULL) avl_file_cache_clear (avl_fp->cache);
+      }
+   }
+   if (ret == 0) ret = (lim0 - lim) / reclen;
 
-af_delete_return:
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_ULOCK, 1);
+af_squash_step_return:
+   free (ls);
+   free (srt);
+   free (mv);
+   avl_file_lend (avl_fp, &lim);
 #ifdef	AVL_FILE_TSAFE
-   sem_post (&avl_fp->sem);
+   pthread_rwlock_unlock (&avl_fp->rwl);
 #endif
    return (ret);
 }
 
 
-/* --------------------------------------------------- avl_file_update
- * Update a record with new information. For trees with multiple
- * keys, all of the keys must match for the update to succeed.
- * The return value is 0 for OK, or -1 for none.
+/*------------------------------------------- avl_file_reorganize
+ * Move the records so that the tree for key k is stored in blocks of
+ * a few levels, each small enough to fit in an AVL_FILE_PAGE byte 
+ * page, starting with the top of the tree. A search by key k then 
+ * reads about one page for each block it passes through, instead of 
+ * one page for each level, when the record cache is on (it reads 
+ * whole pages) or the file is mapped. The empty records are removed
+ * and the file is shortened, but the current-pointer records are not
+ * moved. If expected is not NULL, it gets the average number of pages
+ * a search for a record would read if the blocks were aligned with
+ * the pages. Compare it with avl_file_pages().
+ * Returns 0 if successful.
  */
-int32_t 
+int32_t
 #ifdef	AVL_FILE_TSAFE
-avl_file_update_t (AVL_FILE *avl_fp, void *data) 
+avl_file_reorganize_t (AVL_FILE *avl_fp, int32_t k, double *expected)
 #else
-avl_file_update (AVL_FILE *avl_fp, void *data) 
+avl_file_reorganize (AVL_FILE *avl_fp, int32_t k, double *expected)
 #endif
 {
-   int32_t fd, reclen, len, ret;
-
    struct hdr_struct {
       char magic[8];
       int32_t n_keys; 
-      int32_t len;
-      int32_t reclen;
-      int64_t n_avl;
-      int64_t nextnum;
+      int32_t len;        // AVL record data length
+      int32_t reclen;     // AVL record length including key nodes
+      uint32_t gen;       // generation, changed by every update
+      int64_t n_avl;      // number of AVL records 
+      int64_t nextnum;    // unique record numbers 
       off_t root[avl_fp->n_keys];
-      off_t head_seq;
-      off_t head_empty;
-      off_t head_cpr; 
+      off_t head_seq;     // doubly linked
+      off_t head_empty;   // singly linked
+      off_t head_cpr;     // singly linked
    } hdr;
 
    struct avl_struct {
       struct avl_node_struct n[avl_fp->n_keys];
-      off_t prev, next;
+      off_t prev, next;   // prev used as sequential pointer in 'cpr' records
       char b[avl_fp->len];
-   } yr, par[128];
-   off_t y, pa[128], lim;
-   int32_t i, k, l, m, stack[128];
+   } cpr, ar, br, *rp;
+   off_t *map, *st, *qu, y, l, r, cp, lim, head;
+   int64_t n, i, j, e, ns, n_st, max_st, count, total;
+   int32_t reclen, levels, m, h, t, c, *lev, *bd, d, ret;
 
 
-   fd = avl_fp->fd;
+   unsetenv (AVL_FILE_EMSG_VNAME);
+   if ((k < 0) || (k >= avl_fp->n_keys)) {
+      setenv (AVL_FILE_EMSG_VNAME, "160 the key index is out of bounds", 1);
+      return (-1);
+   }
    reclen = avl_fp->reclen;
-   len = avl_fp->len;
+
+  /*
+   * The number of tree levels in a block of at most m records.
+   */
+   m = AVL_FILE_PAGE / reclen;
+   for (levels = 1; (2 << levels) - 1 <= m; levels++);
+   max_st = 129 << levels;
 
 #ifdef	AVL_FILE_TSAFE
-   sem_wait (&avl_fp->sem);
+   avl_file_tlock (avl_fp, F_WRLCK);
 #endif
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_LOCK, 1);
-   lim = lseek (fd, 0, SEEK_END);
+   lim = avl_file_lbegin (avl_fp, F_WRLCK);
 
    avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
 
-   memcpy (yr.b, data, len);
-   y = 0;
+   ret = 0;
+   n = (lim - avl_fp->hdrlen) / reclen;
+   map = calloc (n + 1, sizeof (off_t));
+   st = malloc (max_st * sizeof (off_t));
+   bd = malloc (max_st * sizeof (int32_t));
+   qu = malloc ((1 << levels) * sizeof (off_t));
+   lev = malloc ((1 << levels) * sizeof (int32_t));
+   if ((map == NULL) || (st == NULL) || (bd == NULL) || (qu == NULL) || (lev == NULL)) {
+      setenv (AVL_FILE_EMSG_VNAME, "161 malloc returned NULL", 1);
+      ret = -1;
+      goto af_reorganize_return;
+   }
 
   /*
-   * Find the record. Duplicate keys require some searching.
+   * The map has the new position of the record in each slot of the 
+   * file, negated once the record has been moved. The current-pointer
+   * records stay where they are, so they start out moved.
    */
-   if (avl_fp->n_keys > 0) {
-      k = 0; l = 0; m = 0;
-      pa[l] = hdr.root[k];
-af_update_loop1:
-      if (pa[l] > 0) {
-         avl_file_lread (avl_fp, &lim, pa[l], &par[l], reclen);
-
-         i = avl_fp->cmp (k, yr.b, par[l].b);
-         if (i <= 0) {
-            if (i == 0) stack[m++] = l;
+   e = 0;
+   for (cp = hdr.head_cpr; cp > 0; cp = cpr.next) {
+      i = (cp - avl_fp->hdrlen) / reclen;
+      if ((cp < avl_fp->hdrlen) || (i >= n)) {
+         setenv (AVL_FILE_EMSG_VNAME, "162 corrupted file, bad current-pointer list", 1);
+         ret = -1;
+         goto af_reorganize_return;
+      }
+      avl_file_cread (avl_fp, &lim, cp, &cpr, reclen);
+      map[i] = -cp;
+      if (i >= e) e = i + 1;
+   }
 
-            pa[l+1] = par[l].n[k].l; l++; 
-            goto af_update_loop1;
+  /*
+   * Give the tree records their new positions, one block at a time.
+   * A block is the top levels of a subtree, in breadth-first order,
+   * and it is followed by the blocks of the subtrees below it, from 
+   * left to right.
+   */
+   ns = 0; count = 0; total = 0;
+   n_st = 0;
+   if (hdr.root[k] > 0) {
+      st[n_st] = hdr.root[k];
+      bd[n_st++] = 1;
+   }
+   while (n_st > 0) {
+      n_st--;
+      qu[0] = st[n_st];
+      lev[0] = 0;
+      d = bd[n_st];
+      j = n_st;
+      for (h = 0, t = 1; h < t; h++) {
+         y = qu[h];
+         i = (y - avl_fp->hdrlen) / reclen;
+         if ((y < avl_fp->hdrlen) || (i >= n) || ((y - avl_fp->hdrlen) % reclen != 0) ||
+             (map[i] != 0)) {
+            setenv (AVL_FILE_EMSG_VNAME, "163 corrupted file, bad tree pointer", 1);
+            ret = -1;
+            goto af_reorganize_return;
+         }
+         while (map[ns] == -(avl_fp->hdrlen + ns * reclen)) ns++;
+         map[i] = avl_fp->hdrlen + ns * reclen;
+         ns++;
+         count++;
+         total += d;
+
+         rp = avl_file_nref (avl_fp, &lim, y, &ar);
+         l = rp->n[k].l;
+         r = rp->n[k].r;
+         for (c = 0; c < 2; c++) {
+            y = (c == 0) ? l : r;
+            if (y <= 0) continue;
+            if (lev[h] + 1 < levels) {
+               qu[t] = y;
+               lev[t++] = lev[h] + 1;
+            } else if (n_st < max_st) {
+               st[n_st] = y;
+               bd[n_st++] = d + 1;
+            } else {
+               setenv (AVL_FILE_EMSG_VNAME, "163 corrupted file, bad tree pointer", 1);
+               ret = -1;
+               goto af_reorganize_return;
+            }
          }
-af_update_loop2:
-         pa[l+1] = par[l].n[k].r; l++;
-         goto af_update_loop1;
       }
-      if (m > 0) {
-         l = stack[--m];
-         for (i = 0; i < avl_fp->n_keys; i++) 
-            if (avl_fp->cmp (i, yr.b, par[l].b) != 0) break;
-         if (i < avl_fp->n_keys) goto af_update_loop2;         
-         y = pa[l]; yr = par[l];
+
+     /*
+      * Reverse the subtrees just added, so that the left ones are
+      * taken first.
+      */
+      for (i = j, j = n_st - 1; i < j; i++, j--) {
+         y = st[i]; st[i] = st[j]; st[j] = y;
+         h = bd[i]; bd[i] = bd[j]; bd[j] = h;
       }
    }
-
-   if (y == 0) {
+   if (count != hdr.n_avl) {
+      setenv (AVL_FILE_EMSG_VNAME, "164 corrupted file, count != hdr.n_avl", 1);
       ret = -1;
-   } else {
-      memcpy (yr.b, data, len);
-      avl_file_lwrite (avl_fp, &lim, y, &yr, reclen);
-      ret = 0;
-   }
-
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_ULOCK, 1);
-#ifdef	AVL_FILE_TSAFE
-   sem_post (&avl_fp->sem);
-#endif
-   return (ret);
-}
-
-
-
-/*--------------------------------------------------- avl_file_startlt
- * Using key k, return the first record less than data. The data field
- * is over-written with the file record, if one exists.
- * The return value is 0 for OK, or -1 for none.
- */
-int32_t
-#ifdef	AVL_FILE_TSAFE
-avl_file_startlt_t (AVL_FILE *avl_fp, void *data, int32_t k) 
-#else
-avl_file_startlt (AVL_FILE *avl_fp, void *data, int32_t k) 
-#endif
-{
-   int32_t fd, reclen, ret;
-
-   struct hdr_struct {
-      char magic[8];
-      int32_t n_keys; 
-      int32_t len;
-      int32_t reclen;
-      int64_t n_avl;
-      int64_t nextnum;
-      off_t root[avl_fp->n_keys];
-      off_t head_seq;
-      off_t head_empty;
-      off_t head_cpr; 
-   } hdr;
-
-   struct avl_struct {
-      struct avl_node_struct n[avl_fp->n_keys];
-      off_t prev, next;
-      char b[avl_fp->len];
-   } ar, br, cpr, sr;
-   off_t a, cp, sp, lim;
-
-
-   if ((k < 0) || (k >= avl_fp->n_keys)) {
-      setenv (AVL_FILE_EMSG_VNAME, "70 the key index is out of bounds", 1);
-      return (-1);
+      goto af_reorganize_return;
    }
-   reclen = avl_fp->reclen;
-   fd = avl_fp->fd;
-   cp = avl_fp->cpr;
-   ret = 0;
-
-#ifdef	AVL_FILE_TSAFE
-   sem_wait (&avl_fp->sem);
-#endif
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_LOCK, 1);
-   lim = lseek (fd, 0, SEEK_END);
-
-   memcpy (br.b, data, avl_fp->len);
+   if (expected != NULL) *expected = (count > 0) ? (double) total / count : 0;
 
-   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
-   a = hdr.root[k];
-   while (a > 0) {
-      avl_file_lread (avl_fp, &lim, a, &ar, reclen);
-      if (avl_fp->cmp (k, br.b, ar.b) <= 0) {
-         if (ar.n[k].l > 0)
-            a = ar.n[k].l;
-         else {
-            a = -ar.n[k].l;
-            break;
+  /*
+   * Move the records. Each record that is moved is read first, and
+   * then the record it replaces, if that has not been moved yet, and
+   * so on to the end of the chain. The pointers are changed on the way.
+   */
+   for (i = 0; i < n; i++) {
+      if (map[i] <= 0) continue;
+      rp = avl_file_fref (avl_fp, &lim, avl_fp->hdrlen + i * reclen, &ar, reclen);
+      if (rp != &ar) memcpy (&ar, rp, reclen);
+      for (j = i; ; ) {
+         y = map[j];
+         map[j] = -y;
+         j = (y - avl_fp->hdrlen) / reclen;
+         if (map[j] > 0) {
+            rp = avl_file_fref (avl_fp, &lim, y, &br, reclen);
+            if (rp != &br) memcpy (&br, rp, reclen);
          }
-      } else {
-         if (ar.n[k].r > 0)
-            a = ar.n[k].r;
-         else
-            break;
+         for (d = 0; d < avl_fp->n_keys; d++) {
+            ar.n[d].l = avl_file_rmap (avl_fp, map, n, ar.n[d].l);
+            ar.n[d].r = avl_file_rmap (avl_fp, map, n, ar.n[d].r);
+         }
+         ar.prev = avl_file_rmap (avl_fp, map, n, ar.prev);
+         ar.next = avl_file_rmap (avl_fp, map, n, ar.next);
+         avl_file_fwrite (avl_fp, &lim, y, &ar, reclen);
+         if (map[j] <= 0) break;
+         memcpy (&ar, &br, reclen);
       }
    }
 
-   avl_file_lread (avl_fp, &lim, cp, &cpr, reclen);
+  /*
+   * The slots left before the last tree or current-pointer record 
+   * become the empty records, and the file is shortened after that.
+   */
+   if (ns > e) e = ns;
+   head = 0;
+   if (avl_fp->fmap != NULL) avl_file_fclear (avl_fp);
+   memset (&ar, 0, reclen);
+   for (d = 0; d < avl_fp->n_keys; d++) ar.n[d].b = 0x40;
+   for (i = e - 1; i >= ns; i--) {
+      y = avl_fp->hdrlen + i * reclen;
+      if (map[i] == -y) continue;
+      avl_file_efree (avl_fp, &lim, &head, y, &ar.next);
+      avl_file_fwrite (avl_fp, &lim, y, &ar, reclen);
+   }
+   hdr.head_empty = head;
 
-   if (a > 0) {
-      avl_file_lread (avl_fp, &lim, a, &ar, reclen);
-      memcpy (data, ar.b, avl_fp->len);
+   for (d = 0; d < avl_fp->n_keys; d++) hdr.root[d] = avl_file_rmap (avl_fp, map, n, hdr.root[d]);
+   hdr.head_seq = avl_file_rmap (avl_fp, map, n, hdr.head_seq);
+   avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
 
-      sp = ar.n[k].l; 
-      if (sp > 0) {
-         avl_file_lread (avl_fp, &lim, sp, &sr, reclen);
-         while (sr.n[k].r > 0) {
-            sp = sr.n[k].r;
-            avl_file_lread (avl_fp, &lim, sp, &sr, reclen);
-         }
-      } else {
-         sp = -ar.n[k].l;
+   for (cp = hdr.head_cpr; cp > 0; cp = cpr.next) {
+      avl_file_cread (avl_fp, &lim, cp, &cpr, reclen);
+      for (d = 0; d < avl_fp->n_keys; d++) {
+         cpr.n[d].l = avl_file_rmap (avl_fp, map, n, cpr.n[d].l);
+         cpr.n[d].r = avl_file_rmap (avl_fp, map, n, cpr.n[d].r);
       }
-      cpr.n[k].l = sp;
+      cpr.prev = avl_file_rmap (avl_fp, map, n, cpr.prev);
+      avl_file_cwrite (avl_fp, &lim, cp, &cpr, reclen);
+   }
 
-      sp = ar.n[k].r; 
-      if (sp > 0) {
-         avl_file_lread (avl_fp, &lim, sp, &sr, reclen);
-         while (sr.n[k].l > 0) {
-            sp = sr.n[k].l;
-            avl_file_lread (avl_fp, &lim, sp, &sr, reclen);
-         }
+   y = avl_fp->hdrlen + e * reclen;
+   if (y < lim) {
+      if (avl_file_ftruncate (avl_fp, y) != 0) {
+         setenv (AVL_FILE_EMSG_VNAME, "165 ftruncate failed", 1);
+         ret = -1;
       } else {
-         sp = -ar.n[k].r;
+         lim = y;
       }
-      cpr.n[k].r = sp;
-   } else {
-      cpr.n[k].l = 0;
-      cpr.n[k].r = 0;
-      ret = -1;
    }
-
-   avl_file_lwrite (avl_fp, &lim, cp, &cpr, reclen);
-
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_ULOCK, 1);
+   if (avl_fp->mode & AVL_FILE_MMAP) avl_file_lmap (avl_fp, lim);
+   if (avl_fp->cache != NULL) avl_file_cache_clear (avl_fp->cache);
+
+af_reorganize_return:
+   free (map);
+   free (st);
+   free (bd);
+   free (qu);
+   free (lev);
+   avl_file_lend (avl_fp, &lim);
 #ifdef	AVL_FILE_TSAFE
-   sem_post (&avl_fp->sem);
+   pthread_rwlock_unlock (&avl_fp->rwl);
 #endif
    return (ret);
 }
 
 
-/*--------------------------------------------------- avl_file_startge
- * Using key k, return the first record greater than or equal to data.
- * The data field is over-written with the file record, if one exists.
- * The return value is 0 for OK, or -1 for none.
+/*------------------------------------------- avl_file_pages
+ * Get the average number of AVL_FILE_PAGE byte pages of the file 
+ * read by a search by key k that ends at a record, over all of the
+ * records. A record that crosses a page boundary is in two pages, 
+ * and a page is counted once for each search.
+ * Returns 0 if successful.
  */
-int32_t 
+int32_t
 #ifdef	AVL_FILE_TSAFE
-avl_file_startge_t (AVL_FILE *avl_fp, void *data, int32_t k) 
+avl_file_pages_t (AVL_FILE *avl_fp, int32_t k, double *pages)
 #else
-avl_file_startge (AVL_FILE *avl_fp, void *data, int32_t k) 
+avl_file_pages (AVL_FILE *avl_fp, int32_t k, double *pages)
 #endif
 {
-   int32_t fd, reclen, ret;
-
    struct hdr_struct {
       char magic[8];
       int32_t n_keys; 
-      int32_t len;      // AVL record data length
-      int32_t reclen;   // AVL record length including key nodes
-      int64_t n_avl;    // number of AVL records 
-      int64_t nextnum;  // unique record numbers 
+      int32_t len;        // AVL record data length
+      int32_t reclen;     // AVL record length including key nodes
+      uint32_t gen;       // generation, changed by every update
+      int64_t n_avl;      // number of AVL records 
+      int64_t nextnum;    // unique record numbers 
       off_t root[avl_fp->n_keys];
-      off_t head_seq;
-      off_t head_empty;
-      off_t head_cpr; 
+      off_t head_seq;     // doubly linked
+      off_t head_empty;   // singly linked
+      off_t head_cpr;     // singly linked
    } hdr;
 
    struct avl_struct {
       struct avl_node_struct n[avl_fp->n_keys];
       off_t prev, next;
       char b[avl_fp->len];
-   } ar, br, cpr, sr;
-   off_t a, cp, sp, lim;
+   } ar, *rp;
+   off_t st[256], p0[128], p1[128], y, lim;
+   int64_t tc[128], count, total;
+   int32_t sd[256], n_st, d, i, ret;
 
 
+   unsetenv (AVL_FILE_EMSG_VNAME);
    if ((k < 0) || (k >= avl_fp->n_keys)) {
-      setenv (AVL_FILE_EMSG_VNAME, "80 the key index is out of bounds", 1);
+      setenv (AVL_FILE_EMSG_VNAME, "170 the key index is out of bounds", 1);
       return (-1);
    }
-   reclen = avl_fp->reclen;
-   fd = avl_fp->fd;
-   cp = avl_fp->cpr;
-   ret = 0;
 
 #ifdef	AVL_FILE_TSAFE
-   sem_wait (&avl_fp->sem);
+   avl_file_tlock (avl_fp, F_RDLCK);
 #endif
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_LOCK, 1);
-   lim = lseek (fd, 0, SEEK_END);
-
-   memcpy (br.b, data, avl_fp->len);
+   lim = avl_file_lbegin (avl_fp, F_RDLCK);
 
    avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
-   a = hdr.root[k];
-   while (a > 0) {
-      avl_file_lread (avl_fp, &lim, a, &ar, reclen);
-      if (avl_fp->cmp (k, br.b, ar.b) <= 0) {
-         if (ar.n[k].l > 0)
-            a = ar.n[k].l;
-         else
-            break;
-      } else {
-         if (ar.n[k].r > 0)
-            a = ar.n[k].r;
-         else {
-            a = -ar.n[k].r;
-            break;
-         }
-      }
-   }
-
-   avl_file_lread (avl_fp, &lim, cp, &cpr, reclen);
-
-   if (a > 0) {
-      avl_file_lread (avl_fp, &lim, a, &ar, reclen);
-      memcpy (data, ar.b, avl_fp->len);
 
-      sp = ar.n[k].l; 
-      if (sp > 0) {
-         avl_file_lread (avl_fp, &lim, sp, &sr, reclen);
-         while (sr.n[k].r > 0) {
-            sp = sr.n[k].r;
-            avl_file_lread (avl_fp, &lim, sp, &sr, reclen);
-         }
-      } else {
-         sp = -ar.n[k].l;
+  /*
+   * Go through the tree depth first, keeping the pages of the 
+   * records on the path to the root.
+   */
+   ret = 0;
+   count = 0; total = 0;
+   n_st = 0;
+   if (hdr.root[k] > 0) {
+      st[n_st] = hdr.root[k];
+      sd[n_st++] = 0;
+   }
+   while (n_st > 0) {
+      n_st--;
+      y = st[n_st];
+      d = sd[n_st];
+      if (d >= 128) {
+         setenv (AVL_FILE_EMSG_VNAME, "171 corrupted file, tree too deep", 1);
+         ret = -1;
+         break;
       }
-      cpr.n[k].l = sp;
+      p0[d] = y / AVL_FILE_PAGE;
+      p1[d] = (y + avl_fp->reclen - 1) / AVL_FILE_PAGE;
+      tc[d] = (d > 0) ? tc[d-1] : 0;
+      for (i = 0; (i < d) && (p0[i] != p0[d]) && (p1[i] != p0[d]); i++);
+      if (i == d) tc[d]++;
+      if (p1[d] != p0[d]) {
+         for (i = 0; (i < d) && (p0[i] != p1[d]) && (p1[i] != p1[d]); i++);
+         if (i == d) tc[d]++;
+      }
+      total += tc[d];
+      count++;
 
-      sp = ar.n[k].r; 
-      if (sp > 0) {
-         avl_file_lread (avl_fp, &lim, sp, &sr, reclen);
-         while (sr.n[k].l > 0) {
-            sp = sr.n[k].l;
-            avl_file_lread (avl_fp, &lim, sp, &sr, reclen);
-         }
-      } else {
-         sp = -ar.n[k].r;
+      rp = avl_file_nref (avl_fp, &lim, y, &ar);
+      if (rp->n[k].r > 0) {
+         st[n_st] = rp->n[k].r;
+         sd[n_st++] = d + 1;
+      }
+      if (rp->n[k].l > 0) {
+         st[n_st] = rp->n[k].l;
+         sd[n_st++] = d + 1;
       }
-      cpr.n[k].r = sp;
-   } else {
-      cpr.n[k].l = 0;
-      cpr.n[k].r = 0;
-      ret = -1;
    }
 
-   avl_file_lwrite (avl_fp, &lim, cp, &cpr, reclen);
-
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_ULOCK, 1);
+   avl_file_lend (avl_fp, &lim);
 #ifdef	AVL_FILE_TSAFE
-   sem_post (&avl_fp->sem);
+   pthread_rwlock_unlock (&avl_fp->rwl);
 #endif
+   if (pages != NULL) *pages = (count > 0) ? (double) total / count : 0;
    return (ret);
 }
 
 
-/*--------------------------------------------------- avl_file_next
- * Using key k, read the next record into data buffer. 
- * Separate pointers are maintained for the 'previous' and 'next' functions. 
- * The return value is 0 for OK, or -1 for none.
+/*------------------------------------------- avl_file_free_policy
+ * Choose the empty record that each new record is put into, for a
+ * file with a free-space map (see avl_file_open_free()): 
+ * AVL_FILE_FREE_LOWEST, the first one in the file (the default), 
+ * which keeps the records packed at the start of the file, or
+ * AVL_FILE_FREE_NEAR, one near the record in the key 0 tree that the
+ * new record goes under, if there is one within a few pages, which 
+ * keeps the records near each other by key 0. The policy is only 
+ * for this AVL_FILE.
+ * Returns 0 if successful.
  */
-int32_t 
+int32_t
 #ifdef	AVL_FILE_TSAFE
-avl_file_next_t (AVL_FILE *avl_fp, void *data, int32_t k) 
+avl_file_free_policy_t (AVL_FILE *avl_fp, int32_t policy)
 #else
-avl_file_next (AVL_FILE *avl_fp, void *data, int32_t k) 
+avl_file_free_policy (AVL_FILE *avl_fp, int32_t policy)
 #endif
 {
-   int32_t fd, reclen, ret;
+   int32_t ret;
 
-   struct avl_struct {
-      struct avl_node_struct n[avl_fp->n_keys];
-      off_t prev, next;
-      char b[avl_fp->len];
-   } ar, cpr, sr;
-   off_t a, cp, sp, lim;
+   unsetenv (AVL_FILE_EMSG_VNAME);
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_WRLCK);
+#endif
+   ret = 0;
+   if (avl_fp->fmap == NULL) {
+      setenv (AVL_FILE_EMSG_VNAME, "185 the file has no free-space map", 1);
+      ret = -1;
+   } else if ((policy != AVL_FILE_FREE_LOWEST) && (policy != AVL_FILE_FREE_NEAR)) {
+      setenv (AVL_FILE_EMSG_VNAME, "186 bad free-space policy", 1);
+      ret = -1;
+   } else {
+      avl_fp->fmap->policy = policy;
+   }
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (ret);
+}
 
 
-   if ((k < 0) || (k >= avl_fp->n_keys)) {
-      setenv (AVL_FILE_EMSG_VNAME, "90 the key index is out of bounds", 1);
+/*
+ * Sort state for avl_file_bulk_load(). The entries are the record 
+ * data followed by the int64_t record index, sorted by key k. When 
+ * there are more than n_max entries, sorted runs are written to a 
+ * temporary file and merged at the end.
+ */
+struct avl_file_bsort_struct {
+   avl_file_cmp_fn_t cmp;
+   AVL_FILE_SEG *seg;        // key schema instead, or NULL
+   int32_t *kseg;
+   int32_t k, len, esize;    // key, data length, entry size
+   int64_t n_max, n;         // entries per run, entries in memory
+   char *buf;                // entries in memory
+   char **v, **t;            // entry pointers, and merge sort space
+   FILE *fp;                 // runs, or NULL
+   int32_t n_runs;
+   int64_t *run_n;           // run lengths
+};
+
+
+/*------------------------------------------- avl_file_bcmp
+ * Compare two entries by the sort key.
+ */
+static int32_t
+avl_file_bcmp (struct avl_file_bsort_struct *bs, const void *a, const void *b)
+{
+   if (bs->seg == NULL) return (bs->cmp (bs->k, a, b));
+   return (avl_file_scmp (bs->seg + bs->kseg[bs->k], bs->kseg[bs->k+1] - bs->kseg[bs->k], a, b));
+}
+
+
+/*------------------------------------------- avl_file_bmsort
+ * Merge sort n entry pointers (stable, so records with equal keys
+ * stay in file order).
+ */
+static void
+avl_file_bmsort (struct avl_file_bsort_struct *bs, char **v, char **t, int64_t n)
+{
+   int64_t i, j, m, o;
+
+   if (n < 2) return;
+   m = n / 2;
+   avl_file_bmsort (bs, v, t, m);
+   avl_file_bmsort (bs, v + m, t, n - m);
+
+   i = 0; j = m; o = 0;
+   while ((i < m) && (j < n)) {
+      if (avl_file_bcmp (bs, v[j], v[i]) < 0)
+         t[o++] = v[j++];
+      else
+         t[o++] = v[i++];
+   }
+   while (i < m) t[o++] = v[i++];
+   while (j < n) t[o++] = v[j++];
+   memcpy (v, t, n * sizeof (char *));
+}
+
+
+/*------------------------------------------- avl_file_bspill
+ * Sort the entries in memory and write them as a run.
+ * Returns 0 if successful.
+ */
+static int32_t
+avl_file_bspill (struct avl_file_bsort_struct *bs)
+{
+   int64_t i, *p;
+
+   if (bs->fp == NULL) {
+      bs->fp = tmpfile ();
+      if (bs->fp == NULL) {
+         setenv (AVL_FILE_EMSG_VNAME, "142 tmpfile failed", 1);
+         return (-1);
+      }
+   }
+   p = realloc (bs->run_n, (bs->n_runs + 1) * sizeof (int64_t));
+   if (p == NULL) {
+      setenv (AVL_FILE_EMSG_VNAME, "143 malloc returned NULL", 1);
       return (-1);
    }
-   reclen = avl_fp->reclen;
-   fd = avl_fp->fd;
-   cp = avl_fp->cpr;
-   ret = 0;
+   bs->run_n = p;
 
-#ifdef	AVL_FILE_TSAFE
-   sem_wait (&avl_fp->sem);
-#endif
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_LOCK, 1);
-   lim = lseek (fd, 0, SEEK_END);
+   avl_file_bmsort (bs, bs->v, bs->t, bs->n);
+   for (i = 0; i < bs->n; i++) {
+      if (fwrite (bs->v[i], bs->esize, 1, bs->fp) != 1) {
+         setenv (AVL_FILE_EMSG_VNAME, "144 temporary file write failed", 1);
+         return (-1);
+      }
+   }
+   bs->run_n[bs->n_runs++] = bs->n;
+   bs->n = 0;
+   return (0);
+}
 
-   avl_file_lread (avl_fp, &lim, cp, &cpr, reclen);
 
-   a = cpr.n[k].r;
-   if (a > 0) {
-      avl_file_lread (avl_fp, &lim, a, &ar, reclen);
-      memcpy (data, ar.b, avl_fp->len);
+/*------------------------------------------- avl_file_badd
+ * Add the data of record number i to the sort.
+ * Returns 0 if successful.
+ */
+static int32_t
+avl_file_badd (struct avl_file_bsort_struct *bs, void *data, int64_t i)
+{
+   char *e;
 
-      sp = ar.n[k].r; 
-      if (sp > 0) {
-         avl_file_lread (avl_fp, &lim, sp, &sr, reclen);
-         while (sr.n[k].l > 0) {
-            sp = sr.n[k].l;
-            avl_file_lread (avl_fp, &lim, sp, &sr, reclen);
-         }
-      } else {
-         sp = -ar.n[k].r;
+   if (bs->n == bs->n_max) {
+      if (avl_file_bspill (bs) != 0) return (-1);
+   }
+   e = bs->buf + bs->n * bs->esize;
+   memcpy (e, data, bs->len);
+   memcpy (e + bs->len, &i, sizeof (int64_t));
+   bs->v[bs->n++] = e;
+   return (0);
+}
+
+
+/*
+ * A run being merged, read through a buffer of entries.
+ */
+struct avl_file_brun_struct {
+   off_t pos;                // next position in the run file
+   int64_t left;             // entries not yet read
+   int64_t got, used;        // entries in the buffer, and used
+   char *b, *e;              // buffer, and current entry
+};
+
+
+/*------------------------------------------- avl_file_bfill
+ * Read the next entries of run r into its buffer, up to bn entries.
+ * Returns 0 if successful.
+ */
+static int32_t
+avl_file_bfill (struct avl_file_bsort_struct *bs, struct avl_file_brun_struct *r, int64_t bn)
+{
+   r->got = (r->left < bn) ? r->left : bn;
+   r->used = 0;
+   r->e = r->b;
+   if (r->got == 0) return (0);
+
+   if (pread (fileno (bs->fp), r->b, r->got * bs->esize, r->pos) != r->got * bs->esize) {
+      setenv (AVL_FILE_EMSG_VNAME, "145 temporary file read failed", 1);
+      return (-1);
+   }
+   r->pos += r->got * bs->esize;
+   r->left -= r->got;
+   return (0);
+}
+
+
+/*------------------------------------------- avl_file_bheap
+ * Restore the merge heap order below heap position i. Runs with 
+ * equal keys are ordered by run number, to keep the sort stable.
+ */
+static void
+avl_file_bheap (struct avl_file_bsort_struct *bs, struct avl_file_brun_struct *r, 
+                int32_t *h, int32_t n, int32_t i)
+{
+   int32_t c, x, d;
+
+   for (;;) {
+      c = 2 * i + 1;
+      if (c >= n) break;
+      if (c + 1 < n) {
+         d = avl_file_bcmp (bs, r[h[c+1]].e, r[h[c]].e);
+         if ((d < 0) || ((d == 0) && (h[c+1] < h[c]))) c++;
       }
-      cpr.n[k].r = sp;
+      d = avl_file_bcmp (bs, r[h[c]].e, r[h[i]].e);
+      if ((d > 0) || ((d == 0) && (h[c] > h[i]))) break;
+      x = h[i]; h[i] = h[c]; h[c] = x;
+      i = c;
+   }
+}
 
-      avl_file_lwrite (avl_fp, &lim, cp, &cpr, reclen);
-   } else 
+
+/*------------------------------------------- avl_file_bfinish
+ * Finish the sort, storing the file positions of the records in
+ * key order into s[].
+ * Returns 0 if successful.
+ */
+static int32_t
+avl_file_bfinish (struct avl_file_bsort_struct *bs, off_t *s, int32_t hdrlen, int32_t reclen)
+{
+   struct avl_file_brun_struct *r;
+   int32_t i, n_h, *h, ret;
+   int64_t j, o, bn, idx;
+   off_t pos;
+   char *mbuf;
+
+   if (bs->n_runs == 0) {
+      avl_file_bmsort (bs, bs->v, bs->t, bs->n);
+      for (j = 0; j < bs->n; j++) {
+         memcpy (&idx, bs->v[j] + bs->len, sizeof (int64_t));
+         s[j] = hdrlen + idx * reclen;
+      }
+      return (0);
+   }
+
+   if ((bs->n > 0) && (avl_file_bspill (bs) != 0)) return (-1);
+   if (fflush (bs->fp) != 0) {
+      setenv (AVL_FILE_EMSG_VNAME, "144 temporary file write failed", 1);
+      return (-1);
+   }
+
+  /*
+   * Merge the runs, reading each through a buffer of bn entries.
+   * The run buffers share the memory of the in-memory sort.
+   */
+   bn = bs->n_max / bs->n_runs;
+   if (bn < 1) bn = 1;
+   mbuf = (bn * bs->n_runs <= bs->n_max) ? bs->buf : malloc (bn * bs->n_runs * bs->esize);
+   r = malloc (bs->n_runs * sizeof (struct avl_file_brun_struct));
+   h = malloc (bs->n_runs * sizeof (int32_t));
+   ret = 0;
+   if ((mbuf == NULL) || (r == NULL) || (h == NULL)) {
+      setenv (AVL_FILE_EMSG_VNAME, "143 malloc returned NULL", 1);
       ret = -1;
+      goto af_bfinish_return;
+   }
 
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_ULOCK, 1);
-#ifdef	AVL_FILE_TSAFE
-   sem_post (&avl_fp->sem);
-#endif
+   pos = 0; n_h = 0;
+   for (i = 0; i < bs->n_runs; i++) {
+      r[i].pos = pos;
+      r[i].left = bs->run_n[i];
+      r[i].b = mbuf + i * bn * bs->esize;
+      pos += (off_t) bs->run_n[i] * bs->esize;
+      if (avl_file_bfill (bs, &r[i], bn) != 0) {
+         ret = -1;
+         goto af_bfinish_return;
+      }
+      if (r[i].got > 0) h[n_h++] = i;
+   }
+   for (i = n_h / 2 - 1; i >= 0; i--) avl_file_bheap (bs, r, h, n_h, i);
+
+   o = 0;
+   while (n_h > 0) {
+      i = h[0];
+      memcpy (&idx, r[i].e + bs->len, sizeof (int64_t));
+      s[o++] = hdrlen + idx * reclen;
+
+      r[i].used++;
+      if (r[i].used < r[i].got) {
+         r[i].e += bs->esize;
+      } else {
+         if (avl_file_bfill (bs, &r[i], bn) != 0) {
+            ret = -1;
+            goto af_bfinish_return;
+         }
+         if (r[i].got == 0) h[0] = h[--n_h];
+      }
+      avl_file_bheap (bs, r, h, n_h, 0);
+   }
+
+af_bfinish_return:
+   if (mbuf != bs->buf) free (mbuf);
+   free (r);
+   free (h);
    return (ret);
 }
 
 
-/*--------------------------------------------------- avl_file_prev
- * Using key k, read the previous record into the data buffer.
- * Separate pointers are maintained for the 'previous' and 'next' functions. 
- * The return value is 0 for OK, or -1 for none.
+/*------------------------------------------- avl_file_bheight
+ * Return the height of a balanced tree of n records, as built by
+ * avl_file_bnodes().
  */
-int32_t 
+static int32_t
+avl_file_bheight (int64_t n)
+{
+   int32_t h;
+
+   for (h = 0; n > 0; n >>= 1) h++;
+   return (h);
+}
+
+
+/*------------------------------------------- avl_file_bnodes
+ * Build a balanced threaded tree of the n records at the file
+ * positions s[], which are in key order, storing the node for each
+ * record into nd[] by record number. The root of each sub-tree of 
+ * records lo to hi-1 is the middle record, lo + (hi - lo) / 2, so the 
+ * left sub-tree is the same size as the right one, or one larger.
+ * The tree is traversed in order without recursion.
+ */
+static void
+avl_file_bnodes (off_t *s, int64_t n, int32_t hdrlen, int32_t reclen, struct avl_node_struct *nd)
+{
+   int64_t lo, hi, r, i, slo[64], shi[64];
+   int32_t sp;
+
+   sp = 0;
+   lo = 0; hi = n;
+   for (;;) {
+      while (lo < hi) {
+         slo[sp] = lo; shi[sp] = hi; sp++;
+         hi = lo + (hi - lo) / 2;
+      }
+      if (sp == 0) break;
+      sp--;
+      lo = slo[sp]; hi = shi[sp];
+      r = lo + (hi - lo) / 2;
+
+      i = (s[r] - hdrlen) / reclen;
+      if (r > lo) 
+         nd[i].l = s[lo + (r - lo) / 2];
+      else
+         nd[i].l = (r > 0) ? -s[r-1] : 0;
+      if (r + 1 < hi)
+         nd[i].r = s[r + 1 + (hi - r - 1) / 2];
+      else
+         nd[i].r = (r + 1 < n) ? -s[r+1] : 0;
+      nd[i].b = avl_file_bheight (r - lo) - avl_file_bheight (hi - r - 1);
+      nd[i].c = hi - lo;
+
+      lo = r + 1;
+   }
+}
+
+
+/*------------------------------------------- avl_file_bmap
+ * Create a temporary file of size bytes and map it, for arrays that
+ * may be too big for memory. Returns NULL for failure.
+ */
+static void *
+avl_file_bmap (FILE **fp, size_t size)
+{
+   void *p;
+
+   *fp = tmpfile ();
+   if (*fp == NULL) {
+      setenv (AVL_FILE_EMSG_VNAME, "142 tmpfile failed", 1);
+      return (NULL);
+   }
+   if (size == 0) size = 1;
+   if (ftruncate (fileno (*fp), size) != 0) {
+      setenv (AVL_FILE_EMSG_VNAME, "146 ftruncate failed", 1);
+      return (NULL);
+   }
+   p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno (*fp), 0);
+   if (p == MAP_FAILED) {
+      setenv (AVL_FILE_EMSG_VNAME, "147 mmap failed", 1);
+      return (NULL);
+   }
+   return (p);
+}
+
+
+/*------------------------------------------- avl_file_bulk_load
+ * Create an AVL file from the records returned by the source 
+ * function, which is called as source (arg, data) and must fill the
+ * data buffer and return 0 for each record, and then return non-zero.
+ * The file must be empty or not exist.
+ *
+ * The records are written sequentially. Then for each key, the 
+ * records are sorted (by an external merge sort, with temporary 
+ * files, when they do not fit into AVL_FILE_BULK_MEM bytes), a
+ * balanced threaded tree is built in memory mapped temporary files,
+ * and its nodes are written into the records with one more 
+ * sequential pass over the file. Records with equal keys are kept
+ * in the order of the source.
+ *
+ * The return value is 0 for OK, or -1 for failure.
+ */
+int32_t
 #ifdef	AVL_FILE_TSAFE
-avl_file_prev_t (AVL_FILE *avl_fp, void *data, int32_t k) 
+avl_file_bulk_load_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp,
+                      avl_file_source_fn_t source, void *arg)
 #else
-avl_file_prev (AVL_FILE *avl_fp, void *data, int32_t k) 
+avl_file_bulk_load (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp,
+                    avl_file_source_fn_t source, void *arg)
 #endif
 {
-   int32_t fd, reclen, ret;
+   int32_t fd, reclen, hdrlen, k, ret;
+
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;        // AVL record data length
+      int32_t reclen;     // AVL record length including key nodes
+      uint32_t gen;       // generation, changed by every update
+      int64_t n_avl;      // number of AVL records 
+      int64_t nextnum;    // unique record numbers 
+      off_t root[n_keys];
+      off_t head_seq;     // doubly linked
+      off_t head_empty;   // singly linked
+      off_t head_cpr;     // singly linked
+   } hdr;
 
    struct avl_struct {
-      struct avl_node_struct n[avl_fp->n_keys];
+      struct avl_node_struct n[n_keys];
       off_t prev, next;
-      char b[avl_fp->len];
-   } ar, cpr, sr;
-   off_t a, cp, sp, lim;
+      char b[len];
+   } *ar;
+   struct avl_file_bsort_struct bs;
+   struct avl_node_struct *nd;
+   FILE *s_fp, *nd_fp;
+   int64_t n, i, j, m, cn;
+   off_t *s, pos;
+   char *cbuf, fmname[strlen (fname) + 6];
+
+
+   unsetenv (AVL_FILE_EMSG_VNAME);
+   reclen = sizeof (struct avl_struct);
+   hdrlen = sizeof (hdr);
+   if ((cmp == NULL) && (n_keys > 0)) {
+      setenv (AVL_FILE_EMSG_VNAME, "207 no comparison function and no key schema", 1);
+      return (-1);
+   }
+
+   fd = open (fname, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+   if (fd < 0) {
+      setenv (AVL_FILE_EMSG_VNAME, "140 open failed", 1);
+      return (-1);
+   }
+   avl_file_plock (fd, F_WRLCK, 0, 1);
+
+   memset (&bs, 0, sizeof (bs));
+   s_fp = NULL; s = NULL; nd_fp = NULL; nd = NULL;
+   n = 0;
+   ret = -1;
+
+   cn = (1 << 20) / reclen;            // records per sequential I/O
+   if (cn < 1) cn = 1;
+   cbuf = malloc (cn * reclen);
+
+   bs.cmp = cmp;
+   bs.len = len;
+   bs.esize = len + sizeof (int64_t);
+   bs.n_max = AVL_FILE_BULK_MEM / (bs.esize + 2 * sizeof (char *));
+   if (bs.n_max < 2) bs.n_max = 2;
+   bs.buf = malloc (bs.n_max * bs.esize);
+   bs.v = malloc (bs.n_max * sizeof (char *));
+   bs.t = malloc (bs.n_max * sizeof (char *));
+   if ((cbuf == NULL) || (bs.buf == NULL) || (bs.v == NULL) || (bs.t == NULL)) {
+      setenv (AVL_FILE_EMSG_VNAME, "143 malloc returned NULL", 1);
+      goto af_bulk_load_return;
+   }
+
+   if (lseek (fd, 0, SEEK_END) != 0) {
+      setenv (AVL_FILE_EMSG_VNAME, "141 the file is not empty", 1);
+      goto af_bulk_load_return;
+   }
+
+  /*
+   * A free-space map left by an older file is reset, to be made again 
+   * by the next open.
+   */
+   strcpy (fmname, fname);
+   strcat (fmname, "-free");
+   if ((access (fmname, F_OK) == 0) && (truncate (fmname, 0) != 0)) {
+      setenv (AVL_FILE_EMSG_VNAME, "180 free map truncate failed", 1);
+      goto af_bulk_load_return;
+   }
 
+   memset (&hdr, 0, sizeof (hdr));
+   memcpy (hdr.magic, AVL_FILE_MAGIC, 8);
+   hdr.n_keys = n_keys;
+   hdr.len = len;
+   hdr.reclen = reclen;
+   if (pwrite (fd, &hdr, hdrlen, 0) != hdrlen) goto af_bulk_load_wfail;
 
-   if ((k < 0) || (k >= avl_fp->n_keys)) {
-      setenv (AVL_FILE_EMSG_VNAME, "100 the key index is out of bounds", 1);
-      return (-1);
+  /*
+   * Write the records in source order, linked in the same order for
+   * sequential access, and sort them by the first key.
+   */
+   bs.k = 0;
+   m = 0;
+   for (;;) {
+      ar = (struct avl_struct *) (cbuf + m * reclen);
+      memset (ar, 0, reclen);
+      if (source (arg, ar->b) != 0) break;
+      ar->prev = (n > 0) ? hdrlen + (n - 1) * reclen : 0;
+      ar->next = hdrlen + (n + 1) * reclen;
+      if ((n_keys > 0) && (avl_file_badd (&bs, ar->b, n) != 0)) goto af_bulk_load_return;
+      n++;
+      if (++m == cn) {
+         pos = hdrlen + (n - m) * reclen;
+         if (pwrite (fd, cbuf, m * reclen, pos) != m * reclen) goto af_bulk_load_wfail;
+         m = 0;
+      }
+   }
+   if (m > 0) {
+      pos = hdrlen + (n - m) * reclen;
+      if (pwrite (fd, cbuf, m * reclen, pos) != m * reclen) goto af_bulk_load_wfail;
+   }
+   if (n > 0) {                          // the last record has no next
+      pos = hdrlen + (n - 1) * reclen + offsetof (struct avl_struct, next);
+      ar = (struct avl_struct *) cbuf;
+      ar->next = 0;
+      if (pwrite (fd, &ar->next, sizeof (off_t), pos) != sizeof (off_t)) goto af_bulk_load_wfail;
    }
-   reclen = avl_fp->reclen;
-   fd = avl_fp->fd;
-   cp = avl_fp->cpr;
-   ret = 0;
-
-#ifdef	AVL_FILE_TSAFE
-   sem_wait (&avl_fp->sem);
-#endif
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_LOCK, 1);
-   lim = lseek (fd, 0, SEEK_END);
 
-   avl_file_lread (avl_fp, &lim, cp, &cpr, reclen);
+   hdr.n_avl = n;
+   hdr.head_seq = (n > 0) ? hdrlen : 0;
 
-   a = cpr.n[k].l;
-   if (a > 0) {
-      avl_file_lread (avl_fp, &lim, a, &ar, reclen);
-      memcpy (data, ar.b, avl_fp->len);
+   if ((n_keys > 0) && (n > 0)) {
+      s = avl_file_bmap (&s_fp, n * sizeof (off_t));
+      if (s == NULL) goto af_bulk_load_return;
+      nd = avl_file_bmap (&nd_fp, n * sizeof (struct avl_node_struct));
+      if (nd == NULL) goto af_bulk_load_return;
+   }
 
-      sp = ar.n[k].l;
-      if (sp > 0) {
-         avl_file_lread (avl_fp, &lim, sp, &sr, reclen);
-         while (sr.n[k].r > 0) {
-            sp = sr.n[k].r;
-            avl_file_lread (avl_fp, &lim, sp, &sr, reclen);
+   for (k = 0; (k < n_keys) && (n > 0); k++) {
+     /*
+      * Sort by key k, reading the records again for keys after the
+      * first.
+      */
+      if (k > 0) {
+         bs.k = k;
+         for (i = 0; i < n; i += m) {
+            m = (n - i < cn) ? n - i : cn;
+            pos = hdrlen + i * reclen;
+            if (pread (fd, cbuf, m * reclen, pos) != m * reclen) goto af_bulk_load_rfail;
+            for (j = 0; j < m; j++) {
+               ar = (struct avl_struct *) (cbuf + j * reclen);
+               if (avl_file_badd (&bs, ar->b, i + j) != 0) goto af_bulk_load_return;
+            }
          }
-      } else {
-         sp = -ar.n[k].l;
       }
-      cpr.n[k].l = sp;
+      if (avl_file_bfinish (&bs, s, hdrlen, reclen) != 0) goto af_bulk_load_return;
+      if (bs.fp != NULL) fclose (bs.fp);
+      bs.fp = NULL;
+      bs.n_runs = 0;
+      bs.n = 0;
 
-      avl_file_lwrite (avl_fp, &lim, cp, &cpr, reclen);
-   } else 
-      ret = -1;
+      avl_file_bnodes (s, n, hdrlen, reclen, nd);
+      hdr.root[k] = s[n / 2];
 
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_ULOCK, 1);
-#ifdef	AVL_FILE_TSAFE
-   sem_post (&avl_fp->sem);
-#endif
+     /*
+      * Copy the nodes into the records.
+      */
+      for (i = 0; i < n; i += m) {
+         m = (n - i < cn) ? n - i : cn;
+         pos = hdrlen + i * reclen;
+         if (pread (fd, cbuf, m * reclen, pos) != m * reclen) goto af_bulk_load_rfail;
+         for (j = 0; j < m; j++) {
+            ar = (struct avl_struct *) (cbuf + j * reclen);
+            ar->n[k] = nd[i + j];
+         }
+         if (pwrite (fd, cbuf, m * reclen, pos) != m * reclen) goto af_bulk_load_wfail;
+      }
+   }
+
+   if (pwrite (fd, &hdr, hdrlen, 0) != hdrlen) goto af_bulk_load_wfail;
+   ret = 0;
+   goto af_bulk_load_return;
+
+af_bulk_load_rfail:
+   setenv (AVL_FILE_EMSG_VNAME, "148 read failed", 1);
+   goto af_bulk_load_return;
+
+af_bulk_load_wfail:
+   setenv (AVL_FILE_EMSG_VNAME, "149 write failed", 1);
+
+af_bulk_load_return:
+   if (s != NULL) munmap (s, n * sizeof (off_t));
+   if (nd != NULL) munmap (nd, n * sizeof (struct avl_node_struct));
+   if (s_fp != NULL) fclose (s_fp);
+   if (nd_fp != NULL) fclose (nd_fp);
+   if (bs.fp != NULL) fclose (bs.fp);
+   free (bs.run_n);
+   free (bs.buf);
+   free (bs.v);
+   free (bs.t);
+   free (cbuf);
+   avl_file_plock (fd, F_UNLCK, 0, 1);
+   close (fd);
    return (ret);
 }
 
 
-/*--------------------------------------------------- avl_file_find
- * Find a record using key k, over-writing the data buffer with
- * the matching file record, if one exists.
- * The return value is 0 for OK, or -1 for none.
+/*
+ * Source state for avl_file_upgrade(): the earlier file, and the 
+ * position of the next record to read, oldest first, in its 
+ * sequential list.
  */
-int32_t
-#ifdef	AVL_FILE_TSAFE
-avl_file_find_t (AVL_FILE *avl_fp, void *data, int32_t k) 
-#else
-avl_file_find (AVL_FILE *avl_fp, void *data, int32_t k) 
-#endif
+struct avl_file_usrc_struct {
+   int32_t fd;
+   int32_t reclen, len;
+   off_t poff, boff;         // prev and data offsets in a record
+   off_t pos;
+   int64_t n;                // records read
+   int32_t failed;
+   char *r;
+};
+
+
+/*------------------------------------------- avl_file_usource
+ * Return the next record of the earlier file, for avl_file_bulk_load().
+ */
+static int32_t
+avl_file_usource (void *arg, void *data)
 {
-   char b[avl_fp->len];
+   struct avl_file_usrc_struct *u = arg;
 
-   memcpy (b, data, avl_fp->len);
-#ifdef	AVL_FILE_TSAFE
-   if (avl_file_startge_t (avl_fp, b, k) == 0) { 
-#else
-   if (avl_file_startge (avl_fp, b, k) == 0) { 
-#endif
-      if (avl_fp->cmp (k, b, data) == 0) {
-         memcpy (data, b, avl_fp->len);
-         return (0);
-      }
+   if (u->pos <= 0) return (1);
+   if (pread (u->fd, u->r, u->reclen, u->pos) != u->reclen) {
+      u->failed = 1;
+      return (1);
    }
-   return (-1);
+   memcpy (data, u->r + u->boff, u->len);
+   memcpy (&u->pos, u->r + u->poff, sizeof (off_t));
+   u->n++;
+   return (0);
 }
 
 
-/*------------------------------------------------- avl_file_scan
- * Recursively scan a tree by the order of key k. The variable sp and
- * 'count' must be zero initially when calling this function.
- * The return value is the height of the tree. The variable 
- * 'count' contains the record count.
+/*------------------------------------------- avl_file_upgrade
+ * Convert a file made by an earlier version of the library, whose 
+ * tree nodes have no subtree counts, to the current format. The 
+ * records are read from the file's sequential list, oldest first, 
+ * and loaded with avl_file_bulk_load() into a new file (fname with 
+ * "-new" added), which then replaces the file. Records with equal
+ * keys stay in the order they had in the trees, which is the order
+ * they were inserted in. The len, n_keys and
+ * cmp are the ones the file was used with. The file is locked while
+ * it is converted, and must not be open.
+ *
+ * The return value is 0 for OK, or -1 for failure, in which case the
+ * file is left as it was.
  */
-int32_t 
+int32_t
 #ifdef	AVL_FILE_TSAFE
-avl_file_scan_t (AVL_FILE *avl_fp, int32_t k, off_t sp, int64_t *count) 
+avl_file_upgrade_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
 #else
-avl_file_scan (AVL_FILE *avl_fp, int32_t k, off_t sp, int64_t *count) 
+avl_file_upgrade (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp)
 #endif
 {
-   int32_t fd, reclen;
+   AVL_FILE avl_dummy;
+   struct avl_file_usrc_struct u;
+   struct stat st;
+   int32_t fd, ret;
+   int64_t n;
+   off_t pos, next;
 
    struct hdr_struct {
       char magic[8];
       int32_t n_keys; 
-      int32_t len;      // AVL record data length
-      int32_t reclen;   // AVL record length including key nodes
-      int64_t n_avl;    // number of AVL records 
-      int64_t nextnum;  // unique record numbers 
-      off_t root[avl_fp->n_keys];
+      int32_t len;
+      int32_t reclen;
+      uint32_t pad;       // the generation number, in later files
+      int64_t n_avl;
+      int64_t nextnum;
+      off_t root[n_keys];
       off_t head_seq;
       off_t head_empty;
       off_t head_cpr; 
    } hdr;
 
-   struct avl_struct {
-      struct avl_node_struct n[avl_fp->n_keys];
+   struct avl1_struct {
+      struct avl_file_node1_struct n[n_keys];
       off_t prev, next;
-      char b[avl_fp->len];
-   } sr;
-   off_t lim;
-   int32_t hl, hr, h;
+      char b[len];
+   };
+   char nname[strlen (fname) + 5];
 
 
-   if ((k < 0) || (k >= avl_fp->n_keys)) {
-      setenv (AVL_FILE_EMSG_VNAME, "110 the key index is out of bounds", 1);
+   unsetenv (AVL_FILE_EMSG_VNAME);
+   fd = open (fname, O_RDWR);
+   if (fd < 0) {
+      setenv (AVL_FILE_EMSG_VNAME, "260 open failed", 1);
+      return (-1);
+   }
+   avl_file_plock (fd, F_WRLCK, 0, 1);
+   if ((pread (fd, &hdr, sizeof (hdr), 0) != (ssize_t) sizeof (hdr)) || (fstat (fd, &st) != 0)) {
+      setenv (AVL_FILE_EMSG_VNAME, "261 read header failed", 1);
+      close (fd);
+      return (-1);
+   }
+   if (memcmp (hdr.magic, AVL_FILE_MAGIC_V1, 8) != 0) {
+      setenv (AVL_FILE_EMSG_VNAME, "262 the file is not from an earlier version", 1);
+      close (fd);
+      return (-1);
+   }
+   if ((hdr.n_keys != n_keys) || (hdr.len != len) || (hdr.reclen != (int32_t) sizeof (struct avl1_struct))) {
+      setenv (AVL_FILE_EMSG_VNAME, "263 the file does not match len and n_keys", 1);
+      close (fd);
       return (-1);
    }
-   reclen = avl_fp->reclen;
-   fd = avl_fp->fd;
-
-
-   if (sp == 0) {
-#ifdef	AVL_FILE_TSAFE
-      sem_wait (&avl_fp->sem);
-#endif
-      lseek (fd, 0, SEEK_SET);
-      lockf (fd, F_LOCK, 1);
-
-      lseek (fd, 0, SEEK_SET);
-      read (fd, &hdr, sizeof (hdr));
 
-      if (hdr.root[k] > 0) {
-#ifdef	AVL_FILE_TSAFE
-         h = avl_file_scan_t (avl_fp, k, hdr.root[k], count);
-#else
-         h = avl_file_scan (avl_fp, k, hdr.root[k], count);
-#endif
-      } else {
-         h = 0;
-      }
+  /*
+   * The earlier files lock the current-pointer records of the open
+   * AVL_FILEs as the current ones do, with the process ID in the 
+   * data, so the same test finds them.
+   */
+   memset (&avl_dummy, 0, sizeof (avl_dummy));
+   avl_dummy.fd = fd;
+   avl_dummy.hlen = sizeof (hdr);
+   avl_dummy.len = len;
+   avl_dummy.reclen = sizeof (struct avl1_struct);
+   avl_dummy.nodelen = offsetof (struct avl1_struct, b);
+   if (avl_file_olive (&avl_dummy)) {
+      setenv (AVL_FILE_EMSG_VNAME, "264 the file is open", 1);
+      close (fd);
+      return (-1);
+   }
 
-      lseek (fd, 0, SEEK_SET);
-      lockf (fd, F_ULOCK, 1);
-#ifdef	AVL_FILE_TSAFE
-      sem_post (&avl_fp->sem);
-#endif
-      if (*count != hdr.n_avl) {
-         setenv (AVL_FILE_EMSG_VNAME, "50 count != hdr.n_avl", 1);
-//       fprintf (stderr, "avl_file_scan: count %lld != %lld\n", *count, hdr.n_avl);
+   memset (&u, 0, sizeof (u));
+   u.fd = fd;
+   u.reclen = sizeof (struct avl1_struct);
+   u.len = len;
+   u.poff = offsetof (struct avl1_struct, prev);
+   u.boff = offsetof (struct avl1_struct, b);
+   for (n = 0, pos = hdr.head_seq; (pos > 0) && (n <= hdr.n_avl); n++, pos = next) {
+      if (pread (fd, &next, sizeof (next), pos + offsetof (struct avl1_struct, next)) != sizeof (next)) {
+         setenv (AVL_FILE_EMSG_VNAME, "266 read failed", 1);
+         close (fd);
+         return (-1);
       }
-   } else if (sp > 0) {
-      lim = lseek (fd, 0, SEEK_END);
-      avl_file_lread (avl_fp, &lim, sp, &sr, reclen);
+      u.pos = pos;
+   }
+   u.r = malloc (u.reclen);
+   if (u.r == NULL) {
+      setenv (AVL_FILE_EMSG_VNAME, "265 malloc returned NULL", 1);
+      close (fd);
+      return (-1);
+   }
 
-     *count += 1;
-      hl = 1; hr = 1;
+   strcpy (nname, fname);
+   strcat (nname, "-new");
+   unlink (nname);
 #ifdef	AVL_FILE_TSAFE
-      if (sr.n[k].l > 0) hl += avl_file_scan_t (avl_fp, k, sr.n[k].l, count);
-      if (sr.n[k].r > 0) hr += avl_file_scan_t (avl_fp, k, sr.n[k].r, count);
+   ret = avl_file_bulk_load_t (nname, len, n_keys, cmp, avl_file_usource, &u);
 #else
-      if (sr.n[k].l > 0) hl += avl_file_scan (avl_fp, k, sr.n[k].l, count);
-      if (sr.n[k].r > 0) hr += avl_file_scan (avl_fp, k, sr.n[k].r, count);
+   ret = avl_file_bulk_load (nname, len, n_keys, cmp, avl_file_usource, &u);
 #endif
-      if (sr.n[k].b != hl - hr) {
-         setenv (AVL_FILE_EMSG_VNAME, "51 bad balance", 1);	// key k
-//       fprintf (stderr, "avl_file_scan: key %d bad balance = %2d\n", k, sr.n[k].b);
-      }
-
-      h = (hl > hr) ? hl : hr;
-   } else {
-      h = 0;
+   if ((ret == 0) && (u.failed || (u.n != hdr.n_avl))) {
+      setenv (AVL_FILE_EMSG_VNAME, "266 read failed", 1);
+      ret = -1;
    }
-   return (h);
+   if ((ret == 0) && ((chmod (nname, st.st_mode & 07777) != 0) || (rename (nname, fname) != 0))) {
+      setenv (AVL_FILE_EMSG_VNAME, "267 rename failed", 1);
+      ret = -1;
+   }
+   if (ret != 0) unlink (nname);
+   free (u.r);
+   close (fd);
+   return (ret);
 }
 
 
-/*------------------------------------------- avl_file_lock
- * Place an advisory lock on the file at lseek position 1.
- * Note that lseek position 0 is already used by the other
- * functions.
- * 
- * This function does not block process threads from concurrent access,
- * because file locks do not guarantee exclusive access for threads.
+
+/*------------------------------------------- avl_file_insert_batch
+ * Insert count new records, stored one after the other (each of the
+ * data length) starting at data, into the AVL file. The file is 
+ * locked once, and the header is read and written once, for the 
+ * whole batch. The records are added to each tree in key order, so 
+ * that the searches for consecutive records follow the same paths,
+ * and those records are kept in a record cache (a temporary one, if 
+ * the AVL_FILE does not have one) while the batch is inserted. The
+ * result is the same as calling avl_file_insert() for each record
+ * in turn.
+ * It returns 0 for success, or -1 for failure, in which case 
+ * the records before the one that failed have been inserted.
  */
+int32_t 
 #ifdef	AVL_FILE_TSAFE
-
-void 
-avl_file_lock_t (AVL_FILE *avl_fp) 
-{
-   sem_wait (&avl_fp->sem);
-   lseek (avl_fp->fd, 1, SEEK_SET);
-   lockf (avl_fp->fd, F_LOCK, 1);
-   sem_post (&avl_fp->sem);
-}
-
+avl_file_insert_batch_t (AVL_FILE *avl_fp, void *data, int32_t count) 
 #else
-
-void 
-avl_file_lock (AVL_FILE *avl_fp) 
-{
-   lseek (avl_fp->fd, 1, SEEK_SET);
-   lockf (avl_fp->fd, F_LOCK, 1);
-}
-
+avl_file_insert_batch (AVL_FILE *avl_fp, void *data, int32_t count) 
 #endif
-
-
-/*------------------------------------------- avl_file_unlock
- * Remove the lock at lseek position 1 from the file.
- */
-#ifdef	AVL_FILE_TSAFE
-
-void 
-avl_file_unlock_t (AVL_FILE *avl_fp) 
 {
-   sem_wait (&avl_fp->sem);
-   lseek (avl_fp->fd, 1, SEEK_SET);
-   lockf (avl_fp->fd, F_ULOCK, 1);
-   sem_post (&avl_fp->sem);
-}
-
-#else
+   int32_t i, k, ret, tmp_cache;
+   uint32_t gen;
 
-void 
-avl_file_unlock (AVL_FILE *avl_fp) 
-{
-   lseek (avl_fp->fd, 1, SEEK_SET);
-   lockf (avl_fp->fd, F_ULOCK, 1);
-}
+   struct hdr_struct {
+      char magic[8];
+      int32_t n_keys; 
+      int32_t len;
+      int32_t reclen;
+      uint32_t gen;
+      int64_t n_avl;
+      int64_t nextnum;
+      off_t root[avl_fp->n_keys];
+      off_t head_seq;
+      off_t head_empty;
+      off_t head_cpr; 
+   } hdr;
+   struct avl_file_bsort_struct bs;
+   off_t *y, lim;
+   char **v, **t;
 
-#endif
 
+   if (count <= 0) return (0);
+   ret = 0;
 
+   y = malloc (count * sizeof (off_t));
+   v = malloc (count * sizeof (char *));
+   t = malloc (count * sizeof (char *));
+   if ((y == NULL) || (v == NULL) || (t == NULL)) {
+      free (y);
+      free (v);
+      free (t);
+      setenv (AVL_FILE_EMSG_VNAME, "34 malloc returned NULL", 1);
+      return (-1);
+   }
+   memset (&bs, 0, sizeof (bs));
+   bs.cmp = avl_fp->cmp;
+   bs.seg = avl_fp->seg;
+   bs.kseg = avl_fp->kseg;
 
-/*------------------------------------------- avl_file_dump
- * Show record nodes for debugging.
- */
-void 
 #ifdef	AVL_FILE_TSAFE
-avl_file_dump_t (AVL_FILE *avl_fp) 
-#else
-avl_file_dump (AVL_FILE *avl_fp) 
+   avl_file_tlock (avl_fp, F_WRLCK);
 #endif
-{
-   int32_t fd, n, i, reclen;
+   lim = avl_file_lbegin (avl_fp, F_WRLCK);
+
+   tmp_cache = 0;
+   if ((avl_fp->cache == NULL) && !(avl_fp->mode & AVL_FILE_MMAP)) {
+      gen = avl_file_lgen (avl_fp);
+      if (avl_file_cache_set (avl_fp, AVL_FILE_BATCH_CACHE) == 0) {
+         if (avl_fp->cache != NULL) {
+            avl_fp->cache->gen = gen;
+            tmp_cache = 1;
+         }
+      } else {
+         unsetenv (AVL_FILE_EMSG_VNAME);	// go on without the cache
+      }
+   }
 
-   struct hdr_struct {
-      char magic[8];
-      int32_t n_keys; 
-      int32_t len;        // AVL record data length
-      int32_t reclen;     // AVL record length including key nodes
-      int64_t n_avl;      // number of AVL records 
-      int64_t nextnum;    // unique record numbers 
-      off_t root[avl_fp->n_keys];
-      off_t head_seq;     // doubly linked
-      off_t head_empty;   // singly linked
-      off_t head_cpr;     // singly linked
-   } hdr;
+   avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
 
-   struct avl_struct {
-      struct avl_node_struct n[avl_fp->n_keys];
-      off_t prev, next;   // prev used as sequential pointer in 'cpr' records
-      char b[avl_fp->len];
-   } pr;                 // per-process current position pointer
+   for (i = 0; i < count; i++) {
+      y[i] = avl_file_ialloc (avl_fp, &lim, &hdr, (char *) data + i * avl_fp->ulen);
+      if (y[i] == 0) {
+         count = i;
+         ret = -1;
+         break;
+      }
+   }
+
+  /*
+   * Sort the records (stable, so equal keys stay in batch order,
+   * as they would with one insert at a time) for each key.
+   */
+   for (k = 0; k < avl_fp->n_keys; k++) {
+      for (i = 0; i < count; i++) v[i] = (char *) data + i * avl_fp->ulen;
+      bs.k = k;
+      avl_file_bmsort (&bs, v, t, count);
+      for (i = 0; i < count; i++) 
+         avl_file_itree (avl_fp, &lim, &hdr, y[(v[i] - (char *) data) / avl_fp->ulen], v[i], k);
+   }
+   avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
 
+   avl_file_lend (avl_fp, &lim);
+   if (tmp_cache) avl_file_cache_free (avl_fp);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   free (y);
+   free (v);
+   free (t);
+   return (ret);
+}
 
-   fd = avl_fp->fd;
-   reclen = avl_fp->reclen;
 
-   lseek (fd, 0, SEEK_SET);
-   read (fd, &hdr, sizeof (hdr));
+/*--------------------------------------------- avl_file_count_range
+ * Return the number of records whose key k is greater than or equal
+ * to lo and less than hi, from the subtree counts, with two searches
+ * down the tree. The return value is -1 for an invalid key index.
+ */
+int64_t
+#ifdef	AVL_FILE_TSAFE
+avl_file_count_range_t (AVL_FILE *avl_fp, void *lo, void *hi, int32_t k) 
+#else
+avl_file_count_range (AVL_FILE *avl_fp, void *lo, void *hi, int32_t k) 
+#endif
+{
+   off_t lim;
+   int64_t n;
 
-   printf ("hdr: n_keys %d, len %d, reclen %d, n_avl %lld, head_seq %d, head_empty %d, head_cpr %d\n",
-           hdr.n_keys, hdr.len, hdr.reclen, hdr.n_avl,
-           (int) hdr.head_seq, (int) hdr.head_empty, (int) hdr.head_cpr);
 
-   printf ("hdr: ");
-   for (i = 0; i < avl_fp->n_keys; i++) {
-      printf ("%2d: %6d | ", i, (int) hdr.root[i]);
+   if ((k < 0) || (k >= avl_fp->n_keys)) {
+      setenv (AVL_FILE_EMSG_VNAME, "192 the key index is out of bounds", 1);
+      return (-1);
    }
-   printf ("\n");
 
+#ifdef	AVL_FILE_TSAFE
+   avl_file_tlock (avl_fp, F_RDLCK);
+#endif
+   lim = avl_file_lbegin (avl_fp, F_RDLCK);
+
+   n = avl_file_crank (avl_fp, &lim, k, hi) - avl_file_crank (avl_fp, &lim, k, lo);
+   if (n < 0) n = 0;
 
-   for (;;) {
-      printf ("  pos %6ld: ", lseek (fd, 0, SEEK_CUR)); 
-      n = read (fd, &pr, reclen);
-      if (n != reclen) {
-         printf ("\n");
-         break;
-      }
-      for (i = 0; i < avl_fp->n_keys; i++) {
-         printf ("%2d:%3d %6ld %6ld | ", i, pr.n[i].b, pr.n[i].l, pr.n[i].r);
-      }
-      printf (" prev %6ld, next %6ld | ", pr.prev, pr.next);
-//    printf (" (%s)", &pr.b[0]);	// show data?
-      printf ("\n");
-   }
+   avl_file_lend (avl_fp, &lim);
+#ifdef	AVL_FILE_TSAFE
+   pthread_rwlock_unlock (&avl_fp->rwl);
+#endif
+   return (n);
 }
 
 
-
-/* --------------------------------------------------- avl_file_squash
- * Move empty records to the end of the file and shorten it.
- * Shortening is limited to the last 'current-pointer' record
- * for files opened more than once.
+/*-------------------------------------------- avl_file_delete_range
+ * Delete the records whose key k is greater than or equal to lo and
+ * less than hi. The file is locked once, and the header and the 
+ * current-pointer records are read and written once, for all of the
+ * records. Each record is found from the one before it, and while
+ * they are removed from the trees the records are kept in a record
+ * cache (a temporary one, as for avl_file_insert_batch(), if the 
+ * AVL_FILE does not have one).
+ * The return value is the number of records deleted, or -1 for 
+ * failure.
  */
-void 
+int64_t
 #ifdef	AVL_FILE_TSAFE
-avl_file_squash_t (AVL_FILE *avl_fp) 
+avl_file_delete_range_t (AVL_FILE *avl_fp, void *lo, void *hi, int32_t k) 
 #else
-avl_file_squash (AVL_FILE *avl_fp) 
+avl_file_delete_range (AVL_FILE *avl_fp, void *lo, void *hi, int32_t k) 
 #endif
 {
-   int32_t fd, reclen, len;
-
    struct hdr_struct {
       char magic[8];
       int32_t n_keys; 
-      int32_t len;        // AVL record data length
-      int32_t reclen;     // AVL record length including key nodes
-      int64_t n_avl;      // number of AVL records 
-      int64_t nextnum;    // unique record numbers 
+      int32_t len;
+      int32_t reclen;
+      uint32_t gen;
+      int64_t n_avl;
+      int64_t nextnum;
       off_t root[avl_fp->n_keys];
-      off_t head_seq;     // doubly linked
-      off_t head_empty;   // singly linked
-      off_t head_cpr;     // singly linked
+      off_t head_seq;
+      off_t head_empty;
+      off_t head_cpr; 
    } hdr;
 
    struct avl_struct {
       struct avl_node_struct n[avl_fp->n_keys];
-      off_t prev, next;   // prev used as sequential pointer in 'cpr' records
+      off_t prev, next;
       char b[avl_fp->len];
-   } cpr, spr, ar, br, yr, zr, pr, qr, par[128];
-   off_t cp, sp, a, b, y, z, p, q, pa[128], lim;
-   int32_t i, k, l, m, updated, stack[128];
-   pid_t pid;
+   } yr, cpr;
+   struct avl_file_dcpr_struct dc;
+   off_t y, cp, lim;
+   int64_t n;
+   int32_t i, tmp_cache;
+   uint32_t gen;
 
 
-   fd = avl_fp->fd;
-   reclen = avl_fp->reclen;
-   len = avl_fp->len;
+   if ((k < 0) || (k >= avl_fp->n_keys)) {
+      setenv (AVL_FILE_EMSG_VNAME, "193 the key index is out of bounds", 1);
+      return (-1);
+   }
+   n = 0;
 
 #ifdef	AVL_FILE_TSAFE
-   sem_wait (&avl_fp->sem);
+   avl_file_tlock (avl_fp, F_WRLCK);
 #endif
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_LOCK, 1);
-   lim = lseek (fd, 0, SEEK_END);
+   lim = avl_file_lbegin (avl_fp, F_WRLCK);
+
+   tmp_cache = 0;
+   if ((avl_fp->cache == NULL) && !(avl_fp->mode & AVL_FILE_MMAP)) {
+      gen = avl_file_lgen (avl_fp);
+      if (avl_file_cache_set (avl_fp, AVL_FILE_BATCH_CACHE) == 0) {
+         if (avl_fp->cache != NULL) {
+            avl_fp->cache->gen = gen;
+            tmp_cache = 1;
+         }
+      } else {
+         unsetenv (AVL_FILE_EMSG_VNAME);	// go on without the cache
+      }
+   }
 
    avl_file_lread (avl_fp, &lim, 0, &hdr, sizeof (hdr));
 
   /*
-   * Search for unused (unlocked) current-pointer records to
-   * remove and add to the empty list.
+   * Read the current-pointer records.
    */
-   pid = getpid ();
-   sp = 0;
+   memset (&dc, 0, sizeof (dc));
    for (cp = hdr.head_cpr; cp > 0; cp = cpr.next) {
-      avl_file_lread (avl_fp, &lim, cp, &cpr, reclen);
-
-      if (sizeof (cpr.b) >= sizeof (pid_t)) {
-         if (memcmp (&cpr.b, &pid, sizeof (pid_t)) != 0) {
-            lseek (fd, cp, SEEK_SET);
-            if (lockf (fd, F_TEST, reclen) == 0) {
-               if (sp > 0) {
-                  avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
-                  spr.next = cpr.next;
-                  avl_file_lwrite (avl_fp, &lim, sp, &spr, reclen);
-               } else {
-                  hdr.head_cpr = cpr.next;
-               }
-               a = cp; ar = cpr;
-               for (i = 0; i < avl_fp->n_keys; i++) {
-                  ar.n[i].b = 0x40; ar.n[i].l = 0; ar.n[i].r = 0;
-               }
-               ar.next = hdr.head_empty;
-               hdr.head_empty = a;
-               avl_file_lwrite (avl_fp, &lim, a, &ar, reclen);
-               continue;
-            }
-         }
-      }
-
-      sp = cp;
+      avl_file_cread (avl_fp, &lim, cp, &cpr, avl_fp->nodelen);
+      dc.n++;
+   }
+   dc.pos = malloc (dc.n * sizeof (off_t) + 1);
+   dc.r = malloc (dc.n * avl_fp->nodelen + 1);
+   dc.updated = calloc (dc.n + 1, 1);
+   if ((dc.pos == NULL) || (dc.r == NULL) || (dc.updated == NULL)) {
+      setenv (AVL_FILE_EMSG_VNAME, "194 malloc returned NULL", 1);
+      n = -1;
+      goto af_delete_range_return;
+   }
+   for (i = 0, cp = hdr.head_cpr; (i < dc.n) && (cp > 0); i++) {
+      avl_file_cread (avl_fp, &lim, cp, dc.r + i * avl_fp->nodelen, avl_fp->nodelen);
+      dc.pos[i] = cp;
+      memcpy (&cpr, dc.r + i * avl_fp->nodelen, avl_fp->nodelen);
+      cp = cpr.next;
    }
 
   /*
-   * Loop eliminating the empty records.
+   * Remove the records in key order. Records do not move in the
+   * file, so the position of the next one can be found first.
    */
-   while (hdr.head_empty > 0) {
-      avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
-
-      a = 0; b = hdr.head_empty;
-      p = 0; q = hdr.head_empty;     
-
-      y = 0;
-      for (sp = hdr.head_empty; sp > 0; sp = spr.next) {
-         avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
-         if (sp <= b) { b = sp; br = spr; a = y; ar = yr; }
-         if (sp >= q) { q = sp; qr = spr; p = y; pr = yr; }
-         y = sp; yr = spr;
-      }
-
-      y = lim - reclen;
-      avl_file_lread (avl_fp, &lim, y, &yr, reclen);
-
-     /*
-      * Is the last record an empty record?
-      */
-      if (y == q) {
-         if (p > 0) {
-            pr.next = qr.next;
-            avl_file_lwrite (avl_fp, &lim, p, &pr, reclen);
-         } else {
-            hdr.head_empty = qr.next;
-         }
-         lim = y;
-         i = ftruncate (fd, lim);
-         if (i != 0) {
-            setenv (AVL_FILE_EMSG_VNAME, "60 ftruncate failed", 1);
-            break;
-         }
-         continue;
-      }
-
-     /*
-      * Is the last record the cpr record?
-      */
-      if (y == avl_fp->cpr) {
-         lseek (fd, y, SEEK_SET);
-         lockf (fd, F_ULOCK, reclen);
-
-         if (hdr.head_cpr == y) {
-            hdr.head_cpr = yr.next;
-         } else {
-            for (sp = hdr.head_cpr; sp > 0; sp = spr.next) {
-               avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
-               if (spr.next == y) {
-                  spr.next = yr.next;
-                  avl_file_lwrite (avl_fp, &lim, sp, &spr, reclen);
-                  break;
-               }
-            }
-         }
-
-         if (a > 0) {
-            ar.next = br.next;
-            avl_file_lwrite (avl_fp, &lim, a, &ar, reclen);
-         } else {
-            hdr.head_empty = br.next;
-         }
-
-         avl_fp->cpr = b;
-         br = yr;
-         br.next = hdr.head_cpr;
-         hdr.head_cpr = b;
-         avl_file_lwrite (avl_fp, &lim, b, &br, reclen);
-
-         lseek (fd, b, SEEK_SET);
-         lockf (fd, F_LOCK, reclen);
-
-         lim = y;
-         i = ftruncate (fd, lim);
-         if (i != 0) {
-            setenv (AVL_FILE_EMSG_VNAME, "61 ftruncate failed", 1);
-            break;
-         }
-         continue;
-      }
-
-     /*
-      * Is the last record a tree node record?
-      */
-      if (avl_fp->n_keys == 0) {
-         for (cp = hdr.head_cpr; cp > 0; cp = cpr.next) {
-            avl_file_lread (avl_fp, &lim, cp, &cpr, reclen);
-            if (y == cp) break;
-         }
-         if (y == cp) break;
-      } else if (abs (yr.n[0].b) > 1) {
-         if (yr.n[0].b != 0x20) {	// 'current-pointer' record
-            setenv (AVL_FILE_EMSG_VNAME, "62 unknown last record", 1);
-         }
-         break;
-      }
-
-     /*
-      * The last record is a tree node, so move it to the first
-      * empty record location.
-      */
-      if (a > 0) {
-         ar.next = br.next;
-         avl_file_lwrite (avl_fp, &lim, a, &ar, reclen);
-      } else {
-         hdr.head_empty = br.next;
-      }
-      br = yr;
-      avl_file_lwrite (avl_fp, &lim, b, &br, reclen);
-
-     /*
-      * Take it off the sequential list.
-      */
-      if (yr.next > 0) {
-         z = yr.next;
-         avl_file_lread (avl_fp, &lim, z, &zr, reclen);
-         if (zr.prev != y) {
-            setenv (AVL_FILE_EMSG_VNAME, "63 bad sequential list pointer", 1);
-            break;
-         }
-         zr.prev = b;
-         avl_file_lwrite (avl_fp, &lim, z, &zr, reclen);
-      }
-
-      if (yr.prev > 0) {
-         z = yr.prev;
-         avl_file_lread (avl_fp, &lim, z, &zr, reclen);
-         if (zr.next != y) {
-            setenv (AVL_FILE_EMSG_VNAME, "64 bad sequential list pointer", 1);
-            break;
-         }
-         zr.next = b;
-         avl_file_lwrite (avl_fp, &lim, z, &zr, reclen);
-      } else {
-         hdr.head_seq = b;
-      }
-
-     /*
-      * Find all tree node pointers to 'y' and change them to 'b'.
-      */
-      for (k = 0; k < avl_fp->n_keys; k++) {
-        /*
-         * Make a path to y. Duplicate keys require some searching.
-         */
-         l = 0; m = 0;
-         pa[l] = hdr.root[k];
-af_squash_loop1:
-         if (pa[l] > 0) {
-            avl_file_lread (avl_fp, &lim, pa[l], &par[l], reclen);
-
-            i = avl_fp->cmp (k, yr.b, par[l].b);
-            if (i <= 0) {
-               if (i == 0) stack[m++] = l;
-
-               pa[l+1] = par[l].n[k].l; l++; 
-               goto af_squash_loop1;
-            }
-af_squash_loop2:
-            pa[l+1] = par[l].n[k].r; l++;
-            goto af_squash_loop1;
-         }
-         if (m > 0) {
-            l = stack[--m];
-            if (pa[l] != y) goto af_squash_loop2;         
-         } else {
-            setenv (AVL_FILE_EMSG_VNAME, "65 not in the tree", 1);	// key k
-            continue;
-         }
-         m = l;
-         if (l > 0) {
-            if (par[l-1].n[k].l == y) 
-               par[l-1].n[k].l = b;
-            else
-               par[l-1].n[k].r = b;
-            avl_file_lwrite (avl_fp, &lim, pa[l-1], &par[l-1], reclen);
-         } else {
-            hdr.root[k] = b;
-         }
-
-        /*
-         * Change thread pointers.
-         */
-         sp = yr.n[k].l;
-         if (sp > 0) {
-            avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
-            while (spr.n[k].r > 0) {
-               sp = spr.n[k].r;
-               avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
-            }
-            spr.n[k].r = -b;
-            avl_file_lwrite (avl_fp, &lim, sp, &spr, reclen);
-         }
-
-         sp = yr.n[k].r;
-         if (sp > 0) {
-            avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
-            while (spr.n[k].l > 0) {
-               sp = spr.n[k].l;
-               avl_file_lread (avl_fp, &lim, sp, &spr, reclen);
-            }
-            spr.n[k].l = -b;
-            avl_file_lwrite (avl_fp, &lim, sp, &spr, reclen);
-         }
-      }
-
-     /*
-      * Go through the cpr list changing 'y' pointers to 'b'.
-      */
-      for (cp = hdr.head_cpr; cp > 0; cp = cpr.next) {
-         avl_file_lread (avl_fp, &lim, cp, &cpr, reclen);
-
-         updated = 0;
-
-         if (cpr.prev == y) {
-            cpr.prev = b;
-            updated = 1;
-         }
-
-         for (k = 0; k < avl_fp->n_keys; k++) {
-            if (cpr.n[k].l == y) {
-               cpr.n[k].l = b;
-               updated = 1;
-            }
-            if (cpr.n[k].r == y) {
-               cpr.n[k].r = b;
-               updated = 1;
-            }
-         }
-
-         if (updated == 1) {
-            avl_file_lwrite (avl_fp, &lim, cp, &cpr, reclen);
-         }
-      }
-
-      lim = y;
-      i = ftruncate (fd, lim);
-      if (i != 0) {
-         setenv (AVL_FILE_EMSG_VNAME, "66 ftruncate failed", 1);
-         break;
-      }
+   y = avl_file_csearch (avl_fp, &lim, k, lo, +1);
+   while (y > 0) {
+      avl_file_lread (avl_fp, &lim, y, &yr, avl_fp->reclen);
+      if (avl_file_kcmp (avl_fp, k, yr.b + avl_fp->uoff, hi) >= 0) break;
+      cp = avl_file_cnext (avl_fp, &lim, k, &yr, +1);
+      avl_file_dremove (avl_fp, &lim, &hdr, y, &yr, &dc);
+      n++;
+      y = cp;
    }
 
-   avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
-
-   lseek (fd, 0, SEEK_SET);
-   lockf (fd, F_ULOCK, 1);
+   for (i = 0; i < dc.n; i++) {
+      if (dc.updated[i]) 
+         avl_file_cwrite (avl_fp, &lim, dc.pos[i], dc.r + i * avl_fp->nodelen, avl_fp->nodelen);
+   }
+   if (n > 0) avl_file_lwrite (avl_fp, &lim, 0, &hdr, sizeof (hdr));
+
+af_delete_range_return:
+   free (dc.pos);
+   free (dc.r);
+   free (dc.updated);
+   avl_file_lend (avl_fp, &lim);
+   if (tmp_cache) avl_file_cache_free (avl_fp);
 #ifdef	AVL_FILE_TSAFE
-   sem_post (&avl_fp->sem);
+   pthread_rwlock_unlock (&avl_fp->rwl);
 #endif
+   return (n);
 }
@@ -34,9 +34,11 @@
  * can the data format be changed. Duplicate keys are allowed.
  *
  * A file will be left in a corrupted state if the functions are
- * interrupted before completing. There is no provision for identifying
- * or repairing a corrupted file. The functions will call abort()
- * if a corrupted file causes a read or write beyond the end of file.
+ * interrupted before completing, unless it was opened with a
+ * write-ahead log (avl_file_open_wal ()). There is no provision for
+ * identifying or repairing a corrupted file. The functions will call
+ * abort() if a corrupted file causes a read or write beyond the end
+ * of file.
  *
  *
  *
@@ -46,11 +48,19 @@
  * The functions are:
  *
  *    avl_file_open ()          - open
+ *    avl_file_open_mmap ()     - open, with memory mapped access
+ *    avl_file_open_wal ()      - open, with a write-ahead log
+ *    avl_file_open_free ()     - open, with a free-space map
+ *    avl_file_open_schema ()   - open, with keys described by a schema
+ *    avl_file_open_shm ()      - open, with a shared lock segment
+ *    avl_file_open_snap ()     - open, with a version store for snapshots
+ *    avl_file_open_shadow ()   - open, with shadow paging for atomic updates
  *    avl_file_close ()         - close
  *    avl_file_getnum ()        - get a sequential record number
  *    avl_file_startseq ()      - position sequential pointer to start
  *    avl_file_readseq ()       - read the next record sequentially
  *    avl_file_insert ()        - insert a new record
+ *    avl_file_insert_batch ()  - insert many records at once
  *    avl_file_update ()        - update a record
  *    avl_file_delete ()        - delete a record
  *    avl_file_startlt ()       - read the first record less than key
@@ -58,15 +68,41 @@
  *    avl_file_next ()          - read the next record by key
  *    avl_file_prev ()          - read the previous record by key
  *    avl_file_find ()          - get a record by key
+ *    avl_file_rank ()          - count the records less than a key
+ *    avl_file_select ()        - read the record at a position by key
+ *    avl_file_count_range ()   - count the records in a key range
+ *    avl_file_delete_range ()  - delete the records in a key range
  *    avl_file_scan ()          - scan the tree recursively by key
  *    avl_file_lock ()          - lock the file for exclusive access
  *    avl_file_unlock ()        - unlock the file
+ *    avl_file_snapshot_begin () - read the file as it is now, without locking
+ *    avl_file_snapshot_end ()  - end the snapshot
+ *    avl_file_txn_begin ()     - begin a transaction
+ *    avl_file_txn_commit ()    - commit the transaction, all at once
+ *    avl_file_txn_abort ()     - discard the transaction
  *    avl_file_dump ()          - show tree nodes
  *    avl_file_squash ()        - eliminate empty records, shorten file
+ *    avl_file_squash_step ()   - squash a part of the file at a time
+ *    avl_file_reorganize ()    - store a key's tree in page-sized blocks
+ *    avl_file_pages ()         - get the average pages read per search
+ *    avl_file_free_policy ()   - choose where new records are put
+ *    avl_file_cache ()         - set the record cache size
+ *    avl_file_cache_stats ()   - get the record cache hit/miss counts
+ *    avl_file_cursor_open ()   - create an in-memory cursor for a key
+ *    avl_file_cursor_seek_ge () - read record greater or equal to key
+ *    avl_file_cursor_seek_lt () - read the first record less than key
+ *    avl_file_cursor_next ()   - read the next record by the cursor key
+ *    avl_file_cursor_prev ()   - read the previous record by the cursor key
+ *    avl_file_cursor_close ()  - free a cursor
+ *    avl_file_bulk_load ()     - create a file from many records
+ *    avl_file_upgrade ()       - convert a file from an earlier version
  *
  * Note: Thread-safe versions of the functions have '_t' appended to the
  *       end of the function names, i.e. avl_file_open_t (),
- *       avl_file_insert_t (), etc.
+ *       avl_file_insert_t (), etc. They are in the same library, 
+ *       which then needs the threads library (-pthread). Threads that
+ *       search the same AVL_FILE with the _t functions run at the 
+ *       same time, unless it has a record cache or a log.
  *
  *--------------------------------------------------------------------
  * An example program using two keys:
@@ -149,33 +185,110 @@
 
 
 #include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h> 
 #include <string.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
-#include <semaphore.h>		// semaphores require a threads library
+#include <pthread.h>		// the _t functions require a threads library
 
 
 struct avl_node_struct {
    char b;		// balance
    off_t l, r;		// left/right pointers
+   int64_t c;		// records in the subtree
 };
 
+struct avl_file_cache_struct;
+struct avl_file_wal_struct;
+struct avl_file_free_struct;
+struct avl_file_shm_struct;
+struct avl_file_vers_struct;
+
 typedef int32_t (*avl_file_cmp_fn_t) (int32_t, const void *, const void *);
+typedef int32_t (*avl_file_source_fn_t) (void *, void *);	// avl_file_bulk_load() input
+
+struct avl_file_seg_struct {	// key schema segment, see avl_file_open_schema()
+   int32_t key;		// key index, each key's segments together in order
+   int32_t off, len;	// position and length in the record
+   int32_t type;	// AVL_FILE_SEG_INT32, etc., or'ed with AVL_FILE_SEG_DESC
+};
+
+typedef struct avl_file_seg_struct AVL_FILE_SEG;
 
 struct avl_file_struct { 
    char *fname;
    int32_t fd, n_keys, len, reclen;	// len is the data structure length
+   int32_t ulen;	// the caller's data length, len without key prefixes
+   int32_t uoff;	// the caller's data position in the record data, after the key prefixes
    avl_file_cmp_fn_t cmp;
    off_t cpr;
-   sem_t sem;		// serialize process-thread file position access
+   int32_t mode;	// AVL_FILE_MMAP, etc.
+   char *map;		// file mapping, for AVL_FILE_MMAP
+   off_t map_len;
+   int32_t hdrlen;	// header length, the first record position
+   int32_t nodelen;	// record length up to the caller's data, with the key prefixes
+   int32_t dirty;	// records written since the file was locked
+   char *hdr;		// the header, read when the file is locked
+   int32_t hlen;	// header length without the key schema
+   uint32_t hgen;	// generation number that the file length hlim is for
+   off_t hlim;		// file length, kept while the generation is the same
+   int32_t txn;		// 1 in a transaction, 2 once it has written records
+   struct avl_file_cache_struct *cache;	// record cache, or NULL
+   struct avl_file_wal_struct *wal;	// write-ahead log or shadow paging, or NULL
+   struct avl_file_free_struct *fmap;	// free-space map, or NULL
+   struct avl_file_shm_struct *shm;	// shared lock segment, or NULL
+   struct avl_file_vers_struct *vers;	// version store and snapshot, or NULL
+   AVL_FILE_SEG *seg;	// key schema, or NULL to use cmp
+   int32_t *kseg;	// first segment of each key, and n_seg
+   int32_t *kpfx;	// key prefix position in the data (-1 for none), or NULL
+   pthread_rwlock_t rwl;	// process-thread access, shared by readers (_t)
+   pthread_mutex_t tmu;	// the readers count and length, for the _t functions
+   pthread_mutex_t cmu;	// the current-pointer record, for the _t functions
+   int32_t readers;	// _t functions reading the file at once
+   off_t rlim;		// and the file length when they started
 };
 
 typedef struct avl_file_struct AVL_FILE;
 
+struct avl_file_cursor_struct {
+   AVL_FILE *avl_fp;
+   int32_t k;		// key index
+   uint32_t gen;	// file generation when l and r were found
+   off_t l, r;		// previous and next record positions, or 0
+   off_t lp, rp;	// positions of the records last read by prev and next
+   char *lb, *rb;	// and their data, to find the places again
+};
+
+typedef struct avl_file_cursor_struct AVL_FILE_CURSOR;
+
+#define	AVL_FILE_MMAP		1	/* access records through mmap() */
+#define	AVL_FILE_WAL		2	/* write-ahead log, see avl_file_open_wal() */
+#define	AVL_FILE_FREE		4	/* free-space map, see avl_file_open_free() */
+#define	AVL_FILE_SHM		8	/* shared lock segment, see avl_file_open_shm() */
+#define	AVL_FILE_SNAP		16	/* version store, see avl_file_open_snap() */
+#define	AVL_FILE_SHADOW		32	/* shadow paging, see avl_file_open_shadow() */
+
+#define	AVL_FILE_FREE_LOWEST	0	/* avl_file_free_policy(): first empty record */
+#define	AVL_FILE_FREE_NEAR	1	/* an empty record near the new record's parent */
+
+#define	AVL_FILE_SEG_INT32	1	/* key schema segment types */
+#define	AVL_FILE_SEG_INT64	2
+#define	AVL_FILE_SEG_UINT32	3
+#define	AVL_FILE_SEG_UINT64	4
+#define	AVL_FILE_SEG_FLOAT	5
+#define	AVL_FILE_SEG_DOUBLE	6
+#define	AVL_FILE_SEG_STRING	7	/* up to len bytes, or to a NUL */
+#define	AVL_FILE_SEG_BYTES	8	/* len bytes, as memcmp() */
+#define	AVL_FILE_SEG_DESC	0x100	/* or'ed with the type, for descending order */
+#define	AVL_FILE_SEG_PREFIX	0x200	/* or'ed with a type, to store the key's prefix */
+
 
 
 /*
@@ -183,11 +296,19 @@ typedef struct avl_file_struct AVL_FILE;
  */
 
 AVL_FILE *avl_file_open (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
+AVL_FILE *avl_file_open_mmap (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
+AVL_FILE *avl_file_open_wal (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
+AVL_FILE *avl_file_open_free (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
+AVL_FILE *avl_file_open_schema (char *fname, int32_t len, int32_t n_keys, AVL_FILE_SEG *seg, int32_t n_seg);
+AVL_FILE *avl_file_open_shm (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
+AVL_FILE *avl_file_open_snap (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
+AVL_FILE *avl_file_open_shadow (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
 void      avl_file_close (AVL_FILE *avl_fp);
 int64_t   avl_file_getnum (AVL_FILE *avl_fp);
 void      avl_file_startseq (AVL_FILE *avl_fp);
 int32_t   avl_file_readseq (AVL_FILE *avl_fp, void *data);
 int32_t   avl_file_insert (AVL_FILE *avl_fp, void *data);
+int32_t   avl_file_insert_batch (AVL_FILE *avl_fp, void *data, int32_t count);
 int32_t   avl_file_delete (AVL_FILE *avl_fp, void *data);
 int32_t   avl_file_update (AVL_FILE *avl_fp, void *data);
 int32_t   avl_file_startlt (AVL_FILE *avl_fp, void *data, int32_t k);
@@ -195,11 +316,35 @@ int32_t   avl_file_startge (AVL_FILE *avl_fp, void *data, int32_t k);
 int32_t   avl_file_next (AVL_FILE *avl_fp, void *data, int32_t k);
 int32_t   avl_file_prev (AVL_FILE *avl_fp, void *data, int32_t k);
 int32_t   avl_file_find (AVL_FILE *avl_fp, void *data, int32_t k);
+int64_t   avl_file_rank (AVL_FILE *avl_fp, void *data, int32_t k);
+int32_t   avl_file_select (AVL_FILE *avl_fp, int64_t idx, void *data, int32_t k);
+int64_t   avl_file_count_range (AVL_FILE *avl_fp, void *lo, void *hi, int32_t k);
+int64_t   avl_file_delete_range (AVL_FILE *avl_fp, void *lo, void *hi, int32_t k);
 int32_t   avl_file_scan (AVL_FILE *avl_fp, int32_t k, off_t sp, int64_t *count);
 void      avl_file_lock (AVL_FILE *avl_fp);
 void      avl_file_unlock (AVL_FILE *avl_fp);
+int32_t   avl_file_snapshot_begin (AVL_FILE *avl_fp);
+int32_t   avl_file_snapshot_end (AVL_FILE *avl_fp);
+int32_t   avl_file_txn_begin (AVL_FILE *avl_fp);
+int32_t   avl_file_txn_commit (AVL_FILE *avl_fp);
+int32_t   avl_file_txn_abort (AVL_FILE *avl_fp);
 void      avl_file_dump (AVL_FILE *avl_fp);
-void      avl_file_squash (AVL_FILE *avl_fp);
+int64_t   avl_file_squash (AVL_FILE *avl_fp);
+int64_t   avl_file_squash_step (AVL_FILE *avl_fp, int64_t budget);
+int32_t   avl_file_reorganize (AVL_FILE *avl_fp, int32_t k, double *expected);
+int32_t   avl_file_pages (AVL_FILE *avl_fp, int32_t k, double *pages);
+int32_t   avl_file_free_policy (AVL_FILE *avl_fp, int32_t policy);
+int32_t   avl_file_cache (AVL_FILE *avl_fp, int64_t size);
+void      avl_file_cache_stats (AVL_FILE *avl_fp, int64_t *hits, int64_t *misses);
+AVL_FILE_CURSOR *avl_file_cursor_open (AVL_FILE *avl_fp, int32_t k);
+int32_t   avl_file_cursor_seek_ge (AVL_FILE_CURSOR *cur, void *data);
+int32_t   avl_file_cursor_seek_lt (AVL_FILE_CURSOR *cur, void *data);
+int32_t   avl_file_cursor_next (AVL_FILE_CURSOR *cur, void *data);
+int32_t   avl_file_cursor_prev (AVL_FILE_CURSOR *cur, void *data);
+void      avl_file_cursor_close (AVL_FILE_CURSOR *cur);
+int32_t   avl_file_bulk_load (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp,
+                              avl_file_source_fn_t source, void *arg);
+int32_t   avl_file_upgrade (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
 
 
 /*
@@ -207,11 +352,19 @@ void      avl_file_squash (AVL_FILE *avl_fp);
  */
 
 AVL_FILE *avl_file_open_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
+AVL_FILE *avl_file_open_mmap_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
+AVL_FILE *avl_file_open_wal_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
+AVL_FILE *avl_file_open_free_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
+AVL_FILE *avl_file_open_schema_t (char *fname, int32_t len, int32_t n_keys, AVL_FILE_SEG *seg, int32_t n_seg);
+AVL_FILE *avl_file_open_shm_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
+AVL_FILE *avl_file_open_snap_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
+AVL_FILE *avl_file_open_shadow_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
 void      avl_file_close_t (AVL_FILE *avl_fp);
 int64_t   avl_file_getnum_t (AVL_FILE *avl_fp);
 void      avl_file_startseq_t (AVL_FILE *avl_fp);
 int32_t   avl_file_readseq_t (AVL_FILE *avl_fp, void *data);
 int32_t   avl_file_insert_t (AVL_FILE *avl_fp, void *data);
+int32_t   avl_file_insert_batch_t (AVL_FILE *avl_fp, void *data, int32_t count);
 int32_t   avl_file_delete_t (AVL_FILE *avl_fp, void *data);
 int32_t   avl_file_update_t (AVL_FILE *avl_fp, void *data);
 int32_t   avl_file_startlt_t (AVL_FILE *avl_fp, void *data, int32_t k);
@@ -219,11 +372,35 @@ int32_t   avl_file_startge_t (AVL_FILE *avl_fp, void *data, int32_t k);
 int32_t   avl_file_next_t (AVL_FILE *avl_fp, void *data, int32_t k);
 int32_t   avl_file_prev_t (AVL_FILE *avl_fp, void *data, int32_t k);
 int32_t   avl_file_find_t (AVL_FILE *avl_fp, void *data, int32_t k);
+int64_t   avl_file_rank_t (AVL_FILE *avl_fp, void *data, int32_t k);
+int32_t   avl_file_select_t (AVL_FILE *avl_fp, int64_t idx, void *data, int32_t k);
+int64_t   avl_file_count_range_t (AVL_FILE *avl_fp, void *lo, void *hi, int32_t k);
+int64_t   avl_file_delete_range_t (AVL_FILE *avl_fp, void *lo, void *hi, int32_t k);
 int32_t   avl_file_scan_t (AVL_FILE *avl_fp, int32_t k, off_t sp, int64_t *count);
 void      avl_file_lock_t (AVL_FILE *avl_fp);
 void      avl_file_unlock_t (AVL_FILE *avl_fp);
+int32_t   avl_file_snapshot_begin_t (AVL_FILE *avl_fp);
+int32_t   avl_file_snapshot_end_t (AVL_FILE *avl_fp);
+int32_t   avl_file_txn_begin_t (AVL_FILE *avl_fp);
+int32_t   avl_file_txn_commit_t (AVL_FILE *avl_fp);
+int32_t   avl_file_txn_abort_t (AVL_FILE *avl_fp);
 void      avl_file_dump_t (AVL_FILE *avl_fp);
-void      avl_file_squash_t (AVL_FILE *avl_fp);
+int64_t   avl_file_squash_t (AVL_FILE *avl_fp);
+int64_t   avl_file_squash_step_t (AVL_FILE *avl_fp, int64_t budget);
+int32_t   avl_file_reorganize_t (AVL_FILE *avl_fp, int32_t k, double *expected);
+int32_t   avl_file_pages_t (AVL_FILE *avl_fp, int32_t k, double *pages);
+int32_t   avl_file_free_policy_t (AVL_FILE *avl_fp, int32_t policy);
+int32_t   avl_file_cache_t (AVL_FILE *avl_fp, int64_t size);
+void      avl_file_cache_stats_t (AVL_FILE *avl_fp, int64_t *hits, int64_t *misses);
+AVL_FILE_CURSOR *avl_file_cursor_open_t (AVL_FILE *avl_fp, int32_t k);
+int32_t   avl_file_cursor_seek_ge_t (AVL_FILE_CURSOR *cur, void *data);
+int32_t   avl_file_cursor_seek_lt_t (AVL_FILE_CURSOR *cur, void *data);
+int32_t   avl_file_cursor_next_t (AVL_FILE_CURSOR *cur, void *data);
+int32_t   avl_file_cursor_prev_t (AVL_FILE_CURSOR *cur, void *data);
+void      avl_file_cursor_close_t (AVL_FILE_CURSOR *cur);
+int32_t   avl_file_bulk_load_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp,
+                                avl_file_source_fn_t source, void *arg);
+int32_t   avl_file_upgrade_t (char *fname, int32_t len, int32_t n_keys, avl_file_cmp_fn_t cmp);
 
 
 #define	AVL_FILE_EMSG_VNAME	"AVL_FILE_EMSG"	/* error message environment variable */
@@ -0,0 +1,1666 @@
+/* avl_file_bench.c
+ *
+ * Benchmarks for the avl_file functions.
+ *
+ * By default it runs the benchmark suite, and prints one CSV line
+ * per test case: random and sequential avl_file_insert(), 
+ * avl_file_find() of records that are and are not in the file,
+ * avl_file_rank() and avl_file_select() of random records,
+ * avl_file_count_range() of key ranges of about 100 records,
+ * avl_file_startge() then avl_file_next() range scans of 10, 100 
+ * and 1000 records, avl_file_update(), avl_file_readseq() full 
+ * scans, avl_file_delete(), avl_file_insert() of half of the deleted
+ * records again, avl_file_delete_range() of key ranges of about 100
+ * records, avl_file_squash_step() with a budget of 16
+ * records and then avl_file_squash() after the deletes, and
+ * avl_file_reorganize() followed by avl_file_find() again.
+ * Each line has the rate, the median and 99th percentile time per
+ * call, and the system calls and bytes read and written per call,
+ * for a file size, record length, number of keys, number of
+ * processes (running the test case at once) and open mode.
+ *
+ * With -M it runs the older benchmarks instead: for files opened 
+ * with avl_file_open() and avl_file_open_mmap(), with the record cache
+ * (avl_file_cache()), with the write-ahead log 
+ * (avl_file_open_wal()) and with shadow paging 
+ * (avl_file_open_shadow()), it reports the system calls, bytes and time 
+ * for each avl_file_insert(), avl_file_find(), avl_file_next() and 
+ * avl_file_cursor_next() call. It times avl_file_bulk_load(),
+ * avl_file_find() before and after avl_file_reorganize() (with the
+ * pages read per search), avl_file_insert_batch() with batches
+ * of 1000, for the same records, and changes of a record (delete,
+ * insert and avl_file_getnum()) with and without a transaction
+ * (avl_file_txn_begin()), with the log and with shadow paging,
+ * and inserts by 1, 2, 4 and 8 processes at once into a file with
+ * the log, counting the fdatasync() calls. It walks through a file
+ * with avl_file_next() while another process updates it, with and 
+ * without avl_file_snapshot_begin(). Last, it reports the
+ * total avl_file_find() rate for 1, 2, 4 and 8 reader processes,
+ * and the avl_file_find_t() rate for 1, 2, 4 and 8 threads sharing
+ * one AVL_FILE, also with a thread inserting records at the same time.
+ *
+ * The system calls are counted by wrapping the I/O and locking 
+ * functions at link time (-Wl,--wrap=...). The tests of the
+ * functions are in avl_file_test.c, run by 'make check'.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2007-2009 Michael Williamson <michael.h.williamson@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * Usage: avl_file_bench [-n records,...] [-r length,...] [-k keys,...]
+ *                       [-p processes,...] [-t threads,...] [-m mode,...]
+ *                       [-o ops]
+ *        avl_file_bench -M [n_records [n_finds [record_length]]]
+ *
+ * The lists are comma separated, and the numbers may end with k, M
+ * or G (or be written as 1e6). The modes are open, mmap, cache (open
+ * with a 16 MB record cache), wal, shadow (with shadow paging, see
+ * avl_file_open_shadow()), free (with the free-space map, see
+ * avl_file_open_free()), near (with the map and the
+ * AVL_FILE_FREE_NEAR policy), shm (with the shared lock segment, see
+ * avl_file_open_shm()), schema (with the keys described by 
+ * a key schema, see avl_file_open_schema(), instead of by the
+ * comparison function) and prefix (the same, with the key prefixes
+ * stored, AVL_FILE_SEG_PREFIX). In the schema and prefix modes the 
+ * file is made with avl_file_insert_batch(), since 
+ * avl_file_bulk_load() cannot make files with a schema. With more
+ * than one thread (-t), each process runs its part of a test case
+ * in that many threads, sharing one AVL_FILE opened with the _t 
+ * functions.
+ */
+
+#include "config.h"
+#include "avl_file.h"
+#include <stdarg.h>
+#include <time.h>
+#include <sys/wait.h>
+
+
+/*
+ * System call counters, incremented by the link-time wrappers. The
+ * increments are atomic, since the suite can run several threads.
+ */
+static int64_t n_read, n_write, n_lseek, n_lock, n_sync, n_rbytes, n_wbytes;
+
+#define COUNT(n, v)	__atomic_add_fetch (&(n), (v), __ATOMIC_RELAXED)
+
+ssize_t __real_read (int fd, void *buf, size_t count);
+ssize_t __real_write (int fd, const void *buf, size_t count);
+ssize_t __real_pread (int fd, void *buf, size_t count, off_t pos);
+ssize_t __real_pwrite (int fd, const void *buf, size_t count, off_t pos);
+ssize_t __real_pwritev (int fd, const struct iovec *iov, int n, off_t pos);
+off_t   __real_lseek (int fd, off_t pos, int whence);
+int     __real_lockf (int fd, int cmd, off_t len);
+int     __real_fcntl (int fd, int cmd, ...);
+int     __real_fdatasync (int fd);
+int     __real_fsync (int fd);
+
+ssize_t __wrap_read (int fd, void *buf, size_t count)
+{ COUNT (n_read, 1); COUNT (n_rbytes, count); return (__real_read (fd, buf, count)); }
+
+ssize_t __wrap_write (int fd, const void *buf, size_t count)
+{ COUNT (n_write, 1); COUNT (n_wbytes, count); return (__real_write (fd, buf, count)); }
+
+ssize_t __wrap_pread (int fd, void *buf, size_t count, off_t pos)
+{ COUNT (n_read, 1); COUNT (n_rbytes, count); return (__real_pread (fd, buf, count, pos)); }
+
+ssize_t __wrap_pwrite (int fd, const void *buf, size_t count, off_t pos)
+{ COUNT (n_write, 1); COUNT (n_wbytes, count); return (__real_pwrite (fd, buf, count, pos)); }
+
+ssize_t
+__wrap_pwritev (int fd, const struct iovec *iov, int n, off_t pos)
+{
+   int i;
+
+   COUNT (n_write, 1);
+   for (i = 0; i < n; i++) COUNT (n_wbytes, iov[i].iov_len);
+   return (__real_pwritev (fd, iov, n, pos));
+}
+
+off_t __wrap_lseek (int fd, off_t pos, int whence)
+{ COUNT (n_lseek, 1); return (__real_lseek (fd, pos, whence)); }
+
+int __wrap_lockf (int fd, int cmd, off_t len)
+{ COUNT (n_lock, 1); return (__real_lockf (fd, cmd, len)); }
+
+int __wrap_fdatasync (int fd)
+{ COUNT (n_sync, 1); return (__real_fdatasync (fd)); }
+
+int __wrap_fsync (int fd)
+{ COUNT (n_sync, 1); return (__real_fsync (fd)); }
+
+int
+__wrap_fcntl (int fd, int cmd, ...)
+{
+   va_list ap;
+   void *arg;
+
+   va_start (ap, cmd);
+   arg = va_arg (ap, void *);
+   va_end (ap);
+   COUNT (n_lock, 1);
+   return (__real_fcntl (fd, cmd, arg));
+}
+
+
+/*
+ * The records are rec_len bytes, with an int32_t key at the start.
+ */
+static int32_t rec_len = 64;
+
+
+static int32_t
+cmp_r (int32_t key, const void *va, const void *vb)
+{
+   int32_t a, b;
+
+   memcpy (&a, va, sizeof (a));
+   memcpy (&b, vb, sizeof (b));
+   return ((a > b) - (a < b));
+}
+
+
+static double
+now (void)
+{
+   struct timespec ts;
+
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+
+typedef AVL_FILE *(*open_fn_t) (char *, int32_t, int32_t, avl_file_cmp_fn_t);
+
+
+/*------------------------------------------- bench_start
+ * Reset the counters and return the start time.
+ */
+static double
+bench_start (void)
+{
+   n_read = n_write = n_lseek = n_lock = n_sync = n_rbytes = n_wbytes = 0;
+   return (now ());
+}
+
+
+/*------------------------------------------- bench_report
+ * Print the time, system calls and bytes per call for n calls of 
+ * function op, started at time t.
+ */
+static void
+bench_report (char *name, char *op, int32_t n, double t)
+{
+   int64_t c_read, c_write, c_lseek, c_lock, c_sync, c_rbytes, c_wbytes;
+
+   t = now () - t;
+   c_read = n_read; c_write = n_write; c_lseek = n_lseek; c_lock = n_lock;
+   c_sync = n_sync; c_rbytes = n_rbytes; c_wbytes = n_wbytes;
+   if (n <= 0) n = 1;
+
+   printf ("%s/%s: %d calls, %.2f us/call\n", name, op, n, t * 1e6 / n);
+   printf ("  syscalls/call: %.2f total = %.2f read + %.2f write + %.2f lseek + %.2f lock + %.2f sync\n",
+           (double) (c_read + c_write + c_lseek + c_lock + c_sync) / n,
+           (double) c_read / n, (double) c_write / n,
+           (double) c_lseek / n, (double) c_lock / n, (double) c_sync / n);
+   printf ("  bytes/call: %.1f read, %.1f written\n",
+           (double) c_rbytes / n, (double) c_wbytes / n);
+}
+
+
+/*------------------------------------------- bench_run
+ * Time n_rec random record inserts, then n_find avl_file_find() calls,
+ * then ordered walks through the records with avl_file_next() and
+ * avl_file_cursor_next(), with a record cache of cache_size bytes 
+ * if not zero.
+ */
+static int32_t
+bench_run (char *name, open_fn_t open_fn, int64_t cache_size, int32_t n_rec, int32_t n_find)
+{
+   AVL_FILE *ap;
+   AVL_FILE_CURSOR *cur;
+   char r[rec_len];
+   int32_t i, num;
+   int64_t hits, misses;
+   double t;
+   char *fname = "avl_file_bench.avl";
+
+
+   unlink (fname);
+   unlink ("avl_file_bench.avl-wal");
+   unlink ("avl_file_bench.avl-shadow");
+   unlink ("avl_file_bench.avl-shm");
+   ap = open_fn (fname, rec_len, 1, cmp_r);
+   if (ap == NULL) {
+      fprintf (stderr, "%s: %s\n", name, getenv (AVL_FILE_EMSG_VNAME));
+      return (-1);
+   }
+   if (avl_file_cache (ap, cache_size) != 0) {
+      fprintf (stderr, "%s: %s\n", name, getenv (AVL_FILE_EMSG_VNAME));
+      avl_file_close (ap);
+      return (-1);
+   }
+
+   memset (r, 0, rec_len);
+   srandom (1);
+   t = bench_start ();
+   for (i = 0; i < n_rec; i++) {
+      num = random () % (2 * n_rec);
+      memcpy (r, &num, sizeof (num));
+      avl_file_insert (ap, r);
+   }
+   bench_report (name, "avl_file_insert", n_rec, t);
+
+   t = bench_start ();
+   for (i = 0; i < n_find; i++) {
+      num = random () % (2 * n_rec);
+      memcpy (r, &num, sizeof (num));
+      avl_file_find (ap, r, 0);
+   }
+   bench_report (name, "avl_file_find", n_find, t);
+
+   num = 0;
+   memcpy (r, &num, sizeof (num));
+   t = bench_start ();
+   i = 0;
+   if (avl_file_startge (ap, r, 0) == 0) {
+      for (i = 1; avl_file_next (ap, r, 0) == 0; i++);
+   }
+   bench_report (name, "avl_file_next", i, t);
+
+   cur = avl_file_cursor_open (ap, 0);
+   num = 0;
+   memcpy (r, &num, sizeof (num));
+   t = bench_start ();
+   i = 0;
+   if (avl_file_cursor_seek_ge (cur, r) == 0) {
+      for (i = 1; avl_file_cursor_next (cur, r) == 0; i++);
+   }
+   bench_report (name, "avl_file_cursor_next", i, t);
+   avl_file_cursor_close (cur);
+
+   if (cache_size > 0) {
+      avl_file_cache_stats (ap, &hits, &misses);
+      printf ("  cache: %lld bytes, %lld hits, %lld misses, %.1f%% hit rate\n",
+              (long long) cache_size, (long long) hits, (long long) misses,
+              100.0 * hits / ((hits + misses > 0) ? (hits + misses) : 1));
+   }
+
+   avl_file_close (ap);
+   unlink (fname);
+   unlink ("avl_file_bench.avl-wal");
+   unlink ("avl_file_bench.avl-shadow");
+   unlink ("avl_file_bench.avl-shm");
+   return (0);
+}
+
+
+static int32_t src_n, src_i;
+
+
+static int32_t
+bench_source (void *arg, void *data)
+{
+   int32_t num;
+
+   if (src_i == src_n) return (1);
+   src_i++;
+   num = random () % (2 * src_n);
+   memcpy (data, &num, sizeof (num));
+   return (0);
+}
+
+
+/*------------------------------------------- bench_bulk_load
+ * Time avl_file_bulk_load() for n_rec random records.
+ */
+static int32_t
+bench_bulk_load (int32_t n_rec)
+{
+   AVL_FILE *ap;
+   int32_t h;
+   int64_t count;
+   double t;
+   char *fname = "avl_file_bench.avl";
+
+
+   unlink (fname);
+   srandom (1);
+   src_n = n_rec;
+   src_i = 0;
+   t = bench_start ();
+   if (avl_file_bulk_load (fname, rec_len, 1, cmp_r, bench_source, NULL) != 0) {
+      fprintf (stderr, "bulk_load: %s\n", getenv (AVL_FILE_EMSG_VNAME));
+      return (-1);
+   }
+   bench_report ("bulk", "avl_file_bulk_load (per record)", n_rec, t);
+
+   ap = avl_file_open (fname, rec_len, 1, cmp_r);
+   count = 0;
+   h = avl_file_scan (ap, 0, 0, &count);
+   printf ("  tree height %d, %lld records\n", h, (long long) count);
+   avl_file_close (ap);
+   unlink (fname);
+   return (0);
+}
+
+
+/*------------------------------------------- bench_reorganize
+ * Time n_find avl_file_find() calls on n_rec random records, before
+ * and after avl_file_reorganize(), with the expected and measured
+ * pages per search. A 1 MB record cache is used, so that records read
+ * with the rest of their page are counted as a single read.
+ */
+static int32_t
+bench_reorganize (int32_t n_rec, int32_t n_find)
+{
+   AVL_FILE *ap;
+   char r[rec_len];
+   int32_t i, j, num;
+   double t, expected, pages;
+   char *fname = "avl_file_bench.avl";
+
+
+   unlink (fname);
+   ap = avl_file_open (fname, rec_len, 1, cmp_r);
+   if (ap == NULL) {
+      fprintf (stderr, "reorganize: %s\n", getenv (AVL_FILE_EMSG_VNAME));
+      return (-1);
+   }
+   memset (r, 0, rec_len);
+   srandom (1);
+   for (i = 0; i < n_rec; i++) {
+      num = random () % (2 * n_rec);
+      memcpy (r, &num, sizeof (num));
+      avl_file_insert (ap, r);
+   }
+   avl_file_cache (ap, 1 << 20);
+
+   for (j = 0; j < 2; j++) {
+      if (j == 1) {
+         t = bench_start ();
+         if (avl_file_reorganize (ap, 0, &expected) != 0) {
+            fprintf (stderr, "reorganize: %s\n", getenv (AVL_FILE_EMSG_VNAME));
+            avl_file_close (ap);
+            return (-1);
+         }
+         bench_report ("reorganize", "avl_file_reorganize", 1, t);
+         printf ("  expected pages/search: %.2f\n", expected);
+      }
+      avl_file_pages (ap, 0, &pages);
+      printf ("  measured pages/search: %.2f\n", pages);
+
+      srandom (2);
+      t = bench_start ();
+      for (i = 0; i < n_find; i++) {
+         num = random () % (2 * n_rec);
+         memcpy (r, &num, sizeof (num));
+         avl_file_find (ap, r, 0);
+      }
+      bench_report ((j == 0) ? "reorganize" : "reorganized", "avl_file_find", n_find, t);
+   }
+
+   avl_file_close (ap);
+   unlink (fname);
+   return (0);
+}
+
+
+/*------------------------------------------- bench_insert_batch
+ * Time avl_file_insert_batch() for n_rec random records, in batches
+ * of n_batch records.
+ */
+static int32_t
+bench_insert_batch (char *name, open_fn_t open_fn, int32_t n_rec, int32_t n_batch)
+{
+   AVL_FILE *ap;
+   char *r;
+   int32_t i, j, m, num;
+   double t;
+   char *fname = "avl_file_bench.avl";
+
+
+   unlink (fname);
+   ap = open_fn (fname, rec_len, 1, cmp_r);
+   r = calloc (n_batch, rec_len);
+   if ((ap == NULL) || (r == NULL)) {
+      fprintf (stderr, "%s: %s\n", name, getenv (AVL_FILE_EMSG_VNAME));
+      return (-1);
+   }
+
+   srandom (1);
+   t = bench_start ();
+   for (i = 0; i < n_rec; i += m) {
+      m = (n_rec - i < n_batch) ? n_rec - i : n_batch;
+      for (j = 0; j < m; j++) {
+         num = random () % (2 * n_rec);
+         memcpy (r + j * rec_len, &num, sizeof (num));
+      }
+      if (avl_file_insert_batch (ap, r, m) != 0) {
+         fprintf (stderr, "%s: %s\n", name, getenv (AVL_FILE_EMSG_VNAME));
+         break;
+      }
+   }
+   bench_report (name, "avl_file_insert_batch (per record)", n_rec, t);
+
+   avl_file_close (ap);
+   free (r);
+   unlink (fname);
+   return (0);
+}
+
+
+/*------------------------------------------- bench_txn
+ * Make a file of n_rec records with the even keys below 2 * n_rec,
+ * then time n_rec / 10 changes that each delete a record, insert it
+ * again with the next key, and get a record number, with one call
+ * each or, if txn is not zero, in a transaction (avl_file_txn_begin()
+ * and avl_file_txn_commit()).
+ */
+static int32_t
+bench_txn (char *name, open_fn_t open_fn, int32_t n_rec, int32_t txn)
+{
+   AVL_FILE *ap;
+   char r[rec_len];
+   int32_t i, num;
+   double t;
+   char *fname = "avl_file_bench.avl";
+
+
+   unlink (fname);
+   unlink ("avl_file_bench.avl-wal");
+   unlink ("avl_file_bench.avl-shadow");
+   ap = open_fn (fname, rec_len, 1, cmp_r);
+   if (ap == NULL) {
+      fprintf (stderr, "%s: %s\n", name, getenv (AVL_FILE_EMSG_VNAME));
+      return (-1);
+   }
+   memset (r, 0, rec_len);
+   if (txn) avl_file_txn_begin (ap);
+   for (i = 0; i < n_rec; i++) {
+      num = 2 * (int32_t) ((i * 7919LL) % n_rec);	// in a scattered order
+      memcpy (r, &num, sizeof (num));
+      avl_file_insert (ap, r);
+   }
+   if (txn) avl_file_txn_commit (ap);
+
+   t = bench_start ();
+   for (i = 0; i < n_rec / 10; i++) {
+      num = 2 * (int32_t) ((i * 104729LL) % n_rec);
+      memcpy (r, &num, sizeof (num));
+      if (txn && (avl_file_txn_begin (ap) != 0)) {
+         fprintf (stderr, "%s: %s\n", name, getenv (AVL_FILE_EMSG_VNAME));
+         break;
+      }
+      if (avl_file_delete (ap, r) == 0) {
+         num++;
+         memcpy (r, &num, sizeof (num));
+         avl_file_insert (ap, r);
+      }
+      avl_file_getnum (ap);
+      if (txn) avl_file_txn_commit (ap);
+   }
+   bench_report (name, txn ? "delete+insert+getnum in a transaction" : "delete+insert+getnum", n_rec / 10, t);
+
+   avl_file_close (ap);
+   unlink (fname);
+   unlink ("avl_file_bench.avl-wal");
+   unlink ("avl_file_bench.avl-shadow");
+   return (0);
+}
+
+
+/*------------------------------------------- bench_wal_writers
+ * Fork n_proc processes that each insert n_rec / n_proc random 
+ * records into a file with the write-ahead log, and report the 
+ * total rate, and the number of fdatasync() calls per insert, which
+ * is less than 1 when the log syncs are shared (group commit).
+ */
+static int32_t
+bench_wal_writers (int32_t n_rec, int32_t n_proc)
+{
+   AVL_FILE *ap;
+   char r[rec_len];
+   int32_t i, j, num, status, ret;
+   int64_t *syncs, total;
+   double t;
+   char *fname = "avl_file_bench.avl";
+
+
+   unlink (fname);
+   unlink ("avl_file_bench.avl-wal");
+   ap = avl_file_open_wal (fname, rec_len, 1, cmp_r);
+   if (ap == NULL) {
+      fprintf (stderr, "open_wal: %s\n", getenv (AVL_FILE_EMSG_VNAME));
+      return (-1);
+   }
+   avl_file_close (ap);
+   syncs = mmap (NULL, n_proc * sizeof (int64_t), PROT_READ | PROT_WRITE, 
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (syncs == MAP_FAILED) return (-1);
+
+   t = now ();
+   for (j = 0; j < n_proc; j++) {
+      if (fork () == 0) {
+         ap = avl_file_open (fname, rec_len, 1, cmp_r);
+         if (ap == NULL) _exit (1);
+         memset (r, 0, rec_len);
+         srandom (j + 2);
+         n_sync = 0;
+         for (i = 0; i < n_rec / n_proc; i++) {
+            num = random () % (2 * n_rec);
+            memcpy (r, &num, sizeof (num));
+            avl_file_insert (ap, r);
+         }
+         syncs[j] = n_sync;
+         avl_file_close (ap);
+         _exit (0);
+      }
+   }
+   ret = 0;
+   for (j = 0; j < n_proc; j++) {
+      if ((wait (&status) < 0) || (status != 0)) ret = -1;
+   }
+   t = now () - t;
+
+   for (total = 0, j = 0; j < n_proc; j++) total += syncs[j];
+   printf ("open_wal/avl_file_insert: %d processes, %.0f inserts/s, %.2f syncs/insert\n", 
+           n_proc, (double) (n_rec / n_proc) * n_proc / t, 
+           (double) total / ((n_rec / n_proc) * n_proc));
+   munmap (syncs, n_proc * sizeof (int64_t));
+   unlink (fname);
+   unlink ("avl_file_bench.avl-wal");
+   return (ret);
+}
+
+
+/*------------------------------------------- bench_readers
+ * Insert n_rec random records, then fork n_proc processes that each
+ * open the file and make n_find avl_file_find() calls, and report
+ * the total rate.
+ */
+static int32_t
+bench_readers (char *name, open_fn_t open_fn, int32_t n_rec, int32_t n_find, int32_t n_proc)
+{
+   AVL_FILE *ap;
+   char r[rec_len];
+   int32_t i, j, num, status, ret;
+   double t;
+   char *fname = "avl_file_bench.avl";
+
+
+   unlink (fname);
+   unlink ("avl_file_bench.avl-shm");
+   ap = open_fn (fname, rec_len, 1, cmp_r);
+   if (ap == NULL) {
+      fprintf (stderr, "%s: %s\n", name, getenv (AVL_FILE_EMSG_VNAME));
+      return (-1);
+   }
+   memset (r, 0, rec_len);
+   srandom (1);
+   for (i = 0; i < n_rec; i++) {
+      num = random () % (2 * n_rec);
+      memcpy (r, &num, sizeof (num));
+      avl_file_insert (ap, r);
+   }
+   avl_file_close (ap);
+
+   t = now ();
+   for (j = 0; j < n_proc; j++) {
+      if (fork () == 0) {
+         ap = open_fn (fname, rec_len, 1, cmp_r);
+         if (ap == NULL) _exit (1);
+         srandom (j + 2);
+         for (i = 0; i < n_find; i++) {
+            num = random () % (2 * n_rec);
+            memcpy (r, &num, sizeof (num));
+            avl_file_find (ap, r, 0);
+         }
+         avl_file_close (ap);
+         _exit (0);
+      }
+   }
+   ret = 0;
+   for (j = 0; j < n_proc; j++) {
+      if ((wait (&status) < 0) || (status != 0)) ret = -1;
+   }
+   t = now () - t;
+
+   printf ("%s/avl_file_find: %d processes, %.0f finds/s\n", 
+           name, n_proc, (double) n_proc * n_find / t);
+   unlink (fname);
+   unlink ("avl_file_bench.avl-shm");
+   return (ret);
+}
+
+
+/*------------------------------------------- bench_snapshot
+ * Insert n_rec random records into a file with a version store, then
+ * walk through them 10 times with avl_file_next(), in a snapshot if
+ * snap is not zero, while another process inserts and deletes 
+ * records, and report both rates.
+ */
+static int32_t
+bench_snapshot (int32_t n_rec, int32_t snap)
+{
+   AVL_FILE *ap;
+   char r[rec_len];
+   int32_t i, j, num, status;
+   volatile int64_t *shared;
+   int64_t n;
+   double t;
+   pid_t pid;
+   char *fname = "avl_file_bench.avl";
+
+
+   unlink (fname);
+   unlink ("avl_file_bench.avl-snap");
+   ap = avl_file_open_snap (fname, rec_len, 1, cmp_r);
+   if (ap == NULL) {
+      fprintf (stderr, "open_snap: %s\n", getenv (AVL_FILE_EMSG_VNAME));
+      return (-1);
+   }
+   memset (r, 0, rec_len);
+   srandom (1);
+   for (i = 0; i < n_rec; i++) {
+      num = random () % (2 * n_rec);
+      memcpy (r, &num, sizeof (num));
+      avl_file_insert (ap, r);
+   }
+   shared = mmap (NULL, 2 * sizeof (int64_t), PROT_READ | PROT_WRITE, 
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (shared == MAP_FAILED) return (-1);
+   shared[0] = 0;              // stop flag
+   shared[1] = 0;              // updates
+
+   pid = fork ();
+   if (pid == 0) {
+      ap = avl_file_open (fname, rec_len, 1, cmp_r);
+      if (ap == NULL) _exit (1);
+      memset (r, 0, rec_len);
+      srandom (2);
+      for (n = 0; shared[0] == 0; n++) {
+         num = random () % (2 * n_rec);
+         memcpy (r, &num, sizeof (num));
+         if (n & 1) avl_file_insert (ap, r);
+         else if (avl_file_startge (ap, r, 0) == 0) avl_file_delete (ap, r);
+      }
+      shared[1] = n;
+      avl_file_close (ap);
+      _exit (0);
+   }
+
+   t = now ();
+   n = 0;
+   for (j = 0; j < 10; j++) {
+      if (snap && (avl_file_snapshot_begin (ap) != 0)) {
+         fprintf (stderr, "snapshot_begin: %s\n", getenv (AVL_FILE_EMSG_VNAME));
+         break;
+      }
+      num = 0;
+      memcpy (r, &num, sizeof (num));
+      if (avl_file_startge (ap, r, 0) == 0) {
+         for (n++; avl_file_next (ap, r, 0) == 0; n++);
+      }
+      if (snap) avl_file_snapshot_end (ap);
+   }
+   t = now () - t;
+   shared[0] = 1;
+   if ((waitpid (pid, &status, 0) < 0) || (status != 0)) j = -1;
+
+   printf ("open_snap/avl_file_next: %s, %.0f records/s read, %.0f updates/s by another process\n",
+           snap ? "in snapshots" : "no snapshots", n / t, shared[1] / t);
+   munmap ((void *) shared, 2 * sizeof (int64_t));
+   avl_file_close (ap);
+   unlink (fname);
+   unlink ("avl_file_bench.avl-snap");
+   return ((j == 10) ? 0 : -1);
+}
+
+
+/*------------------------------------------- bench_threads
+ * Insert n_rec random records, then start n_thr threads that share
+ * one AVL_FILE and each make n_find avl_file_find_t() calls, and 
+ * report the total rate. With a writer, one more thread inserts 
+ * records (with keys that the finds do not look for) at the same 
+ * time. Afterwards the finds are made again by this thread, and
+ * each thread must have found the same records.
+ */
+struct bench_thread_struct {
+   AVL_FILE *ap;
+   int32_t n_rec, n_find, seed;
+   volatile int32_t *stop;    // set when the finds are done
+   int64_t found, inserted;
+};
+
+
+static void *
+bench_finder (void *arg)
+{
+   struct bench_thread_struct *b = arg;
+   char r[rec_len];
+   uint32_t x;
+   int32_t i, num;
+
+   memset (r, 0, rec_len);
+   x = b->seed;
+   b->found = 0;
+   for (i = 0; i < b->n_find; i++) {
+      x = x * 1103515245 + 12345;
+      num = (x >> 1) % (2 * b->n_rec);
+      memcpy (r, &num, sizeof (num));
+      if (avl_file_find_t (b->ap, r, 0) == 0) b->found++;
+   }
+   return (NULL);
+}
+
+
+static void *
+bench_inserter (void *arg)
+{
+   struct bench_thread_struct *b = arg;
+   char r[rec_len];
+   int32_t num;
+
+   memset (r, 0, rec_len);
+   b->inserted = 0;
+   for (num = 2 * b->n_rec; !*b->stop; num++) {
+      memcpy (r, &num, sizeof (num));
+      if (avl_file_insert_t (b->ap, r) != 0) break;
+      b->inserted++;
+   }
+   return (NULL);
+}
+
+
+static int32_t
+bench_threads (char *name, open_fn_t open_fn, int32_t n_rec, int32_t n_find, 
+               int32_t n_thr, int32_t writer)
+{
+   AVL_FILE *ap;
+   struct bench_thread_struct b[n_thr + 1];
+   pthread_t tid[n_thr + 1];
+   char r[rec_len];
+   int32_t i, j, num, ret;
+   volatile int32_t stop;
+   int64_t found;
+   double t;
+   char *fname = "avl_file_bench.avl";
+
+
+   unlink (fname);
+   ap = open_fn (fname, rec_len, 1, cmp_r);
+   if (ap == NULL) {
+      fprintf (stderr, "%s: %s\n", name, getenv (AVL_FILE_EMSG_VNAME));
+      return (-1);
+   }
+   memset (r, 0, rec_len);
+   srandom (1);
+   for (i = 0; i < n_rec; i++) {
+      num = random () % (2 * n_rec);
+      memcpy (r, &num, sizeof (num));
+      avl_file_insert_t (ap, r);
+   }
+
+   stop = 0;
+   for (j = 0; j <= n_thr; j++) {
+      b[j].ap = ap;
+      b[j].n_rec = n_rec;
+      b[j].n_find = n_find;
+      b[j].seed = j + 2;
+      b[j].stop = &stop;
+   }
+   t = now ();
+   if (writer) pthread_create (&tid[n_thr], NULL, bench_inserter, &b[n_thr]);
+   for (j = 0; j < n_thr; j++) pthread_create (&tid[j], NULL, bench_finder, &b[j]);
+   for (j = 0; j < n_thr; j++) pthread_join (tid[j], NULL);
+   t = now () - t;
+   stop = 1;
+   if (writer) pthread_join (tid[n_thr], NULL);
+
+   ret = 0;
+   for (j = 0; j < n_thr; j++) {
+      found = b[j].found;
+      bench_finder (&b[j]);
+      if (found != b[j].found) {
+         fprintf (stderr, "%s: thread %d found %lld records, expected %lld\n",
+                  name, j, (long long) found, (long long) b[j].found);
+         ret = -1;
+      }
+   }
+   if (writer) {
+      for (num = 2 * n_rec; num < 2 * n_rec + b[n_thr].inserted; num++) {
+         memcpy (r, &num, sizeof (num));
+         if (avl_file_find_t (ap, r, 0) != 0) {
+            fprintf (stderr, "%s: inserted record %d not found\n", name, num);
+            ret = -1;
+            break;
+         }
+      }
+   }
+   avl_file_close_t (ap);
+
+   printf ("%s/avl_file_find_t: %d threads%s, %.0f finds/s", name, n_thr, 
+           writer ? " and a writer" : "", (double) n_thr * n_find / t);
+   if (writer) printf (", %.0f inserts/s", b[n_thr].inserted / t);
+   printf ("\n");
+   unlink (fname);
+   return (ret);
+}
+
+
+/*
+ * Benchmark suite. For each combination of the file size (records),
+ * record length, number of keys, number of processes, number of 
+ * threads in each process and open mode, a file is made with 
+ * avl_file_bulk_load(), then each test case is run by all of the 
+ * processes at once, and one CSV line is printed for it. With more
+ * than one thread, each process opens the file once, and its threads
+ * share that AVL_FILE through the _t functions. The suite records 
+ * start with n_keys int32_t keys, and record i of the file has keys 
+ * made from i, so that any record can be made again to be found, 
+ * updated or deleted.
+ */
+struct suite_fn_struct {        // the functions, or the _t ones
+   AVL_FILE *(*open) (char *, int32_t, int32_t, avl_file_cmp_fn_t);
+   AVL_FILE *(*open_mmap) (char *, int32_t, int32_t, avl_file_cmp_fn_t);
+   AVL_FILE *(*open_schema) (char *, int32_t, int32_t, AVL_FILE_SEG *, int32_t);
+   void (*close) (AVL_FILE *);
+   int32_t (*cache) (AVL_FILE *, int64_t);
+   int32_t (*free_policy) (AVL_FILE *, int32_t);
+   int32_t (*insert) (AVL_FILE *, void *);
+   int32_t (*insert_batch) (AVL_FILE *, void *, int32_t);
+   int32_t (*find) (AVL_FILE *, void *, int32_t);
+   int64_t (*rank) (AVL_FILE *, void *, int32_t);
+   int32_t (*select) (AVL_FILE *, int64_t, void *, int32_t);
+   int32_t (*startge) (AVL_FILE *, void *, int32_t);
+   int32_t (*next) (AVL_FILE *, void *, int32_t);
+   int32_t (*update) (AVL_FILE *, void *);
+   void (*startseq) (AVL_FILE *);
+   int32_t (*readseq) (AVL_FILE *, void *);
+   int32_t (*delete) (AVL_FILE *, void *);
+   int64_t (*count_range) (AVL_FILE *, void *, void *, int32_t);
+   int64_t (*delete_range) (AVL_FILE *, void *, void *, int32_t);
+   int64_t (*squash) (AVL_FILE *);
+   int64_t (*squash_step) (AVL_FILE *, int64_t);
+   int32_t (*reorganize) (AVL_FILE *, int32_t, double *);
+};
+
+static struct suite_fn_struct suite_fn = {
+   avl_file_open, avl_file_open_mmap, avl_file_open_schema, avl_file_close,
+   avl_file_cache, avl_file_free_policy, avl_file_insert, avl_file_insert_batch,
+   avl_file_find,
+   avl_file_rank, avl_file_select, avl_file_startge, avl_file_next,
+   avl_file_update, avl_file_startseq, avl_file_readseq, avl_file_delete,
+   avl_file_count_range, avl_file_delete_range, avl_file_squash,
+   avl_file_squash_step, avl_file_reorganize
+};
+
+static struct suite_fn_struct suite_fn_t = {
+   avl_file_open_t, avl_file_open_mmap_t, avl_file_open_schema_t, avl_file_close_t,
+   avl_file_cache_t, avl_file_free_policy_t, avl_file_insert_t, avl_file_insert_batch_t,
+   avl_file_find_t,
+   avl_file_rank_t, avl_file_select_t, avl_file_startge_t, avl_file_next_t,
+   avl_file_update_t, avl_file_startseq_t, avl_file_readseq_t, avl_file_delete_t,
+   avl_file_count_range_t, avl_file_delete_range_t, avl_file_squash_t,
+   avl_file_squash_step_t, avl_file_reorganize_t
+};
+
+struct suite_struct {
+   int32_t n_keys, n_proc;
+   int32_t n_thr;               // threads in each process
+   struct suite_fn_struct *fn;  // suite_fn, or suite_fn_t with threads
+   int64_t n_rec;               // records in the file
+   int64_t n_ops;               // operations per test case
+   int64_t n_ins;               // records inserted by the insert cases
+   char *mode;                  // open, mmap, cache, wal, shadow, free, near, shm, schema or prefix
+};
+
+struct suite_stat_struct {      // per-process results, in shared memory
+   double t0, t1;
+   int64_t ops, syscalls, rbytes, wbytes;
+};
+
+typedef void (*suite_op_fn_t) (struct suite_struct *, AVL_FILE *, char *, int64_t);
+
+#define SUITE_SAMPLES	1000000	// latency samples per test case, at most
+#define SUITE_SEQ_KEY	0x70000000	// first key of the sequential inserts
+
+static char *suite_fname = "avl_file_bench.avl";
+
+
+/*------------------------------------------- suite_mix
+ * Mix the bits of x (a one-to-one function).
+ */
+static uint32_t
+suite_mix (uint32_t x)
+{
+   x ^= x >> 16;
+   x *= 0x7feb352d;
+   x ^= x >> 15;
+   x *= 0x846ca68b;
+   x ^= x >> 16;
+   return (x);
+}
+
+
+/*------------------------------------------- suite_rec
+ * Make record i, with the rest of the record after the keys set
+ * to fill.
+ */
+static void
+suite_rec (struct suite_struct *s, char *r, int64_t i, int32_t fill)
+{
+   int32_t k, key;
+
+   memset (r, fill, rec_len);
+   for (k = 0; k < s->n_keys; k++) {
+      key = suite_mix ((uint32_t) i + k * 0x9e3779b9);
+      memcpy (r + k * sizeof (int32_t), &key, sizeof (key));
+   }
+}
+
+
+static int32_t
+suite_cmp (int32_t k, const void *va, const void *vb)
+{
+   int32_t a, b;
+
+   memcpy (&a, (char *) va + k * sizeof (int32_t), sizeof (a));
+   memcpy (&b, (char *) vb + k * sizeof (int32_t), sizeof (b));
+   return ((a > b) - (a < b));
+}
+
+
+static struct suite_struct *src_s;
+
+
+/*------------------------------------------- suite_schema
+ * Return 1 if the mode makes the file with a key schema, or 0.
+ */
+static int32_t
+suite_schema (struct suite_struct *s)
+{
+   return ((strcmp (s->mode, "schema") == 0) || (strcmp (s->mode, "prefix") == 0));
+}
+
+
+/*------------------------------------------- suite_open_schema
+ * Open the file with a key schema that orders the records the same
+ * as suite_cmp(), and with the key prefixes for the prefix mode.
+ */
+static AVL_FILE *
+suite_open_schema (struct suite_struct *s)
+{
+   AVL_FILE_SEG seg[s->n_keys];
+   int32_t k;
+
+   for (k = 0; k < s->n_keys; k++) {
+      seg[k].key = k;
+      seg[k].off = k * sizeof (int32_t);
+      seg[k].len = sizeof (int32_t);
+      seg[k].type = AVL_FILE_SEG_INT32;
+      if (strcmp (s->mode, "prefix") == 0) seg[k].type |= AVL_FILE_SEG_PREFIX;
+   }
+   return (s->fn->open_schema (suite_fname, rec_len, s->n_keys, seg, s->n_keys));
+}
+
+
+static int32_t
+suite_source (void *arg, void *data)
+{
+   if (src_i == src_s->n_rec) return (1);
+   suite_rec (src_s, data, src_i++, 0);
+   return (0);
+}
+
+
+/*------------------------------------------- suite_schema_load
+ * Make the file with a key schema from the suite records, with
+ * avl_file_insert_batch() in batches of 1000.
+ * Returns 0 if successful.
+ */
+static int32_t
+suite_schema_load (struct suite_struct *s)
+{
+   AVL_FILE *ap;
+   char *r;
+   int64_t i;
+   int32_t m, ret;
+
+   ap = suite_open_schema (s);
+   r = malloc (1000 * rec_len);
+   ret = ((ap != NULL) && (r != NULL)) ? 0 : -1;
+   for (i = 0; (ret == 0) && (i < s->n_rec); i += m) {
+      for (m = 0; (m < 1000) && (i + m < s->n_rec); m++)
+         suite_rec (s, r + m * rec_len, i + m, 0);
+      ret = s->fn->insert_batch (ap, r, m);
+   }
+   if (ap != NULL) s->fn->close (ap);
+   free (r);
+   return (ret);
+}
+
+
+/*------------------------------------------- suite_open
+ * Open the file the way the mode says.
+ */
+static AVL_FILE *
+suite_open (struct suite_struct *s)
+{
+   AVL_FILE *ap;
+
+   if (strcmp (s->mode, "mmap") == 0)
+      return (s->fn->open_mmap (suite_fname, rec_len, s->n_keys, suite_cmp));
+   if (suite_schema (s)) return (suite_open_schema (s));
+   ap = s->fn->open (suite_fname, rec_len, s->n_keys, suite_cmp);
+   if ((ap != NULL) && (strcmp (s->mode, "cache") == 0)) s->fn->cache (ap, 16 << 20);
+   if ((ap != NULL) && (strcmp (s->mode, "near") == 0)) s->fn->free_policy (ap, AVL_FILE_FREE_NEAR);
+   return (ap);
+}
+
+
+/*
+ * The test case operations. Operation number t is one of 0 to n_ops-1,
+ * and each thread of each process does the ones with t modulo 
+ * n_proc * n_thr equal to its number. Each case is also called once 
+ * with t = -1 before the first operation in each process. The scan
+ * and readseq cases move the position of the AVL_FILE, which the
+ * threads of a process share.
+ */
+static void
+op_insert_random (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{
+   if (t < 0) return;
+   suite_rec (s, r, s->n_rec + t, 0);
+   s->fn->insert (ap, r);
+}
+
+
+static void
+op_insert_seq (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{
+   int32_t k, key;
+
+   if (t < 0) return;
+   memset (r, 0, rec_len);
+   key = SUITE_SEQ_KEY + t;
+   for (k = 0; k < s->n_keys; k++) memcpy (r + k * sizeof (int32_t), &key, sizeof (key));
+   s->fn->insert (ap, r);
+}
+
+
+static void
+op_find_hit (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{
+   if (t < 0) return;
+   suite_rec (s, r, suite_mix (t) % s->n_rec, 0);
+   s->fn->find (ap, r, 0);
+}
+
+
+static void
+op_find_miss (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{
+   if (t < 0) return;
+   suite_rec (s, r, 0x40000000 + t, 0);
+   s->fn->find (ap, r, 0);
+}
+
+
+static void
+op_rank (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{
+   if (t < 0) return;
+   suite_rec (s, r, suite_mix (t) % s->n_rec, 0);
+   s->fn->rank (ap, r, 0);
+}
+
+
+static void
+op_select (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{
+   if (t < 0) return;
+   s->fn->select (ap, suite_mix (t) % s->n_rec, r, 0);
+}
+
+
+static void
+op_scan (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t, int32_t n)
+{
+   int32_t i;
+
+   if (t < 0) return;
+   suite_rec (s, r, suite_mix (t) % s->n_rec, 0);
+   if (s->fn->startge (ap, r, 0) != 0) return;
+   for (i = 1; (i < n) && (s->fn->next (ap, r, 0) == 0); i++);
+}
+
+
+static void
+op_scan_10 (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{ op_scan (s, ap, r, t, 10); }
+
+static void
+op_scan_100 (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{ op_scan (s, ap, r, t, 100); }
+
+static void
+op_scan_1000 (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{ op_scan (s, ap, r, t, 1000); }
+
+
+static void
+op_update (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{
+   if (t < 0) return;
+   suite_rec (s, r, suite_mix (t) % s->n_rec, (int32_t) (t & 0x7f) + 1);
+   s->fn->update (ap, r);
+}
+
+
+static void
+op_readseq (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{
+   if (t < 0)
+      s->fn->startseq (ap);
+   else
+      s->fn->readseq (ap, r);
+}
+
+
+static void
+op_delete (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{
+   if (t < 0) return;
+   suite_rec (s, r, t, 0);
+   if (s->fn->find (ap, r, 0) == 0) s->fn->delete (ap, r);
+}
+
+
+/*------------------------------------------- suite_range
+ * Make the records lo and hi for a key range starting at a random 
+ * key, wide enough to hold about n of the records in the file.
+ */
+static void
+suite_range (struct suite_struct *s, char *lo, char *hi, int64_t t, int32_t n)
+{
+   int64_t a, b;
+   int32_t key;
+
+   memset (lo, 0, rec_len);
+   memset (hi, 0, rec_len);
+   a = (int32_t) suite_mix (t);
+   b = a + (int64_t) n * 0x100000000LL / s->n_rec;
+   if (b > INT32_MAX) b = INT32_MAX;
+   key = a; memcpy (lo, &key, sizeof (key));
+   key = b; memcpy (hi, &key, sizeof (key));
+}
+
+
+static void
+op_count_range (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{
+   char hi[rec_len];
+
+   if (t < 0) return;
+   suite_range (s, r, hi, t, 100);
+   s->fn->count_range (ap, r, hi, 0);
+}
+
+
+static void
+op_delete_range (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{
+   char hi[rec_len];
+
+   if (t < 0) return;
+   suite_range (s, r, hi, t, 100);
+   s->fn->delete_range (ap, r, hi, 0);
+}
+
+
+static void
+op_insert_reuse (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{
+   if (t < 0) return;
+   suite_rec (s, r, t, 0);
+   s->fn->insert (ap, r);
+}
+
+
+static void
+op_squash (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{
+   if (t < 0) return;
+   s->fn->squash (ap);
+}
+
+
+static void
+op_squash_step (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{
+   if (t < 0) return;
+   s->fn->squash_step (ap, 16);
+}
+
+
+static void
+op_reorganize (struct suite_struct *s, AVL_FILE *ap, char *r, int64_t t)
+{
+   double expected;
+
+   if (t < 0) return;
+   s->fn->reorganize (ap, 0, &expected);
+}
+
+
+static int
+suite_lat_cmp (const void *a, const void *b)
+{
+   float x = *(const float *) a, y = *(const float *) b;
+
+   return ((x > y) - (x < y));
+}
+
+
+/*------------------------------------------- suite_thr
+ * One thread of a test case, doing operations t0, t0 + step, ... 
+ * below n, and recording the latency of every lat_step'th one.
+ */
+struct suite_thr_struct {
+   struct suite_struct *s;
+   suite_op_fn_t op;
+   AVL_FILE *ap;
+   float *lat;
+   int64_t t0, n, step, lat_step, ops;
+   int32_t each, n_proc, j;
+};
+
+static void *
+suite_thr (void *arg)
+{
+   struct suite_thr_struct *w = arg;
+   char r[rec_len];
+   int64_t t, i;
+   double t_op;
+
+   for (t = w->t0; t < w->n; t += w->step) {
+      t_op = now ();
+      w->op (w->s, w->ap, r, t);
+      i = w->each ? t * w->n_proc + w->j : t;
+      if (i % w->lat_step == 0) w->lat[i / w->lat_step] = (now () - t_op) * 1e6;
+      w->ops++;
+   }
+   return (NULL);
+}
+
+
+/*------------------------------------------- suite_case
+ * Run one test case of n_ops operations, split between n_proc
+ * processes of n_thr threads (n_ops per process with each), and 
+ * print the CSV line.
+ * Returns 0 if successful.
+ */
+static int32_t
+suite_case (struct suite_struct *s, char *name, suite_op_fn_t op, int64_t n_ops,
+            int32_t n_proc, int32_t n_thr, int32_t each)
+{
+   struct suite_stat_struct *st;
+   struct suite_thr_struct w[n_thr];
+   pthread_t tid[n_thr];
+   AVL_FILE *ap;
+   char r[rec_len];
+   float *lat;
+   int64_t i, n, m, step, n_lat, ops, sys, rb, wb;
+   int32_t j, status, ret;
+   double t0, t1;
+   size_t sz;
+
+
+   n = each ? n_ops * n_proc : n_ops;
+   if (n <= 0) return (0);
+   step = (n + SUITE_SAMPLES - 1) / SUITE_SAMPLES;
+   m = n / step + n_proc;
+   sz = n_proc * sizeof (struct suite_stat_struct) + m * sizeof (float);
+   st = mmap (NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (st == MAP_FAILED) return (-1);
+   lat = (float *) (st + n_proc);
+   for (i = 0; i < m; i++) lat[i] = -1;
+
+   for (j = 0; j < n_proc; j++) {
+      if (fork () == 0) {
+         ap = suite_open (s);
+         if (ap == NULL) _exit (1);
+         op (s, ap, r, -1);
+         for (i = 0; i < n_thr; i++) {
+            w[i].s = s;
+            w[i].op = op;
+            w[i].ap = ap;
+            w[i].lat = lat;
+            w[i].t0 = each ? i : j * n_thr + i;
+            w[i].n = each ? n_ops : n;
+            w[i].step = each ? n_thr : n_proc * n_thr;
+            w[i].lat_step = step;
+            w[i].ops = 0;
+            w[i].each = each;
+            w[i].n_proc = n_proc;
+            w[i].j = j;
+         }
+         t0 = bench_start ();
+         if (n_thr == 1)
+            suite_thr (&w[0]);
+         else {
+            for (i = 0; i < n_thr; i++) pthread_create (&tid[i], NULL, suite_thr, &w[i]);
+            for (i = 0; i < n_thr; i++) pthread_join (tid[i], NULL);
+         }
+         t1 = now ();
+         for (i = ops = 0; i < n_thr; i++) ops += w[i].ops;
+         st[j].t0 = t0;
+         st[j].t1 = t1;
+         st[j].ops = ops;
+         st[j].syscalls = n_read + n_write + n_lseek + n_lock + n_sync;
+         st[j].rbytes = n_rbytes;
+         st[j].wbytes = n_wbytes;
+         s->fn->close (ap);
+         _exit (0);
+      }
+   }
+   ret = 0;
+   for (j = 0; j < n_proc; j++) {
+      if ((wait (&status) < 0) || (status != 0)) ret = -1;
+   }
+
+   t0 = st[0].t0; t1 = st[0].t1;
+   ops = sys = rb = wb = 0;
+   for (j = 0; j < n_proc; j++) {
+      if (st[j].t0 < t0) t0 = st[j].t0;
+      if (st[j].t1 > t1) t1 = st[j].t1;
+      ops += st[j].ops;
+      sys += st[j].syscalls;
+      rb += st[j].rbytes;
+      wb += st[j].wbytes;
+   }
+   for (i = n_lat = 0; i < m; i++) if (lat[i] >= 0) lat[n_lat++] = lat[i];
+   qsort (lat, n_lat, sizeof (float), suite_lat_cmp);
+   if (ops <= 0) ops = 1;
+   if (n_lat <= 0) { lat[0] = 0; n_lat = 1; }
+
+   printf ("%s,%s,%lld,%d,%d,%d,%d,%lld,%.0f,%.2f,%.2f,%.2f,%.1f,%.1f\n",
+           name, s->mode, (long long) s->n_rec, rec_len, s->n_keys, n_proc, n_thr,
+           (long long) ops, ops / ((t1 > t0) ? t1 - t0 : 1e-9),
+           lat[n_lat / 2], lat[(n_lat * 99) / 100],
+           (double) sys / ops, (double) rb / ops, (double) wb / ops);
+   fflush (stdout);
+   munmap (st, sz);
+   return (ret);
+}
+
+
+/*------------------------------------------- suite_run
+ * Make the file, and run the test cases on it.
+ * Returns 0 if successful.
+ */
+static int32_t
+suite_run (struct suite_struct *s)
+{
+   AVL_FILE *ap;
+   int64_t n_del, n_cur;
+   double t;
+   int32_t p, h;
+
+
+   unlink (suite_fname);
+   unlink ("avl_file_bench.avl-wal");
+   unlink ("avl_file_bench.avl-shadow");
+   unlink ("avl_file_bench.avl-free");
+   unlink ("avl_file_bench.avl-shm");
+   src_s = s;
+   src_i = 0;
+   t = bench_start ();
+   if (suite_schema (s)) {
+      if (suite_schema_load (s) != 0) {
+         fprintf (stderr, "insert_batch: %s\n", getenv (AVL_FILE_EMSG_VNAME));
+         return (-1);
+      }
+   }
+   else if (avl_file_bulk_load (suite_fname, rec_len, s->n_keys, suite_cmp, suite_source, NULL) != 0) {
+      fprintf (stderr, "bulk_load: %s\n", getenv (AVL_FILE_EMSG_VNAME));
+      return (-1);
+   }
+   t = now () - t;
+   printf ("%s,%s,", suite_schema (s) ? "insert_batch" : "bulk_load", s->mode);
+   printf ("%lld,%d,%d,1,1,%lld,%.0f,,,%.2f,%.1f,%.1f\n",
+           (long long) s->n_rec, rec_len, s->n_keys, (long long) s->n_rec,
+           s->n_rec / ((t > 0) ? t : 1e-9),
+           (double) (n_read + n_write + n_lseek + n_lock + n_sync) / s->n_rec,
+           (double) n_rbytes / s->n_rec, (double) n_wbytes / s->n_rec);
+   if (strcmp (s->mode, "wal") == 0) {
+      ap = avl_file_open_wal (suite_fname, rec_len, s->n_keys, suite_cmp);
+      if (ap == NULL) return (-1);
+      avl_file_close (ap);
+   }
+   if (strcmp (s->mode, "shadow") == 0) {
+      ap = avl_file_open_shadow (suite_fname, rec_len, s->n_keys, suite_cmp);
+      if (ap == NULL) return (-1);
+      avl_file_close (ap);
+   }
+   if ((strcmp (s->mode, "free") == 0) || (strcmp (s->mode, "near") == 0)) {
+      ap = avl_file_open_free (suite_fname, rec_len, s->n_keys, suite_cmp);
+      if (ap == NULL) return (-1);
+      avl_file_close (ap);
+   }
+   if (strcmp (s->mode, "shm") == 0) {
+      ap = avl_file_open_shm (suite_fname, rec_len, s->n_keys, suite_cmp);
+      if (ap == NULL) return (-1);
+      avl_file_close (ap);
+   }
+
+   p = s->n_proc;
+   h = s->n_thr;
+   n_cur = s->n_rec + 2 * s->n_ins;
+   n_del = (s->n_ops < s->n_rec) ? s->n_ops : s->n_rec;
+   if ((suite_case (s, "insert_random", op_insert_random, s->n_ins, p, h, 0) != 0) ||
+       (suite_case (s, "insert_seq", op_insert_seq, s->n_ins, p, h, 0) != 0) ||
+       (suite_case (s, "find_hit", op_find_hit, s->n_ops, p, h, 0) != 0) ||
+       (suite_case (s, "find_miss", op_find_miss, s->n_ops, p, h, 0) != 0) ||
+       (suite_case (s, "rank", op_rank, s->n_ops, p, h, 0) != 0) ||
+       (suite_case (s, "select", op_select, s->n_ops, p, h, 0) != 0) ||
+       (suite_case (s, "count_range", op_count_range, s->n_ops, p, h, 0) != 0) ||
+       (suite_case (s, "scan_10", op_scan_10, s->n_ops / 10, p, h, 0) != 0) ||
+       (suite_case (s, "scan_100", op_scan_100, s->n_ops / 100, p, h, 0) != 0) ||
+       (suite_case (s, "scan_1000", op_scan_1000, s->n_ops / 1000, p, h, 0) != 0) ||
+       (suite_case (s, "update", op_update, s->n_ops, p, h, 0) != 0) ||
+       (suite_case (s, "readseq", op_readseq, n_cur, p, h, 1) != 0) ||
+       (suite_case (s, "delete", op_delete, n_del, p, h, 0) != 0) ||
+       (suite_case (s, "insert_reuse", op_insert_reuse, n_del / 2, p, h, 0) != 0) ||
+       (suite_case (s, "delete_range", op_delete_range, n_del / 100, p, h, 0) != 0) ||
+       (suite_case (s, "squash_step", op_squash_step, n_del / 16, 1, 1, 0) != 0) ||
+       (suite_case (s, "squash", op_squash, 1, 1, 1, 0) != 0) ||
+       (suite_case (s, "reorganize", op_reorganize, 1, 1, 1, 0) != 0) ||
+       (suite_case (s, "find_hit_reorganized", op_find_hit, s->n_ops, p, h, 0) != 0)) {
+      fprintf (stderr, "suite: a test case failed\n");
+      return (-1);
+   }
+
+   unlink (suite_fname);
+   unlink ("avl_file_bench.avl-wal");
+   unlink ("avl_file_bench.avl-shadow");
+   unlink ("avl_file_bench.avl-free");
+   unlink ("avl_file_bench.avl-shm");
+   return (0);
+}
+
+
+/*------------------------------------------- suite_list
+ * Read a comma separated list of numbers (with an optional k, M or G
+ * multiplier, or as 1e6) into v, and return the count.
+ */
+static int32_t
+suite_list (char *arg, int64_t *v, int32_t max)
+{
+   char *p, *e;
+   int32_t n;
+
+   for (n = 0, p = arg; (*p != '\0') && (n < max); p = e) {
+      v[n] = (int64_t) strtod (p, &e);
+      if (e == p) break;
+      if (*e == 'k') { v[n] *= 1000; e++; }
+      if (*e == 'M') { v[n] *= 1000000; e++; }
+      if (*e == 'G') { v[n] *= 1000000000; e++; }
+      n++;
+      if (*e == ',') e++;
+   }
+   return (n);
+}
+
+
+/*------------------------------------------- suite_main
+ * Run the benchmark suite for the command line options:
+ *
+ *   -n records,...     file sizes (default 1000,100000)
+ *   -r length,...      record lengths (default 64,1024)
+ *   -k keys,...        numbers of keys, 1 to 8 (default 1,4)
+ *   -p processes,...   numbers of processes (default 1,4)
+ *   -t threads,...     numbers of threads in each process (default 1)
+ *   -m mode,...        open, mmap, cache, wal, shadow, free, near, shm, schema
+ *                      or prefix
+ *                      (default open,mmap)
+ *   -o ops             operations per test case (default 10000)
+ */
+static int32_t
+suite_main (int argc, char *argv[])
+{
+   struct suite_struct s;
+   int64_t n[16], r[16], k[16], p[16], h[16];
+   int32_t n_n, n_r, n_k, n_p, n_h, n_m, i_n, i_r, i_k, i_p, i_h, i_m, c;
+   char *modes[16], *m;
+
+
+   n_n = suite_list ("1000,100000", n, 16);
+   n_r = suite_list ("64,1024", r, 16);
+   n_k = suite_list ("1,4", k, 16);
+   n_p = suite_list ("1,4", p, 16);
+   n_h = suite_list ("1", h, 16);
+   m = "open,mmap";
+   s.n_ops = 10000;
+
+   while ((c = getopt (argc, argv, "n:r:k:p:t:m:o:")) != -1) {
+      switch (c) {
+      case 'n': n_n = suite_list (optarg, n, 16); break;
+      case 'r': n_r = suite_list (optarg, r, 16); break;
+      case 'k': n_k = suite_list (optarg, k, 16); break;
+      case 'p': n_p = suite_list (optarg, p, 16); break;
+      case 't': n_h = suite_list (optarg, h, 16); break;
+      case 'm': m = optarg; break;
+      case 'o': s.n_ops = atoll (optarg); break;
+      default:
+         fprintf (stderr, "usage: avl_file_bench [-n records,...] [-r length,...] [-k keys,...]\n"
+                          "                      [-p processes,...] [-t threads,...] [-m mode,...]\n"
+                          "                      [-o ops]\n"
+                          "       avl_file_bench -M [n_records [n_finds [record_length]]]\n");
+         return (1);
+      }
+   }
+   m = strdup (m);
+   for (n_m = 0, modes[0] = strtok (m, ","); (modes[n_m] != NULL) && (n_m < 15); )
+      modes[++n_m] = strtok (NULL, ",");
+
+   printf ("op,mode,n_records,rec_len,n_keys,n_proc,n_threads,ops,ops_per_sec,"
+           "p50_us,p99_us,syscalls_per_op,rbytes_per_op,wbytes_per_op\n");
+   for (i_m = 0; i_m < n_m; i_m++)
+   for (i_n = 0; i_n < n_n; i_n++)
+   for (i_r = 0; i_r < n_r; i_r++)
+   for (i_k = 0; i_k < n_k; i_k++)
+   for (i_p = 0; i_p < n_p; i_p++)
+   for (i_h = 0; i_h < n_h; i_h++) {
+      s.mode = modes[i_m];
+      s.n_rec = (n[i_n] > 0) ? n[i_n] : 1;
+      s.n_keys = (k[i_k] < 1) ? 1 : (k[i_k] > 8) ? 8 : k[i_k];
+      s.n_proc = (p[i_p] < 1) ? 1 : p[i_p];
+      s.n_thr = (h[i_h] < 1) ? 1 : h[i_h];
+      s.fn = (s.n_thr > 1) ? &suite_fn_t : &suite_fn;
+      s.n_ins = s.n_ops;
+      rec_len = r[i_r];
+      if (rec_len < s.n_keys * (int32_t) sizeof (int32_t)) rec_len = s.n_keys * sizeof (int32_t);
+      if (suite_run (&s) != 0) return (1);
+   }
+   free (m);
+   return (0);
+}
+
+
+/*------------------------------------------- bench_micro
+ * Run the older benchmarks, for the arguments
+ * [n_records [n_finds [record_length]]].
+ */
+static int32_t
+bench_micro (int argc, char *argv[])
+{
+   int32_t n_rec, n_find, n_proc;
+
+   n_rec = (argc > 1) ? atoi (argv[1]) : 100000;
+   n_find = (argc > 2) ? atoi (argv[2]) : 100000;
+   if (argc > 3) rec_len = atoi (argv[3]);
+   if (rec_len < (int32_t) sizeof (int32_t)) rec_len = sizeof (int32_t);
+
+   if (bench_run ("open", avl_file_open, 0, n_rec, n_find) != 0) return (1);
+   if (bench_run ("open_mmap", avl_file_open_mmap, 0, n_rec, n_find) != 0) return (1);
+   if (bench_run ("open+cache", avl_file_open, 1 << 20, n_rec, n_find) != 0) return (1);
+   if (bench_run ("open_wal", avl_file_open_wal, 0, n_rec, n_find) != 0) return (1);
+   if (bench_run ("open_shadow", avl_file_open_shadow, 0, n_rec, n_find) != 0) return (1);
+   if (bench_run ("open_shm", avl_file_open_shm, 0, n_rec, n_find) != 0) return (1);
+   if (bench_bulk_load (n_rec) != 0) return (1);
+   if (bench_reorganize (n_rec, n_find) != 0) return (1);
+   if (bench_insert_batch ("open", avl_file_open, n_rec, 1000) != 0) return (1);
+   if (bench_insert_batch ("open_mmap", avl_file_open_mmap, n_rec, 1000) != 0) return (1);
+   if (bench_txn ("open_wal", avl_file_open_wal, n_rec, 0) != 0) return (1);
+   if (bench_txn ("open_wal", avl_file_open_wal, n_rec, 1) != 0) return (1);
+   if (bench_txn ("open_shadow", avl_file_open_shadow, n_rec, 0) != 0) return (1);
+   if (bench_txn ("open_shadow", avl_file_open_shadow, n_rec, 1) != 0) return (1);
+   for (n_proc = 1; n_proc <= 8; n_proc *= 2) {
+      if (bench_wal_writers (n_rec / 10, n_proc) != 0) return (1);
+   }
+   if (bench_snapshot (n_rec, 0) != 0) return (1);
+   if (bench_snapshot (n_rec, 1) != 0) return (1);
+   for (n_proc = 1; n_proc <= 8; n_proc *= 2) {
+      if (bench_readers ("open", avl_file_open, n_rec, n_find, n_proc) != 0) return (1);
+   }
+   for (n_proc = 1; n_proc <= 8; n_proc *= 2) {
+      if (bench_readers ("open_mmap", avl_file_open_mmap, n_rec, n_find, n_proc) != 0) return (1);
+   }
+   for (n_proc = 1; n_proc <= 8; n_proc *= 2) {
+      if (bench_readers ("open_shm", avl_file_open_shm, n_rec, n_find, n_proc) != 0) return (1);
+   }
+   for (n_proc = 1; n_proc <= 8; n_proc *= 2) {
+      if (bench_threads ("open", avl_file_open_t, n_rec, n_find, n_proc, 0) != 0) return (1);
+   }
+   for (n_proc = 1; n_proc <= 8; n_proc *= 2) {
+      if (bench_threads ("open_mmap", avl_file_open_mmap_t, n_rec, n_find, n_proc, 0) != 0) return (1);
+   }
+   for (n_proc = 1; n_proc <= 8; n_proc *= 2) {
+      if (bench_threads ("open_mmap", avl_file_open_mmap_t, n_rec, n_find, n_proc, 1) != 0) return (1);
+   }
+   return (0);
+}
+
+
+int
+main (int argc, char *argv[])
+{
+   if ((argc > 1) && (strcmp (argv[1], "-M") == 0)) return (bench_micro (argc - 1, argv + 1));
+   return (suite_main (argc, argv));
+}
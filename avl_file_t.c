@@ -0,0 +1,28 @@
+/* avl_file_t.c
+ * 
+ * The thread-safe versions of the avl_file functions, which have '_t'
+ * appended to the function names. They are compiled from the same 
+ * source as the other functions, with AVL_FILE_TSAFE defined, and put
+ * into the same library.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2007-2009 Michael Williamson <michael.h.williamson@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ */
+
+#define	_GNU_SOURCE		// for pthread_rwlockattr_setkind_np() with glibc
+#define	AVL_FILE_TSAFE
+#include "avl_file.c"
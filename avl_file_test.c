@@ -0,0 +1,706 @@
+/* avl_file_test.c
+ *
+ * Tests for the avl_file functions, run by 'make check'.
+ *
+ * It checks that avl_file_cursor_next() reads every record when each
+ * one is updated or deleted as it is read, that the log, shadow file,
+ * shared lock segment and version store are not created while the
+ * file is open, and that the positions of avl_file_next() and
+ * avl_file_readseq() are kept, with the log and with shadow paging,
+ * when another process opens the file. It checks that a NULL
+ * comparison function needs a key schema, the trees and records of a
+ * file with key prefixes, avl_file_upgrade() of a file in the layout
+ * of the earlier versions, that the version store does not keep
+ * growing with two snapshots, and the tree after 2, 4 and 8 threads
+ * have inserted and deleted records through one AVL_FILE with the _t
+ * functions.
+ *
+ * The records are written into avl_file_test.avl (and the files
+ * named after it) in the current directory, which are removed again.
+ * The exit status is 0 if every test passed, or 1.
+ *
+ *-----------------------------------------------------------------------
+ * Copyright (C) 2007-2009 Michael Williamson <michael.h.williamson@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *-----------------------------------------------------------------------
+ *
+ * Usage: avl_file_test [n_records [record_length]]
+ */
+
+#include "config.h"
+#include "avl_file.h"
+#include <sys/wait.h>
+
+
+/*
+ * The records are rec_len bytes, with an int32_t key at the start.
+ */
+static int32_t rec_len = 64;
+
+
+static int32_t
+cmp_r (int32_t key, const void *va, const void *vb)
+{
+   int32_t a, b;
+
+   memcpy (&a, va, sizeof (a));
+   memcpy (&b, vb, sizeof (b));
+   return ((a > b) - (a < b));
+}
+
+
+typedef AVL_FILE *(*open_fn_t) (char *, int32_t, int32_t, avl_file_cmp_fn_t);
+
+
+static int32_t src_i;
+
+
+/*------------------------------------------- test_source
+ * Return 10 records for avl_file_bulk_load().
+ */
+static int32_t
+test_source (void *arg, void *data)
+{
+   int32_t num;
+
+   if (src_i == 10) return (1);
+   num = src_i++;
+   memcpy (data, &num, sizeof (num));
+   return (0);
+}
+
+
+/*------------------------------------------- test_cursor_change
+ * Insert 20 records, 10 with key 5 and 10 with key 6, then walk
+ * through them with avl_file_cursor_next(), and update (or, if del
+ * is not zero, delete) each record as it is read. Every record must
+ * still be read once, as with avl_file_startge() and avl_file_next().
+ */
+static int32_t
+test_cursor_change (int32_t del)
+{
+   AVL_FILE *ap;
+   AVL_FILE_CURSOR *cur;
+   char r[rec_len];
+   int32_t i, n, num;
+   char *fname = "avl_file_test.avl";
+
+
+   unlink (fname);
+   ap = avl_file_open (fname, rec_len, 1, cmp_r);
+   if (ap == NULL) {
+      fprintf (stderr, "cursor: %s\n", getenv (AVL_FILE_EMSG_VNAME));
+      return (-1);
+   }
+   memset (r, 0, rec_len);
+   for (i = 0; i < 20; i++) {
+      num = 5 + (i & 1);
+      memcpy (r, &num, sizeof (num));
+      r[sizeof (num)] = i;
+      avl_file_insert (ap, r);
+   }
+
+   cur = avl_file_cursor_open (ap, 0);
+   num = 0;
+   memcpy (r, &num, sizeof (num));
+   n = 0;
+   if (avl_file_cursor_seek_ge (cur, r) == 0) {
+      do {
+         n++;
+         if (del) {
+            avl_file_delete (ap, r);
+         } else {
+            r[sizeof (num) + 1]++;
+            avl_file_update (ap, r);
+         }
+      } while (avl_file_cursor_next (cur, r) == 0);
+   }
+   avl_file_cursor_close (cur);
+   avl_file_close (ap);
+   unlink (fname);
+
+   printf ("open/avl_file_cursor_next: %d of 20 records read, with avl_file_%s() of each\n",
+           n, del ? "delete" : "update");
+   return ((n == 20) ? 0 : -1);
+}
+
+
+/*------------------------------------------- test_companion
+ * Check that open_fn cannot create its file (the log, shadow file, 
+ * shared lock segment or version store, named fname with ext added)
+ * while the file is open as another AVL_FILE, in this process or in
+ * another one, and that it can once that is closed.
+ */
+static int32_t
+test_companion (char *name, open_fn_t open_fn, char *ext)
+{
+   AVL_FILE *ap, *bp;
+   char r[rec_len], cname[64];
+   int32_t num, status, ret;
+   pid_t pid;
+   char *fname = "avl_file_test.avl";
+
+
+   snprintf (cname, sizeof (cname), "%s%s", fname, ext);
+   unlink (fname);
+   unlink (cname);
+   ap = avl_file_open (fname, rec_len, 1, cmp_r);
+   if (ap == NULL) {
+      fprintf (stderr, "%s: %s\n", name, getenv (AVL_FILE_EMSG_VNAME));
+      return (-1);
+   }
+   memset (r, 0, rec_len);
+   num = 1;
+   memcpy (r, &num, sizeof (num));
+   avl_file_insert (ap, r);
+
+  /*
+   * The other process tries first, since closing the file after the
+   * failed open in this process releases its fcntl() locks.
+   */
+   ret = 0;
+   pid = fork ();
+   if (pid == 0) {
+      bp = open_fn (fname, rec_len, 1, cmp_r);
+      _exit ((bp == NULL) ? 0 : 1);
+   }
+   if ((waitpid (pid, &status, 0) < 0) || (status != 0) || (access (cname, F_OK) == 0)) {
+      fprintf (stderr, "%s: created %s while another process had the file open\n", name, cname);
+      ret = -1;
+   }
+   bp = open_fn (fname, rec_len, 1, cmp_r);
+   if ((bp != NULL) || (access (cname, F_OK) == 0)) {
+      fprintf (stderr, "%s: created %s while the file was open\n", name, cname);
+      if (bp != NULL) avl_file_close (bp);
+      ret = -1;
+   }
+   avl_file_close (ap);
+
+   bp = open_fn (fname, rec_len, 1, cmp_r);
+   if ((bp == NULL) || (access (cname, F_OK) != 0) || (avl_file_find (bp, r, 0) != 0)) {
+      fprintf (stderr, "%s: %s not created after the close\n", name, cname);
+      ret = -1;
+   }
+   if (bp != NULL) avl_file_close (bp);
+   printf ("%s: %s is not created while the file is open: %s\n", name, cname, 
+           (ret == 0) ? "ok" : "FAILED");
+   unlink (fname);
+   unlink (cname);
+   return (ret);
+}
+
+
+/*------------------------------------------- test_positions
+ * Insert 100 records, with keys 0 to 99, and read the first 5 with
+ * avl_file_startge() and avl_file_next(), and with avl_file_readseq().
+ * Another process then opens the file with open_fn and closes it
+ * (after deleting key 90, if del is not zero). The next record read
+ * each way must follow on from the position before.
+ */
+static int32_t
+test_positions (char *name, open_fn_t open_fn, int32_t del)
+{
+   AVL_FILE *ap, *bp;
+   char r[rec_len];
+   int32_t i, num, seq, status, ret;
+   pid_t pid;
+   char *fname = "avl_file_test.avl";
+
+
+   unlink (fname);
+   unlink ("avl_file_test.avl-wal");
+   unlink ("avl_file_test.avl-shadow");
+   ap = open_fn (fname, rec_len, 1, cmp_r);
+   if (ap == NULL) {
+      fprintf (stderr, "%s: %s\n", name, getenv (AVL_FILE_EMSG_VNAME));
+      return (-1);
+   }
+   memset (r, 0, rec_len);
+   for (num = 0; num < 100; num++) {
+      memcpy (r, &num, sizeof (num));
+      avl_file_insert (ap, r);
+   }
+   num = 0;
+   memcpy (r, &num, sizeof (num));
+   avl_file_startge (ap, r, 0);
+   for (i = 0; i < 5; i++) avl_file_next (ap, r, 0);
+   avl_file_startseq (ap);
+   for (i = 0; i < 5; i++) avl_file_readseq (ap, r);
+   memcpy (&seq, r, sizeof (seq));
+
+   pid = fork ();
+   if (pid == 0) {
+      bp = open_fn (fname, rec_len, 1, cmp_r);
+      if (bp == NULL) _exit (1);
+      num = 90;
+      memcpy (r, &num, sizeof (num));
+      if (del && (avl_file_delete (bp, r) != 0)) _exit (1);
+      avl_file_close (bp);
+      _exit (0);
+   }
+   ret = ((waitpid (pid, &status, 0) < 0) || (status != 0)) ? -1 : 0;
+
+   num = -1;
+   if (avl_file_next (ap, r, 0) == 0) memcpy (&num, r, sizeof (num));
+   if (num != 6) ret = -1;
+   num = -1;
+   if (avl_file_readseq (ap, r) == 0) memcpy (&num, r, sizeof (num));
+   if ((num < 0) || (num == seq)) ret = -1;
+   avl_file_close (ap);
+   printf ("%s: positions kept after another process opened%s the file: %s\n", name,
+           del ? " (and deleted from)" : "", (ret == 0) ? "ok" : "FAILED");
+   unlink (fname);
+   unlink ("avl_file_test.avl-wal");
+   unlink ("avl_file_test.avl-shadow");
+   return (ret);
+}
+
+
+/*------------------------------------------- test_no_cmp
+ * Check that a file without a key schema cannot be opened or bulk 
+ * loaded with a NULL comparison function, and that one with a 
+ * schema can.
+ */
+static int32_t
+test_no_cmp (void)
+{
+   AVL_FILE *ap;
+   AVL_FILE_SEG seg;
+   int32_t ret;
+   char *fname = "avl_file_test.avl";
+
+
+   ret = 0;
+   unlink (fname);
+   ap = avl_file_open (fname, rec_len, 1, NULL);
+   if ((ap != NULL) || (getenv (AVL_FILE_EMSG_VNAME) == NULL) ||
+       (strncmp (getenv (AVL_FILE_EMSG_VNAME), "207 ", 4) != 0)) ret = -1;
+   if (ap != NULL) avl_file_close (ap);
+   unlink (fname);
+   src_i = 0;
+   if (avl_file_bulk_load (fname, rec_len, 1, NULL, test_source, NULL) == 0) ret = -1;
+   unlink (fname);
+
+   seg.key = 0;
+   seg.off = 0;
+   seg.len = sizeof (int32_t);
+   seg.type = AVL_FILE_SEG_INT32;
+   ap = avl_file_open_schema (fname, rec_len, 1, &seg, 1);
+   if (ap == NULL) ret = -1;
+   if (ap != NULL) avl_file_close (ap);
+   ap = avl_file_open (fname, rec_len, 1, NULL);
+   if (ap == NULL) ret = -1;
+   if (ap != NULL) avl_file_close (ap);
+   unlink (fname);
+
+   printf ("open: a NULL comparison function needs a key schema: %s\n",
+           (ret == 0) ? "ok" : "FAILED");
+   return (ret);
+}
+
+
+/*------------------------------------------- test_prefix
+ * Make a file with key prefixes: key 0 a string whose first 24 
+ * bytes are the same in every record, so that every comparison 
+ * must read the whole record, with two records for each value; key
+ * 1 a unique number, with a prefix too; and key 2 a number without
+ * one. Insert n_rec records in random order, update them, delete 
+ * the ones with even numbers, and check the trees with avl_file_scan(), and the 
+ * records with avl_file_find(), avl_file_rank() and a cursor.
+ */
+struct test_prefix_struct {
+   char s[40];
+   int32_t num, dup, val;
+};
+
+
+static void
+test_prefix_rec (struct test_prefix_struct *r, int32_t i, int32_t n_rec)
+{
+   memset (r, 0, sizeof (*r));
+   snprintf (r->s, sizeof (r->s), "the same 24 byte start: %08d", i / 2);
+   r->num = i;
+   r->dup = n_rec - i;
+   r->val = i;
+}
+
+
+static int32_t
+test_prefix (int32_t n_rec)
+{
+   AVL_FILE *ap;
+   AVL_FILE_CURSOR *cur;
+   AVL_FILE_SEG seg[3];
+   struct test_prefix_struct r, q;
+   int32_t i, j, k, t, *v, ret;
+   int64_t count, n;
+   char *fname = "avl_file_test.avl";
+
+
+   seg[0].key = 0;
+   seg[0].off = offsetof (struct test_prefix_struct, s);
+   seg[0].len = sizeof (r.s);
+   seg[0].type = AVL_FILE_SEG_STRING | AVL_FILE_SEG_PREFIX;
+   seg[1].key = 1;
+   seg[1].off = offsetof (struct test_prefix_struct, num);
+   seg[1].len = sizeof (int32_t);
+   seg[1].type = AVL_FILE_SEG_INT32 | AVL_FILE_SEG_PREFIX;
+   seg[2].key = 2;
+   seg[2].off = offsetof (struct test_prefix_struct, dup);
+   seg[2].len = sizeof (int32_t);
+   seg[2].type = AVL_FILE_SEG_INT32;
+
+   unlink (fname);
+   ap = avl_file_open_schema (fname, sizeof (r), 3, seg, 3);
+   v = malloc (n_rec * sizeof (int32_t));
+   if ((ap == NULL) || (v == NULL)) {
+      fprintf (stderr, "open_schema: %s\n", (ap == NULL) ? getenv (AVL_FILE_EMSG_VNAME) : "malloc failed");
+      if (ap != NULL) avl_file_close (ap);
+      free (v);
+      return (-1);
+   }
+   srandom (1);
+   for (i = 0; i < n_rec; i++) v[i] = i;
+   for (i = n_rec - 1; i > 0; i--) {
+      j = random () % (i + 1);
+      t = v[i]; v[i] = v[j]; v[j] = t;
+   }
+
+   ret = 0;
+   for (i = 0; i < n_rec; i++) {
+      test_prefix_rec (&r, v[i], n_rec);
+      if (avl_file_insert (ap, &r) != 0) ret = -1;
+   }
+   for (i = 0; i < n_rec; i++) {
+      test_prefix_rec (&r, v[i], n_rec);
+      r.val = -v[i];
+      if (avl_file_update (ap, &r) != 0) ret = -1;
+   }
+   for (i = 0; i < n_rec; i++) {
+      if (v[i] & 1) continue;
+      test_prefix_rec (&r, v[i], n_rec);
+      r.val = -v[i];
+      if (avl_file_delete (ap, &r) != 0) ret = -1;
+   }
+   n = n_rec / 2;
+
+   unsetenv (AVL_FILE_EMSG_VNAME);
+   for (k = 0; k < 3; k++) {
+      count = 0;
+      if ((avl_file_scan (ap, k, 0, &count) < 0) || (count != n)) ret = -1;
+   }
+   if (getenv (AVL_FILE_EMSG_VNAME) != NULL) ret = -1;
+
+   for (i = 0; (ret == 0) && (i < n_rec); i++) {
+      test_prefix_rec (&r, i, n_rec);
+      q = r;
+      if ((avl_file_find (ap, &q, 1) == 0) != (i & 1)) ret = -1;
+      if ((i & 1) && ((strcmp (q.s, r.s) != 0) || (q.val != -i))) ret = -1;
+      q = r;
+      if ((avl_file_find (ap, &q, 0) != 0) || (strcmp (q.s, r.s) != 0)) ret = -1;
+   }
+
+  /*
+   * Each value of key 0 is left once, in order.
+   */
+   cur = avl_file_cursor_open (ap, 0);
+   if (cur == NULL) ret = -1;
+   test_prefix_rec (&r, 0, n_rec);
+   for (i = 0; (ret == 0) && (i < n); i++) {
+      test_prefix_rec (&q, 2 * i, n_rec);
+      if (((i == 0) ? avl_file_cursor_seek_ge (cur, &r) : avl_file_cursor_next (cur, &r)) != 0) ret = -1;
+      if ((strcmp (q.s, r.s) != 0) || (avl_file_rank (ap, &r, 0) != i)) ret = -1;
+   }
+   if ((ret == 0) && (avl_file_cursor_next (cur, &r) == 0)) ret = -1;
+   if (cur != NULL) avl_file_cursor_close (cur);
+   avl_file_close (ap);
+   unlink (fname);
+   free (v);
+
+   printf ("open_schema: key prefixes, %d records: %s\n", n_rec, (ret == 0) ? "ok" : "FAILED");
+   return (ret);
+}
+
+
+/*------------------------------------------- test_upgrade
+ * Write a file of n_rec records in the layout of the earlier 
+ * versions of the library, with keys that repeat, and check that it
+ * cannot be opened, and that after avl_file_upgrade() it can, with 
+ * all of the records, and the ones with equal keys in the order they
+ * were added.
+ */
+static int32_t
+test_upgrade (int32_t n_rec)
+{
+   AVL_FILE *ap;
+   struct {
+      char magic[8];
+      int32_t n_keys, len, reclen, pad;
+      int64_t n_avl, nextnum;
+      off_t root, head_seq, head_empty, head_cpr;
+   } hdr;
+   struct v1_struct {
+      struct { char b; off_t l, r; } n[1];
+      off_t prev, next;
+      char b[rec_len];
+   } v1;
+   int32_t fd, i, num, last, ret;
+   int64_t count;
+   char *fname = "avl_file_test.avl";
+
+
+   unlink (fname);
+   fd = open (fname, O_RDWR | O_CREAT, 0644);
+   if ((fd < 0) || (rec_len < 2 * (int32_t) sizeof (int32_t))) return (-1);
+   memset (&hdr, 0, sizeof (hdr));
+   memcpy (hdr.magic, "AVL.MW  ", 8);
+   hdr.n_keys = 1;
+   hdr.len = rec_len;
+   hdr.reclen = sizeof (v1);
+   hdr.n_avl = n_rec;
+   hdr.nextnum = n_rec;
+   hdr.head_seq = (n_rec > 0) ? sizeof (hdr) + (off_t) (n_rec - 1) * sizeof (v1) : 0;
+   ret = (pwrite (fd, &hdr, sizeof (hdr), 0) == sizeof (hdr)) ? 0 : -1;
+   for (i = 0; (ret == 0) && (i < n_rec); i++) {
+      memset (&v1, 0, sizeof (v1));
+      v1.prev = (i < n_rec - 1) ? sizeof (hdr) + (off_t) (i + 1) * sizeof (v1) : 0;
+      v1.next = (i > 0) ? sizeof (hdr) + (off_t) (i - 1) * sizeof (v1) : 0;
+      num = i % 100;
+      memcpy (v1.b, &num, sizeof (num));
+      memcpy (v1.b + sizeof (num), &i, sizeof (i));
+      if (pwrite (fd, &v1, sizeof (v1), sizeof (hdr) + (off_t) i * sizeof (v1)) != (ssize_t) sizeof (v1)) ret = -1;
+   }
+   close (fd);
+
+   ap = avl_file_open (fname, rec_len, 1, cmp_r);
+   if (ap != NULL) {
+      avl_file_close (ap);
+      ret = -1;
+   }
+   if ((ret == 0) && (avl_file_upgrade (fname, rec_len, 1, cmp_r) != 0)) {
+      fprintf (stderr, "avl_file_upgrade: %s\n", getenv (AVL_FILE_EMSG_VNAME));
+      ret = -1;
+   }
+   ap = (ret == 0) ? avl_file_open (fname, rec_len, 1, cmp_r) : NULL;
+   if (ap == NULL) ret = -1;
+
+   count = 0;
+   if (ap != NULL) {
+      unsetenv (AVL_FILE_EMSG_VNAME);
+      avl_file_scan (ap, 0, 0, &count);
+      if ((count != n_rec) || (getenv (AVL_FILE_EMSG_VNAME) != NULL)) ret = -1;
+      memset (v1.b, 0, rec_len);
+      last = -1;
+      if (avl_file_startge (ap, v1.b, 0) == 0) {
+         do {
+            memcpy (&i, v1.b + sizeof (num), sizeof (i));
+            if ((last >= 0) && (i % 100 == last % 100) && (i < last)) ret = -1;
+            last = i;
+         } while (avl_file_next (ap, v1.b, 0) == 0);
+      }
+      avl_file_close (ap);
+   }
+   unlink (fname);
+
+   printf ("avl_file_upgrade: %lld of %d records: %s\n", (long long) count, n_rec, 
+           (ret == 0) ? "ok" : "FAILED");
+   return (ret);
+}
+
+
+/*------------------------------------------- test_snap_reclaim
+ * Update n_rec records 50 times, with two snapshots that take turns
+ * ending and beginning again before each round, so that there is 
+ * always one. Each snapshot must see the records as they were when 
+ * it began, and the version store must not keep growing with the
+ * saved records that neither snapshot can use.
+ */
+static int32_t
+test_snap_reclaim (int32_t n_rec)
+{
+   AVL_FILE *ap, *sp[2];
+   struct stat st;
+   char r[rec_len];
+   int32_t i, j, num, ret;
+   off_t size[51];
+   char *fname = "avl_file_test.avl";
+
+
+   unlink (fname);
+   unlink ("avl_file_test.avl-snap");
+   ap = avl_file_open_snap (fname, rec_len, 1, cmp_r);
+   sp[0] = avl_file_open (fname, rec_len, 1, cmp_r);
+   sp[1] = avl_file_open (fname, rec_len, 1, cmp_r);
+   if ((ap == NULL) || (sp[0] == NULL) || (sp[1] == NULL) || (rec_len < 2 * (int32_t) sizeof (int32_t))) {
+      fprintf (stderr, "open_snap: %s\n", getenv (AVL_FILE_EMSG_VNAME));
+      return (-1);
+   }
+   memset (r, 0, rec_len);
+   for (i = 0; i < n_rec; i++) {
+      memcpy (r, &i, sizeof (i));
+      avl_file_insert (ap, r);
+   }
+
+   ret = 0;
+   for (j = 1; (j <= 50) && (ret == 0); j++) {
+      avl_file_snapshot_end (sp[j % 2]);
+      if (avl_file_snapshot_begin (sp[j % 2]) != 0) ret = -1;
+      for (i = 0; i < n_rec; i++) {
+         memcpy (r, &i, sizeof (i));
+         memcpy (r + sizeof (i), &j, sizeof (j));
+         avl_file_update (ap, r);
+      }
+      for (i = 0; (i < n_rec) && (j > 1); i += 7) {
+         memcpy (r, &i, sizeof (i));
+         num = -1;
+         if (avl_file_find (sp[(j + 1) % 2], r, 0) == 0) memcpy (&num, r + sizeof (i), sizeof (num));
+         if (num != j - 2) ret = -1;
+      }
+      size[j] = (stat ("avl_file_test.avl-snap", &st) == 0) ? st.st_size : 0;
+   }
+   if ((ret == 0) && (size[50] > 2 * size[10])) ret = -1;
+
+   printf ("open_snap/avl_file_update: 2 snapshots, %d updates, version store %lld bytes "
+           "after 10 rounds, %lld after 50: %s\n", 50 * n_rec, (long long) size[10], 
+           (long long) size[50], (ret == 0) ? "ok" : "FAILED");
+   avl_file_close (sp[0]);
+   avl_file_close (sp[1]);
+   avl_file_close (ap);
+   unlink (fname);
+   unlink ("avl_file_test.avl-snap");
+   return (ret);
+}
+
+
+/*------------------------------------------- test_stress
+ * Start n_thr threads that share one AVL_FILE, and each insert n_rec
+ * records with keys of their own, deleting every other one again 
+ * after inserting the next. Then check the tree with avl_file_scan_t()
+ * and that it holds the records that were not deleted.
+ */
+struct test_stress_struct {
+   AVL_FILE *ap;
+   int32_t n_rec, n_thr, j;
+   int32_t failed;
+};
+
+
+static void *
+test_stresser (void *arg)
+{
+   struct test_stress_struct *b = arg;
+   char r[rec_len];
+   int32_t i, num;
+
+   memset (r, 0, rec_len);
+   b->failed = 0;
+   for (i = 0; i < b->n_rec; i++) {
+      num = i * b->n_thr + b->j;
+      memcpy (r, &num, sizeof (num));
+      if (avl_file_insert_t (b->ap, r) != 0) b->failed++;
+      if (i & 1) {
+         num -= b->n_thr;
+         memcpy (r, &num, sizeof (num));
+         if (avl_file_delete_t (b->ap, r) != 0) b->failed++;
+      }
+   }
+   return (NULL);
+}
+
+
+static int32_t
+test_stress (char *name, open_fn_t open_fn, int32_t n_rec, int32_t n_thr)
+{
+   AVL_FILE *ap;
+   struct test_stress_struct b[n_thr];
+   pthread_t tid[n_thr];
+   char r[rec_len];
+   int32_t i, j, num, h, ret;
+   int64_t count, expected;
+   char *fname = "avl_file_test.avl";
+
+
+   unlink (fname);
+   ap = open_fn (fname, rec_len, 1, cmp_r);
+   if (ap == NULL) {
+      fprintf (stderr, "%s: %s\n", name, getenv (AVL_FILE_EMSG_VNAME));
+      return (-1);
+   }
+   for (j = 0; j < n_thr; j++) {
+      b[j].ap = ap;
+      b[j].n_rec = n_rec;
+      b[j].n_thr = n_thr;
+      b[j].j = j;
+   }
+   for (j = 0; j < n_thr; j++) pthread_create (&tid[j], NULL, test_stresser, &b[j]);
+   for (j = 0; j < n_thr; j++) pthread_join (tid[j], NULL);
+
+   ret = 0;
+   for (j = 0; j < n_thr; j++) if (b[j].failed) ret = -1;
+   unsetenv (AVL_FILE_EMSG_VNAME);
+   count = 0;
+   h = avl_file_scan_t (ap, 0, 0, &count);
+   expected = (int64_t) n_thr * (n_rec - n_rec / 2);
+   if ((h < 0) || (count != expected) || (getenv (AVL_FILE_EMSG_VNAME) != NULL)) ret = -1;
+   memset (r, 0, rec_len);
+   for (i = 0; (ret == 0) && (i < n_rec); i++) {
+      for (j = 0; j < n_thr; j++) {
+         num = i * n_thr + j;
+         memcpy (r, &num, sizeof (num));
+         if ((avl_file_find_t (ap, r, 0) == 0) != ((i & 1) || (i == n_rec - 1))) ret = -1;
+      }
+   }
+   avl_file_close_t (ap);
+   unlink (fname);
+
+   printf ("%s/avl_file_insert_t+avl_file_delete_t: %d threads, "
+           "%lld of %lld records scanned: %s\n", name, n_thr, 
+           (long long) count, (long long) expected, (ret == 0) ? "ok" : "FAILED");
+   return (ret);
+}
+
+
+int
+main (int argc, char *argv[])
+{
+   int32_t n_rec, n_thr, ret;
+
+   n_rec = (argc > 1) ? atoi (argv[1]) : 2000;
+   if (argc > 2) rec_len = atoi (argv[2]);
+   if (rec_len < 2 * (int32_t) sizeof (int32_t)) rec_len = 2 * sizeof (int32_t);
+
+   ret = 0;
+   if (test_cursor_change (0) != 0) ret = 1;
+   if (test_cursor_change (1) != 0) ret = 1;
+   if (test_companion ("open_wal", avl_file_open_wal, "-wal") != 0) ret = 1;
+   if (test_companion ("open_shadow", avl_file_open_shadow, "-shadow") != 0) ret = 1;
+   if (test_companion ("open_shm", avl_file_open_shm, "-shm") != 0) ret = 1;
+   if (test_companion ("open_snap", avl_file_open_snap, "-snap") != 0) ret = 1;
+   if (test_positions ("open_wal", avl_file_open_wal, 0) != 0) ret = 1;
+   if (test_positions ("open_wal", avl_file_open_wal, 1) != 0) ret = 1;
+   if (test_positions ("open_shadow", avl_file_open_shadow, 0) != 0) ret = 1;
+   if (test_positions ("open_shadow", avl_file_open_shadow, 1) != 0) ret = 1;
+   if (test_no_cmp () != 0) ret = 1;
+   if (test_prefix (n_rec) != 0) ret = 1;
+   if (test_upgrade (n_rec) != 0) ret = 1;
+   if (test_snap_reclaim (n_rec) != 0) ret = 1;
+   for (n_thr = 2; n_thr <= 8; n_thr *= 2) {
+      if (test_stress ("open", avl_file_open_t, n_rec, n_thr) != 0) ret = 1;
+   }
+   for (n_thr = 2; n_thr <= 8; n_thr *= 2) {
+      if (test_stress ("open_mmap", avl_file_open_mmap_t, n_rec, n_thr) != 0) ret = 1;
+   }
+   return (ret);
+}